@@ -0,0 +1,508 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Throughput benchmarks for the Lumberjack pipeline (meson benchmark).
+//
+// Usage: LumberjackBenchmarks [directory]
+//
+// Each benchmark reports entries per second of wall time and CPU time per
+// entry, measured over the whole process so background threads count.
+
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <lumberjack.hpp>
+#include <lumberjack_arrow.hpp>
+#include <lumberjack_import.hpp>
+#include <lumberjack_index.hpp>
+#include <lumberjack_search.hpp>
+#include <lumberjack_store.hpp>
+#include <lumberjack_template.hpp>
+
+using namespace lumberjack;
+
+namespace {
+
+  double wallSeconds()
+  {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+  double cpuSeconds()
+  {
+    struct timespec ts;
+    clock_gettime( CLOCK_PROCESS_CPUTIME_ID, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+  /**
+   * \brief times a benchmark body and prints one result line
+   */
+  class Timer {
+    public:
+      explicit Timer( const std::string &name ) : name_( name ) {
+        wall_ = wallSeconds();
+        cpu_ = cpuSeconds();
+      };
+
+      void report( uint64_t entries, const std::string &extra = std::string()) {
+        double wall = wallSeconds() - wall_;
+        double cpu = cpuSeconds() - cpu_;
+        std::cout << std::left << std::setw( 36 ) << name_
+          << std::right << std::setw( 12 ) << static_cast<uint64_t>( entries / wall )
+          << " entries/s"
+          << std::setw( 10 ) << std::fixed << std::setprecision( 1 )
+          << cpu * 1e9 / entries << " cpu ns/entry"
+          << ( extra.empty() ? "" : "  " ) << extra
+          << std::endl;
+      };
+
+    private:
+      std::string name_;
+      double wall_;
+      double cpu_;
+  };
+
+  uint64_t fileBytes( const std::string &path )
+  {
+    struct stat st;
+    return stat( path.c_str(), &st ) == 0 ? static_cast<uint64_t>( st.st_size ) : 0;
+  }
+
+  std::string fresh( const std::string &root, const std::string &name )
+  {
+    std::string path = root + "/" + name;
+    std::string command = "rm -rf '" + path + "'";
+    if( system( command.c_str()) != 0 ) {
+      std::cerr << "unable to clear " << path << std::endl;
+    }
+    return path;
+  }
+
+  /**
+   * \brief writes pre-encoded blocks straight into a FileStore
+   */
+  void benchStore( const std::string &root
+      , const std::string &name
+      , IoBackend backend
+      , Durability durability
+      )
+  {
+    const int BLOCKS = 2000;
+    const int PER_BLOCK = 256;
+
+    StoreOptions options;
+    options.backend = backend;
+    options.durability = durability;
+
+    FileStore store;
+    if( store.open( fresh( root, name ), options, "bench" ) != OK ) {
+      std::cerr << name << ": unable to open store" << std::endl;
+      return;
+    }
+
+    Record record;
+    record.level = INFO;
+    record.module = "bench";
+    record.message = "request 4711 completed in 12.5 ms with status 200";
+    record.tags.push_back( "http" );
+
+    BlockBuilder block;
+    std::vector<std::pair<uint64_t, DurableCallback> > waiters;
+    uint64_t seq = store.nextSeq();
+
+    Timer timer( name );
+    for( int b = 0; b < BLOCKS; b++ ) {
+      block.clear();
+      for( int i = 0; i < PER_BLOCK; i++ ) {
+        record.seq = seq++;
+        record.timestamp = static_cast<int64_t>( record.seq );
+        block.add( record );
+      }
+      block.seal();
+      store.write( block, waiters );
+    }
+    std::string backendName = store.backend();
+    store.close();
+    timer.report( static_cast<uint64_t>( BLOCKS ) * PER_BLOCK, backendName );
+  }
+
+  /**
+   * \brief appends through the public API with a store attached
+   */
+  void benchAppend( const std::string &root
+      , const std::string &name
+      , IoBackend backend
+      )
+  {
+    const int ENTRIES = 500000;
+
+    StoreOptions options;
+    options.backend = backend;
+
+    Timer timer( name );
+    {
+      Lumberjack lj;
+      if( lj.openStore( fresh( root, name ), options ) != OK ) {
+        std::cerr << name << ": unable to open store" << std::endl;
+        return;
+      }
+      std::vector<std::string> tags( 1, "http" );
+      for( int i = 0; i < ENTRIES; i++ ) {
+        lj.append( INFO, "request completed with status 200", "bench", tags );
+      }
+    }
+    timer.report( ENTRIES );
+  }
+
+  /**
+   * \brief searches a store for a rare phrase, as a substring and then as
+   * whole words so block filters can prune
+   */
+  void benchSearch( const std::string &root, const std::string &name )
+  {
+    const int BLOCKS = 8000;
+    const int PER_BLOCK = 256;
+
+    FileStore store;
+    std::string path = fresh( root, name );
+    if( store.open( path, StoreOptions(), "bench" ) != OK ) {
+      std::cerr << name << ": unable to open store" << std::endl;
+      return;
+    }
+
+    Record record;
+    record.level = INFO;
+    record.module = "bench";
+    record.tags.push_back( "http" );
+
+    BlockBuilder block;
+    std::vector<std::pair<uint64_t, DurableCallback> > waiters;
+    uint64_t seq = store.nextSeq();
+    for( int b = 0; b < BLOCKS; b++ ) {
+      block.clear();
+      for( int i = 0; i < PER_BLOCK; i++ ) {
+        record.seq = seq++;
+        record.timestamp = static_cast<int64_t>( record.seq );
+        record.message = "request " + std::to_string( record.seq )
+          + ( record.seq % 100000 == 0 ? " timed out" : " completed in 12.5 ms with status 200" );
+        block.add( record );
+      }
+      block.seal();
+      store.write( block, waiters );
+    }
+    store.close();
+
+    for( int words = 0; words < 2; words++ ) {
+      SearchQuery query;
+      query.text = "timed out";
+      query.words = words != 0;
+      SearchStats stats;
+      Timer timer( name + ( query.words ? " words" : " substring" ));
+      double start = wallSeconds();
+      searchStore( path, query, []( const SearchMatch & ) { return true; }, &stats );
+      double seconds = wallSeconds() - start;
+
+      std::ostringstream extra;
+      extra << std::fixed << std::setprecision( 2 ) << stats.bytesScanned / seconds / 1e9
+        << " GB/s, " << stats.matches << " matches, " << stats.blocksPruned << " blocks pruned";
+      timer.report( static_cast<uint64_t>( BLOCKS ) * PER_BLOCK, extra.str());
+    }
+  }
+
+  /**
+   * \brief indexes sealed segments, then looks up words through the index
+   */
+  void benchIndex( const std::string &root, const std::string &name )
+  {
+    const int BLOCKS = 4000;
+    const int PER_BLOCK = 256;
+    const char *VERBS[] = { "completed", "failed", "retried", "queued" };
+
+    StoreOptions options;
+    options.segmentBytes = 16 * 1024 * 1024;
+    options.compactIntervalMs = 0;
+    options.indexMessages = true;
+
+    FileStore store;
+    std::string path = fresh( root, name );
+    if( store.open( path, options, "bench" ) != OK ) {
+      std::cerr << name << ": unable to open store" << std::endl;
+      return;
+    }
+
+    Record record;
+    record.level = INFO;
+    record.module = "bench";
+
+    BlockBuilder block;
+    std::vector<std::pair<uint64_t, DurableCallback> > waiters;
+    uint64_t seq = store.nextSeq();
+    for( int b = 0; b < BLOCKS; b++ ) {
+      block.clear();
+      for( int i = 0; i < PER_BLOCK; i++ ) {
+        record.seq = seq++;
+        record.timestamp = static_cast<int64_t>( record.seq );
+        record.message = "request " + std::to_string( record.seq % 50000 ) + " "
+          + VERBS[record.seq % 4] + " for user" + std::to_string( record.seq % 997 )
+          + ( record.seq % 1000 == 0 ? " after timeout" : " in 12.5 ms" );
+        block.add( record );
+      }
+      block.seal();
+      store.write( block, waiters );
+    }
+
+    //Everything but the current segment gets its index
+    uint64_t entries = static_cast<uint64_t>( BLOCKS ) * PER_BLOCK;
+    std::vector<SegmentInfo> segments = store.segments();
+    uint64_t segmentBytes = 0;
+    for( size_t i = 0; i + 1 < segments.size(); i++ ) {
+      segmentBytes += fileBytes( segments[i].path );
+    }
+    Timer build( name + " build" );
+    store.compact();
+    uint64_t indexBytes = 0;
+    for( size_t i = 0; i + 1 < segments.size(); i++ ) {
+      indexBytes += fileBytes( indexPath( segments[i].path ));
+    }
+    std::ostringstream extra;
+    extra << std::fixed << std::setprecision( 1 ) << indexBytes / 1e6 << " MB index for "
+      << segmentBytes / 1e6 << " MB of segments";
+    build.report( entries * ( segments.size() - 1 ) / segments.size(), extra.str());
+    store.close();
+
+    TermQuery query;
+    query.clauses = { { "completed", "queued" }, { "timeout" } };
+    std::vector<uint64_t> seqs;
+    TermStats stats;
+    Timer lookup( name + " lookup" );
+    lookupTerms( path, query, seqs, &stats );
+    extra.str( "" );
+    extra << seqs.size() << " matches, " << stats.indexed << "/" << stats.segments
+      << " segments indexed, " << stats.postings << " postings";
+    lookup.report( entries, extra.str());
+  }
+
+  /**
+   * \brief stores the same messages with and without template mining
+   * \return bytes of segments written
+   */
+  uint64_t storeMessages( const std::string &path, bool mine, const std::string &name )
+  {
+    const int BLOCKS = 2000;
+    const int PER_BLOCK = 256;
+    const char *VERBS[] = { "completed", "failed", "retried", "queued" };
+
+    StoreOptions options;
+    options.compactIntervalMs = 0;
+    options.mineTemplates = mine;
+
+    FileStore store;
+    if( store.open( path, options, "bench" ) != OK ) {
+      std::cerr << name << ": unable to open store" << std::endl;
+      return 0;
+    }
+
+    Record record;
+    record.level = INFO;
+    record.module = "bench";
+
+    //Records go through prepareRecord like the writer thread's
+    BlockBuilder block;
+    std::string encoded;
+    std::string prepared;
+    std::vector<std::pair<uint64_t, DurableCallback> > waiters;
+    uint64_t seq = store.nextSeq();
+    Timer timer( name );
+    for( int b = 0; b < BLOCKS; b++ ) {
+      block.clear();
+      for( int i = 0; i < PER_BLOCK; i++ ) {
+        record.seq = seq++;
+        record.timestamp = static_cast<int64_t>( record.seq );
+        record.message = "request " + std::to_string( record.seq % 50000 ) + " "
+          + VERBS[record.seq % 4] + " for user" + std::to_string( record.seq % 997 )
+          + " from 10.0.0." + std::to_string( record.seq % 251 ) + " in "
+          + std::to_string( record.seq % 90 ) + ".5 ms";
+        encoded.clear();
+        encodeRecord( record, encoded );
+        const uint8_t *body = reinterpret_cast<const uint8_t *>( encoded.data()) + sizeof( uint32_t );
+        size_t size = encoded.size() - sizeof( uint32_t );
+        if( store.prepareRecord( body, size, NULL, 0, prepared )) {
+          body = reinterpret_cast<const uint8_t *>( prepared.data());
+          size = prepared.size();
+        }
+        block.addEncoded( body, size, record.seq );
+      }
+      block.seal();
+      store.write( block, waiters );
+    }
+    std::vector<SegmentInfo> segments = store.segments();
+    store.close();
+
+    uint64_t bytes = 0;
+    for( size_t i = 0; i < segments.size(); i++ ) {
+      bytes += fileBytes( segments[i].path );
+    }
+    std::ostringstream extra;
+    extra << std::fixed << std::setprecision( 1 ) << bytes / 1e6 << " MB of segments";
+    timer.report( static_cast<uint64_t>( BLOCKS ) * PER_BLOCK, extra.str());
+    return bytes;
+  }
+
+  void benchTemplates( const std::string &root, const std::string &name )
+  {
+    uint64_t plain = storeMessages( fresh( root, name + " plain" ), false, name + " plain" );
+    std::string path = fresh( root, name + " mined" );
+    uint64_t mined = storeMessages( path, true, name + " mined" );
+    if( plain == 0 || mined == 0 ) {
+      return;
+    }
+
+    std::vector<TemplateRow> rows;
+    Timer timer( name + " group-by" );
+    queryTemplates( path, TemplateQuery(), rows );
+    std::ostringstream extra;
+    extra << std::fixed << std::setprecision( 2 ) << rows.size() << " clusters, segments "
+      << static_cast<double>( plain ) / mined << "x smaller";
+    timer.report( rows.empty() ? 0 : rows[0].count, extra.str());
+  }
+
+  /**
+   * \brief exports the store benchTemplates mined as an Arrow stream, all
+   * of it and then the entries matching a word
+   */
+  void benchExport( const std::string &root, const std::string &name )
+  {
+    std::string path = root + "/templates mined";
+    int fd = ::open( "/dev/null", O_WRONLY );
+    if( fd < 0 ) {
+      std::cerr << name << ": unable to open /dev/null" << std::endl;
+      return;
+    }
+    for( int text = 0; text < 2; text++ ) {
+      SearchQuery query;
+      if( text ) {
+        query.text = "failed";
+      }
+      ExportStats stats;
+      Timer timer( name + ( text ? " text" : " all" ));
+      if( exportArrow( path, query, fd, &stats ) != OK ) {
+        std::cerr << name << ": export failed" << std::endl;
+        break;
+      }
+      std::ostringstream extra;
+      extra << std::fixed << std::setprecision( 1 ) << stats.bytes / 1e6 << " MB in "
+        << stats.batches << " batches";
+      timer.report( stats.rows, extra.str());
+    }
+    ::close( fd );
+  }
+
+  /**
+   * \brief imports a JSON-lines file, against parsing its lines with
+   * nlohmann's parser alone
+   */
+  void benchImport( const std::string &root, const std::string &name )
+  {
+    const int LINES = 1000000;
+    const char *VERBS[] = { "completed", "failed", "retried", "queued" };
+
+    std::string logs = root + "/" + name + ".jsonl";
+    {
+      std::ofstream out( logs.c_str(), std::ios::trunc );
+      for( int i = 0; i < LINES; i++ ) {
+        out << "{\"timestamp\":" << 1666000000 + i / 1000 << "." << std::setw( 3 ) << std::setfill( '0' )
+          << i % 1000 << std::setfill( ' ' ) << ",\"pid\":" << 1000 + i % 7
+          << ",\"deviceId\":\"cam-" << i % 3 << "\",\"type\":\"log\",\"level\":" << 1 + i % 4
+          << ",\"message\":\"request " << i << " " << VERBS[i % 4] << " for user" << i % 997
+          << " in " << i % 90 << ".5 ms\",\"module\":\"net\",\"tags\":[\"edge\"]}\n";
+      }
+    }
+    uint64_t bytes = fileBytes( logs );
+
+    {
+      std::ifstream in( logs.c_str());
+      std::string line;
+      Timer timer( name + " nlohmann parse" );
+      uint64_t parsed = 0;
+      while( std::getline( in, line )) {
+        parsed += json::parse( line ).size() > 0;
+      }
+      timer.report( parsed );
+    }
+
+    StoreOptions options;
+    options.compactIntervalMs = 0;
+    options.indexMessages = true;
+    FileStore store;
+    std::string path = fresh( root, name );
+    if( store.open( path, options, "cam-0" ) != OK ) {
+      std::cerr << name << ": unable to open store" << std::endl;
+      return;
+    }
+    ImportStats stats;
+    double start = wallSeconds();
+    Timer timer( name );
+    if( importJsonLines( store, { logs }, ImportOptions(), &stats ) != OK ) {
+      std::cerr << name << ": import failed" << std::endl;
+      return;
+    }
+    double seconds = wallSeconds() - start;
+    std::ostringstream extra;
+    extra << std::fixed << std::setprecision( 0 ) << bytes / seconds / 1e6 << " MB/s of JSON, "
+      << stats.rejected << " rejected, indexes included";
+    timer.report( stats.entries, extra.str());
+    store.close();
+  }
+}
+
+int main( int argc, char *argv[] )
+{
+  std::string root = argc > 1 ? argv[1] : "/tmp/lumberjack_bench";
+  std::string command = "mkdir -p '" + root + "'";
+  if( system( command.c_str()) != 0 ) {
+    std::cerr << "unable to create " << root << std::endl;
+    return 1;
+  }
+
+  benchStore( root, "store pwrite none", IoBackend::PWRITE, Durability::NONE );
+  benchStore( root, "store io_uring none", IoBackend::IO_URING, Durability::NONE );
+  benchStore( root, "store pwrite group", IoBackend::PWRITE, Durability::GROUP );
+  benchStore( root, "store io_uring group", IoBackend::IO_URING, Durability::GROUP );
+
+  benchAppend( root, "append pwrite", IoBackend::PWRITE );
+  benchAppend( root, "append io_uring", IoBackend::IO_URING );
+
+  benchSearch( root, "search" );
+  benchIndex( root, "index" );
+  benchTemplates( root, "templates" );
+  benchExport( root, "export" );
+  benchImport( root, "import" );
+
+  return 0;
+}
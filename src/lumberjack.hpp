@@ -14,7 +14,17 @@
  * limitations under the License
  **/
 
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <atomic>
+#include <future>
+#include <memory>
 #include <string>
+#include <type_traits>
 #include <vector>
 #include <syslog.h>
 
@@ -25,7 +35,331 @@ using json = nlohmann::json;
 namespace lumberjack {
   enum Severity{ CRITICAL, ERROR, WARNING, INFO, DEBUG, TRACE, ALL };
   enum class PayloadType { STRING, BINARY };
-  enum Status{ OK, NO_INIT, ERR, INCOMPATIBLE};
+  enum Status{ OK, NO_INIT, ERR, INCOMPATIBLE, CONNECTING };
+
+  /**
+   * \brief native type of a structured field
+   **/
+  enum class FieldType : uint8_t { INT64, DOUBLE, BOOL, STRING, TIMESTAMP };
+
+  /**
+   * \brief typed key/value attached to an entry
+   *
+   * Values are stored in their native binary form and only rendered as JSON
+   * when an entry is read back. A Field refers to its key and string value
+   * rather than copying them, so both must outlive the append call it is
+   * passed to; keys are normally string literals.
+   **/
+  class Field {
+    public:
+      template<typename T>
+      Field( const char *key
+          , T value
+          , typename std::enable_if<std::is_integral<T>::value
+              && !std::is_same<T, bool>::value>::type * = NULL
+          ) : Field( key, FieldType::INT64 )
+      {
+        integer_ = static_cast<int64_t>( value );
+      };
+
+      Field( const char *key, double value ) : Field( key, FieldType::DOUBLE )
+      {
+        real_ = value;
+      };
+
+      Field( const char *key, bool value ) : Field( key, FieldType::BOOL )
+      {
+        integer_ = value ? 1 : 0;
+      };
+
+      Field( const char *key, const std::string &value )
+        : Field( key, FieldType::STRING )
+      {
+        text_ = value.data();
+        textSize_ = value.size();
+      };
+
+      Field( const char *key, const char *value ) : Field( key, FieldType::STRING )
+      {
+        text_ = value;
+        textSize_ = strlen( value );
+      };
+
+      /**
+       * \brief timestamp field, stored as nanoseconds since the epoch
+       **/
+      Field( const char *key, std::chrono::system_clock::time_point value )
+        : Field( key, FieldType::TIMESTAMP )
+      {
+        integer_ = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            value.time_since_epoch()).count();
+      };
+
+      FieldType type() const { return type_; };
+      const char *key() const { return key_; };
+      size_t keySize() const { return keySize_; };
+
+      //INT64, BOOL and TIMESTAMP values
+      int64_t integer() const { return integer_; };
+      double real() const { return real_; };
+      const char *text() const { return text_; };
+      size_t textSize() const { return textSize_; };
+
+    private:
+      Field( const char *key, FieldType type )
+        : type_( type ), key_( key ), keySize_( strlen( key )) {};
+
+      FieldType type_;
+      const char *key_;
+      size_t keySize_;
+      int64_t integer_ = 0;
+      double real_ = 0;
+      const char *text_ = NULL;
+      size_t textSize_ = 0;
+  };
+
+  /**
+   * \brief level threshold of one module, cached by whatever logs as it
+   *
+   * The cache is tagged with the version of the level table it came from,
+   * so it goes stale by itself whenever levels change.
+   **/
+  class LevelCache {
+    public:
+      /**
+       * \brief returns the cached level threshold
+       * \param [in] version version of the level table in use
+       * \param [out] threshold cached threshold
+       * \return false if nothing is cached for that version
+       **/
+      bool cachedLevel( uint64_t version, Severity &threshold ) const
+      {
+        uint64_t cache = levelCache_.load( std::memory_order_relaxed );
+        if(( cache >> 8 ) != version ) {
+          return false;
+        }
+        threshold = static_cast<Severity>( cache & 0xff );
+        return true;
+      };
+
+      void cacheLevel( uint64_t version, Severity threshold ) const
+      {
+        levelCache_.store(( version << 8 ) | static_cast<uint64_t>( threshold )
+            , std::memory_order_relaxed );
+      };
+
+    private:
+      mutable std::atomic<uint64_t> levelCache_{ 0 };
+  };
+
+  /**
+   * \brief static metadata of one logging call site
+   *
+   * A call site is registered once, normally through LJ_SITE, and is given a
+   * 32-bit id derived from its metadata. Entries appended through it store
+   * only the id, the timestamp and their fields; the metadata is written
+   * once to a dictionary next to the log data and resolved when read back.
+   **/
+  class CallSite : public LevelCache {
+    public:
+      CallSite( Severity level
+          , const char *module
+          , const char *message
+          , const char *file
+          , uint32_t line
+          );
+
+      uint32_t id() const { return id_; };
+      Severity level() const { return level_; };
+      const std::string &module() const { return module_; };
+      const std::string &message() const { return message_; };
+      const std::string &file() const { return file_; };
+      uint32_t line() const { return line_; };
+
+      /**
+       * \brief records that the site's metadata was sent for a sink epoch
+       * \return true if the caller must send the metadata now
+       **/
+      bool announce( uint32_t epoch ) const
+      {
+        return epoch_.load( std::memory_order_relaxed ) != epoch
+          && epoch_.exchange( epoch ) != epoch;
+      };
+
+    private:
+      uint32_t id_;
+      Severity level_;
+      std::string module_;
+      std::string message_;
+      std::string file_;
+      uint32_t line_;
+      mutable std::atomic<uint32_t> epoch_{ 0 };
+
+      CallSite( const CallSite & );
+      CallSite &operator=( const CallSite & );
+  };
+
+/**
+ * \brief registers the enclosing call site on first use
+ *
+ * Evaluates to a reference to a static CallSite. The arguments must be
+ * constants, e.g. lj.append( LJ_SITE( INFO, "camera", "frame dropped" ),
+ * { Field( "frame", n ) } ).
+ **/
+#define LJ_SITE( level, module, message ) \
+  ( []() -> const ::lumberjack::CallSite & { \
+      static const ::lumberjack::CallSite site( level, module, message \
+          , __FILE__, __LINE__ ); \
+      return site; \
+    }())
+
+  /**
+   * \brief controls when the on-disk store flushes entries to stable storage
+   *
+   * NONE leaves entries in the page cache. INTERVAL flushes on a fixed
+   * period. GROUP flushes once groupEntries are pending or the oldest pending
+   * entry is groupUs old. SYNC_CRITICAL flushes as soon as a CRITICAL entry
+   * is written. In every mode an entry appended with a durability callback is
+   * flushed together with whatever else is pending at the time.
+   **/
+  enum class Durability { NONE, INTERVAL, GROUP, SYNC_CRITICAL };
+
+  /**
+   * \brief selects how the on-disk store issues writes
+   *
+   * IO_URING keeps up to ioDepth writes in flight from registered buffers.
+   * It falls back to PWRITE when io_uring is unavailable at runtime.
+   **/
+  enum class IoBackend { PWRITE, IO_URING };
+
+  /**
+   * \brief settings for the on-disk store
+   *
+   * Binary payloads of spillBytes or more are written to a blob file next to
+   * their segment so they do not bloat the record stream. Zero keeps every
+   * payload inline.
+   *
+   * Retention limits are enforced by a background compactor every
+   * compactIntervalMs. Entries older than retainSeconds are dropped, unless
+   * levelRetainSeconds sets an age for their level, and the oldest segments
+   * are deleted while the store holds more than retainBytes. Zero means no
+   * limit. The compactor rewrites at most compactBytesPerSec.
+   *
+   * With indexMessages the compactor also indexes the message words of each
+   * segment once it is sealed, for lookupTerms().
+   *
+   * With mineTemplates string messages are clustered into templates as they
+   * are stored, and kept as a template id and the tokens that vary, for a
+   * smaller store and queryTemplates(). Messages read back are unchanged.
+   **/
+  struct StoreOptions {
+    Durability durability = Durability::NONE;
+    uint32_t intervalUs = 1000000;
+    uint32_t groupEntries = 128;
+    uint32_t groupUs = 2000;
+    uint64_t segmentBytes = 64 * 1024 * 1024;
+    IoBackend backend = IoBackend::PWRITE;
+    uint32_t ioDepth = 8;
+    uint32_t spillBytes = 16 * 1024;
+    uint64_t retainBytes = 0;
+    uint32_t retainSeconds = 0;
+    uint32_t levelRetainSeconds[ALL] = { 0, 0, 0, 0, 0, 0 };
+    uint32_t compactIntervalMs = 60000;
+    uint32_t compactBytesPerSec = 8 * 1024 * 1024;
+    bool indexMessages = false;
+    bool mineTemplates = false;
+  };
+
+  /**
+   * \brief settings for the per-host shared memory ring
+   *
+   * The geometry is only used by the process that creates the ring; later
+   * processes use whatever layout the ring already has. A producer that
+   * leaves a claimed cell unpublished for abandonMs, or that exits, has its
+   * cells reclaimed by the collector.
+   **/
+  struct SharedRingOptions {
+    std::string name;
+    uint32_t cells = 65536;
+    uint32_t cellSize = 256;
+    uint32_t abandonMs = 1000;
+  };
+
+  /**
+   * \brief latency distribution of one sink, in nanoseconds
+   *
+   * Percentiles are accurate to about 6%.
+   **/
+  struct LatencyStats {
+    uint64_t count = 0;
+    uint64_t min = 0;
+    uint64_t max = 0;
+    uint64_t mean = 0;
+    uint64_t p50 = 0;
+    uint64_t p90 = 0;
+    uint64_t p99 = 0;
+    uint64_t p999 = 0;
+  };
+
+  /**
+   * \brief what the batching controller is currently doing
+   *
+   * batchEntries is 0 until the controller has seen enough entries to
+   * estimate their rate.
+   **/
+  struct BatchingStats {
+    uint32_t targetP99Us = 0;     //delivery target, 0 when batching is off
+    uint32_t lingerUs = 0;        //time the consumer waits for a batch to fill
+    uint64_t batchEntries = 0;    //batch size that ends the wait early
+    double entriesPerSec = 0;     //entry rate over the last window
+    double batchesPerSec = 0;     //blocks or datagrams per second, same window
+    uint64_t windowP99Ns = 0;     //delivery p99 the last decision was based on
+    LatencyStats delivery;        //time from append until a sink took the entry
+  };
+
+  /**
+   * \brief what the logger has done since it was created
+   **/
+  struct Stats {
+    uint64_t appended = 0;        //entries accepted by append
+    uint64_t filtered = 0;        //entries below their module's level
+    uint64_t sampled = 0;         //entries removed by sampling
+    uint64_t dropped = 0;         //accepted entries that reached no sink
+    uint64_t shed = 0;            //of those, DEBUG and TRACE entries shed under load
+    uint64_t bytesEncoded = 0;    //encoded size of accepted entries
+    uint64_t queueDepth = 0;      //entries waiting for the consumer
+    uint64_t queueHighWater = 0;  //most entries ever waiting at once
+    LatencyStats storeWrite;      //block writes to the store
+    LatencyStats daemonSend;      //batch sends to lumberjackd
+    uint64_t hourglassFailures = 0;
+    BatchingStats batching;
+  };
+
+  /**
+   * \brief called with true once an entry is durable, false if the flush failed
+   **/
+  typedef std::function<void( bool durable )> DurableCallback;
+
+  /**
+   * \brief shared handle to a binary payload
+   *
+   * The pipeline holds a reference instead of copying the bytes, so the
+   * buffer must not be modified after it is appended.
+   **/
+  typedef std::shared_ptr<const std::vector<uint8_t> > BinaryPayload;
+
+  class Logger;
+  struct LoggerState;
+  class Subscription;
+  struct SubscriptionFilter;
+  struct SearchQuery;
+  struct SearchMatch;
+  struct RollupQuery;
+  struct RollupRow;
+  struct TermQuery;
+  struct TemplateQuery;
+  struct TemplateRow;
+  struct ImportStats;
 
   /**
    * \brief the lumberjack base class provides common functionality used by the
@@ -34,12 +368,48 @@ namespace lumberjack {
   class Lumberjack {
     public:
       Lumberjack();
+
+      /**
+       * \brief the process-wide logger core
+       *
+       * Created on first use and shared by every library in the process, so
+       * there is one queue, one set of sinks and one Hourglass connection.
+       * It is destroyed, and its queue flushed, at exit.
+       **/
+      static Lumberjack &shared();
+
+      /**
+       * \brief returns a handle that logs as module with default tags
+       * \param [in] module dotted module name
+       * \param [in] tags tags added to every entry from the handle
+       *
+       * Handles for the same module and tags share their state, and copying
+       * one copies a pointer. A handle must not outlive this object.
+       **/
+      Logger getLogger( const std::string &module
+          , const std::vector<std::string> &tags = std::vector<std::string>()
+          );
+
+      /**
+       * \brief creates a producer that appends into the shared memory ring
+       * \param [in] ring ring to attach to, created if it does not exist
+       *
+       * No Hourglass connection is made. A collector process started with
+       * collectSharedRing() drains the ring into its own store.
+       **/
+      explicit Lumberjack( SharedRingOptions ring );
       ~Lumberjack();
       /**
        * \brief get API version
        * \return version in a major/minor/patch/release format
        **/
       std::string getVersion();
+
+      /**
+       * \brief get the state of the Hourglass connection
+       * \return CONNECTING while the background connect is running, then
+       * OK or ERR. NO_INIT if this instance does not connect.
+       **/
       Status getAPIStatus();
 
 
@@ -60,7 +430,7 @@ namespace lumberjack {
        * \return unique ID of the entry on success, empty string on failure
        **/
       std::string append( Severity level
-          , std::string message
+          , const std::string &message
           );
 
       /**
@@ -71,8 +441,8 @@ namespace lumberjack {
        * \return unique ID of the entry on success, empty string on failure
        **/
       std::string append( Severity level
-          , std::string message
-          , std::vector<std::string> tags
+          , const std::string &message
+          , const std::vector<std::string> &tags
           );
 
       /**
@@ -84,11 +454,320 @@ namespace lumberjack {
        * \return unique ID of the entry on success, empty string on failure
        **/
       std::string append( Severity level
-          , std::string message
-          , std::string module
-          , std::vector<std::string> tags
+          , const std::string &message
+          , const std::string &module
+          , const std::vector<std::string> &tags
           );
 
+      /**
+       * \brief  Function to insert a log message with typed fields.
+       * \param [in] level the enumerated Log level of the issue
+       * \param [in] message text information about the event.
+       * \param [in] fields typed key/value pairs stored in native form
+       * \param [in] tags vector of keywords related to the error
+       * \return unique ID of the entry on success, empty string on failure
+       **/
+      std::string appendFields( Severity level
+          , const std::string &message
+          , std::initializer_list<Field> fields
+          , const std::vector<std::string> &tags = std::vector<std::string>()
+          );
+
+      /**
+       * \brief  Function to insert a log message with typed fields.
+       * \param [in] level the enumerated Log level of the issue
+       * \param [in] message text information about the event.
+       * \param [in] fields typed key/value pairs stored in native form
+       * \param [in] tags vector of keywords related to the error
+       * \return unique ID of the entry on success, empty string on failure
+       **/
+      std::string appendFields( Severity level
+          , const std::string &message
+          , const std::vector<Field> &fields
+          , const std::vector<std::string> &tags = std::vector<std::string>()
+          );
+
+      /**
+       * \brief  Function to insert an entry from a registered call site.
+       * \param [in] site call site, usually from LJ_SITE
+       * \param [in] fields dynamic arguments of the entry
+       * \return unique ID of the entry on success, empty string on failure
+       *
+       * The level, module and message come from the call site and are not
+       * copied into the entry.
+       **/
+      std::string append( const CallSite &site
+          , std::initializer_list<Field> fields = std::initializer_list<Field>()
+          );
+
+      /**
+       * \brief  Function to insert an entry from a registered call site.
+       * \param [in] site call site, usually from LJ_SITE
+       * \param [in] fields dynamic arguments of the entry
+       * \return unique ID of the entry on success, empty string on failure
+       **/
+      std::string append( const CallSite &site
+          , const std::vector<Field> &fields
+          );
+
+      /**
+       * \brief  Function to insert a binary log entry.
+       * \param [in] level the enumerated Log level of the issue
+       * \param [in] data start of the payload
+       * \param [in] size number of payload bytes
+       * \param [in] module name of the module or function appending data
+       * \param [in] tags vector of keywords related to the error
+       * \return unique ID of the entry on success, empty string on failure
+       *
+       * The bytes are copied once into the entry and stored as is, without
+       * any text encoding.
+       **/
+      std::string appendBinary( Severity level
+          , const void *data
+          , size_t size
+          , const std::string &module = std::string()
+          , const std::vector<std::string> &tags = std::vector<std::string>()
+          );
+
+      /**
+       * \brief  Function to insert a binary log entry without copying it.
+       * \param [in] level the enumerated Log level of the issue
+       * \param [in] payload shared payload, referenced until it is stored
+       * \param [in] module name of the module or function appending data
+       * \param [in] tags vector of keywords related to the error
+       * \return unique ID of the entry on success, empty string on failure
+       **/
+      std::string appendBinary( Severity level
+          , const BinaryPayload &payload
+          , const std::string &module = std::string()
+          , const std::vector<std::string> &tags = std::vector<std::string>()
+          );
+
+      /**
+       * \brief  Function to insert a log message and be told when it is durable.
+       * \param [in] level the enumerated Log level of the issue
+       * \param [in] message text information about the event.
+       * \param [in] tags vector of keywords related to the error
+       * \param [in] callback called once the entry reaches stable storage
+       * \return unique ID of the entry on success, empty string on failure
+       *
+       * The callback runs on an internal thread. Concurrent callers waiting
+       * for durability share a single flush of the store.
+       **/
+      std::string append( Severity level
+          , const std::string &message
+          , const std::vector<std::string> &tags
+          , const DurableCallback &callback
+          );
+
+      /**
+       * \brief  Function to insert a log message and wait for it to be durable.
+       * \param [in] level the enumerated Log level of the issue
+       * \param [in] message text information about the event.
+       * \param [in] tags vector of keywords related to the error
+       * \return future that becomes true once the entry is durable
+       **/
+      std::future<bool> appendDurable( Severity level
+          , const std::string &message
+          , const std::vector<std::string> &tags = std::vector<std::string>()
+          );
+
+      /**
+       * \brief opens the on-disk store that entries are written to
+       * \param [in] path directory that holds the store segments
+       * \param [in] options durability and segment settings
+       * \return OK on success, ERR on failure
+       **/
+      Status openStore( std::string path
+          , StoreOptions options = StoreOptions()
+          );
+
+      /**
+       * \brief applies retention and compacts the store now
+       * \return OK on success, ERR if no store is open or a rewrite failed
+       *
+       * Runs the same pass as the background compactor, without its I/O
+       * limit, and returns once it is done.
+       **/
+      Status compactStore( void );
+
+      /**
+       * \brief sends entries to a local lumberjackd instead of a store
+       * \param [in] path daemon socket path, empty for the default
+       * \return OK on success, ERR if the daemon is not listening
+       *
+       * Entries are batched by the background consumer and sent without
+       * blocking. Batches the daemon cannot accept are dropped. IDs returned
+       * by append() are local to this process.
+       **/
+      Status connectDaemon( std::string path = std::string());
+
+      /**
+       * \brief applies settings from a JSON config file
+       * \param [in] path config file, see lumberjack_config.hpp for the format
+       * \param [in] watch reapply the file whenever it changes
+       * \return OK on success, ERR if the file is missing or invalid
+       *
+       * Reloads swap in a new level table without blocking producers. A
+       * reload that fails to parse is ignored and the previous settings
+       * stay in effect.
+       **/
+      Status loadConfig( std::string path, bool watch = true );
+
+      /**
+       * \brief returns counters and sink latencies
+       *
+       * Counters are kept per thread and only summed here, so counting
+       * adds no shared memory traffic to append.
+       **/
+      Stats getStats( void );
+
+      /**
+       * \brief subscribes to entries as they are written
+       * \param [in] filter entries to receive, see lumberjack_subscribe.hpp
+       * \return cursor to poll for new entries
+       *
+       * Every subscription reads the same copy of each entry, and one that
+       * falls behind is told what it missed rather than slowing logging.
+       * Instances that only feed a shared memory ring see no entries.
+       **/
+      std::unique_ptr<Subscription> subscribe( const SubscriptionFilter &filter );
+
+      /**
+       * \brief searches the store for entries by message text
+       * \param [in] query what to look for, see lumberjack_search.hpp
+       * \param [in] each called with each match, oldest first; returning
+       * false stops the search
+       * \return OK, or ERR if no store is open or the pattern is invalid
+       *
+       * Segments are scanned by a thread pool while matches are passed back
+       * on the calling thread. Entries still queued are not searched.
+       **/
+      Status search( const SearchQuery &query
+          , const std::function<bool( const SearchMatch & )> &each
+          );
+
+      /**
+       * \brief writes stored entries to a file as an Arrow IPC stream
+       * \param [in] query entries to export, see lumberjack_arrow.hpp; a
+       * default query exports the whole store
+       * \param [in] file path of the stream to write
+       * \return OK, or ERR if no store is open, the pattern is invalid or
+       * the file cannot be written
+       *
+       * Entries still queued are not exported.
+       **/
+      Status exportArrow( const SearchQuery &query, const std::string &file );
+
+      /**
+       * \brief stores the entries of JSON-lines log files
+       * \param [in] files paths of the files, imported in this order; see
+       * lumberjack_import.hpp for the line format
+       * \param [out] stats what was imported, or NULL
+       * \return OK, or ERR if no store is open, a file cannot be read or
+       * the store cannot be written
+       *
+       * Entries are numbered after those already stored. Appends only
+       * wait while the files are counted; entries appended during the
+       * import are numbered after it and written once it is done. Lines
+       * that are not an entry are skipped and counted in stats.
+       **/
+      Status importJson( const std::vector<std::string> &files, ImportStats *stats = NULL );
+
+      /**
+       * \brief counts stored entries per time bucket
+       * \param [in] query buckets and dimensions, see lumberjack_rollup.hpp
+       * \param [out] rows counts ordered by bucket, level, module and tag
+       * \return OK, or ERR if no store is open
+       *
+       * Answered from counts the store keeps as it writes, so the cost does
+       * not grow with the number of entries. Entries still queued are not
+       * counted.
+       **/
+      Status queryRollups( const RollupQuery &query, std::vector<RollupRow> &rows );
+
+      /**
+       * \brief finds stored entries whose messages hold given words
+       * \param [in] query words to look for, see lumberjack_index.hpp
+       * \param [out] ids ids of the matching entries, oldest first
+       * \return OK, or ERR if no store is open or the query is empty
+       *
+       * Sealed segments are answered from their index when the store has
+       * indexMessages set. Entries still queued are not found.
+       **/
+      Status lookupTerms( const TermQuery &query, std::vector<std::string> &ids );
+
+      /**
+       * \brief counts stored entries per message template
+       * \param [in] query entries to count, see lumberjack_template.hpp
+       * \param [out] rows counts per template cluster, largest first
+       * \return OK, or ERR if no store is open
+       *
+       * Templates are only mined with mineTemplates set. Entries still
+       * queued are not counted.
+       **/
+      Status queryTemplates( const TemplateQuery &query, std::vector<TemplateRow> &rows );
+
+      /**
+       * \brief logs the stats as an entry every interval
+       * \param [in] intervalMs time between entries, 0 to stop
+       *
+       * Entries come from module "lumberjack.stats" at INFO, so they can be
+       * silenced with a module level like any other module.
+       **/
+      void setStatsInterval( uint32_t intervalMs );
+
+      /**
+       * \brief batches entries to meet a delivery latency target
+       * \param [in] p99Us p99 time from append until a sink has the entry,
+       * 0 to hand every entry over as soon as possible (the default)
+       * \param [in] maxLingerUs longest the consumer waits for a batch to fill
+       *
+       * The consumer waits for more entries to join a batch for as long as
+       * the target allows, so bursts become a few large blocks or
+       * datagrams rather than many small ones. Entries waited on for
+       * durability and CRITICAL entries are never held back. Decisions are
+       * reported in Stats::batching.
+       **/
+      void setLatencyTarget( uint32_t p99Us
+          , uint32_t maxLingerUs = 50000
+          );
+
+      /**
+       * \brief keeps recent filtered entries per thread for when things fail
+       * \param [in] bytesPerThread ring size for each thread, 0 to stop
+       * recording
+       * \param [in] level least severe filtered level to keep
+       *
+       * Entries turned away by their level are encoded into a small ring
+       * owned by the appending thread instead of being discarded. When that
+       * thread appends an ERROR or CRITICAL entry, the ring is written just
+       * ahead of it, marked as replayed. Threads that already have a ring
+       * keep its size.
+       **/
+      void setFlightRecorder( size_t bytesPerThread
+          , Severity level = TRACE
+          );
+
+      /**
+       * \brief writes what every thread's flight recorder holds
+       * \return number of entries queued
+       *
+       * The rings are copied, not emptied, so entries may be written again
+       * if their thread later fails.
+       **/
+      size_t dumpFlightRecorder( void );
+
+      /**
+       * \brief makes this instance the collector for a shared memory ring
+       * \param [in] ring ring to drain, created if it does not exist
+       * \return OK on success, INCOMPATIBLE or ERR on failure
+       *
+       * Entries from every producer on the host, including this instance's
+       * own appends, are written to this instance's store in ring order.
+       **/
+      Status collectSharedRing( SharedRingOptions ring = SharedRingOptions());
+
       /**
        * \brief function to append a tag to an entry
        * \param [in] id uid of the entry to add a tag to
@@ -112,7 +791,8 @@ namespace lumberjack {
        * \return true on success, false on failure
        * 
        * Once the severity is set, all incoming messages at that serverity or
-       * higher will be sent to the logging system.
+       * higher will be sent to the logging system. Modules without a level
+       * of their own inherit this one. The default is ALL.
        **/
       bool setLogLevel( Severity level );
 
@@ -122,6 +802,33 @@ namespace lumberjack {
        **/
       Severity getLogLevel( void );
 
+      /**
+       * \brief sets the log level of a module and its submodules
+       * \param [in] module dotted module name, e.g. "net" or "net.tcp"
+       * \param [in] level enumerated severity level
+       * \return true on success, false on failure
+       *
+       * A module without a level of its own inherits the level of its
+       * closest parent, so setting "net" also covers "net.tcp" unless
+       * "net.tcp" has its own level. Changes take effect immediately and
+       * never block threads that are appending.
+       **/
+      bool setModuleLevel( const std::string &module, Severity level );
+
+      /**
+       * \brief removes a module's own level so it inherits again
+       * \param [in] module dotted module name
+       * \return true if the module had a level of its own
+       **/
+      bool clearModuleLevel( const std::string &module );
+
+      /**
+       * \brief gets the level in effect for a module
+       * \param [in] module dotted module name
+       * \return the module's level, inherited if it has none of its own
+       **/
+      Severity getModuleLevel( const std::string &module );
+
       /**
        * \brief sets the print level for the logging module
        * \param [in] level enumerated severity level
@@ -144,6 +851,72 @@ namespace lumberjack {
       //https://cpppatterns.com/patterns/pimpl.html
       class impl;
       std::unique_ptr<impl> pimpl;
+
+      friend struct LoggerState;
+  };
+
+  /**
+   * \brief cheap handle for logging as one module
+   *
+   * The module name, default tags and the module's cached level are bound
+   * when the handle is created, so logging through it does no per-call
+   * module lookup and an entry below the module's level costs two loads.
+   *
+   *   static lumberjack::Logger log( "net.tcp" );
+   *   log.append( lumberjack::INFO, "accepted" );
+   **/
+  class Logger {
+    public:
+      /**
+       * \brief creates a handle that logs nowhere
+       **/
+      Logger() {};
+
+      /**
+       * \brief creates a handle on the shared core
+       **/
+      explicit Logger( const std::string &module
+          , const std::vector<std::string> &tags = std::vector<std::string>()
+          );
+
+      /**
+       * \brief true if an entry at level would be kept
+       *
+       * Lets callers skip building a message that would be filtered. Levels
+       * the flight recorder keeps count as enabled.
+       **/
+      bool enabled( Severity level ) const;
+
+      /**
+       * \brief appends a message
+       * \return entry id, empty if the entry was filtered or failed
+       **/
+      std::string append( Severity level, const std::string &message );
+
+      /**
+       * \brief appends a message with typed fields
+       **/
+      std::string append( Severity level
+          , const std::string &message
+          , std::initializer_list<Field> fields
+          );
+
+      /**
+       * \brief appends a binary payload
+       **/
+      std::string appendBinary( Severity level, const void *data, size_t size );
+
+      /**
+       * \brief module the handle logs as
+       **/
+      const std::string &module() const;
+
+    private:
+      LoggerState *state_ = NULL;
+
+      explicit Logger( LoggerState *state ) : state_( state ) {};
+
+      friend class Lumberjack;
   };
 }
 
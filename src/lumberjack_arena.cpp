@@ -0,0 +1,141 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include <lumberjack_arena.hpp>
+
+namespace lumberjack {
+
+  namespace {
+    //Free chunks kept for reuse; anything beyond goes back to the heap
+    const size_t MAX_FREE_CHUNKS = 256;
+
+    //Entries are aligned so fixed-width fields can be read in place
+    const size_t ALIGNMENT = 8;
+
+    /**
+     * \brief process-wide list of chunks no entry refers to any more
+     */
+    class ChunkPool {
+      public:
+        ChunkPool() { free_.reserve( MAX_FREE_CHUNKS ); };
+
+        ~ChunkPool() {
+          for( size_t i = 0; i < free_.size(); i++ ) {
+            destroy( free_[i] );
+          }
+        };
+
+        ArenaChunk *acquire( size_t size ) {
+          if( size <= Arena::CHUNK_BYTES ) {
+            std::lock_guard<std::mutex> lock( mutex_ );
+            if( !free_.empty()) {
+              ArenaChunk *chunk = free_.back();
+              free_.pop_back();
+              return chunk;
+            }
+          }
+          else {
+            return create( size );
+          }
+          return create( Arena::CHUNK_BYTES );
+        };
+
+        void recycle( ArenaChunk *chunk ) {
+          if( chunk->capacity == Arena::CHUNK_BYTES ) {
+            std::lock_guard<std::mutex> lock( mutex_ );
+            if( free_.size() < MAX_FREE_CHUNKS ) {
+              free_.push_back( chunk );
+              return;
+            }
+          }
+          destroy( chunk );
+        };
+
+      private:
+        std::mutex mutex_;
+        std::vector<ArenaChunk *> free_;
+
+        static ArenaChunk *create( size_t capacity ) {
+          void *memory = ::operator new( sizeof( ArenaChunk ) + capacity );
+          ArenaChunk *chunk = new( memory ) ArenaChunk;
+          chunk->refs.store( 0 );
+          chunk->capacity = static_cast<uint32_t>( capacity );
+          chunk->used = 0;
+          return chunk;
+        };
+
+        static void destroy( ArenaChunk *chunk ) {
+          chunk->~ArenaChunk();
+          ::operator delete( chunk );
+        };
+    };
+
+    //Never destroyed: thread-local arenas may release into it during exit
+    ChunkPool &pool() {
+      static ChunkPool *instance = new ChunkPool();
+      return *instance;
+    }
+  }
+
+  Arena::~Arena()
+  {
+    if( current_ != NULL ) {
+      release( current_ );
+    }
+  }
+
+  Arena &Arena::local()
+  {
+    static thread_local Arena arena;
+    return arena;
+  }
+
+  uint8_t *Arena::allocate( size_t size, ArenaChunk *&chunk )
+  {
+    size = ( size + ALIGNMENT - 1 ) & ~( ALIGNMENT - 1 );
+
+    //Only our own reference is left, so every entry has been consumed
+    if( current_ != NULL && current_->refs.load( std::memory_order_acquire ) == 1 ) {
+      current_->used = 0;
+    }
+
+    if( current_ == NULL || current_->capacity - current_->used < size ) {
+      if( current_ != NULL ) {
+        release( current_ );
+      }
+      current_ = pool().acquire( size );
+      current_->used = 0;
+      current_->refs.store( 1, std::memory_order_relaxed );
+    }
+
+    chunk = current_;
+    chunk->refs.fetch_add( 1, std::memory_order_relaxed );
+    uint8_t *data = chunk->data() + chunk->used;
+    chunk->used += static_cast<uint32_t>( size );
+    return data;
+  }
+
+  void Arena::release( ArenaChunk *chunk )
+  {
+    if( chunk->refs.fetch_sub( 1, std::memory_order_acq_rel ) == 1 ) {
+      pool().recycle( chunk );
+    }
+  }
+}
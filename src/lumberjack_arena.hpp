@@ -0,0 +1,86 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ **/
+
+#pragma once
+
+// Per-thread bump arenas for entries on their way to the consumer thread.
+//
+// Each producer thread carves encoded entries out of its current chunk with
+// a pointer bump. Every entry holds a reference on its chunk, and so does the
+// producer while the chunk is current. The consumer drops an entry's
+// reference once the entry has been copied into a block; the last reference
+// returns the chunk to a process-wide free list. A producer whose current
+// chunk has no outstanding entries rewinds it in place, so a thread that is
+// keeping up with the consumer reuses the same memory indefinitely.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace lumberjack {
+
+  /**
+   * \brief block of arena memory shared by entries from one thread
+   */
+  struct alignas(16) ArenaChunk {
+    std::atomic<uint32_t> refs;
+    uint32_t capacity;
+    uint32_t used;
+    uint32_t reserved;
+
+    uint8_t *data() { return reinterpret_cast<uint8_t *>( this + 1 ); };
+  };
+
+  /**
+   * \brief bump allocator owned by a single producer thread
+   */
+  class Arena {
+    public:
+      //Size of a regular chunk. Larger entries get a chunk of their own.
+      static const size_t CHUNK_BYTES = 64 * 1024;
+
+      Arena() {};
+      ~Arena();
+
+      /**
+       * \brief arena of the calling thread
+       */
+      static Arena &local();
+
+      /**
+       * \brief reserves size bytes for one entry
+       * \param [in] size number of bytes
+       * \param [out] chunk chunk holding the entry, to pass to release
+       * \return start of the reserved bytes
+       *
+       * Only allocates from the heap when no recycled chunk is available.
+       */
+      uint8_t *allocate( size_t size, ArenaChunk *&chunk );
+
+      /**
+       * \brief drops the reference an entry holds on its chunk
+       *
+       * Safe to call from any thread.
+       */
+      static void release( ArenaChunk *chunk );
+
+    private:
+      ArenaChunk *current_ = NULL;
+
+      Arena( const Arena & );
+      Arena &operator=( const Arena & );
+  };
+}
@@ -0,0 +1,702 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include <lumberjack_arrow.hpp>
+#include <lumberjack_store.hpp>
+#include <lumberjack_template.hpp>
+
+namespace lumberjack {
+
+  namespace {
+    const char *LEVEL_NAMES[] = {
+      "critical", "error", "warning", "info", "debug", "trace"
+    };
+
+    //A batch is also cut once its messages reach this many bytes, well
+    //short of the 2 GB int32 offsets can reach
+    const size_t BATCH_MESSAGE_BYTES = 64 * 1024 * 1024;
+
+    //Arrow enums, from Schema.fbs and Message.fbs
+    const int16_t METADATA_V5 = 4;
+    const uint8_t HEADER_SCHEMA = 1;
+    const uint8_t HEADER_DICTIONARY = 2;
+    const uint8_t HEADER_RECORD_BATCH = 3;
+    const uint8_t TYPE_INT = 2;
+    const uint8_t TYPE_UTF8 = 5;
+    const uint8_t TYPE_TIMESTAMP = 10;
+    const uint8_t TYPE_LIST = 12;
+    const int16_t UNIT_NANOSECOND = 3;
+
+    const uint32_t CONTINUATION = 0xffffffffu;
+
+    /**
+     * \brief builds a FlatBuffer back to front, as the FlatBuffers library
+     * does, so objects are finished before anything refers to them
+     *
+     * References are positions counted from the end of the buffer.
+     */
+    class FlatBuilder {
+      public:
+        uint32_t size() const { return static_cast<uint32_t>( data_.size()); };
+
+        template<typename T>
+        void push( T value )
+        {
+          align( sizeof( T ), sizeof( T ));
+          data_.insert( 0, reinterpret_cast<const char *>( &value ), sizeof( T ));
+        };
+
+        void pushOffset( uint32_t ref )
+        {
+          align( sizeof( uint32_t ), sizeof( uint32_t ));
+          uint32_t offset = size() + sizeof( uint32_t ) - ref;
+          data_.insert( 0, reinterpret_cast<const char *>( &offset ), sizeof( offset ));
+        };
+
+        uint32_t string( const std::string &text )
+        {
+          align( text.size() + 1, sizeof( uint32_t ));
+          data_.insert( 0, 1, '\0' );
+          data_.insert( 0, text );
+          push<uint32_t>( static_cast<uint32_t>( text.size()));
+          return size();
+        };
+
+        /**
+         * \brief a vector of structs, given as their packed bytes
+         */
+        uint32_t structs( const void *data, size_t count, size_t width, size_t alignment )
+        {
+          align( count * width, sizeof( uint32_t ));
+          align( count * width, alignment );
+          data_.insert( 0, static_cast<const char *>( data ), count * width );
+          push<uint32_t>( static_cast<uint32_t>( count ));
+          return size();
+        };
+
+        uint32_t offsets( const std::vector<uint32_t> &refs )
+        {
+          align( refs.size() * sizeof( uint32_t ), sizeof( uint32_t ));
+          for( size_t i = refs.size(); i > 0; i-- ) {
+            pushOffset( refs[i - 1] );
+          }
+          push<uint32_t>( static_cast<uint32_t>( refs.size()));
+          return size();
+        };
+
+        void startTable()
+        {
+          fields_.clear();
+          tableStart_ = size();
+        };
+
+        template<typename T>
+        void add( uint16_t slot, T value )
+        {
+          push( value );
+          fields_.push_back( std::make_pair( slot, size()));
+        };
+
+        void addOffset( uint16_t slot, uint32_t ref )
+        {
+          pushOffset( ref );
+          fields_.push_back( std::make_pair( slot, size()));
+        };
+
+        /**
+         * \brief writes the table's vtable in front of it
+         */
+        uint32_t endTable()
+        {
+          push<int32_t>( 0 );
+          uint32_t table = size();
+          uint16_t slots = 0;
+          for( size_t i = 0; i < fields_.size(); i++ ) {
+            slots = std::max<uint16_t>( slots, fields_[i].first + 1 );
+          }
+          std::vector<uint16_t> vtable( slots, 0 );
+          for( size_t i = 0; i < fields_.size(); i++ ) {
+            vtable[fields_[i].first] = static_cast<uint16_t>( table - fields_[i].second );
+          }
+          for( size_t i = slots; i > 0; i-- ) {
+            push<uint16_t>( vtable[i - 1] );
+          }
+          push<uint16_t>( static_cast<uint16_t>( table - tableStart_ ));
+          push<uint16_t>( static_cast<uint16_t>( sizeof( uint16_t ) * ( 2 + slots )));
+
+          //The table starts with its distance back to the vtable
+          int32_t back = static_cast<int32_t>( size() - table );
+          memcpy( &data_[data_.size() - table], &back, sizeof( back ));
+          return table;
+        };
+
+        void finish( uint32_t root, std::string &out )
+        {
+          align( sizeof( uint32_t ), minAlign_ );
+          pushOffset( root );
+          out.swap( data_ );
+          data_.clear();
+        };
+
+      private:
+        std::string data_;
+        std::vector<std::pair<uint16_t, uint32_t> > fields_;
+        uint32_t tableStart_ = 0;
+        size_t minAlign_ = 1;
+
+        //Pads so the buffer is aligned once length more bytes are written
+        void align( size_t length, size_t alignment )
+        {
+          minAlign_ = std::max( minAlign_, alignment );
+          size_t pad = ( alignment - ( data_.size() + length ) % alignment ) % alignment;
+          data_.insert( 0, pad, '\0' );
+        };
+    };
+
+    /**
+     * \brief values of a dictionary column, in the order first seen
+     */
+    struct StringDictionary {
+      std::unordered_map<std::string, int32_t> ids;
+      std::vector<int32_t> offsets{ 0 };
+      std::string data;
+      size_t sent = 0;
+
+      int32_t intern( const uint8_t *value, size_t size, std::string &scratch )
+      {
+        scratch.assign( reinterpret_cast<const char *>( value ), size );
+        std::unordered_map<std::string, int32_t>::const_iterator it = ids.find( scratch );
+        if( it != ids.end()) {
+          return it->second;
+        }
+        int32_t id = static_cast<int32_t>( ids.size());
+        ids[scratch] = id;
+        data.append( scratch );
+        offsets.push_back( static_cast<int32_t>( data.size()));
+        return id;
+      };
+    };
+
+    enum { DICT_LEVEL, DICT_MODULE, DICT_TAG, DICT_DEVICE, DICTIONARIES };
+
+    /**
+     * \brief the buffers of one record batch body
+     */
+    class Body {
+      public:
+        void add( const void *data, size_t size )
+        {
+          buffers_.push_back( static_cast<int64_t>( data_.size()));
+          buffers_.push_back( static_cast<int64_t>( size ));
+          if( size > 0 ) {
+            data_.append( static_cast<const char *>( data ), size );
+            data_.append(( 8 - size % 8 ) % 8, '\0' );
+          }
+        };
+
+        //Columns have no nulls, so their validity bitmaps are left empty
+        void addValidity()
+        {
+          add( NULL, 0 );
+        };
+
+        void addNode( size_t length )
+        {
+          nodes_.push_back( static_cast<int64_t>( length ));
+          nodes_.push_back( 0 );
+        };
+
+        /**
+         * \brief the RecordBatch table describing the body
+         */
+        uint32_t table( FlatBuilder &builder, size_t length )
+        {
+          uint32_t nodes = builder.structs( nodes_.data(), nodes_.size() / 2, 16, 8 );
+          uint32_t buffers = builder.structs( buffers_.data(), buffers_.size() / 2, 16, 8 );
+          builder.startTable();
+          builder.add<int64_t>( 0, static_cast<int64_t>( length ));
+          builder.addOffset( 1, nodes );
+          builder.addOffset( 2, buffers );
+          return builder.endTable();
+        };
+
+        const std::string &data() const { return data_; };
+
+      private:
+        std::string data_;
+        std::vector<int64_t> nodes_;
+        std::vector<int64_t> buffers_;
+    };
+
+    /**
+     * \brief writes rows to an Arrow IPC stream
+     */
+    class ArrowStream {
+      public:
+        explicit ArrowStream( int fd ) : fd_( fd ) {
+          for( size_t i = 0; i < sizeof( LEVEL_NAMES ) / sizeof( LEVEL_NAMES[0] ); i++ ) {
+            dictionaries_[DICT_LEVEL].intern( reinterpret_cast<const uint8_t *>( LEVEL_NAMES[i] )
+                , strlen( LEVEL_NAMES[i] ), scratch_ );
+          }
+          tagOffsets_.push_back( 0 );
+          messageOffsets_.push_back( 0 );
+        };
+
+        /**
+         * \brief writes the schema and the dictionaries as they start out
+         */
+        bool begin();
+
+        void addTag( const uint8_t *tag, size_t size )
+        {
+          tags_.push_back( dictionaries_[DICT_TAG].intern( tag, size, scratch_ ));
+        };
+
+        /**
+         * \brief adds a row with the tags added since the last row
+         */
+        bool addRow( uint64_t seq
+            , int64_t timestamp
+            , uint8_t level
+            , uint32_t pid
+            , const uint8_t *module
+            , size_t moduleSize
+            , const uint8_t *message
+            , size_t messageSize
+            , int32_t device
+            );
+
+        int32_t device( const std::string &deviceId )
+        {
+          return dictionaries_[DICT_DEVICE].intern( reinterpret_cast<const uint8_t *>( deviceId.data())
+              , deviceId.size(), scratch_ );
+        };
+
+        /**
+         * \brief writes the rows left and the end of the stream
+         */
+        bool end();
+
+        const ExportStats &stats() const { return stats_; };
+
+      private:
+        int fd_;
+        ExportStats stats_;
+        std::string scratch_;
+        std::string metadata_;
+        FlatBuilder builder_;
+        StringDictionary dictionaries_[DICTIONARIES];
+
+        //Columns of the batch being filled
+        std::vector<uint64_t> seqs_;
+        std::vector<int64_t> timestamps_;
+        std::vector<int8_t> levels_;
+        std::vector<int32_t> modules_;
+        std::vector<int32_t> tagOffsets_;
+        std::vector<int32_t> tags_;
+        std::vector<int32_t> messageOffsets_;
+        std::string messages_;
+        std::vector<uint32_t> pids_;
+        std::vector<int32_t> devices_;
+
+        bool flush();
+        bool writeDictionary( int id );
+        bool writeMessage( uint8_t type, uint32_t header, const std::string &body );
+        uint32_t field( const std::string &name
+            , uint8_t type
+            , uint32_t typeRef
+            , int dictionary
+            , uint32_t indexBits
+            , const std::vector<uint32_t> &children
+            );
+        uint32_t intType( uint32_t bits, bool isSigned );
+    };
+
+    uint32_t ArrowStream::intType( uint32_t bits, bool isSigned )
+    {
+      builder_.startTable();
+      builder_.add<int32_t>( 0, static_cast<int32_t>( bits ));
+      builder_.add<uint8_t>( 1, isSigned ? 1 : 0 );
+      return builder_.endTable();
+    }
+
+    uint32_t ArrowStream::field( const std::string &name
+        , uint8_t type
+        , uint32_t typeRef
+        , int dictionary
+        , uint32_t indexBits
+        , const std::vector<uint32_t> &children
+        )
+    {
+      uint32_t nameRef = builder_.string( name );
+      uint32_t childrenRef = builder_.offsets( children );
+      uint32_t encoding = 0;
+      if( dictionary >= 0 ) {
+        uint32_t index = intType( indexBits, true );
+        builder_.startTable();
+        builder_.add<int64_t>( 0, dictionary );
+        builder_.addOffset( 1, index );
+        encoding = builder_.endTable();
+      }
+      builder_.startTable();
+      builder_.addOffset( 0, nameRef );
+      builder_.add<uint8_t>( 1, 0 );
+      builder_.add<uint8_t>( 2, type );
+      builder_.addOffset( 3, typeRef );
+      if( dictionary >= 0 ) {
+        builder_.addOffset( 4, encoding );
+      }
+      builder_.addOffset( 5, childrenRef );
+      return builder_.endTable();
+    }
+
+    bool ArrowStream::begin()
+    {
+      std::vector<uint32_t> none;
+      std::vector<uint32_t> fields;
+      fields.push_back( field( "seq", TYPE_INT, intType( 64, false ), -1, 0, none ));
+
+      uint32_t utc = builder_.string( "UTC" );
+      builder_.startTable();
+      builder_.add<int16_t>( 0, UNIT_NANOSECOND );
+      builder_.addOffset( 1, utc );
+      fields.push_back( field( "timestamp", TYPE_TIMESTAMP, builder_.endTable(), -1, 0, none ));
+
+      builder_.startTable();
+      uint32_t utf8 = builder_.endTable();
+      fields.push_back( field( "level", TYPE_UTF8, utf8, DICT_LEVEL, 8, none ));
+      fields.push_back( field( "module", TYPE_UTF8, utf8, DICT_MODULE, 32, none ));
+
+      std::vector<uint32_t> item( 1, field( "item", TYPE_UTF8, utf8, DICT_TAG, 32, none ));
+      builder_.startTable();
+      fields.push_back( field( "tags", TYPE_LIST, builder_.endTable(), -1, 0, item ));
+
+      fields.push_back( field( "message", TYPE_UTF8, utf8, -1, 0, none ));
+      fields.push_back( field( "pid", TYPE_INT, intType( 32, false ), -1, 0, none ));
+      fields.push_back( field( "deviceId", TYPE_UTF8, utf8, DICT_DEVICE, 32, none ));
+
+      uint32_t list = builder_.offsets( fields );
+      builder_.startTable();
+      builder_.add<int16_t>( 0, 0 );
+      builder_.addOffset( 1, list );
+      if( !writeMessage( HEADER_SCHEMA, builder_.endTable(), std::string())) {
+        return false;
+      }
+
+      //Readers expect every dictionary before the first record batch
+      for( int i = 0; i < DICTIONARIES; i++ ) {
+        if( !writeDictionary( i )) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    bool ArrowStream::addRow( uint64_t seq
+        , int64_t timestamp
+        , uint8_t level
+        , uint32_t pid
+        , const uint8_t *module
+        , size_t moduleSize
+        , const uint8_t *message
+        , size_t messageSize
+        , int32_t device
+        )
+    {
+      seqs_.push_back( seq );
+      timestamps_.push_back( timestamp );
+      levels_.push_back( static_cast<int8_t>( level ));
+      modules_.push_back( dictionaries_[DICT_MODULE].intern( module, moduleSize, scratch_ ));
+      tagOffsets_.push_back( static_cast<int32_t>( tags_.size()));
+      messages_.append( reinterpret_cast<const char *>( message ), messageSize );
+      messageOffsets_.push_back( static_cast<int32_t>( messages_.size()));
+      pids_.push_back( pid );
+      devices_.push_back( device );
+      stats_.rows++;
+
+      if( seqs_.size() >= ARROW_BATCH_ROWS || messages_.size() >= BATCH_MESSAGE_BYTES ) {
+        return flush();
+      }
+      return true;
+    }
+
+    bool ArrowStream::end()
+    {
+      if( !seqs_.empty() && !flush()) {
+        return false;
+      }
+      uint32_t eos[2] = { CONTINUATION, 0 };
+      stats_.bytes += sizeof( eos );
+      return appendFile( fd_, std::string( reinterpret_cast<const char *>( eos ), sizeof( eos )));
+    }
+
+    bool ArrowStream::flush()
+    {
+      for( int i = 0; i < DICTIONARIES; i++ ) {
+        if( dictionaries_[i].sent < dictionaries_[i].ids.size() && !writeDictionary( i )) {
+          return false;
+        }
+      }
+
+      size_t rows = seqs_.size();
+      Body body;
+      body.addNode( rows );
+      body.addValidity();
+      body.add( seqs_.data(), rows * sizeof( uint64_t ));
+      body.addNode( rows );
+      body.addValidity();
+      body.add( timestamps_.data(), rows * sizeof( int64_t ));
+      body.addNode( rows );
+      body.addValidity();
+      body.add( levels_.data(), rows * sizeof( int8_t ));
+      body.addNode( rows );
+      body.addValidity();
+      body.add( modules_.data(), rows * sizeof( int32_t ));
+      body.addNode( rows );
+      body.addValidity();
+      body.add( tagOffsets_.data(), tagOffsets_.size() * sizeof( int32_t ));
+      body.addNode( tags_.size());
+      body.addValidity();
+      body.add( tags_.data(), tags_.size() * sizeof( int32_t ));
+      body.addNode( rows );
+      body.addValidity();
+      body.add( messageOffsets_.data(), messageOffsets_.size() * sizeof( int32_t ));
+      body.add( messages_.data(), messages_.size());
+      body.addNode( rows );
+      body.addValidity();
+      body.add( pids_.data(), rows * sizeof( uint32_t ));
+      body.addNode( rows );
+      body.addValidity();
+      body.add( devices_.data(), rows * sizeof( int32_t ));
+
+      bool ok = writeMessage( HEADER_RECORD_BATCH, body.table( builder_, rows ), body.data());
+      stats_.batches++;
+
+      seqs_.clear();
+      timestamps_.clear();
+      levels_.clear();
+      modules_.clear();
+      tagOffsets_.resize( 1 );
+      tags_.clear();
+      messageOffsets_.resize( 1 );
+      messages_.clear();
+      pids_.clear();
+      devices_.clear();
+      return ok;
+    }
+
+    /////////////////////////////////////////////
+    // Writes the values of a dictionary not yet sent, as its first batch or
+    // as a delta
+    /////////////////////////////////////////////
+    bool ArrowStream::writeDictionary( int id )
+    {
+      StringDictionary &dictionary = dictionaries_[id];
+      size_t count = dictionary.ids.size() - dictionary.sent;
+      int32_t first = dictionary.offsets[dictionary.sent];
+      std::vector<int32_t> offsets( count + 1 );
+      for( size_t i = 0; i <= count; i++ ) {
+        offsets[i] = dictionary.offsets[dictionary.sent + i] - first;
+      }
+
+      Body body;
+      body.addNode( count );
+      body.addValidity();
+      body.add( offsets.data(), offsets.size() * sizeof( int32_t ));
+      body.add( dictionary.data.data() + first, offsets.back());
+      uint32_t batch = body.table( builder_, count );
+
+      builder_.startTable();
+      builder_.add<int64_t>( 0, id );
+      builder_.addOffset( 1, batch );
+      builder_.add<uint8_t>( 2, dictionary.sent > 0 ? 1 : 0 );
+      dictionary.sent = dictionary.ids.size();
+      return writeMessage( HEADER_DICTIONARY, builder_.endTable(), body.data());
+    }
+
+    /////////////////////////////////////////////
+    // Frames a Message: continuation marker, metadata length, the Message
+    // FlatBuffer padded to 8 bytes, then the body
+    /////////////////////////////////////////////
+    bool ArrowStream::writeMessage( uint8_t type, uint32_t header, const std::string &body )
+    {
+      builder_.startTable();
+      builder_.add<int64_t>( 3, static_cast<int64_t>( body.size()));
+      builder_.addOffset( 2, header );
+      builder_.add<int16_t>( 0, METADATA_V5 );
+      builder_.add<uint8_t>( 1, type );
+      std::string flat;
+      builder_.finish( builder_.endTable(), flat );
+      flat.append(( 8 - flat.size() % 8 ) % 8, '\0' );
+
+      metadata_.clear();
+      putFixed<uint32_t>( metadata_, CONTINUATION );
+      putFixed<uint32_t>( metadata_, static_cast<uint32_t>( flat.size()));
+      metadata_.append( flat );
+      stats_.bytes += metadata_.size() + body.size();
+      return appendFile( fd_, metadata_ ) && ( body.empty() || appendFile( fd_, body ));
+    }
+
+    bool inModule( const uint8_t *module, size_t size, const std::string &query )
+    {
+      return query.empty() || ( size >= query.size() && memcmp( module, query.data(), query.size()) == 0
+          && ( size == query.size() || module[query.size()] == '.' ));
+    }
+
+    /**
+     * \brief exports the entries a query without text selects, straight
+     * from the blocks
+     */
+    bool exportBlocks( const std::string &path, const SearchQuery &query, ArrowStream &stream )
+    {
+      std::vector<SegmentInfo> segments;
+      std::map<uint32_t, SiteInfo> sites;
+      std::map<uint32_t, MessageTemplate> templates;
+      if( !listSegments( path, segments ) || !readSites( path, sites )
+          || !readTemplates( path, templates )) {
+        return false;
+      }
+
+      uint32_t levels = query.level >= ALL ? 0xffffffffu : ( 2u << query.level ) - 1;
+      size_t rows = 0;
+      bool ok = true;
+      BlockHeader header;
+      std::string data;
+      std::string expanded;
+      for( size_t i = 0; i < segments.size() && ok; i++ ) {
+        SegmentReader reader;
+        if( !reader.open( segments[i].path )) {
+          continue;
+        }
+        const SegmentHeader &segment = reader.header();
+        int32_t device = stream.device( std::string( segment.deviceId
+              , strnlen( segment.deviceId, sizeof( segment.deviceId ))));
+
+        while( ok && reader.nextHeader( header )) {
+          if(( header.levelMask & levels ) == 0 || header.maxTimestamp < query.from
+              || header.minTimestamp > query.to ) {
+            reader.skipData();
+            continue;
+          }
+          if( !reader.readData( data )) {
+            continue;
+          }
+          forEachRecord( data, [&]( const uint8_t *body, size_t size ) {
+              BodyStrings strings;
+              if( !ok || ( query.limit > 0 && rows >= query.limit )
+                  || size < RECORD_HEADER_BYTES || recordVersion( body ) != RECORD_VERSION
+                  || recordLevel( body ) > query.level
+                  || recordType( body ) != static_cast<uint8_t>( PayloadType::STRING )
+                  || isSiteDefinition( body, size ) || !locateStrings( body, size, strings )) {
+                return;
+              }
+              int64_t timestamp = recordTimestamp( body );
+              if( timestamp < query.from || timestamp > query.to ) {
+                return;
+              }
+
+              const uint8_t *module = strings.module;
+              size_t moduleSize = strings.moduleSize;
+              const uint8_t *message = strings.message;
+              size_t messageSize = strings.messageSize;
+              std::map<uint32_t, SiteInfo>::const_iterator site = sites.find( strings.site );
+              if( strings.site != 0 && site != sites.end()) {
+                module = reinterpret_cast<const uint8_t *>( site->second.module.data());
+                moduleSize = site->second.module.size();
+                message = reinterpret_cast<const uint8_t *>( site->second.message.data());
+                messageSize = site->second.message.size();
+              }
+              if( recordFlags( body ) & RECORD_TEMPLATE ) {
+                uint32_t id = 0;
+                std::map<uint32_t, MessageTemplate>::const_iterator it = templates.end();
+                if( templateOf( message, messageSize, id )) {
+                  it = templates.find( id );
+                }
+                if( it == templates.end() || !expandTemplate( it->second, message, messageSize, expanded )) {
+                  return;
+                }
+                message = reinterpret_cast<const uint8_t *>( expanded.data());
+                messageSize = expanded.size();
+              }
+              if( !inModule( module, moduleSize, query.module )) {
+                return;
+              }
+              if( !query.tag.empty()) {
+                bool tagged = false;
+                forEachTag( strings, [&]( const uint8_t *tag, size_t length ) {
+                    tagged = tagged || ( length == query.tag.size()
+                        && memcmp( tag, query.tag.data(), length ) == 0 );
+                  });
+                if( !tagged ) {
+                  return;
+                }
+              }
+
+              forEachTag( strings, [&]( const uint8_t *tag, size_t length ) {
+                  stream.addTag( tag, length );
+                });
+              ok = stream.addRow( recordSeq( body ), timestamp, recordLevel( body ), recordPid( body )
+                  , module, moduleSize
+                  , message, messageSize, device );
+              rows++;
+            });
+        }
+      }
+      return ok;
+    }
+  }
+
+  Status exportArrow( const std::string &path
+      , const SearchQuery &query
+      , int fd
+      , ExportStats *stats
+      )
+  {
+    ArrowStream stream( fd );
+    bool ok = false;
+    if( query.text.empty()) {
+      ok = stream.begin() && exportBlocks( path, query, stream );
+    }
+    else if( stream.begin()) {
+      ok = true;
+      Status status = searchStore( path, query, [&]( const SearchMatch &match ) {
+          const Record &record = match.record;
+          for( size_t i = 0; i < record.tags.size(); i++ ) {
+            stream.addTag( reinterpret_cast<const uint8_t *>( record.tags[i].data())
+                , record.tags[i].size());
+          }
+          ok = stream.addRow( record.seq, record.timestamp, static_cast<uint8_t>( record.level )
+              , record.pid
+              , reinterpret_cast<const uint8_t *>( record.module.data()), record.module.size()
+              , reinterpret_cast<const uint8_t *>( record.message.data()), record.message.size()
+              , stream.device( match.deviceId ));
+          return ok;
+        });
+      ok = ok && status == OK;
+    }
+    ok = ok && stream.end();
+
+    if( stats != NULL ) {
+      *stats = stream.stats();
+    }
+    return ok ? OK : ERR;
+  }
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ **/
+
+#pragma once
+
+// Arrow IPC export.
+//
+// exportArrow writes the entries a SearchQuery selects as an Arrow IPC
+// stream, the format read by pyarrow.ipc.open_stream and the dataframe
+// tools built on Arrow. The stream has one row per entry and the columns:
+//   seq        uint64
+//   timestamp  timestamp[ns, tz=UTC]
+//   level      dictionary<int8, utf8>, e.g. "warning"
+//   module     dictionary<int32, utf8>
+//   tags       list<dictionary<int32, utf8>>
+//   message    utf8
+//   pid        uint32
+//   deviceId   dictionary<int32, utf8>
+// Only string entries are exported; binary payloads are left out.
+//
+// The Arrow metadata is written with a small FlatBuffers builder of our
+// own, so the library does not depend on Arrow. Rows go out in record
+// batches of up to ARROW_BATCH_ROWS. Dictionaries grow as new values turn
+// up, and each batch is preceded by delta dictionary batches holding the
+// values that are new since the last.
+//
+// Without query text, entries are taken straight from the blocks, in store
+// order: fixed fields and string bytes are copied from the encoded records
+// into the column buffers without decoding records. With text, the matches
+// of searchStore are exported oldest first. Either way, entries from call
+// sites get their site's module and message and templated messages are
+// rebuilt.
+
+#include <cstdint>
+#include <string>
+
+#include <lumberjack.hpp>
+#include <lumberjack_search.hpp>
+
+namespace lumberjack {
+
+  //Most rows in one record batch
+  const size_t ARROW_BATCH_ROWS = 65536;
+
+  /**
+   * \brief what an export wrote
+   */
+  struct ExportStats {
+    uint64_t rows = 0;
+    uint64_t batches = 0;     //record batches
+    uint64_t bytes = 0;       //bytes of the stream
+  };
+
+  /**
+   * \brief writes the entries of a store a query selects as an Arrow IPC
+   * stream
+   * \param [in] path store directory
+   * \param [in] query entries to export; the whole store if default
+   * \param [in] fd file or pipe to write the stream to
+   * \param [out] stats what was written, or NULL
+   * \return OK, or ERR if the store cannot be read, the pattern is invalid
+   * or the stream cannot be written
+   */
+  Status exportArrow( const std::string &path
+      , const SearchQuery &query
+      , int fd
+      , ExportStats *stats = NULL
+      );
+}
@@ -26,7 +26,9 @@
 //
 
 //#include "lumberjack_api.hpp"
+#include <algorithm>
 #include <iostream>
+#include <iterator>
 #include <sstream>
 #include <filesystem>
 #include <memory>
@@ -42,11 +44,13 @@
 #include <fstream>
 #include <atomic>
 #include <string>
+#include <condition_variable>
 
 #include <functional>
 
 #ifdef _WIN32
 #else
+#include <fcntl.h>
 #include <sys/types.h>
 #include <unistd.h>
 #endif
@@ -54,6 +58,22 @@
 #include <FTTimer.hpp>
 
 #include <lumberjack.hpp>
+#include <lumberjack_arena.hpp>
+#include <lumberjack_arrow.hpp>
+#include <lumberjack_import.hpp>
+#include <lumberjack_client.hpp>
+#include <lumberjack_batching.hpp>
+#include <lumberjack_config.hpp>
+#include <lumberjack_index.hpp>
+#include <lumberjack_levels.hpp>
+#include <lumberjack_recorder.hpp>
+#include <lumberjack_record.hpp>
+#include <lumberjack_shm.hpp>
+#include <lumberjack_stats.hpp>
+#include <lumberjack_search.hpp>
+#include <lumberjack_subscribe.hpp>
+#include <lumberjack_store.hpp>
+#include <lumberjack_template.hpp>
 #include <hrgls_api_defs.hpp>
 
 //JSON Parser
@@ -84,16 +104,82 @@ namespace lumberjack {
   }
 
 
+  /**
+   * \brief what every Logger handle for one module and set of tags shares
+   */
+  struct LoggerState : public LevelCache {
+    Lumberjack::impl *core;
+    std::string name;
+    std::vector<std::string> tags;
+
+    const std::string &module() const { return name; };
+  };
+
   /**
    * \brief internal implementation class
    */
   class Lumberjack::impl {
     public:
+      /**
+       * \brief internal queues by severity, drained in this order
+       *
+       * CRITICAL and ERROR entries, and site definitions, are never shed
+       * and are written ahead of anything else waiting. DEBUG and TRACE
+       * entries are shed once their lane is full.
+       */
+      enum Lane { HIGH_LANE, NORMAL_LANE, LOW_LANE, LANES };
+
       impl() {
         version_ = LJ_VERSION;
         hash_ = LJ_HASH;
+        deviceId_ = getDeviceId();
+        pid_ = static_cast<uint32_t>( getpid());
 
+        epoch_ = newEpoch();
 
+        //Sized up front so steady-state appends never grow the queue
+        for( int lane = 0; lane < LANES; lane++ ) {
+          lanes_[lane].reserve( QUEUE_RESERVE );
+        }
+
+        running_ = true;
+        consumer_ = std::thread( &Lumberjack::impl::consume, this );
+      }
+
+      ~impl() {
+        watcher_.stop();
+
+        //A connection still being made is left to finish on its own, as
+        //the Hourglass API offers no way to cancel one
+        if( connector_.joinable()) {
+          std::lock_guard<std::mutex> lock( connection_->mutex );
+          connection_->abandoned = true;
+          if( connection_->done ) {
+            connector_.join();
+          }
+          else {
+            connector_.detach();
+          }
+        }
+
+        collecting_ = false;
+        ring_.wake();
+        if( collector_.joinable()) {
+          collector_.join();
+        }
+
+        {
+          std::lock_guard<std::mutex> lock( queueMutex_ );
+          running_ = false;
+          holding_ = false;
+        }
+        queueCv_.notify_all();
+        if( consumer_.joinable()) {
+          consumer_.join();
+        }
+        store_.close();
+
+        delete streamPtr_;
       }
 
       /**
@@ -123,60 +209,758 @@ namespace lumberjack {
 
 
       /**
-       * \brief connects the application to the hourglass API backend
-       * \return connection status
+       * \brief connects to the hourglass API backend in the background
+       *
+       * Entries appended in the meantime are held by the consumer, in
+       * order, and written once the connection is up or has failed. The
+       * hold ends early once EARLY_ENTRIES are waiting, so producers never
+       * block and startup never loses entries, or once a sink is
+       * configured with entries waiting.
+       *
+       * The connecting thread only touches this object once it is done,
+       * under the connection's mutex, and not at all once the destructor
+       * has abandoned it, so a hung connection never holds up destruction.
        */
-      Status connect() {
-        hrgls_Status status = api_.GetStatus();
+      void connectAsync() {
+        status_ = CONNECTING;
+        {
+          std::lock_guard<std::mutex> lock( queueMutex_ );
+          holding_ = true;
+        }
+        std::shared_ptr<Connection> connection = std::make_shared<Connection>();
+        connection_ = connection;
+        hrgls::StreamProperties properties = streamProperties_;
+        connector_ = std::thread( [this, connection, properties]() mutable {
+            std::unique_ptr<hrgls::API> api( new hrgls::API());
+            std::unique_ptr<hrgls::datablob::DataBlobSource> stream;
+            if( api->GetStatus() == hrgls_STATUS_OKAY ) {
+              stream.reset( new hrgls::datablob::DataBlobSource( *api, properties ));
+              stream->SetStreamCallback( &lumberjack::Lumberjack::impl::HGStreamCallback );
+            }
+
+            //Declared last so it is released before an abandoned
+            //connection is torn down
+            std::lock_guard<std::mutex> lock( connection->mutex );
+            if( !connection->abandoned ) {
+              connected( api, stream );
+              connection->done = true;
+            }
+          } );
+      };
 
-        if( status == hrgls_STATUS_OKAY ) {
+      /**
+       * \brief takes over a finished connection and ends the hold
+       * \param [in,out] api the API, taken over
+       * \param [in,out] stream the stream, taken over, empty if the API
+       * failed
+       */
+      void connected( std::unique_ptr<hrgls::API> &api
+          , std::unique_ptr<hrgls::datablob::DataBlobSource> &stream
+          )
+      {
+        api_.swap( api );
+        streamPtr_ = stream.release();
+        if( streamPtr_ != NULL ) {
           status_ = OK;
         }
         else {
           status_ = ERR;
-          return status_;
+          hourglassFailures_++;
         }
 
-        //Create a point to the given stream
-        streamPtr_ = new hrgls::datablob::DataBlobSource ( api_
-            , streamProperties_
-            );
-        if( streamPtr_ == NULL ) {
-          status_ = ERR;
-          return status_;
+        {
+          std::lock_guard<std::mutex> lock( queueMutex_ );
+          holding_ = false;
         }
+        queueCv_.notify_all();
+      };
 
-        //Set the stream callback
-        streamPtr_->SetStreamCallback( &lumberjack::Lumberjack::impl::HGStreamCallback); 
-       
-        return status_;
+      /**
+       * \brief creates a new log entry and queues it for the consumer
+       * \return sequence number of the entry
+       *
+       * The entry is encoded straight into the calling thread's arena, so
+       * once the arena and queue have warmed up nothing here touches the
+       * heap.
+       **/
+      uint64_t append( Severity level
+          , const std::string &message
+          , const std::string &module
+          , const std::vector<std::string> &tags
+          , const DurableCallback &done
+          ) 
+      {
+        RecordRef record = makeRecord( level, message.data(), message.size()
+            , module, tags );
+        return append( record, done, BinaryPayload());
+      };
+
+      /**
+       * \brief creates an entry that refers to a registered call site
+       *
+       * The first entry from a site after the sink changes is preceded by
+       * the site's definition so the sink can add it to its dictionary.
+       **/
+      uint64_t append( const CallSite &site
+          , const Field *fields
+          , size_t fieldCount
+          )
+      {
+        Admit admit = levels_.admit( site );
+        if( admit != Admit::KEEP ) {
+          reject( admit );
+          if( recorder_.keeps( site.level())) {
+            //Recorded in full, since the site may never be announced
+            RecordRef record = makeRecord( site.level(), site.message().data()
+                , site.message().size(), site.module(), noTags());
+            record.fields = fields;
+            record.fieldCount = fieldCount;
+            remember( record );
+          }
+          return 0;
+        }
+
+        if( site.announce( epoch_.load( std::memory_order_relaxed ))) {
+          Field definition[2] = {
+            Field( "file", site.file())
+            , Field( "line", site.line())
+          };
+          RecordRef record;
+          record.level = site.level();
+          record.flags = RECORD_SITE | RECORD_SITE_DEF;
+          record.site = site.id();
+          record.module = site.module().data();
+          record.moduleSize = site.module().size();
+          record.message = site.message().data();
+          record.messageSize = site.message().size();
+          record.fields = definition;
+          record.fieldCount = 2;
+          enqueue( record, DurableCallback(), BinaryPayload());
+        }
+
+        RecordRef record;
+        record.level = site.level();
+        record.flags = RECORD_SITE;
+        record.site = site.id();
+        record.fields = fields;
+        record.fieldCount = fieldCount;
+        return enqueue( record, DurableCallback(), BinaryPayload());
+      };
+
+      /**
+       * \brief counts an entry turned away by the level table
+       **/
+      void reject( Admit admit )
+      {
+        StatsShard &shard = stats_.local();
+        StatsShard::add( admit == Admit::SAMPLED ? shard.sampled : shard.filtered, 1 );
+      };
+
+      /**
+       * \brief counts an accepted entry; definitions only add their bytes
+       **/
+      static void count( StatsShard &shard, const RecordRef &record, size_t size )
+      {
+        if( !( record.flags & RECORD_SITE_DEF )) {
+          StatsShard::add( shard.appended, 1 );
+        }
+        StatsShard::add( shard.bytes, size );
+      };
+
+      /**
+       * \brief describes an entry before the automatic items are filled in
+       **/
+      static RecordRef makeRecord( Severity level
+          , const char *message
+          , size_t messageSize
+          , const std::string &module
+          , const std::vector<std::string> &tags
+          )
+      {
+        RecordRef record;
+        record.level = level;
+        record.module = module.data();
+        record.moduleSize = module.size();
+        record.message = message;
+        record.messageSize = messageSize;
+        record.tags = tags.empty() ? NULL : &tags[0];
+        record.tagCount = tags.size();
+        return record;
+      };
+
+      /**
+       * \brief creates a new log entry of any payload type
+       * \param [in] record entry built with makeRecord
+       * \param [in] done durability callback, may be empty
+       * \param [in] payload shared payload used instead of message, may be empty
+       * \return sequence number of the entry
+       **/
+      uint64_t append( RecordRef &record
+          , const DurableCallback &done
+          , const BinaryPayload &payload
+          ) 
+      {
+        Admit admit = levels_.admit( record.level, record.module, record.moduleSize );
+        if( admit != Admit::KEEP ) {
+          reject( admit );
+          if( recorder_.keeps( record.level )) {
+            if( payload ) {
+              record.message = reinterpret_cast<const char *>( payload->data());
+              record.messageSize = payload->size();
+            }
+            remember( record );
+          }
+          if( done ) {
+            done( false );
+          }
+          return 0;
+        }
+        return enqueue( record, done, payload );
+      };
+
+      /**
+       * \brief creates an entry from a logger handle
+       *
+       * The handle's cached level stands in for the module lookup.
+       **/
+      uint64_t append( const LoggerState &logger
+          , Severity level
+          , PayloadType type
+          , const char *message
+          , size_t messageSize
+          , const Field *fields
+          , size_t fieldCount
+          )
+      {
+        Admit admit = levels_.admit( level, logger );
+        RecordRef record = makeRecord( level, message, messageSize
+            , logger.name, logger.tags );
+        record.type = type;
+        record.fields = fields;
+        record.fieldCount = fieldCount;
+        if( admit != Admit::KEEP ) {
+          reject( admit );
+          if( recorder_.keeps( level )) {
+            remember( record );
+          }
+          return 0;
+        }
+        return enqueue( record, DurableCallback(), BinaryPayload());
+      };
+
+      bool enabled( const LoggerState &logger, Severity level )
+      {
+        return level <= levels_.threshold( logger ) || recorder_.keeps( level );
+      };
+
+      /**
+       * \brief keeps a filtered entry in the calling thread's flight ring
+       *
+       * The coarse clock costs a fraction of the precise one, and the ring
+       * keeps entries in order anyway, so recorded timestamps are only
+       * accurate to the kernel tick.
+       **/
+      void remember( RecordRef &record )
+      {
+        struct timespec now;
+        clock_gettime( CLOCK_REALTIME_COARSE, &now );
+        record.timestamp = static_cast<int64_t>( now.tv_sec ) * 1000000000LL + now.tv_nsec;
+        record.pid = pid_;
+        record.tid = getTid();
+        recorder_.local().record( record );
       };
 
       /**
-       * \brief creates a new log entry
-       * \return json entry on success, 
+       * \brief queues the calling thread's flight ring ahead of an error
        **/
-      bool append( Severity level
-          , std::string message
-          , std::vector<std::string> tags
+      void replayLocal( void )
+      {
+        FlightRing *ring = recorder_.find();
+        if( ring == NULL || ring->empty()) {
+          return;
+        }
+        std::string &frames = replayFrames();
+        frames.clear();
+        ring->copy( frames );
+        ring->clear();
+        replay( frames );
+      };
+
+      void setFlightRecorder( size_t bytesPerThread, Severity level )
+      {
+        if( bytesPerThread == 0 ) {
+          recorder_.disable();
+        }
+        else {
+          recorder_.enable( bytesPerThread, level );
+        }
+      };
+
+      size_t dumpFlightRecorder( void )
+      {
+        std::string frames;
+        recorder_.copyAll( frames );
+        return replay( frames );
+      };
+
+      static const std::vector<std::string> &noTags( void )
+      {
+        static const std::vector<std::string> tags;
+        return tags;
+      };
+
+      static std::string &replayFrames( void )
+      {
+        static thread_local std::string frames;
+        return frames;
+      };
+
+      /**
+       * \brief encodes an entry that passed its level and queues it
+       **/
+      uint64_t enqueue( RecordRef &record
+          , const DurableCallback &done
+          , const BinaryPayload &payload
           ) 
       {
-        json entry;
+        //Context recorded by this thread goes just ahead of its error
+        if( record.level <= ERROR && !( record.flags & RECORD_SITE_DEF )
+            && recorder_.active()) {
+          replayLocal();
+        }
 
         //Add auto-generated items
-        entry["timestamp"] = getTimestamp();
-        entry["pid"] = getPid();
-        entry["deviceId"] = getDeviceId();
-        entry["type"]  = "log";
+        record.timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        record.pid = pid_;
+        record.tid = getTid();
+        if( payload ) {
+          record.message = reinterpret_cast<const char *>( payload->data());
+          record.messageSize = payload->size();
+        }
 
-        entry["level"] = level;
-        entry["message" ] = message;
+        //Shared ring mode: the collector assigns the sequence number and owns
+        //the store, so durability cannot be tracked from here.
+        if( ringAttached_ ) {
+          size_t size = encodedSize( record );
+          static thread_local std::vector<uint8_t> encoded;
+          encoded.resize( size );
+          encodeRecord( record, &encoded[0] );
+
+          StatsShard &shard = stats_.local();
+          uint64_t seq = 0;
+          if( ring_.push( &encoded[0], size, seq )) {
+            count( shard, record, size );
+          }
+          else {
+            StatsShard::add( shard.dropped, 1 );
+            seq = 0;
+          }
+          if( done ) {
+            done( false );
+          }
+          return seq;
+        }
 
-        //Add tags
-        //entry["tags"] = json::parse( tags.begin(), tags.end() );
+        //A shared payload stays with the entry and is only copied by the
+        //consumer. The sequence number is patched in when the entry joins a
+        //block.
+        Pending pending;
+        if( payload ) {
+          record.message = NULL;
+          record.messageSize = 0;
+          pending.payload = payload;
+        }
+        size_t size = encodedSize( record );
+        uint8_t *data = Arena::local().allocate( size, pending.chunk );
+        encodeRecord( record, data );
+        pending.data = data;
+        pending.size = static_cast<uint32_t>( size );
+        pending.done = done;
+        count( stats_.local(), record, size );
+
+        //Site definitions never reach a block, so they take no number
+        Lane lane = laneOf( record.level, record.flags );
+        std::unique_lock<std::mutex> lock( queueMutex_ );
+        if( shedding( lane )) {
+          lock.unlock();
+          shed( pending );
+          return 0;
+        }
+        uint64_t seq = ( record.flags & RECORD_SITE_DEF ) ? 0 : nextSeq_++;
+        pending.seq = seq;
+        bool wake = push( lane, pending );
+        lock.unlock();
+        if( wake ) {
+          queueCv_.notify_one();
+        }
 
-        return true;
+        return seq;
+      };
+
+      /**
+       * \brief opens the on-disk store
+       *
+       * Entries queued before the store is opened, held ones included, are
+       * drained first, so none goes into the new store under a number
+       * other than the ID already handed out for it.
+       **/
+      Status openStore( std::string path, StoreOptions options )
+      {
+        std::unique_lock<std::mutex> lock( queueMutex_ );
+        waitIdle( lock );
+
+        Status status = store_.open( path, options, deviceId_ );
+        if( status == OK ) {
+          followStore();
+        }
+        epoch_ = newEpoch();
+        return status;
+      };
+
+      /**
+       * \brief imports JSON-lines files into the open store
+       *
+       * Appends only wait while the files are counted. The import then
+       * takes numbers for every line up front and the consumer leaves the
+       * store alone, so entries appended meanwhile are numbered after the
+       * imported ones and written once the import is done.
+       **/
+      Status importJson( const std::vector<std::string> &files, ImportStats *stats )
+      {
+        std::unique_lock<std::mutex> lock( queueMutex_ );
+        waitIdle( lock );
+        if( !store_.isOpen()) {
+          return ERR;
+        }
+        importing_ = true;
+
+        uint64_t reserved = 0;
+        ImportOptions options;
+        options.deviceId = deviceId_;
+        options.reserve = [this, &lock, &reserved]( uint64_t entries ) {
+          followStore();
+          uint64_t first = nextSeq_;
+          nextSeq_ += entries;
+          reserved = nextSeq_;
+          lock.unlock();
+          return first;
+        };
+        Status status = importJsonLines( store_, files, options, stats );
+
+        //Numbers the import did not use are handed back unless an append
+        //has taken one past them
+        if( !lock.owns_lock()) {
+          lock.lock();
+        }
+        if( nextSeq_ == reserved ) {
+          nextSeq_ = store_.nextSeq();
+        }
+        followStore();
+        importing_ = false;
+        lock.unlock();
+        queueCv_.notify_all();
+        idleCv_.notify_all();
+        return status;
+      };
 
+      /**
+       * \brief numbers new entries after those in the store. Call with
+       * queueMutex_ held while the consumer is idle.
+       **/
+      void followStore()
+      {
+        nextSeq_ = std::max( nextSeq_, store_.nextSeq());
+      };
+
+      Status search( const SearchQuery &query, const SearchCallback &each )
+      {
+        std::string path = store_.directory();
+        if( !store_.isOpen()) {
+          return ERR;
+        }
+        return searchStore( path, query, each );
+      };
+
+      Status exportArrow( const SearchQuery &query, const std::string &file )
+      {
+        std::string path = store_.directory();
+        if( !store_.isOpen()) {
+          return ERR;
+        }
+        int fd = ::open( file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+        if( fd < 0 ) {
+          return ERR;
+        }
+        Status status = lumberjack::exportArrow( path, query, fd );
+        if( ::close( fd ) != 0 ) {
+          status = ERR;
+        }
+        return status;
+      };
+
+      Status queryRollups( const RollupQuery &query, std::vector<RollupRow> &rows )
+      {
+        std::string path = store_.directory();
+        if( !store_.isOpen()) {
+          return ERR;
+        }
+        return lumberjack::queryRollups( path, query, rows );
+      };
+
+      Status lookupTerms( const TermQuery &query, std::vector<std::string> &ids )
+      {
+        ids.clear();
+        std::string path = store_.directory();
+        if( !store_.isOpen()) {
+          return ERR;
+        }
+        std::vector<uint64_t> seqs;
+        Status status = lumberjack::lookupTerms( path, query, seqs );
+        ids.reserve( seqs.size());
+        for( size_t i = 0; i < seqs.size(); i++ ) {
+          ids.push_back( std::to_string( seqs[i] ));
+        }
+        return status;
+      };
+
+      Status queryTemplates( const TemplateQuery &query, std::vector<TemplateRow> &rows )
+      {
+        std::string path = store_.directory();
+        if( !store_.isOpen()) {
+          return ERR;
+        }
+        return lumberjack::queryTemplates( path, query, rows );
+      };
+
+      Status compactStore()
+      {
+        return store_.isOpen() && store_.compact() ? OK : ERR;
+      };
+
+      /**
+       * \brief sends entries to lumberjackd instead of a local store
+       **/
+      Status connectDaemon( const std::string &path )
+      {
+        std::unique_lock<std::mutex> lock( queueMutex_ );
+        waitIdle( lock );
+        epoch_ = newEpoch();
+        return client_.connect( path );
+      };
+
+      /**
+       * \brief attaches to the shared memory ring as a producer
+       **/
+      Status attachRing( const SharedRingOptions &options )
+      {
+        Status status = ring_.open( options.name, options );
+        if( status == OK ) {
+          epoch_ = newEpoch();
+          ringAttached_ = true;
+        }
+        return status;
+      };
+
+      /**
+       * \brief attaches to the shared memory ring and starts draining it
+       **/
+      Status collectRing( const SharedRingOptions &options )
+      {
+        if( collector_.joinable()) {
+          return ERR;
+        }
+
+        ringAttached_ = false;
+        Status status = ring_.open( options.name, options );
+        if( status != OK ) {
+          return status;
+        }
+
+        //Drain local entries first so ring sequence numbers follow them
+        std::unique_lock<std::mutex> lock( queueMutex_ );
+        waitIdle( lock );
+        ring_.becomeCollector( nextSeq_ );
+        epoch_ = newEpoch();
+        lock.unlock();
+
+        ringAttached_ = true;
+        collecting_ = true;
+        collector_ = std::thread( &Lumberjack::impl::collect, this );
+        return OK;
+      };
+
+      /**
+       * \brief applies a config file and optionally keeps it applied
+       **/
+      Status loadConfig( const std::string &path, bool watch )
+      {
+        watcher_.stop();
+        Status status = applyConfig( path );
+        if( status == OK && watch ) {
+          status = watcher_.start( path, [this, path] { applyConfig( path ); } );
+        }
+        return status;
+      };
+
+      /**
+       * \brief reads a config file and swaps it in
+       *
+       * Levels and sampling are published as one new table, so producers
+       * never wait on a reload. Sinks are only reopened when their settings
+       * change, and like openStore that drains the queue first. A file
+       * that does not parse leaves the current config in place.
+       **/
+      Status applyConfig( const std::string &path )
+      {
+        std::unique_ptr<Config> config( new Config());
+        if( readConfigFile( path, *config ) != OK ) {
+          return ERR;
+        }
+
+        std::lock_guard<std::mutex> lock( configMutex_ );
+        levels_.replace( config->levels );
+        blockBytes_.store( config->blockBytes, std::memory_order_relaxed );
+        setStatsInterval( config->statsIntervalMs );
+        setLatencyTarget( config->targetP99Us, config->maxLingerUs );
+        lowLaneEntries_.store( config->lowLaneEntries, std::memory_order_relaxed );
+        {
+          std::lock_guard<std::mutex> queueLock( queueMutex_ );
+          for( int lane = 0; lane < LANES; lane++ ) {
+            lanes_[lane].reserve( config->queueEntries );
+          }
+        }
+
+        Status status = OK;
+        Config defaults;
+        const Config &previous = config_ ? *config_ : defaults;
+        //A sink that failed to open is retried by the next reload
+        if( config->hasStore && !sameStore( previous, *config )
+            && openStore( config->storePath, config->store ) != OK ) {
+          config->hasStore = false;
+          status = ERR;
+        }
+        if( config->hasDaemon && ( !previous.hasDaemon
+              || previous.daemonSocket != config->daemonSocket )
+            && connectDaemon( config->daemonSocket ) != OK ) {
+          config->hasDaemon = false;
+          status = ERR;
+        }
+        config_ = std::move( config );
+        return status;
+      };
+
+      /**
+       * \brief returns the state shared by handles for module and tags
+       *
+       * States live as long as this object, so handles can hold a plain
+       * pointer to them.
+       **/
+      LoggerState *getLogger( const std::string &module
+          , const std::vector<std::string> &tags
+          )
+      {
+        std::string key( module );
+        for( size_t i = 0; i < tags.size(); i++ ) {
+          key.push_back( '\0' );
+          key.append( tags[i] );
+        }
+
+        std::lock_guard<std::mutex> lock( loggersMutex_ );
+        std::unique_ptr<LoggerState> &state = loggers_[key];
+        if( !state ) {
+          state.reset( new LoggerState());
+          state->core = this;
+          state->name = module;
+          state->tags = tags;
+        }
+        return state.get();
+      };
+
+      std::unique_ptr<Subscription> subscribe( const SubscriptionFilter &filter )
+      {
+        std::lock_guard<std::mutex> lock( broadcastMutex_ );
+        if( !broadcast_ ) {
+          broadcast_.reset( new BroadcastRing());
+          broadcastRing_.store( broadcast_.get(), std::memory_order_release );
+        }
+        return std::unique_ptr<Subscription>( new Subscription( *broadcast_, filter ));
+      };
+
+      Stats getStats( void )
+      {
+        Stats stats;
+        stats_.sum( stats );
+        stats.shed = shed_.load();
+        stats.dropped += sinkDropped_.load() + stats.shed;
+        {
+          std::lock_guard<std::mutex> lock( queueMutex_ );
+          stats.queueDepth = queued_;
+        }
+        stats.queueHighWater = std::max( queueHighWater_.load(), stats.queueDepth );
+        stats.storeWrite = storeLatency_.snapshot();
+        stats.daemonSend = daemonLatency_.snapshot();
+        stats.hourglassFailures = hourglassFailures_.load();
+        batching_.snapshot( stats.batching );
+        return stats;
+      };
+
+      void setLatencyTarget( uint32_t p99Us, uint32_t maxLingerUs )
+      {
+        {
+          std::lock_guard<std::mutex> lock( queueMutex_ );
+          batching_.setTarget( p99Us, maxLingerUs );
+        }
+        queueCv_.notify_all();
+      };
+
+      void setStatsInterval( uint32_t intervalMs )
+      {
+        {
+          std::lock_guard<std::mutex> lock( queueMutex_ );
+          statsIntervalMs_ = intervalMs;
+        }
+        queueCv_.notify_all();
+      };
+
+      /**
+       * \brief appends the current stats as an entry with typed fields
+       **/
+      void logStats( void )
+      {
+        Stats stats = getStats();
+        Field fields[] = {
+          Field( "appended", stats.appended )
+          , Field( "filtered", stats.filtered )
+          , Field( "sampled", stats.sampled )
+          , Field( "dropped", stats.dropped )
+          , Field( "shed", stats.shed )
+          , Field( "bytesEncoded", stats.bytesEncoded )
+          , Field( "queueDepth", stats.queueDepth )
+          , Field( "queueHighWater", stats.queueHighWater )
+          , Field( "storeWriteP99Ns", stats.storeWrite.p99 )
+          , Field( "daemonSendP99Ns", stats.daemonSend.p99 )
+          , Field( "hourglassFailures", stats.hourglassFailures )
+          , Field( "deliveryP99Ns", stats.batching.delivery.p99 )
+          , Field( "lingerUs", stats.batching.lingerUs )
+          , Field( "batchEntries", stats.batching.batchEntries )
+          , Field( "entriesPerSec", stats.batching.entriesPerSec )
+          , Field( "batchesPerSec", stats.batching.batchesPerSec )
+        };
+        static const std::string module( "lumberjack.stats" );
+        static const std::string message( "stats" );
+        static const std::vector<std::string> tags;
+        RecordRef record = makeRecord( INFO, message.data(), message.size()
+            , module, tags );
+        record.fields = fields;
+        record.fieldCount = sizeof( fields ) / sizeof( fields[0] );
+        append( record, DurableCallback(), BinaryPayload());
+      };
+
+      static uint64_t elapsedNs( std::chrono::steady_clock::time_point start )
+      {
+        return static_cast<uint64_t>( std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - start ).count());
       };
 
       Status getAPIStatus( void ) 
@@ -184,6 +968,33 @@ namespace lumberjack {
         return status_;
       };
 
+      /**
+       * \brief sets the level of a module, or the root level if module is empty
+       **/
+      bool setLevel( const std::string &module, Severity level )
+      {
+        if( level < CRITICAL || level > ALL ) {
+          return false;
+        }
+        if( module.empty()) {
+          levels_.setRoot( level );
+        }
+        else {
+          levels_.set( module, level );
+        }
+        return true;
+      };
+
+      bool clearLevel( const std::string &module )
+      {
+        return levels_.clear( module );
+      };
+
+      Severity getLevel( const std::string &module )
+      {
+        return levels_.table()->threshold( module.data(), module.size());
+      };
+
       std::string getVersion( void )
       {
         std::stringstream ss;
@@ -198,37 +1009,276 @@ namespace lumberjack {
         return FTTimer::getTimestamp();
       };
 
-      /////////////////////////////////////////////
-      // returns the Log entry as a stringl
-      /////////////////////////////////////////////
-      std::string getLogStringById( std::string id ) {
-        std::string event;
-        //Get json represnetation of log
+      /////////////////////////////////////////////
+      // returns the Log entry as a stringl
+      /////////////////////////////////////////////
+      std::string getLogStringById( std::string id ) {
+        std::string event;
+
+        char *end = NULL;
+        uint64_t seq = strtoull( id.c_str(), &end, 10 );
+        if( id.empty() || *end != '\0' ) {
+          return event;
+        }
+
+        //Get json represnetation of log
+        Record record;
+        if( store_.read( seq, record )) {
+          event = recordToJson( record, deviceId_ ).dump();
+        }
+        return event;
+
+      }
+
+
+
+    private:  
+      /**
+       * \brief an encoded entry waiting for the consumer thread
+       */
+      struct Pending {
+        ArenaChunk *chunk;
+        const uint8_t *data;
+        uint32_t size;
+        uint64_t seq;
+        DurableCallback done;
+        BinaryPayload payload;
+      };
+
+      /**
+       * \brief copies an entry into the broadcast ring for subscribers
+       **/
+      void broadcast( BroadcastRing &ring, const Pending &pending )
+      {
+        if( isSiteDefinition( pending.data, pending.size )) {
+          ring.defineSite( pending.data, pending.size );
+          return;
+        }
+        const BinaryPayload &payload = pending.payload;
+        if( payload && rewriteMessage( pending.data, pending.size, payload->data()
+              , payload->size(), 0, broadcastScratch_ )) {
+          ring.publish( reinterpret_cast<const uint8_t *>( broadcastScratch_.data())
+              , broadcastScratch_.size(), pending.seq );
+          return;
+        }
+        ring.publish( pending.data, pending.size, pending.seq );
+      };
+
+      /**
+       * \brief lane for an entry of the given level and record flags
+       */
+      static Lane laneOf( uint8_t level, uint8_t flags )
+      {
+        if( level <= ERROR || ( flags & RECORD_SITE_DEF )) {
+          return HIGH_LANE;
+        }
+        return level <= INFO ? NORMAL_LANE : LOW_LANE;
+      };
+
+      /**
+       * \brief true if an entry for lane has to be shed. Call with
+       * queueMutex_ held.
+       */
+      bool shedding( Lane lane ) const
+      {
+        return lane == LOW_LANE
+          && lanes_[LOW_LANE].size() >= lowLaneEntries_.load( std::memory_order_relaxed );
+      };
+
+      /**
+       * \brief drops an entry that found its lane full
+       */
+      void shed( Pending &pending )
+      {
+        Arena::release( pending.chunk );
+        shed_++;
+        if( pending.done ) {
+          pending.done( false );
+        }
+      };
+
+      /**
+       * \brief queues an entry on its lane. Call with queueMutex_ held.
+       * \return true if the consumer should be woken
+       */
+      bool push( Lane lane, Pending &pending )
+      {
+        if( queued_ == 0 ) {
+          firstQueued_ = std::chrono::steady_clock::now();
+        }
+        bool urgent = pending.done || lane == HIGH_LANE;
+        lanes_[lane].push_back( std::move( pending ));
+        queued_++;
+
+        bool wake = holding_ && queued_ >= EARLY_ENTRIES;
+        if( wake ) {
+          holding_ = false;
+        }
+        //High entries skip any linger and cut short a low lane write
+        if( urgent ) {
+          flushNow_ = true;
+          wake = true;
+        }
+        if( lane == HIGH_LANE ) {
+          highWaiting_.store( true, std::memory_order_relaxed );
+        }
+        //A lingering consumer only needs waking once its batch is full
+        return wake || queued_ == 1 || queued_ >= batching_.batchEntries();
+      };
+
+      /**
+       * \brief queues flight recorder frames, marked as replayed
+       * \param [in] frames u32 length + record body frames
+       * \return number of entries queued
+       *
+       * Replayed entries go on the high lane so they are never shed.
+       */
+      size_t replay( const std::string &frames )
+      {
+        const uint8_t *ptr = reinterpret_cast<const uint8_t *>( frames.data());
+        const uint8_t *end = ptr + frames.size();
+        size_t replayed = 0;
+        Arena &arena = Arena::local();
+
+        std::unique_lock<std::mutex> lock( queueMutex_, std::defer_lock );
+        if( !ringAttached_ ) {
+          lock.lock();
+        }
+        while( end - ptr >= 4 ) {
+          uint32_t size;
+          memcpy( &size, ptr, sizeof( size ));
+          ptr += sizeof( size );
+          if( size < RECORD_HEADER_BYTES || static_cast<size_t>( end - ptr ) < size ) {
+            break;
+          }
+
+          Pending pending;
+          uint8_t *copy = arena.allocate( size, pending.chunk );
+          memcpy( copy, ptr, size );
+          addRecordFlags( copy, RECORD_REPLAYED );
+          ptr += size;
+
+          if( ringAttached_ ) {
+            uint64_t seq = 0;
+            ring_.push( copy, size, seq );
+            Arena::release( pending.chunk );
+          }
+          else {
+            pending.data = copy;
+            pending.size = size;
+            pending.seq = nextSeq_++;
+            push( HIGH_LANE, pending );
+          }
+          replayed++;
+        }
+        if( lock.owns_lock()) {
+          lock.unlock();
+          queueCv_.notify_one();
+        }
+        return replayed;
+      };
 
-        //json entry = pimpl->getLocStringById( level, message, tags );
-        //convert json to string
-        //
-        //
-        return event;
+      //Initial capacity of the queue and of the batch it is swapped with
+      static const size_t QUEUE_RESERVE = 4096;
 
-      }
+      //Entries held while connecting before they are let through anyway
+      static const size_t EARLY_ENTRIES = QUEUE_RESERVE;
 
+      //Default bound of the low lane
+      static const size_t LOW_LANE_ENTRIES = 64 * 1024;
 
+      //Low and normal lanes are written this many entries at a time, so a
+      //high entry waits for at most one such write
+      static const size_t LANE_CHUNK = 1024;
 
-    private:  
       std::string version_;
       std::string hash_;
-      hrgls::API api_;
+      std::string deviceId_;
+      uint32_t pid_ = 0;
+
+      FileStore store_;
+      SocketClient client_;
+      ShmRing ring_;
+      std::atomic<bool> ringAttached_{ false };
+      std::atomic<uint32_t> epoch_{ 0 };
+      std::atomic<bool> collecting_{ false };
+      std::atomic<size_t> blockBytes_{ 256 * 1024 };
+      /**
+       * \brief state a connecting thread shares with this object
+       */
+      struct Connection {
+        std::mutex mutex;
+        bool done = false;        //connected() has run
+        bool abandoned = false;   //this object is being destroyed
+      };
+
+      std::shared_ptr<Connection> connection_;
+      std::thread connector_;
+      bool holding_ = false;
+      bool importing_ = false;
+      bool flushNow_ = false;
+      std::chrono::steady_clock::time_point firstQueued_;
+      BatchController batching_;
+      std::atomic<uint32_t> statsIntervalMs_{ 0 };
+      std::thread collector_;
+      std::thread consumer_;
+      std::mutex queueMutex_;
+      std::condition_variable queueCv_;
+      std::condition_variable idleCv_;
+      std::vector<Pending> lanes_[LANES];
+      size_t queued_ = 0;
+      std::atomic<size_t> lowLaneEntries_{ LOW_LANE_ENTRIES };
+      std::atomic<bool> highWaiting_{ false };
+      std::atomic<uint64_t> shed_{ 0 };
+      BlockBuilder block_;
+      std::string sendBuffer_;
+      std::string scratch_;
+      uint64_t nextSeq_ = 1;
+      bool running_ = false;
+      bool busy_ = false;
+      std::unique_ptr<hrgls::API> api_;
       hrgls::StreamProperties streamProperties_;
       hrgls::datablob::DataBlobSource * streamPtr_ = NULL; 
 
-      Status status_ = NO_INIT;
+      std::atomic<Status> status_{ NO_INIT };
       Severity printLevel_ = WARNING;
-      Severity logLevel_ = ERROR;
+      ModuleLevels levels_;
+      FlightRecorder recorder_;
+      std::mutex loggersMutex_;
+      std::mutex broadcastMutex_;
+      std::unique_ptr<BroadcastRing> broadcast_;
+      std::atomic<BroadcastRing *> broadcastRing_{ NULL };
+      std::string broadcastScratch_;
+      std::map<std::string, std::unique_ptr<LoggerState> > loggers_;
+      StatsShards stats_;
+      LatencyHistogram storeLatency_;
+      LatencyHistogram daemonLatency_;
+      std::atomic<uint64_t> sinkDropped_{ 0 };
+      std::atomic<uint64_t> queueHighWater_{ 0 };
+      std::atomic<uint64_t> hourglassFailures_{ 0 };
+      ConfigWatcher watcher_;
+      std::mutex configMutex_;
+      std::unique_ptr<Config> config_;
       std::thread::id pid; 
 
       std::function<void(hrgls::datablob::DataBlob, void * )> callback_;
 
+      /**
+       * \brief waits until nothing is left for the consumer to write. Call
+       * with queueMutex_ held by lock.
+       *
+       * Entries held from before a sink is configured end the hold early,
+       * so they drain under the numbers they were given and configuring
+       * never waits for the backend connection.
+       */
+      void waitIdle( std::unique_lock<std::mutex> &lock ) {
+        if( holding_ && queued_ > 0 ) {
+          holding_ = false;
+          queueCv_.notify_all();
+        }
+        idleCv_.wait( lock, [this] { return queued_ == 0 && !busy_ && !importing_; } );
+      }
+
       /**
        * \brief get process ID
        * \return process id as string
@@ -244,6 +1294,337 @@ namespace lumberjack {
         return ss.str();
       }
 
+      /**
+       * \brief returns a sink epoch no other instance has used
+       *
+       * Call sites announce themselves once per epoch, so starting a new one
+       * makes every site resend its definition to the current sink.
+       */
+      static uint32_t newEpoch() {
+        static std::atomic<uint32_t> epochs{ 0 };
+        return ++epochs;
+      }
+
+      /**
+       * \brief get a compact identifier for the calling thread
+       */
+      uint32_t getTid() {
+        static thread_local uint32_t tid = static_cast<uint32_t>(
+            std::hash<std::thread::id>()( std::this_thread::get_id()));
+        return tid;
+      }
+
+      /**
+       * \brief consumer thread that writes queued entries in batches
+       *
+       * Every entry that arrives while a batch is being written is picked up
+       * by the next batch, so the store sees one write per batch rather than
+       * one per entry.
+       */
+      void consume() {
+        std::vector<Pending> batches[LANES];
+        size_t written[LANES] = { 0, 0, 0 };
+        for( int lane = 0; lane < LANES; lane++ ) {
+          batches[lane].reserve( QUEUE_RESERVE );
+        }
+        uint32_t statsInterval = 0;
+        std::chrono::steady_clock::time_point nextStats;
+
+        std::unique_lock<std::mutex> lock( queueMutex_ );
+        while( true ) {
+          uint32_t interval = statsIntervalMs_.load( std::memory_order_relaxed );
+          auto ready = [this, interval] {
+            return ( queued_ > 0 && !holding_ && !importing_ ) || !running_
+              || statsIntervalMs_.load( std::memory_order_relaxed ) != interval;
+          };
+          if( interval != statsInterval ) {
+            statsInterval = interval;
+            nextStats = std::chrono::steady_clock::now()
+              + std::chrono::milliseconds( interval );
+          }
+          //Entries left over from a cut short write go out without waiting
+          if( !busy_ ) {
+            if( interval == 0 ) {
+              queueCv_.wait( lock, ready );
+            }
+            else {
+              queueCv_.wait_until( lock, nextStats, ready );
+            }
+          }
+          if( interval != 0 && running_ && std::chrono::steady_clock::now() >= nextStats ) {
+            nextStats += std::chrono::milliseconds( interval );
+            lock.unlock();
+            logStats();
+            lock.lock();
+            continue;
+          }
+          if(( queued_ == 0 || holding_ || importing_ ) && !busy_ ) {
+            if( !running_ ) {
+              break;
+            }
+            continue;
+          }
+
+          //Give the batch time to fill, unless something needs it now
+          uint32_t linger = batching_.lingerUs();
+          if( linger > 0 && running_ && !busy_ && !flushNow_
+              && queued_ < batching_.batchEntries()) {
+            queueCv_.wait_until( lock, firstQueued_ + std::chrono::microseconds( linger )
+                , [this] {
+                  return flushNow_ || !running_ || queued_ >= batching_.batchEntries();
+                } );
+          }
+
+          //The queue only grows between swaps, so it peaks right here
+          if( queued_ > queueHighWater_.load( std::memory_order_relaxed )) {
+            queueHighWater_.store( queued_, std::memory_order_relaxed );
+          }
+
+          //Swapping keeps both vectors' capacity, so neither side
+          //reallocates. A lane still holding leftovers takes the new
+          //entries behind them.
+          if( !holding_ ) {
+            for( int lane = 0; lane < LANES; lane++ ) {
+              std::vector<Pending> &waiting = lanes_[lane];
+              if( batches[lane].empty()) {
+                batches[lane].swap( waiting );
+              }
+              else {
+                std::move( waiting.begin(), waiting.end(), std::back_inserter( batches[lane] ));
+                waiting.clear();
+              }
+            }
+            queued_ = 0;
+            highWaiting_.store( false, std::memory_order_relaxed );
+            flushNow_ = false;
+          }
+          std::chrono::steady_clock::time_point queued = firstQueued_;
+          busy_ = true;
+          lock.unlock();
+
+          //Drain lanes in priority order. A high entry arriving meanwhile
+          //cuts the lower lanes short; what is left goes out next time
+          //round, after it.
+          size_t count = 0;
+          bool preempted = false;
+          for( int lane = 0; lane < LANES && !preempted; lane++ ) {
+            std::vector<Pending> &batch = batches[lane];
+            size_t &begin = written[lane];
+            while( begin < batch.size()) {
+              size_t end = lane == HIGH_LANE ? batch.size()
+                : std::min( batch.size(), begin + LANE_CHUNK );
+              writeBatch( batch, begin, end );
+              count += end - begin;
+              begin = end;
+              if( end < batch.size() && highWaiting_.load( std::memory_order_relaxed )) {
+                preempted = true;
+                break;
+              }
+            }
+            if( !preempted ) {
+              batch.clear();
+              begin = 0;
+            }
+          }
+          if( count > 0 ) {
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            batching_.observe( count
+                , std::chrono::duration_cast<std::chrono::nanoseconds>( now - queued ).count()
+                , std::chrono::duration_cast<std::chrono::nanoseconds>( now.time_since_epoch()).count());
+          }
+
+          lock.lock();
+          if( !preempted ) {
+            busy_ = false;
+            idleCv_.notify_all();
+          }
+        }
+      }
+
+      /**
+       * \brief collector thread that moves ring entries onto the local queue
+       */
+      void collect() {
+        std::vector<Pending> batch;
+        Arena &arena = Arena::local();
+        ShmRing::Handler handler = [&batch, &arena]( uint64_t seq
+            , const uint8_t *data
+            , size_t size
+            ) {
+          Pending pending;
+          uint8_t *copy = arena.allocate( size, pending.chunk );
+          memcpy( copy, data, size );
+          pending.data = copy;
+          pending.size = static_cast<uint32_t>( size );
+          pending.seq = seq;
+          batch.push_back( std::move( pending ));
+        };
+
+        bool draining = true;
+        while( draining ) {
+          draining = collecting_;
+          ring_.drain( handler, draining ? 100 : 0 );
+          if( batch.empty()) {
+            continue;
+          }
+
+          std::unique_lock<std::mutex> lock( queueMutex_ );
+          for( size_t i = 0; i < batch.size(); i++ ) {
+            Lane lane = laneOf( recordLevel( batch[i].data ), recordFlags( batch[i].data ));
+            nextSeq_ = std::max( nextSeq_, batch[i].seq + 1 );
+            if( shedding( lane )) {
+              shed( batch[i] );
+            }
+            else {
+              push( lane, batch[i] );
+            }
+          }
+          lock.unlock();
+          queueCv_.notify_one();
+          batch.clear();
+          draining = true;
+        }
+      }
+
+      /**
+       * \brief copies a batch into blocks and writes them to the store
+       *
+       * Each entry's arena reference is dropped as soon as it has been
+       * copied into the block.
+       */
+      void writeBatch( std::vector<Pending> &batch, size_t begin, size_t end ) {
+        //Subscribers see the batch before any sink, in queue order
+        BroadcastRing *ring = broadcastRing_.load( std::memory_order_acquire );
+        if( ring != NULL && ring->active()) {
+          for( size_t i = begin; i < end; i++ ) {
+            broadcast( *ring, batch[i] );
+          }
+          ring->notify();
+        }
+
+        if( client_.isConnected()) {
+          sendBatch( batch, begin, end );
+          return;
+        }
+
+        std::vector<std::pair<uint64_t, DurableCallback> > waiters;
+
+        for( size_t i = begin; i < end; i++ ) {
+          const uint8_t *body = batch[i].data;
+          size_t size = batch[i].size;
+          if( isSiteDefinition( body, size )) {
+            store_.defineSite( body, size );
+            Arena::release( batch[i].chunk );
+            continue;
+          }
+
+          const BinaryPayload &payload = batch[i].payload;
+          if( store_.prepareRecord( body, size
+                , payload ? payload->data() : NULL
+                , payload ? payload->size() : 0
+                , scratch_ )) {
+            body = reinterpret_cast<const uint8_t *>( scratch_.data());
+            size = scratch_.size();
+          }
+
+          block_.addEncoded( body, size, batch[i].seq );
+          Arena::release( batch[i].chunk );
+          if( batch[i].done ) {
+            waiters.push_back( std::make_pair( batch[i].seq, batch[i].done ));
+          }
+          if( block_.bytes() >= blockBytes_.load( std::memory_order_relaxed )) {
+            writeBlock( block_, waiters );
+          }
+        }
+        if( !block_.empty()) {
+          writeBlock( block_, waiters );
+        }
+      }
+
+      /**
+       * \brief sends a batch to lumberjackd as one or more datagrams
+       *
+       * The daemon owns durability, so durability callbacks complete with
+       * false as soon as their entry has been handed to the socket. Each
+       * datagram holds at most MAX_BATCH_BYTES of entries; an entry that
+       * does not fit in one on its own is dropped.
+       */
+      void sendBatch( std::vector<Pending> &batch, size_t begin, size_t end ) {
+        std::string &buffer = sendBuffer_;
+        uint32_t count = 0;
+        SocketClient::beginBatch( buffer );
+
+        for( size_t i = begin; i < end; i++ ) {
+          const uint8_t *body = batch[i].data;
+          size_t size = batch[i].size;
+          const BinaryPayload &payload = batch[i].payload;
+          if( payload && rewriteMessage( body, size, payload->data(), payload->size()
+                , 0, scratch_ )) {
+            body = reinterpret_cast<const uint8_t *>( scratch_.data());
+            size = scratch_.size();
+          }
+
+          size_t framed = sizeof( uint32_t ) + size;
+          if( framed > MAX_BATCH_BYTES ) {
+            sinkDropped_++;
+          }
+          else {
+            if( buffer.size() - sizeof( BatchHeader ) + framed > MAX_BATCH_BYTES ) {
+              sendDatagram( buffer, count );
+            }
+            putFixed<uint32_t>( buffer, static_cast<uint32_t>( size ));
+            buffer.append( reinterpret_cast<const char *>( body ), size );
+            count++;
+          }
+          Arena::release( batch[i].chunk );
+          if( batch[i].done ) {
+            batch[i].done( false );
+          }
+        }
+        if( count > 0 ) {
+          sendDatagram( buffer, count );
+        }
+      }
+
+      /**
+       * \brief sends the entries in buffer as one datagram and starts the
+       * next one
+       */
+      void sendDatagram( std::string &buffer, uint32_t &count ) {
+        SocketClient::endBatch( buffer, count );
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        bool sent = client_.send( buffer );
+        daemonLatency_.record( elapsedNs( start ));
+        if( !sent ) {
+          //The batch may have held site definitions
+          epoch_ = newEpoch();
+          sinkDropped_ += count;
+        }
+        SocketClient::beginBatch( buffer );
+        count = 0;
+      }
+
+      void writeBlock( BlockBuilder &block
+          , std::vector<std::pair<uint64_t, DurableCallback> > &waiters
+          )
+      {
+        block.seal();
+        bool written = false;
+        if( store_.isOpen()) {
+          std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+          written = store_.write( block, waiters );
+          storeLatency_.record( elapsedNs( start ));
+        }
+        if( !written ) {
+          sinkDropped_ += block.count();
+          for( size_t i = 0; i < waiters.size(); i++ ) {
+            waiters[i].second( false );
+          }
+        }
+        waiters.clear();
+        block.clear();
+      }
+
       /**
        * \brief get unique device id
        * \return device id as as a string
@@ -263,6 +1644,11 @@ namespace lumberjack {
           mid = buffer.str();
         }
 
+        //Strip the trailing newline
+        while( !mid.empty() && ( mid.back() == '\n' || mid.back() == '\r' )) {
+          mid.pop_back();
+        }
+
         //
         if( mid.empty() ) {
           //TODO generate error
@@ -295,38 +1681,388 @@ namespace lumberjack {
   /**
    * \brief Lumberjack main class 
    *
-   * This class connects to the hrgls API on construction
+   * This class connects to the hrgls API in the background on construction
    */
   Lumberjack::Lumberjack() : pimpl { FT::make_unique<impl>()} 
   {
-    pimpl->connect();
+    pimpl->connectAsync();
+  };
+
+  Lumberjack::Lumberjack( SharedRingOptions ring )
+    : pimpl { FT::make_unique<impl>()} 
+  {
+    pimpl->attachRing( ring );
   };
 
   Lumberjack::~Lumberjack() = default;
 
+  /////////////////////////////////////////////
+  // Process-wide core and logger handles
+  /////////////////////////////////////////////
+  Lumberjack &Lumberjack::shared()
+  {
+    static Lumberjack core;
+    return core;
+  }
+
+  Logger Lumberjack::getLogger( const std::string &module
+      , const std::vector<std::string> &tags
+      )
+  {
+    return Logger( pimpl->getLogger( module, tags ));
+  }
+
+  Logger::Logger( const std::string &module
+      , const std::vector<std::string> &tags
+      )
+    : state_( Lumberjack::shared().getLogger( module, tags ).state_ )
+  {
+  }
+
+  bool Logger::enabled( Severity level ) const
+  {
+    return state_ != NULL && state_->core->enabled( *state_, level );
+  }
+
+  std::string Logger::append( Severity level, const std::string &message )
+  {
+    if( state_ == NULL ) {
+      return std::string();
+    }
+    uint64_t seq = state_->core->append( *state_, level, PayloadType::STRING
+        , message.data(), message.size(), NULL, 0 );
+    return seq == 0 ? std::string() : std::to_string( seq );
+  }
+
+  std::string Logger::append( Severity level
+      , const std::string &message
+      , std::initializer_list<Field> fields
+      )
+  {
+    if( state_ == NULL ) {
+      return std::string();
+    }
+    uint64_t seq = state_->core->append( *state_, level, PayloadType::STRING
+        , message.data(), message.size(), fields.begin(), fields.size());
+    return seq == 0 ? std::string() : std::to_string( seq );
+  }
+
+  std::string Logger::appendBinary( Severity level, const void *data, size_t size )
+  {
+    if( state_ == NULL ) {
+      return std::string();
+    }
+    uint64_t seq = state_->core->append( *state_, level, PayloadType::BINARY
+        , static_cast<const char *>( data ), size, NULL, 0 );
+    return seq == 0 ? std::string() : std::to_string( seq );
+  }
+
+  const std::string &Logger::module() const
+  {
+    static const std::string none;
+    return state_ == NULL ? none : state_->name;
+  }
+
 
   /////////////////////////////////////////////
   //Function to append a new log message
   /////////////////////////////////////////////
   std::string Lumberjack::append( Severity level
-      , std::string message
-      , std::vector<std::string> tags
+      , const std::string &message
+      , const std::vector<std::string> &tags
       )
   {
-    pimpl->append( level, message, tags );
-    return "test";
+    uint64_t seq = pimpl->append( level, message, std::string(), tags
+        , DurableCallback());
+    return seq == 0 ? std::string() : std::to_string( seq );
   }
 
   /////////////////////////////////////////////
   // Function to append a new log message
   /////////////////////////////////////////////
   std::string Lumberjack::append( Severity level
-      , std::string message
+      , const std::string &message
       )
   {
     std::vector<std::string> tags;
-    pimpl->append( level, message, tags );
-    return "test";
+    uint64_t seq = pimpl->append( level, message, std::string(), tags
+        , DurableCallback());
+    return seq == 0 ? std::string() : std::to_string( seq );
+  }
+
+  /////////////////////////////////////////////
+  // Function to append a new log message from a module
+  /////////////////////////////////////////////
+  std::string Lumberjack::append( Severity level
+      , const std::string &message
+      , const std::string &module
+      , const std::vector<std::string> &tags
+      )
+  {
+    uint64_t seq = pimpl->append( level, message, module, tags
+        , DurableCallback());
+    return seq == 0 ? std::string() : std::to_string( seq );
+  }
+
+  /////////////////////////////////////////////
+  // Function to append a log message with typed fields
+  /////////////////////////////////////////////
+  std::string Lumberjack::appendFields( Severity level
+      , const std::string &message
+      , std::initializer_list<Field> fields
+      , const std::vector<std::string> &tags
+      )
+  {
+    RecordRef record = impl::makeRecord( level, message.data(), message.size()
+        , std::string(), tags );
+    record.fields = fields.begin();
+    record.fieldCount = fields.size();
+    uint64_t seq = pimpl->append( record, DurableCallback(), BinaryPayload());
+    return seq == 0 ? std::string() : std::to_string( seq );
+  }
+
+  std::string Lumberjack::appendFields( Severity level
+      , const std::string &message
+      , const std::vector<Field> &fields
+      , const std::vector<std::string> &tags
+      )
+  {
+    RecordRef record = impl::makeRecord( level, message.data(), message.size()
+        , std::string(), tags );
+    record.fields = fields.empty() ? NULL : &fields[0];
+    record.fieldCount = fields.size();
+    uint64_t seq = pimpl->append( record, DurableCallback(), BinaryPayload());
+    return seq == 0 ? std::string() : std::to_string( seq );
+  }
+
+  /////////////////////////////////////////////
+  // Function to append an entry from a registered call site
+  /////////////////////////////////////////////
+  std::string Lumberjack::append( const CallSite &site
+      , std::initializer_list<Field> fields
+      )
+  {
+    uint64_t seq = pimpl->append( site, fields.begin(), fields.size());
+    return seq == 0 ? std::string() : std::to_string( seq );
+  }
+
+  std::string Lumberjack::append( const CallSite &site
+      , const std::vector<Field> &fields
+      )
+  {
+    uint64_t seq = pimpl->append( site, fields.empty() ? NULL : &fields[0]
+        , fields.size());
+    return seq == 0 ? std::string() : std::to_string( seq );
+  }
+
+  /////////////////////////////////////////////
+  // Function to append a binary log entry
+  /////////////////////////////////////////////
+  std::string Lumberjack::appendBinary( Severity level
+      , const void *data
+      , size_t size
+      , const std::string &module
+      , const std::vector<std::string> &tags
+      )
+  {
+    RecordRef record = impl::makeRecord( level, static_cast<const char *>( data )
+        , size, module, tags );
+    record.type = PayloadType::BINARY;
+    uint64_t seq = pimpl->append( record, DurableCallback(), BinaryPayload());
+    return seq == 0 ? std::string() : std::to_string( seq );
+  }
+
+  /////////////////////////////////////////////
+  // Function to append a shared binary log entry
+  /////////////////////////////////////////////
+  std::string Lumberjack::appendBinary( Severity level
+      , const BinaryPayload &payload
+      , const std::string &module
+      , const std::vector<std::string> &tags
+      )
+  {
+    RecordRef record = impl::makeRecord( level, NULL, 0, module, tags );
+    record.type = PayloadType::BINARY;
+    uint64_t seq = pimpl->append( record, DurableCallback(), payload );
+    return seq == 0 ? std::string() : std::to_string( seq );
+  }
+
+  /////////////////////////////////////////////
+  // Function to append a log message with a durability callback
+  /////////////////////////////////////////////
+  std::string Lumberjack::append( Severity level
+      , const std::string &message
+      , const std::vector<std::string> &tags
+      , const DurableCallback &callback
+      )
+  {
+    uint64_t seq = pimpl->append( level, message, std::string(), tags
+        , callback );
+    return seq == 0 ? std::string() : std::to_string( seq );
+  }
+
+  /////////////////////////////////////////////
+  // Function to append a log message and wait for durability
+  /////////////////////////////////////////////
+  std::future<bool> Lumberjack::appendDurable( Severity level
+      , const std::string &message
+      , const std::vector<std::string> &tags
+      )
+  {
+    std::shared_ptr<std::promise<bool> > promise =
+      std::make_shared<std::promise<bool> >();
+    std::future<bool> result = promise->get_future();
+
+    pimpl->append( level, message, std::string(), tags
+        , [promise]( bool durable ) { promise->set_value( durable ); } );
+    return result;
+  }
+
+  /////////////////////////////////////////////
+  // Function to send entries to lumberjackd
+  /////////////////////////////////////////////
+  Status Lumberjack::connectDaemon( std::string path )
+  {
+    return pimpl->connectDaemon( path );
+  }
+
+  /////////////////////////////////////////////
+  // Function to collect entries from the shared memory ring
+  /////////////////////////////////////////////
+  Status Lumberjack::collectSharedRing( SharedRingOptions ring )
+  {
+    return pimpl->collectRing( ring );
+  }
+
+  /////////////////////////////////////////////
+  // Function to open the on-disk store
+  /////////////////////////////////////////////
+  Status Lumberjack::openStore( std::string path, StoreOptions options )
+  {
+    return pimpl->openStore( path, options );
+  }
+
+  Status Lumberjack::compactStore( void )
+  {
+    return pimpl->compactStore();
+  }
+
+  /////////////////////////////////////////////
+  // Functions to manage log levels
+  /////////////////////////////////////////////
+  bool Lumberjack::setLogLevel( Severity level )
+  {
+    return pimpl->setLevel( std::string(), level );
+  }
+
+  Severity Lumberjack::getLogLevel( void )
+  {
+    return pimpl->getLevel( std::string());
+  }
+
+  bool Lumberjack::setModuleLevel( const std::string &module, Severity level )
+  {
+    return !module.empty() && pimpl->setLevel( module, level );
+  }
+
+  bool Lumberjack::clearModuleLevel( const std::string &module )
+  {
+    return pimpl->clearLevel( module );
+  }
+
+  Severity Lumberjack::getModuleLevel( const std::string &module )
+  {
+    return pimpl->getLevel( module );
+  }
+
+  /////////////////////////////////////////////
+  // Function to apply and watch a config file
+  /////////////////////////////////////////////
+  Status Lumberjack::loadConfig( std::string path, bool watch )
+  {
+    return pimpl->loadConfig( path, watch );
+  }
+
+  /////////////////////////////////////////////
+  // Function to set the delivery latency target
+  /////////////////////////////////////////////
+  void Lumberjack::setLatencyTarget( uint32_t p99Us, uint32_t maxLingerUs )
+  {
+    pimpl->setLatencyTarget( p99Us, maxLingerUs );
+  }
+
+  /////////////////////////////////////////////
+  // Flight recorder functions
+  /////////////////////////////////////////////
+  void Lumberjack::setFlightRecorder( size_t bytesPerThread, Severity level )
+  {
+    pimpl->setFlightRecorder( bytesPerThread, level );
+  }
+
+  size_t Lumberjack::dumpFlightRecorder( void )
+  {
+    return pimpl->dumpFlightRecorder();
+  }
+
+  /////////////////////////////////////////////
+  // Function to subscribe to live entries
+  /////////////////////////////////////////////
+  std::unique_ptr<Subscription> Lumberjack::subscribe( const SubscriptionFilter &filter )
+  {
+    return pimpl->subscribe( filter );
+  }
+
+  /////////////////////////////////////////////
+  // Function to search stored entries
+  /////////////////////////////////////////////
+  Status Lumberjack::search( const SearchQuery &query
+      , const std::function<bool( const SearchMatch & )> &each
+      )
+  {
+    return pimpl->search( query, each );
+  }
+
+  Status Lumberjack::exportArrow( const SearchQuery &query, const std::string &file )
+  {
+    return pimpl->exportArrow( query, file );
+  }
+
+  Status Lumberjack::importJson( const std::vector<std::string> &files, ImportStats *stats )
+  {
+    return pimpl->importJson( files, stats );
+  }
+
+  Status Lumberjack::queryRollups( const RollupQuery &query, std::vector<RollupRow> &rows )
+  {
+    return pimpl->queryRollups( query, rows );
+  }
+
+  Status Lumberjack::lookupTerms( const TermQuery &query, std::vector<std::string> &ids )
+  {
+    return pimpl->lookupTerms( query, ids );
+  }
+
+  Status Lumberjack::queryTemplates( const TemplateQuery &query, std::vector<TemplateRow> &rows )
+  {
+    return pimpl->queryTemplates( query, rows );
+  }
+
+  /////////////////////////////////////////////
+  // Functions to report stats
+  /////////////////////////////////////////////
+  Stats Lumberjack::getStats( void )
+  {
+    return pimpl->getStats();
+  }
+
+  void Lumberjack::setStatsInterval( uint32_t intervalMs )
+  {
+    pimpl->setStatsInterval( intervalMs );
+  }
+
+  std::string Lumberjack::getLogStringById( std::string id )
+  {
+    return pimpl->getLogStringById( id );
   }
 
  
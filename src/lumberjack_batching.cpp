@@ -0,0 +1,108 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+
+#include <lumberjack_batching.hpp>
+
+namespace lumberjack {
+
+  BatchController::BatchController()
+  {
+    window_.reserve( WINDOW_BATCHES );
+  }
+
+  void BatchController::setTarget( uint32_t p99Us, uint32_t maxLingerUs )
+  {
+    targetUs_.store( p99Us, std::memory_order_relaxed );
+    maxLingerUs_.store( maxLingerUs, std::memory_order_relaxed );
+    if( p99Us == 0 ) {
+      lingerUs_.store( 0, std::memory_order_relaxed );
+      batchEntries_.store( 1, std::memory_order_relaxed );
+      return;
+    }
+
+    //Start a quarter of the way into the budget until there is a rate to
+    //size batches from
+    uint32_t linger = std::min( p99Us / 4, maxLingerUs );
+    lingerUs_.store( linger, std::memory_order_relaxed );
+    if( entriesPerSec_.load( std::memory_order_relaxed ) == 0 ) {
+      batchEntries_.store( SIZE_MAX, std::memory_order_relaxed );
+    }
+  }
+
+  void BatchController::observe( size_t entries, uint64_t deliveryNs, uint64_t nowNs )
+  {
+    delivery_.record( deliveryNs );
+    if( window_.empty()) {
+      windowStart_ = nowNs - std::min( nowNs, deliveryNs );
+    }
+    window_.push_back( deliveryNs );
+    windowEntries_ += entries;
+    if( nowNs - windowStart_ >= WINDOW_NS || window_.size() >= WINDOW_BATCHES ) {
+      decide( nowNs );
+    }
+  }
+
+  void BatchController::decide( uint64_t nowNs )
+  {
+    double seconds = static_cast<double>( std::max<uint64_t>( nowNs - windowStart_, 1 )) / 1e9;
+    double entryRate = windowEntries_ / seconds;
+    entriesPerSec_.store( entryRate, std::memory_order_relaxed );
+    batchesPerSec_.store( window_.size() / seconds, std::memory_order_relaxed );
+
+    std::vector<uint64_t>::iterator p99 = window_.begin() + window_.size() * 99 / 100;
+    std::nth_element( window_.begin(), p99, window_.end());
+    windowP99_.store( *p99, std::memory_order_relaxed );
+    uint64_t observedUs = *p99 / 1000;
+
+    window_.clear();
+    windowEntries_ = 0;
+
+    uint32_t target = targetUs_.load( std::memory_order_relaxed );
+    if( target == 0 ) {
+      return;
+    }
+
+    uint32_t linger = lingerUs_.load( std::memory_order_relaxed );
+    if( observedUs > target ) {
+      linger /= 2;
+    }
+    else if( observedUs < target - target / 4 ) {
+      linger += std::max( linger / 8, MIN_STEP_US );
+    }
+    linger = std::min( linger, std::min( target / 2, maxLingerUs_.load( std::memory_order_relaxed )));
+    lingerUs_.store( linger, std::memory_order_relaxed );
+
+    //The size the current rate fills in one linger. Below two entries
+    //waiting gains nothing, so the consumer flushes straight away.
+    double expected = entryRate * linger / 1e6;
+    batchEntries_.store( std::max<size_t>( static_cast<size_t>( expected ), 1 )
+        , std::memory_order_relaxed );
+  }
+
+  void BatchController::snapshot( BatchingStats &stats ) const
+  {
+    stats.targetP99Us = targetUs_.load( std::memory_order_relaxed );
+    stats.lingerUs = lingerUs_.load( std::memory_order_relaxed );
+    size_t entries = batchEntries_.load( std::memory_order_relaxed );
+    stats.batchEntries = entries == SIZE_MAX ? 0 : entries;
+    stats.entriesPerSec = entriesPerSec_.load( std::memory_order_relaxed );
+    stats.batchesPerSec = batchesPerSec_.load( std::memory_order_relaxed );
+    stats.windowP99Ns = windowP99_.load( std::memory_order_relaxed );
+    stats.delivery = delivery_.snapshot();
+  }
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ **/
+
+#pragma once
+
+// Adaptive batching for the consumer thread.
+//
+// Without a target the consumer takes whatever is queued as soon as it
+// wakes, so a steady trickle of entries becomes one tiny block or datagram
+// each. With a p99 delivery target set, the consumer instead lingers after
+// the first entry of a batch arrives, letting more entries join it, and
+// flushes early once the batch reaches the size the current entry rate
+// would fill in that time.
+//
+// Delivery latency is measured per batch from the moment its first entry
+// was queued until the sink accepted the batch, which is the worst latency
+// of any entry in it. Every window the controller compares the p99 of those
+// latencies with the target: above it the linger time is halved, well below
+// it the linger grows by an eighth. The linger never exceeds half the
+// target, leaving the rest for the sink itself.
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include <lumberjack.hpp>
+#include <lumberjack_stats.hpp>
+
+namespace lumberjack {
+
+  /**
+   * \brief picks how long the consumer waits for a batch to fill
+   *
+   * observe() is only called by the consumer thread; the rest may be called
+   * from any thread.
+   */
+  class BatchController {
+    public:
+      static const uint32_t DEFAULT_MAX_LINGER_US = 50000;
+
+      BatchController();
+
+      /**
+       * \brief sets the delivery target, 0 to flush as soon as possible
+       * \param [in] p99Us p99 time from append to sink
+       * \param [in] maxLingerUs longest the consumer waits for a batch
+       */
+      void setTarget( uint32_t p99Us, uint32_t maxLingerUs );
+
+      /**
+       * \brief time the consumer waits after the first entry of a batch
+       */
+      uint32_t lingerUs() const
+      {
+        return lingerUs_.load( std::memory_order_relaxed );
+      };
+
+      /**
+       * \brief batch size at which the consumer stops waiting
+       */
+      size_t batchEntries() const
+      {
+        return batchEntries_.load( std::memory_order_relaxed );
+      };
+
+      /**
+       * \brief accounts for one batch handed to the sinks
+       * \param [in] entries entries in the batch
+       * \param [in] deliveryNs time from the first entry being queued until
+       * the sinks accepted the batch
+       * \param [in] nowNs current steady clock time
+       */
+      void observe( size_t entries, uint64_t deliveryNs, uint64_t nowNs );
+
+      /**
+       * \brief the controller's current decisions and what they were based on
+       */
+      void snapshot( BatchingStats &stats ) const;
+
+    private:
+      //Decisions are revisited this often, or after this many batches
+      static const uint64_t WINDOW_NS = 250 * 1000 * 1000;
+      static const size_t WINDOW_BATCHES = 1024;
+
+      //Smallest linger increase, so growth does not stall near zero
+      static const uint32_t MIN_STEP_US = 100;
+
+      std::atomic<uint32_t> targetUs_{ 0 };
+      std::atomic<uint32_t> maxLingerUs_{ DEFAULT_MAX_LINGER_US };
+      std::atomic<uint32_t> lingerUs_{ 0 };
+      std::atomic<size_t> batchEntries_{ 1 };
+      std::atomic<double> entriesPerSec_{ 0 };
+      std::atomic<double> batchesPerSec_{ 0 };
+      std::atomic<uint64_t> windowP99_{ 0 };
+      LatencyHistogram delivery_;
+
+      //Consumer thread only
+      std::vector<uint64_t> window_;
+      uint64_t windowEntries_ = 0;
+      uint64_t windowStart_ = 0;
+
+      void decide( uint64_t nowNs );
+
+      BatchController( const BatchController & );
+      BatchController &operator=( const BatchController & );
+  };
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <lumberjack_client.hpp>
+
+namespace lumberjack {
+
+  namespace {
+    //How often a client whose daemon went away tries to reconnect
+    const std::chrono::seconds RECONNECT_INTERVAL( 1 );
+  }
+
+  std::string defaultDaemonSocket()
+  {
+    const char *runtime = getenv( "XDG_RUNTIME_DIR" );
+    if( runtime != NULL && runtime[0] != '\0' ) {
+      return std::string( runtime ) + "/lumberjackd.sock";
+    }
+    return "/tmp/lumberjackd.sock";
+  }
+
+  Status SocketClient::connect( const std::string &path )
+  {
+    close();
+    path_ = path.empty() ? defaultDaemonSocket() : path;
+    return reconnect() ? OK : ERR;
+  }
+
+  void SocketClient::close()
+  {
+    if( fd_ >= 0 ) {
+      ::close( fd_ );
+    }
+    fd_ = -1;
+  }
+
+  bool SocketClient::reconnect()
+  {
+    lastAttempt_ = std::chrono::steady_clock::now();
+
+    struct sockaddr_un addr;
+    memset( &addr, 0, sizeof( addr ));
+    addr.sun_family = AF_UNIX;
+    if( path_.size() >= sizeof( addr.sun_path )) {
+      return false;
+    }
+    strncpy( addr.sun_path, path_.c_str(), sizeof( addr.sun_path ) - 1 );
+
+    int fd = socket( AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if( fd < 0 ) {
+      return false;
+    }
+    if( ::connect( fd, reinterpret_cast<struct sockaddr *>( &addr ), sizeof( addr )) != 0 ) {
+      ::close( fd );
+      return false;
+    }
+
+    if( fd_ >= 0 ) {
+      ::close( fd_ );
+    }
+    fd_ = fd;
+    return true;
+  }
+
+  void SocketClient::beginBatch( std::string &buffer )
+  {
+    buffer.assign( sizeof( BatchHeader ), '\0' );
+  }
+
+  void SocketClient::endBatch( std::string &buffer, uint32_t count )
+  {
+    BatchHeader header;
+    header.magic = BATCH_MAGIC;
+    header.version = BATCH_VERSION;
+    header.flags = 0;
+    header.count = count;
+    header.bytes = static_cast<uint32_t>( buffer.size() - sizeof( header ));
+    memcpy( &buffer[0], &header, sizeof( header ));
+  }
+
+  bool SocketClient::send( const std::string &batch )
+  {
+    if( path_.empty()) {
+      return false;
+    }
+    //lumberjackd would only see it truncated
+    if( batch.size() > MAX_DATAGRAM_BYTES ) {
+      dropped_.fetch_add( 1 );
+      return false;
+    }
+
+    for( int attempt = 0; attempt < 2; attempt++ ) {
+      if( fd_ >= 0 ) {
+        ssize_t sent = ::send( fd_, batch.data(), batch.size(), MSG_DONTWAIT | MSG_NOSIGNAL );
+        if( sent == static_cast<ssize_t>( batch.size())) {
+          return true;
+        }
+        if( sent < 0 && errno != ECONNREFUSED && errno != ENOTCONN ) {
+          //EAGAIN and friends: the daemon is behind, so shed this batch
+          break;
+        }
+      }
+
+      //The daemon restarted or is not running yet
+      if( std::chrono::steady_clock::now() - lastAttempt_ < RECONNECT_INTERVAL
+          || !reconnect()) {
+        break;
+      }
+    }
+
+    dropped_.fetch_add( 1 );
+    return false;
+  }
+}
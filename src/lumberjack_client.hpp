@@ -0,0 +1,108 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ **/
+
+#pragma once
+
+// Framing and client side of the lumberjackd Unix socket protocol.
+//
+// Each datagram carries one batch: a BatchHeader followed by `count`
+// length-framed records in the format of lumberjack_record.hpp. Sequence
+// numbers in the records are ignored; lumberjackd assigns its own.
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+#include <lumberjack.hpp>
+
+namespace lumberjack {
+
+  const uint32_t BATCH_MAGIC = 0x54424a4c;  // "LJBT"
+  const uint16_t BATCH_VERSION = 1;
+
+  //Entries are cut into batches of at most this size so they fit the
+  //default socket buffers. A larger entry cannot be sent.
+  const size_t MAX_BATCH_BYTES = 60 * 1024;
+
+  /**
+   * \brief header at the start of every datagram
+   */
+  struct BatchHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;
+    uint32_t count;
+    uint32_t bytes;
+  };
+
+  static_assert( sizeof( BatchHeader ) == 16, "BatchHeader must be 16 bytes" );
+
+  //Largest datagram a client sends, and what lumberjackd receives into
+  const size_t MAX_DATAGRAM_BYTES = sizeof( BatchHeader ) + MAX_BATCH_BYTES;
+
+  /**
+   * \brief default path of the lumberjackd socket
+   */
+  std::string defaultDaemonSocket();
+
+  /**
+   * \brief non-blocking datagram client for lumberjackd
+   *
+   * Sends never block. A batch that does not fit in the socket buffer or
+   * in MAX_DATAGRAM_BYTES, or that is sent while the daemon is down, is
+   * dropped and counted.
+   */
+  class SocketClient {
+    public:
+      SocketClient() {};
+      ~SocketClient() { close(); };
+
+      /**
+       * \brief connects to the daemon socket
+       * \param [in] path socket path, empty for the default
+       * \return OK on success, ERR if the daemon is not listening
+       */
+      Status connect( const std::string &path );
+      void close();
+      bool isConnected() const { return fd_ >= 0; };
+
+      /**
+       * \brief starts a new batch in buffer
+       */
+      static void beginBatch( std::string &buffer );
+
+      /**
+       * \brief fills in the header of a batch built with beginBatch
+       */
+      static void endBatch( std::string &buffer, uint32_t count );
+
+      /**
+       * \brief sends a finished batch without blocking
+       * \return true if the daemon's socket accepted the batch
+       */
+      bool send( const std::string &batch );
+
+      uint64_t dropped() const { return dropped_.load(); };
+
+    private:
+      int fd_ = -1;
+      std::string path_;
+      std::atomic<uint64_t> dropped_{ 0 };
+      std::chrono::steady_clock::time_point lastAttempt_;
+
+      bool reconnect();
+  };
+}
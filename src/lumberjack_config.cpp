@@ -0,0 +1,370 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <lumberjack_config.hpp>
+
+#include <nlohmann/json.hpp>
+using json = nlohmann::json;
+
+namespace lumberjack {
+
+  namespace {
+    const char *LEVEL_NAMES[] = {
+      "critical", "error", "warning", "info", "debug", "trace", "all"
+    };
+
+    bool parseLevel( const json &value, Severity &level )
+    {
+      if( !value.is_string()) {
+        return false;
+      }
+      std::string name = value.get<std::string>();
+      std::transform( name.begin(), name.end(), name.begin(), ::tolower );
+      for( int i = CRITICAL; i <= ALL; i++ ) {
+        if( name == LEVEL_NAMES[i] ) {
+          level = static_cast<Severity>( i );
+          return true;
+        }
+      }
+      return false;
+    }
+
+    bool parseDurability( const json &value, Durability &durability )
+    {
+      std::string name = value.is_string() ? value.get<std::string>() : "";
+      if( name == "none" ) {
+        durability = Durability::NONE;
+      }
+      else if( name == "interval" ) {
+        durability = Durability::INTERVAL;
+      }
+      else if( name == "group" ) {
+        durability = Durability::GROUP;
+      }
+      else if( name == "critical" ) {
+        durability = Durability::SYNC_CRITICAL;
+      }
+      else {
+        return false;
+      }
+      return true;
+    }
+
+    /**
+     * \brief reads an optional unsigned number from an object
+     */
+    template<typename T>
+    bool parseCount( const json &object, const char *key, T &count )
+    {
+      json::const_iterator it = object.find( key );
+      if( it == object.end()) {
+        return true;
+      }
+      if( !it->is_number_unsigned()) {
+        return false;
+      }
+      uint64_t value = it->get<uint64_t>();
+      if( value > static_cast<uint64_t>( static_cast<T>( -1 ))) {
+        return false;
+      }
+      count = static_cast<T>( value );
+      return true;
+    }
+
+    bool parseRetention( const json &value, StoreOptions &options )
+    {
+      if( !value.is_object()
+          || !parseCount( value, "bytes", options.retainBytes )
+          || !parseCount( value, "seconds", options.retainSeconds )) {
+        return false;
+      }
+      if( !value.contains( "levels" )) {
+        return true;
+      }
+      const json &levels = value["levels"];
+      if( !levels.is_object()) {
+        return false;
+      }
+      for( json::const_iterator it = levels.begin(); it != levels.end(); ++it ) {
+        Severity level;
+        if( !parseLevel( json( it.key()), level ) || level == ALL
+            || !parseCount( levels, it.key().c_str(), options.levelRetainSeconds[level] )) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    bool parseStore( const json &value, Config &config )
+    {
+      if( !value.is_object() || !value.contains( "path" ) || !value["path"].is_string()) {
+        return false;
+      }
+      config.hasStore = true;
+      config.storePath = value["path"].get<std::string>();
+
+      StoreOptions &options = config.store;
+      if( value.contains( "durability" )
+          && !parseDurability( value["durability"], options.durability )) {
+        return false;
+      }
+      if( value.contains( "backend" )) {
+        std::string backend = value["backend"].is_string()
+          ? value["backend"].get<std::string>() : "";
+        if( backend == "pwrite" ) {
+          options.backend = IoBackend::PWRITE;
+        }
+        else if( backend == "io_uring" ) {
+          options.backend = IoBackend::IO_URING;
+        }
+        else {
+          return false;
+        }
+      }
+      if( value.contains( "retention" ) && !parseRetention( value["retention"], options )) {
+        return false;
+      }
+      if( value.contains( "indexMessages" )) {
+        if( !value["indexMessages"].is_boolean()) {
+          return false;
+        }
+        options.indexMessages = value["indexMessages"].get<bool>();
+      }
+      if( value.contains( "mineTemplates" )) {
+        if( !value["mineTemplates"].is_boolean()) {
+          return false;
+        }
+        options.mineTemplates = value["mineTemplates"].get<bool>();
+      }
+      return parseCount( value, "intervalUs", options.intervalUs )
+        && parseCount( value, "groupEntries", options.groupEntries )
+        && parseCount( value, "groupUs", options.groupUs )
+        && parseCount( value, "segmentBytes", options.segmentBytes )
+        && parseCount( value, "ioDepth", options.ioDepth )
+        && parseCount( value, "spillBytes", options.spillBytes )
+        && parseCount( value, "compactIntervalMs", options.compactIntervalMs )
+        && parseCount( value, "compactBytesPerSec", options.compactBytesPerSec );
+    }
+  }
+
+  Status parseConfig( const std::string &text, Config &config )
+  {
+    json root = json::parse( text, nullptr, false );
+    if( root.is_discarded() || !root.is_object()) {
+      return ERR;
+    }
+
+    if( root.contains( "level" ) && !parseLevel( root["level"], config.levels.root )) {
+      return ERR;
+    }
+
+    if( root.contains( "modules" )) {
+      const json &modules = root["modules"];
+      if( !modules.is_object()) {
+        return ERR;
+      }
+      for( json::const_iterator it = modules.begin(); it != modules.end(); ++it ) {
+        Severity level;
+        if( it.key().empty() || !parseLevel( it.value(), level )) {
+          return ERR;
+        }
+        config.levels.modules.push_back( std::make_pair( it.key(), level ));
+      }
+    }
+
+    if( root.contains( "sampling" )) {
+      const json &sampling = root["sampling"];
+      if( !sampling.is_object()) {
+        return ERR;
+      }
+      for( json::const_iterator it = sampling.begin(); it != sampling.end(); ++it ) {
+        Severity level;
+        if( !parseLevel( json( it.key()), level ) || !it.value().is_number_unsigned()
+            || it.value().get<uint64_t>() == 0 || it.value().get<uint64_t>() > UINT32_MAX ) {
+          return ERR;
+        }
+        config.levels.sampleEvery[level] = it.value().get<uint32_t>();
+      }
+    }
+
+    if( root.contains( "store" ) && !parseStore( root["store"], config )) {
+      return ERR;
+    }
+
+    if( root.contains( "daemon" )) {
+      if( !root["daemon"].is_string()) {
+        return ERR;
+      }
+      config.hasDaemon = true;
+      config.daemonSocket = root["daemon"].get<std::string>();
+    }
+
+    if( !parseCount( root, "statsIntervalMs", config.statsIntervalMs )) {
+      return ERR;
+    }
+
+    if( root.contains( "batching" )) {
+      const json &batching = root["batching"];
+      if( !batching.is_object()
+          || !parseCount( batching, "targetP99Us", config.targetP99Us )
+          || !parseCount( batching, "maxLingerUs", config.maxLingerUs )) {
+        return ERR;
+      }
+    }
+
+    if( root.contains( "buffers" )) {
+      const json &buffers = root["buffers"];
+      if( !buffers.is_object()
+          || !parseCount( buffers, "blockBytes", config.blockBytes )
+          || !parseCount( buffers, "queueEntries", config.queueEntries )
+          || !parseCount( buffers, "lowLaneEntries", config.lowLaneEntries )
+          || config.blockBytes == 0 ) {
+        return ERR;
+      }
+    }
+    return OK;
+  }
+
+  Status readConfigFile( const std::string &path, Config &config )
+  {
+    std::ifstream file( path.c_str());
+    if( !file ) {
+      return ERR;
+    }
+    std::stringstream text;
+    text << file.rdbuf();
+    return parseConfig( text.str(), config );
+  }
+
+  bool sameStore( const Config &a, const Config &b )
+  {
+    const StoreOptions &x = a.store;
+    const StoreOptions &y = b.store;
+    return a.hasStore == b.hasStore
+      && a.storePath == b.storePath
+      && x.durability == y.durability
+      && x.intervalUs == y.intervalUs
+      && x.groupEntries == y.groupEntries
+      && x.groupUs == y.groupUs
+      && x.segmentBytes == y.segmentBytes
+      && x.backend == y.backend
+      && x.ioDepth == y.ioDepth
+      && x.spillBytes == y.spillBytes
+      && x.retainBytes == y.retainBytes
+      && x.retainSeconds == y.retainSeconds
+      && std::equal( x.levelRetainSeconds, x.levelRetainSeconds + ALL, y.levelRetainSeconds )
+      && x.compactIntervalMs == y.compactIntervalMs
+      && x.compactBytesPerSec == y.compactBytesPerSec
+      && x.indexMessages == y.indexMessages
+      && x.mineTemplates == y.mineTemplates;
+  }
+
+  ConfigWatcher::~ConfigWatcher()
+  {
+    stop();
+  }
+
+  Status ConfigWatcher::start( const std::string &path
+      , const std::function<void()> &changed
+      )
+  {
+    stop();
+
+    size_t slash = path.rfind( '/' );
+    std::string dir = slash == std::string::npos ? "." : path.substr( 0, slash + 1 );
+    name_ = slash == std::string::npos ? path : path.substr( slash + 1 );
+
+    inotifyFd_ = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+    wakeFd_ = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    if( inotifyFd_ < 0 || wakeFd_ < 0
+        || inotify_add_watch( inotifyFd_, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO ) < 0 ) {
+      stop();
+      return ERR;
+    }
+
+    changed_ = changed;
+    thread_ = std::thread( &ConfigWatcher::watch, this );
+    return OK;
+  }
+
+  void ConfigWatcher::stop()
+  {
+    if( thread_.joinable()) {
+      uint64_t one = 1;
+      ssize_t written = ::write( wakeFd_, &one, sizeof( one ));
+      (void)written;
+      thread_.join();
+    }
+    if( inotifyFd_ >= 0 ) {
+      ::close( inotifyFd_ );
+    }
+    if( wakeFd_ >= 0 ) {
+      ::close( wakeFd_ );
+    }
+    inotifyFd_ = -1;
+    wakeFd_ = -1;
+  }
+
+  void ConfigWatcher::watch()
+  {
+    alignas( struct inotify_event ) char buffer[4096];
+    struct pollfd fds[2];
+    fds[0].fd = inotifyFd_;
+    fds[0].events = POLLIN;
+    fds[1].fd = wakeFd_;
+    fds[1].events = POLLIN;
+
+    while( true ) {
+      if( poll( fds, 2, -1 ) < 0 ) {
+        if( errno == EINTR ) {
+          continue;
+        }
+        return;
+      }
+      if( fds[1].revents != 0 ) {
+        return;
+      }
+
+      //Several events for our file in one read only need one reload
+      bool changed = false;
+      ssize_t size;
+      while(( size = ::read( inotifyFd_, buffer, sizeof( buffer ))) > 0 ) {
+        for( char *ptr = buffer; ptr < buffer + size; ) {
+          struct inotify_event *event = reinterpret_cast<struct inotify_event *>( ptr );
+          if( event->len > 0 && name_ == event->name ) {
+            changed = true;
+          }
+          ptr += sizeof( struct inotify_event ) + event->len;
+        }
+      }
+      if( changed ) {
+        changed_();
+      }
+    }
+  }
+}
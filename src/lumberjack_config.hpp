@@ -0,0 +1,131 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ **/
+
+#pragma once
+
+// JSON configuration files.
+//
+// A config file sets levels, sampling, sinks and buffer sizes, e.g.
+//
+//   {
+//     "level": "warning",
+//     "modules": { "net": "trace", "net.tcp": "error" },
+//     "sampling": { "debug": 10, "trace": 100 },
+//     "store": { "path": "logs", "durability": "group", "spillBytes": 65536,
+//                "retention": { "bytes": 10737418240, "seconds": 604800,
+//                               "levels": { "debug": 86400, "error": 2592000 } },
+//                "compactBytesPerSec": 4194304, "indexMessages": true,
+//                "mineTemplates": true },
+//     "daemon": "/run/lumberjackd.sock",
+//     "buffers": { "blockBytes": 262144, "queueEntries": 4096, "lowLaneEntries": 65536 },
+//     "statsIntervalMs": 60000,
+//     "batching": { "targetP99Us": 5000, "maxLingerUs": 20000 }
+//   }
+//
+// Every key is optional. A file that fails to parse, or has a value of the
+// wrong type, is rejected as a whole so a half-written edit never takes
+// effect. ConfigWatcher watches the file's directory rather than the file,
+// so editors that save by renaming a new file into place are seen too.
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+
+#include <lumberjack.hpp>
+#include <lumberjack_levels.hpp>
+
+namespace lumberjack {
+
+  /**
+   * \brief settings read from one version of a config file
+   */
+  struct Config {
+    LevelTable levels;
+
+    bool hasStore = false;
+    std::string storePath;
+    StoreOptions store;
+
+    bool hasDaemon = false;
+    std::string daemonSocket;
+
+    //Consumer writes a block once it reaches this size
+    size_t blockBytes = 256 * 1024;
+
+    //Entries each append lane holds before it has to grow
+    size_t queueEntries = 4096;
+
+    //DEBUG and TRACE entries waiting beyond this many are shed
+    size_t lowLaneEntries = 64 * 1024;
+
+    //Time between stats entries, 0 for none
+    uint32_t statsIntervalMs = 0;
+
+    //Delivery latency target for adaptive batching, 0 for none
+    uint32_t targetP99Us = 0;
+    uint32_t maxLingerUs = 50000;
+  };
+
+  /**
+   * \brief parses the text of a config file
+   * \return OK, or ERR if the text is not a valid config
+   */
+  Status parseConfig( const std::string &text, Config &config );
+
+  /**
+   * \brief reads and parses a config file
+   */
+  Status readConfigFile( const std::string &path, Config &config );
+
+  /**
+   * \brief true if both configs describe the same store
+   */
+  bool sameStore( const Config &a, const Config &b );
+
+  /**
+   * \brief calls back whenever a file is rewritten
+   */
+  class ConfigWatcher {
+    public:
+      ConfigWatcher() {};
+      ~ConfigWatcher();
+
+      /**
+       * \brief starts watching path, replacing any earlier watch
+       * \param [in] path file to watch
+       * \param [in] changed called on the watcher thread after each change
+       */
+      Status start( const std::string &path, const std::function<void()> &changed );
+
+      /**
+       * \brief stops watching and joins the watcher thread
+       */
+      void stop();
+
+    private:
+      int inotifyFd_ = -1;
+      int wakeFd_ = -1;
+      std::string name_;
+      std::function<void()> changed_;
+      std::thread thread_;
+
+      void watch();
+
+      ConfigWatcher( const ConfigWatcher & );
+      ConfigWatcher &operator=( const ConfigWatcher & );
+  };
+}
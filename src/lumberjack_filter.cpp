@@ -0,0 +1,259 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+
+#include <lumberjack_filter.hpp>
+#include <lumberjack_store.hpp>
+
+namespace lumberjack {
+
+  namespace {
+    const char *FILTER_SUFFIX = ".ljfilt";
+    const uint8_t FILTER_VERSION = 1;
+
+    const uint64_t BITS_PER_KEY = 10;
+    const uint8_t PROBES = 7;
+    const size_t MIN_TABLE = 256;
+
+    /**
+     * \brief bit index of one probe, spread evenly over the filter
+     */
+    inline uint64_t probe( uint64_t key, uint32_t i, uint64_t bits )
+    {
+      uint32_t h1 = static_cast<uint32_t>( key );
+      uint32_t h2 = static_cast<uint32_t>( key >> 32 ) | 1;
+      return ( static_cast<uint64_t>( h1 + i * h2 ) * bits ) >> 32;
+    }
+
+    /**
+     * \brief calls f(key) for a module and every module above it, so
+     * "a.b.c" is also found by searches for "a" and "a.b"
+     */
+    template<typename F>
+    void forEachModuleKey( const uint8_t *module, size_t size, F f )
+    {
+      for( size_t i = 1; i <= size; i++ ) {
+        if( i == size || module[i] == '.' ) {
+          f( filterKey( FILTER_MODULE, module, i ));
+        }
+      }
+    }
+  }
+
+  uint64_t filterKey( char kind, const void *data, size_t size )
+  {
+    const uint8_t *ptr = static_cast<const uint8_t *>( data );
+    uint64_t h = ( 0xcbf29ce484222325ull ^ static_cast<uint8_t>( kind )) * 0x100000001b3ull;
+    for( size_t i = 0; i < size; i++ ) {
+      h = ( h ^ ptr[i] ) * 0x100000001b3ull;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h == 0 ? 1 : h;
+  }
+
+  std::string filterPath( const std::string &segmentPath )
+  {
+    return siblingPath( segmentPath, FILTER_SUFFIX );
+  }
+
+  /////////////////////////////////////////////
+  // BlockFilter
+  /////////////////////////////////////////////
+  bool BlockFilter::parse( const uint8_t *body, size_t size, uint64_t &offset )
+  {
+    const uint8_t *ptr = body;
+    const uint8_t *end = body + size;
+    uint64_t words = 0;
+    if( ptr >= end || *ptr++ != FILTER_VERSION || !getVarint( ptr, end, offset ) || ptr >= end ) {
+      return false;
+    }
+    probes_ = *ptr++;
+    if( !getVarint( ptr, end, words ) || words == 0
+        || words > static_cast<uint64_t>( end - ptr ) / 8 || words > ( 1u << 26 )) {
+      return false;
+    }
+    words_ = ptr;
+    bits_ = words * 64;
+    return true;
+  }
+
+  bool BlockFilter::mayContain( uint64_t key ) const
+  {
+    for( uint32_t i = 0; i < probes_; i++ ) {
+      uint64_t bit = probe( key, i, bits_ );
+      if(( words_[bit >> 3] & ( 1u << ( bit & 7 ))) == 0 ) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool readFilters( const std::string &segmentPath
+      , std::string &data
+      , std::map<uint64_t, BlockFilter> &filters
+      )
+  {
+    if( !readFile( filterPath( segmentPath ), data )) {
+      return false;
+    }
+    forEachFrame( data, [&filters]( const uint8_t *body, size_t size ) {
+        BlockFilter filter;
+        uint64_t offset = 0;
+        if( !filter.parse( body, size, offset )) {
+          return false;
+        }
+        filters[offset] = filter;
+        return true;
+      });
+    return true;
+  }
+
+  /////////////////////////////////////////////
+  // FilterBuilder
+  /////////////////////////////////////////////
+  void FilterBuilder::insert( uint64_t key )
+  {
+    if(( count_ + 1 ) * 2 > table_.size()) {
+      std::vector<uint64_t> old( std::max( MIN_TABLE, table_.size() * 2 ), 0 );
+      old.swap( table_ );
+      count_ = 0;
+      for( size_t i = 0; i < old.size(); i++ ) {
+        if( old[i] != 0 ) {
+          insert( old[i] );
+        }
+      }
+    }
+    size_t mask = table_.size() - 1;
+    for( size_t i = static_cast<size_t>( key ) & mask; ; i = ( i + 1 ) & mask ) {
+      if( table_[i] == key ) {
+        return;
+      }
+      if( table_[i] == 0 ) {
+        table_[i] = key;
+        count_++;
+        return;
+      }
+    }
+  }
+
+  void FilterBuilder::defineSite( const SiteInfo &site )
+  {
+    std::vector<uint64_t> &keys = siteKeys_[site.id];
+    keys.clear();
+    forEachModuleKey( reinterpret_cast<const uint8_t *>( site.module.data()), site.module.size()
+        , [&keys]( uint64_t key ) { keys.push_back( key ); } );
+    const uint8_t *message = reinterpret_cast<const uint8_t *>( site.message.data());
+    forEachWord( message, site.message.size(), [&]( size_t offset, size_t size ) {
+        keys.push_back( filterKey( FILTER_WORD, message + offset, size ));
+      });
+  }
+
+  void FilterBuilder::defineTemplate( const MessageTemplate &tmpl )
+  {
+    std::vector<uint64_t> &keys = templateKeys_[tmpl.id];
+    keys.clear();
+    for( size_t i = 0; i < tmpl.tokens.size(); i++ ) {
+      const uint8_t *token = reinterpret_cast<const uint8_t *>( tmpl.tokens[i].data());
+      forEachWord( token, tmpl.tokens[i].size(), [&]( size_t offset, size_t size ) {
+          keys.push_back( filterKey( FILTER_WORD, token + offset, size ));
+        });
+    }
+  }
+
+  void FilterBuilder::add( const uint8_t *body, size_t size )
+  {
+    BodyStrings strings;
+    if( size < 4 || isSiteDefinition( body, size ) || !locateStrings( body, size, strings )) {
+      return;
+    }
+
+    if( strings.site != 0 && strings.moduleSize == 0 ) {
+      std::map<uint32_t, std::vector<uint64_t> >::const_iterator site = siteKeys_.find( strings.site );
+      if( site != siteKeys_.end()) {
+        for( size_t i = 0; i < site->second.size(); i++ ) {
+          insert( site->second[i] );
+        }
+      }
+    }
+    forEachModuleKey( strings.module, strings.moduleSize, [this]( uint64_t key ) { insert( key ); } );
+
+    uint32_t id = 0;
+    if(( recordFlags( body ) & RECORD_TEMPLATE ) && templateOf( strings.message, strings.messageSize, id )) {
+      std::map<uint32_t, std::vector<uint64_t> >::const_iterator tmpl = templateKeys_.find( id );
+      if( tmpl != templateKeys_.end()) {
+        for( size_t i = 0; i < tmpl->second.size(); i++ ) {
+          insert( tmpl->second[i] );
+        }
+      }
+      forEachVariable( strings.message, strings.messageSize, [this]( const uint8_t *data, size_t length ) {
+          forEachWord( data, length, [&]( size_t offset, size_t word ) {
+              insert( filterKey( FILTER_WORD, data + offset, word ));
+            });
+        });
+    }
+    else if( recordType( body ) == static_cast<uint8_t>( PayloadType::STRING )) {
+      forEachWord( strings.message, strings.messageSize, [&]( size_t offset, size_t length ) {
+          insert( filterKey( FILTER_WORD, strings.message + offset, length ));
+        });
+    }
+    forEachTag( strings, [this]( const uint8_t *tag, size_t length ) {
+        insert( filterKey( FILTER_TAG, tag, length ));
+      });
+  }
+
+  void FilterBuilder::addBlock( const std::string &data )
+  {
+    forEachRecord( data, [this]( const uint8_t *body, size_t size ) {
+        add( body, size );
+      });
+  }
+
+  bool FilterBuilder::take( uint64_t offset, std::string &frame )
+  {
+    if( count_ == 0 ) {
+      return false;
+    }
+
+    uint64_t words = std::max<uint64_t>( 1, ( count_ * BITS_PER_KEY + 63 ) / 64 );
+    uint64_t bits = words * 64;
+    std::string body;
+    body.push_back( static_cast<char>( FILTER_VERSION ));
+    putVarint( body, offset );
+    body.push_back( static_cast<char>( PROBES ));
+    putVarint( body, words );
+    size_t start = body.size();
+    body.resize( start + words * 8, '\0' );
+    uint8_t *filter = reinterpret_cast<uint8_t *>( &body[start] );
+    for( size_t i = 0; i < table_.size(); i++ ) {
+      if( table_[i] == 0 ) {
+        continue;
+      }
+      for( uint32_t p = 0; p < PROBES; p++ ) {
+        uint64_t bit = probe( table_[i], p, bits );
+        filter[bit >> 3] |= static_cast<uint8_t>( 1u << ( bit & 7 ));
+      }
+      table_[i] = 0;
+    }
+    count_ = 0;
+    putFrame( frame, body );
+    return true;
+  }
+}
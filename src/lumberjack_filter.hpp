@@ -0,0 +1,171 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ **/
+
+#pragma once
+
+// Per-block Bloom filters.
+//
+// Every block the store writes gets a Bloom filter over the keys of its
+// entries: the module and each module above it, each tag, and each word of
+// a string message. Entries from a call site are keyed by their site's
+// module and message. A word is a run of ASCII letters, digits, '_' and
+// bytes of 0x80 and up, so UTF-8 text stays whole, and words are case
+// sensitive like the rest of search. Entries stored by a template, see
+// lumberjack_template.hpp, are keyed by its literal tokens and their
+// variables, which give the same words as the message since a space never
+// belongs to a word.
+//
+// Filters are built by the writer thread as each block is written and kept
+// in a file beside the segment, one frame per block. Each frame is a u32
+// length, a u32 CRC and:
+//   u8 version, varint offset of the block's header in the segment,
+//   u8 probe count, varint count of 64 bit words, then the words.
+//
+// Filters get about 10 bits per distinct key, so about 1 in 100 lookups of
+// a key a block does not hold still has to scan it. A block without a
+// filter, because its frame was never written or was lost, is always
+// scanned. The store rebuilds filter files along with rollups.
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <lumberjack_record.hpp>
+#include <lumberjack_template.hpp>
+
+namespace lumberjack {
+
+  //Kinds of filter key
+  const char FILTER_MODULE = 'm';
+  const char FILTER_TAG = 't';
+  const char FILTER_WORD = 'w';
+
+  /**
+   * \brief hashes a key of the given kind for a filter
+   * \return hash, never 0
+   */
+  uint64_t filterKey( char kind, const void *data, size_t size );
+
+  inline bool isWordByte( uint8_t c )
+  {
+    return ( c >= 'a' && c <= 'z' ) || ( c >= 'A' && c <= 'Z' )
+      || ( c >= '0' && c <= '9' ) || c == '_' || c >= 0x80;
+  }
+
+  /**
+   * \brief calls f(offset, size) for every word of a text
+   */
+  template<typename F>
+  void forEachWord( const uint8_t *data, size_t size, F f )
+  {
+    size_t i = 0;
+    while( i < size ) {
+      while( i < size && !isWordByte( data[i] )) {
+        i++;
+      }
+      size_t start = i;
+      while( i < size && isWordByte( data[i] )) {
+        i++;
+      }
+      if( i > start ) {
+        f( start, i - start );
+      }
+    }
+  }
+
+  /**
+   * \brief path of the filter file kept for a segment
+   */
+  std::string filterPath( const std::string &segmentPath );
+
+  /**
+   * \brief view of one block's filter, borrowed from the file's bytes
+   */
+  class BlockFilter {
+    public:
+      /**
+       * \brief reads a filter frame
+       * \param [out] offset offset of the block's header in its segment
+       * \return false if the frame is malformed
+       */
+      bool parse( const uint8_t *body, size_t size, uint64_t &offset );
+
+      /**
+       * \brief false only if the block holds no entry with the key
+       */
+      bool mayContain( uint64_t key ) const;
+
+    private:
+      const uint8_t *words_ = NULL;
+      uint64_t bits_ = 0;
+      uint8_t probes_ = 0;
+  };
+
+  /**
+   * \brief reads the filters of a segment, keyed by block header offset
+   * \param [out] data file contents the filters point into
+   * \return false if there is no filter file
+   */
+  bool readFilters( const std::string &segmentPath
+      , std::string &data
+      , std::map<uint64_t, BlockFilter> &filters
+      );
+
+  /**
+   * \brief collects the keys of a block's entries into a filter
+   */
+  class FilterBuilder {
+    public:
+      /**
+       * \brief learns the module and message of a call site
+       */
+      void defineSite( const SiteInfo &site );
+
+      /**
+       * \brief learns the literal words of a message template
+       */
+      void defineTemplate( const MessageTemplate &tmpl );
+
+      /**
+       * \brief adds the keys of one encoded record body
+       */
+      void add( const uint8_t *body, size_t size );
+
+      /**
+       * \brief adds the keys of every record of a block's data
+       */
+      void addBlock( const std::string &data );
+
+      /**
+       * \brief appends a frame with the filter of the keys added since the
+       * last call
+       * \param [in] offset offset of the block's header in its segment
+       * \return false if nothing was added
+       */
+      bool take( uint64_t offset, std::string &frame );
+
+    private:
+      std::map<uint32_t, std::vector<uint64_t> > siteKeys_;
+      std::map<uint32_t, std::vector<uint64_t> > templateKeys_;
+
+      //Open addressing set of the block's keys, 0 marking free slots
+      std::vector<uint64_t> table_;
+      size_t count_ = 0;
+
+      void insert( uint64_t key );
+  };
+}
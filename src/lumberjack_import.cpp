@@ -0,0 +1,993 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined( __x86_64__ )
+#include <immintrin.h>
+#endif
+
+#include <lumberjack_import.hpp>
+#include <lumberjack_store.hpp>
+
+namespace lumberjack {
+
+  namespace {
+    //Blocks are written once they reach this size, like the consumer's
+    const size_t IMPORT_BLOCK_BYTES = 256 * 1024;
+
+    //Chunks parsed ahead of the writer, per thread
+    const size_t CHUNKS_AHEAD = 2;
+
+    const char *LEVEL_NAMES[] = {
+      "critical", "error", "warning", "info", "debug", "trace"
+    };
+
+    /////////////////////////////////////////////
+    // String kernels
+    /////////////////////////////////////////////
+
+    //Each kernel returns the first quote, backslash or control character,
+    //which are the only bytes of a JSON string that need a closer look
+    typedef const char *( *SpecialFunction )( const char *, const char * );
+
+    const char *findSpecialScalar( const char *ptr, const char *end )
+    {
+      for( ; ptr < end; ptr++ ) {
+        unsigned char c = static_cast<unsigned char>( *ptr );
+        if( c == '"' || c == '\\' || c < 0x20 ) {
+          break;
+        }
+      }
+      return ptr;
+    }
+
+#if defined( __x86_64__ )
+    //Control characters are those left unchanged by an unsigned max with
+    //0x1f; a signed compare would take every byte from 0x80 up for one
+    const char *findSpecialSse2( const char *ptr, const char *end )
+    {
+      const __m128i quote = _mm_set1_epi8( '"' );
+      const __m128i backslash = _mm_set1_epi8( '\\' );
+      const __m128i control = _mm_set1_epi8( 0x1f );
+      for( ; end - ptr >= 16; ptr += 16 ) {
+        __m128i bytes = _mm_loadu_si128( reinterpret_cast<const __m128i *>( ptr ));
+        __m128i special = _mm_or_si128(
+            _mm_or_si128( _mm_cmpeq_epi8( bytes, quote ), _mm_cmpeq_epi8( bytes, backslash ))
+            , _mm_cmpeq_epi8( _mm_max_epu8( bytes, control ), control ));
+        unsigned mask = static_cast<unsigned>( _mm_movemask_epi8( special ));
+        if( mask != 0 ) {
+          return ptr + __builtin_ctz( mask );
+        }
+      }
+      return findSpecialScalar( ptr, end );
+    }
+
+    __attribute__(( target( "avx2" )))
+    const char *findSpecialAvx2( const char *ptr, const char *end )
+    {
+      const __m256i quote = _mm256_set1_epi8( '"' );
+      const __m256i backslash = _mm256_set1_epi8( '\\' );
+      const __m256i control = _mm256_set1_epi8( 0x1f );
+      for( ; end - ptr >= 32; ptr += 32 ) {
+        __m256i bytes = _mm256_loadu_si256( reinterpret_cast<const __m256i *>( ptr ));
+        __m256i special = _mm256_or_si256(
+            _mm256_or_si256( _mm256_cmpeq_epi8( bytes, quote ), _mm256_cmpeq_epi8( bytes, backslash ))
+            , _mm256_cmpeq_epi8( _mm256_max_epu8( bytes, control ), control ));
+        unsigned mask = static_cast<unsigned>( _mm256_movemask_epi8( special ));
+        if( mask != 0 ) {
+          return ptr + __builtin_ctz( mask );
+        }
+      }
+      return findSpecialSse2( ptr, end );
+    }
+#endif
+
+    SpecialFunction chooseKernel()
+    {
+#if defined( __x86_64__ )
+      __builtin_cpu_init();
+      return __builtin_cpu_supports( "avx2" ) ? findSpecialAvx2 : findSpecialSse2;
+#else
+      return findSpecialScalar;
+#endif
+    }
+
+    const SpecialFunction findSpecial = chooseKernel();
+
+    /////////////////////////////////////////////
+    // Scanner
+    /////////////////////////////////////////////
+
+    void putUtf8( std::string &out, uint32_t code )
+    {
+      if( code < 0x80 ) {
+        out.push_back( static_cast<char>( code ));
+      }
+      else if( code < 0x800 ) {
+        out.push_back( static_cast<char>( 0xc0 | ( code >> 6 )));
+        out.push_back( static_cast<char>( 0x80 | ( code & 0x3f )));
+      }
+      else if( code < 0x10000 ) {
+        out.push_back( static_cast<char>( 0xe0 | ( code >> 12 )));
+        out.push_back( static_cast<char>( 0x80 | (( code >> 6 ) & 0x3f )));
+        out.push_back( static_cast<char>( 0x80 | ( code & 0x3f )));
+      }
+      else {
+        out.push_back( static_cast<char>( 0xf0 | ( code >> 18 )));
+        out.push_back( static_cast<char>( 0x80 | (( code >> 12 ) & 0x3f )));
+        out.push_back( static_cast<char>( 0x80 | (( code >> 6 ) & 0x3f )));
+        out.push_back( static_cast<char>( 0x80 | ( code & 0x3f )));
+      }
+    }
+
+    /**
+     * \brief reads JSON values from one line without building a document
+     *
+     * Every method skips the whitespace in front of what it reads and
+     * returns false, leaving the position unspecified, on malformed input.
+     */
+    class Scanner {
+      public:
+        Scanner( const char *begin, const char *end ) : ptr_( begin ), end_( end ) {};
+
+        /**
+         * \brief consumes c if it is the next character
+         */
+        bool consume( char c )
+        {
+          skipSpace();
+          if( ptr_ < end_ && *ptr_ == c ) {
+            ptr_++;
+            return true;
+          }
+          return false;
+        };
+
+        char peek()
+        {
+          skipSpace();
+          return ptr_ < end_ ? *ptr_ : '\0';
+        };
+
+        bool atEnd()
+        {
+          skipSpace();
+          return ptr_ == end_;
+        };
+
+        /**
+         * \brief reads a string, replacing its escapes
+         */
+        bool string( std::string &out )
+        {
+          if( !consume( '"' )) {
+            return false;
+          }
+          out.clear();
+          while( true ) {
+            const char *special = findSpecial( ptr_, end_ );
+            out.append( ptr_, static_cast<size_t>( special - ptr_ ));
+            ptr_ = special;
+            if( ptr_ == end_ || static_cast<unsigned char>( *ptr_ ) < 0x20 ) {
+              return false;
+            }
+            if( *ptr_++ == '"' ) {
+              return true;
+            }
+            if( !escape( out )) {
+              return false;
+            }
+          }
+        };
+
+        /**
+         * \brief reads a number, scaled to an integer without going through
+         * a double, so fractions of a second are not rounded
+         * \param [in] digits decimal digits of the fraction to keep
+         * \param [out] integer value times 10^digits, truncated
+         * \param [out] real value as a double, or NULL if not needed
+         * \param [out] isInteger true if the number has no fraction or
+         * exponent and fits an int64
+         */
+        bool number( int digits, int64_t &integer, double *real, bool &isInteger )
+        {
+          skipSpace();
+          const char *start = ptr_;
+          bool negative = ptr_ < end_ && *ptr_ == '-';
+          ptr_ += negative;
+          uint64_t whole = 0;
+          int wholeDigits = 0;
+          for( ; ptr_ < end_ && *ptr_ >= '0' && *ptr_ <= '9'; ptr_++, wholeDigits++ ) {
+            whole = whole * 10 + static_cast<uint64_t>( *ptr_ - '0' );
+          }
+          if( wholeDigits == 0 ) {
+            return false;
+          }
+          uint64_t fraction = 0;
+          int fractionDigits = 0;
+          bool fractional = ptr_ < end_ && *ptr_ == '.';
+          if( fractional ) {
+            for( ptr_++; ptr_ < end_ && *ptr_ >= '0' && *ptr_ <= '9'; ptr_++, fractionDigits++ ) {
+              if( fractionDigits < digits ) {
+                fraction = fraction * 10 + static_cast<uint64_t>( *ptr_ - '0' );
+              }
+            }
+            if( fractionDigits == 0 ) {
+              return false;
+            }
+          }
+          bool exponent = ptr_ < end_ && ( *ptr_ == 'e' || *ptr_ == 'E' );
+          if( exponent ) {
+            ptr_++;
+            ptr_ += ptr_ < end_ && ( *ptr_ == '+' || *ptr_ == '-' );
+            const char *first = ptr_;
+            while( ptr_ < end_ && *ptr_ >= '0' && *ptr_ <= '9' ) {
+              ptr_++;
+            }
+            if( ptr_ == first ) {
+              return false;
+            }
+          }
+
+          //Doubles and rare forms go through strtod, which needs a
+          //terminated copy
+          isInteger = !fractional && !exponent && wholeDigits <= 18;
+          bool rare = exponent || wholeDigits > 18;
+          if( rare || ( real != NULL && !isInteger )) {
+            char text[64];
+            size_t length = static_cast<size_t>( ptr_ - start );
+            if( length >= sizeof( text )) {
+              return false;
+            }
+            memcpy( text, start, length );
+            text[length] = '\0';
+            double value = strtod( text, NULL );
+            if( real != NULL ) {
+              *real = value;
+            }
+            if( rare ) {
+              integer = static_cast<int64_t>( std::llround( value * std::pow( 10.0, digits )));
+              return true;
+            }
+          }
+          for( int i = std::min( fractionDigits, digits ); i < digits; i++ ) {
+            fraction *= 10;
+          }
+          uint64_t scale = 1;
+          for( int i = 0; i < digits; i++ ) {
+            scale *= 10;
+          }
+          integer = static_cast<int64_t>( whole * scale + fraction );
+          integer = negative ? -integer : integer;
+          return true;
+        };
+
+        /**
+         * \brief reads true or false
+         */
+        bool boolean( bool &value )
+        {
+          if( literal( "true", 4 )) {
+            value = true;
+            return true;
+          }
+          value = false;
+          return literal( "false", 5 );
+        };
+
+        bool literal( const char *text, size_t size )
+        {
+          skipSpace();
+          if( static_cast<size_t>( end_ - ptr_ ) < size || memcmp( ptr_, text, size ) != 0 ) {
+            return false;
+          }
+          ptr_ += size;
+          return true;
+        };
+
+        /**
+         * \brief steps over a value of any type
+         */
+        bool skip( std::string &scratch, int depth = 0 )
+        {
+          const int MAX_DEPTH = 64;
+          int64_t integer = 0;
+          bool isInteger = false;
+          bool value = false;
+          switch( peek()) {
+            case '"':
+              return string( scratch );
+            case 't':
+            case 'f':
+              return boolean( value );
+            case 'n':
+              return literal( "null", 4 );
+            case '[':
+              ptr_++;
+              if( depth >= MAX_DEPTH ) {
+                return false;
+              }
+              if( consume( ']' )) {
+                return true;
+              }
+              do {
+                if( !skip( scratch, depth + 1 )) {
+                  return false;
+                }
+              } while( consume( ',' ));
+              return consume( ']' );
+            case '{':
+              ptr_++;
+              if( depth >= MAX_DEPTH ) {
+                return false;
+              }
+              if( consume( '}' )) {
+                return true;
+              }
+              do {
+                if( !string( scratch ) || !consume( ':' ) || !skip( scratch, depth + 1 )) {
+                  return false;
+                }
+              } while( consume( ',' ));
+              return consume( '}' );
+            default:
+              return number( 0, integer, NULL, isInteger );
+          }
+        };
+
+      private:
+        const char *ptr_;
+        const char *end_;
+
+        void skipSpace()
+        {
+          while( ptr_ < end_ && ( *ptr_ == ' ' || *ptr_ == '\t' || *ptr_ == '\r' || *ptr_ == '\n' )) {
+            ptr_++;
+          }
+        };
+
+        bool hex4( uint32_t &code )
+        {
+          if( end_ - ptr_ < 4 ) {
+            return false;
+          }
+          code = 0;
+          for( int i = 0; i < 4; i++ ) {
+            char c = *ptr_++;
+            code <<= 4;
+            if( c >= '0' && c <= '9' ) {
+              code |= static_cast<uint32_t>( c - '0' );
+            }
+            else if( c >= 'a' && c <= 'f' ) {
+              code |= static_cast<uint32_t>( c - 'a' + 10 );
+            }
+            else if( c >= 'A' && c <= 'F' ) {
+              code |= static_cast<uint32_t>( c - 'A' + 10 );
+            }
+            else {
+              return false;
+            }
+          }
+          return true;
+        };
+
+        /**
+         * \brief appends the character of the escape after a backslash
+         */
+        bool escape( std::string &out )
+        {
+          if( ptr_ == end_ ) {
+            return false;
+          }
+          char c = *ptr_++;
+          switch( c ) {
+            case '"':
+            case '\\':
+            case '/':
+              out.push_back( c );
+              return true;
+            case 'b':
+              out.push_back( '\b' );
+              return true;
+            case 'f':
+              out.push_back( '\f' );
+              return true;
+            case 'n':
+              out.push_back( '\n' );
+              return true;
+            case 'r':
+              out.push_back( '\r' );
+              return true;
+            case 't':
+              out.push_back( '\t' );
+              return true;
+            case 'u':
+              break;
+            default:
+              return false;
+          }
+
+          //Characters outside the basic plane come as a surrogate pair
+          uint32_t code = 0;
+          if( !hex4( code )) {
+            return false;
+          }
+          if( code >= 0xd800 && code < 0xdc00 ) {
+            uint32_t low = 0;
+            if( end_ - ptr_ < 2 || ptr_[0] != '\\' || ptr_[1] != 'u' ) {
+              return false;
+            }
+            ptr_ += 2;
+            if( !hex4( low ) || low < 0xdc00 || low >= 0xe000 ) {
+              return false;
+            }
+            code = 0x10000 + (( code - 0xd800 ) << 10 ) + ( low - 0xdc00 );
+          }
+          else if( code >= 0xdc00 && code < 0xe000 ) {
+            return false;
+          }
+          putUtf8( out, code );
+          return true;
+        };
+    };
+
+    bool decodeBase64( const std::string &text, std::string &out )
+    {
+      out.clear();
+      uint32_t bits = 0;
+      int count = 0;
+      for( size_t i = 0; i < text.size(); i++ ) {
+        char c = text[i];
+        uint32_t value = 0;
+        if( c >= 'A' && c <= 'Z' ) {
+          value = static_cast<uint32_t>( c - 'A' );
+        }
+        else if( c >= 'a' && c <= 'z' ) {
+          value = static_cast<uint32_t>( c - 'a' + 26 );
+        }
+        else if( c >= '0' && c <= '9' ) {
+          value = static_cast<uint32_t>( c - '0' + 52 );
+        }
+        else if( c == '+' ) {
+          value = 62;
+        }
+        else if( c == '/' ) {
+          value = 63;
+        }
+        else if( c == '=' ) {
+          break;
+        }
+        else {
+          return false;
+        }
+        bits = ( bits << 6 ) | value;
+        if( ++count == 4 ) {
+          out.push_back( static_cast<char>( bits >> 16 ));
+          out.push_back( static_cast<char>( bits >> 8 ));
+          out.push_back( static_cast<char>( bits ));
+          bits = 0;
+          count = 0;
+        }
+      }
+      if( count == 2 ) {
+        out.push_back( static_cast<char>( bits >> 4 ));
+      }
+      else if( count == 3 ) {
+        out.push_back( static_cast<char>( bits >> 10 ));
+        out.push_back( static_cast<char>( bits >> 2 ));
+      }
+      return count != 1;
+    }
+
+    /**
+     * \brief reads an unsigned 32 bit number, which may be quoted
+     */
+    bool readId( Scanner &scanner, std::string &scratch, uint32_t &value )
+    {
+      int64_t integer = 0;
+      bool isInteger = false;
+      if( scanner.peek() == '"' ) {
+        if( !scanner.string( scratch ) || scratch.empty() || scratch.size() > 10 ) {
+          return false;
+        }
+        Scanner quoted( scratch.data(), scratch.data() + scratch.size());
+        if( !quoted.number( 0, integer, NULL, isInteger ) || !quoted.atEnd()) {
+          return false;
+        }
+      }
+      else if( !scanner.number( 0, integer, NULL, isInteger )) {
+        return false;
+      }
+      if( !isInteger || integer < 0 || integer > UINT32_MAX ) {
+        return false;
+      }
+      value = static_cast<uint32_t>( integer );
+      return true;
+    }
+
+    bool readLevel( Scanner &scanner, std::string &scratch, Severity &level )
+    {
+      if( scanner.peek() == '"' ) {
+        if( !scanner.string( scratch )) {
+          return false;
+        }
+        for( int i = CRITICAL; i < ALL; i++ ) {
+          if( strcasecmp( scratch.c_str(), LEVEL_NAMES[i] ) == 0 ) {
+            level = static_cast<Severity>( i );
+            return true;
+          }
+        }
+        return false;
+      }
+      int64_t integer = 0;
+      bool isInteger = false;
+      if( !scanner.number( 0, integer, NULL, isInteger ) || !isInteger
+          || integer < CRITICAL || integer >= ALL ) {
+        return false;
+      }
+      level = static_cast<Severity>( integer );
+      return true;
+    }
+
+    /**
+     * \brief reads the fields object, keeping scalar values
+     */
+    bool readFields( Scanner &scanner, std::string &scratch, Record &record, size_t &count )
+    {
+      if( !scanner.consume( '{' )) {
+        return false;
+      }
+      if( scanner.consume( '}' )) {
+        return true;
+      }
+      do {
+        if( count == record.fields.size()) {
+          record.fields.push_back( FieldValue());
+        }
+        FieldValue &field = record.fields[count];
+        if( !scanner.string( field.key ) || !scanner.consume( ':' )) {
+          return false;
+        }
+        field.integer = 0;
+        field.real = 0;
+        field.text.clear();
+        bool flag = false;
+        bool isInteger = false;
+        switch( scanner.peek()) {
+          case '"':
+            field.type = FieldType::STRING;
+            if( !scanner.string( field.text )) {
+              return false;
+            }
+            break;
+          case 't':
+          case 'f':
+            field.type = FieldType::BOOL;
+            if( !scanner.boolean( flag )) {
+              return false;
+            }
+            field.integer = flag;
+            break;
+          case '-':
+          case '0': case '1': case '2': case '3': case '4':
+          case '5': case '6': case '7': case '8': case '9':
+            if( !scanner.number( 0, field.integer, &field.real, isInteger )) {
+              return false;
+            }
+            field.type = isInteger ? FieldType::INT64 : FieldType::DOUBLE;
+            break;
+          default:
+            //Nulls and nested values have no field type
+            if( !scanner.skip( scratch )) {
+              return false;
+            }
+            continue;
+        }
+        count++;
+      } while( scanner.consume( ',' ));
+      return scanner.consume( '}' );
+    }
+
+    /////////////////////////////////////////////
+    // Input
+    /////////////////////////////////////////////
+
+    /**
+     * \brief read-only mapping of an input file
+     */
+    class MappedFile {
+      public:
+        MappedFile() {};
+        ~MappedFile()
+        {
+          if( data_ != NULL ) {
+            ::munmap( const_cast<char *>( data_ ), size_ );
+          }
+        };
+
+        bool open( const std::string &path )
+        {
+          int fd = ::open( path.c_str(), O_RDONLY );
+          if( fd < 0 ) {
+            return false;
+          }
+          struct stat st;
+          if( fstat( fd, &st ) != 0 ) {
+            ::close( fd );
+            return false;
+          }
+          size_ = static_cast<size_t>( st.st_size );
+          if( size_ == 0 ) {
+            ::close( fd );
+            return true;
+          }
+          void *data = ::mmap( NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0 );
+          ::close( fd );
+          if( data == MAP_FAILED ) {
+            size_ = 0;
+            return false;
+          }
+          ::madvise( data, size_, MADV_SEQUENTIAL );
+          data_ = static_cast<const char *>( data );
+          return true;
+        };
+
+        const char *data() const { return data_; };
+        size_t size() const { return size_; };
+
+      private:
+        const char *data_ = NULL;
+        size_t size_ = 0;
+
+        MappedFile( const MappedFile & );
+        MappedFile &operator=( const MappedFile & );
+    };
+
+    struct Chunk {
+      const char *begin;
+      const char *end;
+    };
+
+    /**
+     * \brief entries of one chunk, length framed as in a block
+     */
+    struct Parsed {
+      std::string records;
+      uint64_t lines = 0;
+      uint64_t rejected = 0;
+    };
+
+    void parseChunk( const Chunk &chunk, const std::string &deviceId, Record &record, Parsed &parsed )
+    {
+      const char *ptr = chunk.begin;
+      while( ptr < chunk.end ) {
+        const char *end = static_cast<const char *>(
+            memchr( ptr, '\n', static_cast<size_t>( chunk.end - ptr )));
+        const char *next = end == NULL ? chunk.end : end + 1;
+        end = end == NULL ? chunk.end : end;
+
+        Scanner blank( ptr, end );
+        if( !blank.atEnd()) {
+          parsed.lines++;
+          if( parseJsonLine( ptr, end, deviceId, record )) {
+            encodeRecord( record, parsed.records );
+          }
+          else {
+            parsed.rejected++;
+          }
+        }
+        ptr = next;
+      }
+    }
+  }
+
+  bool parseJsonLine( const char *begin
+      , const char *end
+      , const std::string &deviceId
+      , Record &record
+      )
+  {
+    //Strings and vectors keep their capacity from line to line
+    thread_local std::string key;
+    thread_local std::string scratch;
+    thread_local std::string encoding;
+    thread_local std::string origin;
+    record.seq = 0;
+    record.timestamp = 0;
+    record.level = INFO;
+    record.type = PayloadType::STRING;
+    record.flags = 0;
+    record.pid = 0;
+    record.tid = 0;
+    record.site = 0;
+    record.module.clear();
+    record.message.clear();
+    record.file.clear();
+    record.line = 0;
+    encoding.clear();
+    origin.clear();
+    size_t tags = 0;
+    size_t fields = 0;
+    bool stamped = false;
+
+    Scanner scanner( begin, end );
+    if( !scanner.consume( '{' )) {
+      return false;
+    }
+    if( !scanner.consume( '}' )) {
+      do {
+        if( !scanner.string( key ) || !scanner.consume( ':' )) {
+          return false;
+        }
+        bool ok = true;
+        if( key == "message" ) {
+          ok = scanner.string( record.message );
+        }
+        else if( key == "timestamp" ) {
+          bool isInteger = false;
+          ok = scanner.number( 9, record.timestamp, NULL, isInteger );
+          stamped = true;
+        }
+        else if( key == "level" ) {
+          ok = readLevel( scanner, scratch, record.level );
+        }
+        else if( key == "pid" ) {
+          ok = readId( scanner, scratch, record.pid );
+        }
+        else if( key == "tid" ) {
+          ok = readId( scanner, scratch, record.tid );
+        }
+        else if( key == "module" ) {
+          ok = scanner.string( record.module );
+        }
+        else if( key == "deviceId" ) {
+          ok = scanner.string( origin );
+        }
+        else if( key == "tags" ) {
+          ok = scanner.consume( '[' );
+          if( ok && !scanner.consume( ']' )) {
+            do {
+              if( tags == record.tags.size()) {
+                record.tags.push_back( std::string());
+              }
+              ok = scanner.string( record.tags[tags++] );
+            } while( ok && scanner.consume( ',' ));
+            ok = ok && scanner.consume( ']' );
+          }
+        }
+        else if( key == "fields" ) {
+          ok = readFields( scanner, scratch, record, fields );
+        }
+        else if( key == "replayed" ) {
+          bool replayed = false;
+          ok = scanner.boolean( replayed );
+          record.flags = replayed ? RECORD_REPLAYED : 0;
+        }
+        else if( key == "encoding" ) {
+          ok = scanner.string( encoding );
+        }
+        else {
+          ok = scanner.skip( scratch );
+        }
+        if( !ok ) {
+          return false;
+        }
+      } while( scanner.consume( ',' ));
+      if( !scanner.consume( '}' )) {
+        return false;
+      }
+    }
+    //An entry without a time would be stored at the epoch
+    if( !scanner.atEnd() || !stamped ) {
+      return false;
+    }
+
+    record.tags.resize( tags );
+    if( !origin.empty() && origin != deviceId ) {
+      if( fields == record.fields.size()) {
+        record.fields.push_back( FieldValue());
+      }
+      FieldValue &field = record.fields[fields++];
+      field.key = "deviceId";
+      field.type = FieldType::STRING;
+      field.integer = 0;
+      field.real = 0;
+      field.text = origin;
+    }
+    record.fields.resize( fields );
+    if( encoding == "base64" ) {
+      if( !decodeBase64( record.message, scratch )) {
+        return false;
+      }
+      record.message.swap( scratch );
+      record.type = PayloadType::BINARY;
+    }
+    else if( !encoding.empty()) {
+      return false;
+    }
+    return true;
+  }
+
+  Status importJsonLines( FileStore &store
+      , const std::vector<std::string> &files
+      , const ImportOptions &options
+      , ImportStats *stats
+      )
+  {
+    ImportStats total;
+    std::vector<std::unique_ptr<MappedFile> > mapped;
+    for( size_t i = 0; i < files.size(); i++ ) {
+      mapped.push_back( std::unique_ptr<MappedFile>( new MappedFile ));
+      if( !mapped.back()->open( files[i] )) {
+        return ERR;
+      }
+      total.bytes += mapped.back()->size();
+    }
+    if( !store.isOpen()) {
+      return ERR;
+    }
+
+    //Every entry takes a line of its own, so the lines bound the numbers
+    //the import needs
+    uint64_t seq = store.nextSeq();
+    if( options.reserve ) {
+      uint64_t lines = 0;
+      for( size_t i = 0; i < mapped.size(); i++ ) {
+        const char *data = mapped[i]->data();
+        const char *end = data + mapped[i]->size();
+        for( const char *line = data; line < end; lines++ ) {
+          const char *newline = static_cast<const char *>(
+              memchr( line, '\n', static_cast<size_t>( end - line )));
+          line = newline == NULL ? end : newline + 1;
+        }
+      }
+      seq = options.reserve( lines );
+    }
+
+    //Chunks end just after a newline, so none splits a line
+    size_t chunkBytes = std::max<size_t>( options.chunkBytes, 1 );
+    std::vector<Chunk> chunks;
+    for( size_t i = 0; i < mapped.size(); i++ ) {
+      const char *data = mapped[i]->data();
+      const char *end = data + mapped[i]->size();
+      for( const char *begin = data; begin < end; ) {
+        const char *cut = begin + std::min( chunkBytes, static_cast<size_t>( end - begin ));
+        if( cut < end ) {
+          const char *newline = static_cast<const char *>(
+              memchr( cut - 1, '\n', static_cast<size_t>( end - cut + 1 )));
+          cut = newline == NULL ? end : newline + 1;
+        }
+        Chunk chunk = { begin, cut };
+        chunks.push_back( chunk );
+        begin = cut;
+      }
+    }
+
+    unsigned threads = options.threads;
+    if( threads == 0 ) {
+      threads = std::max( 1u, std::thread::hardware_concurrency());
+    }
+    threads = static_cast<unsigned>( std::max<size_t>( 1, std::min<size_t>( threads, chunks.size())));
+    const size_t ahead = threads * CHUNKS_AHEAD;
+
+    //Parse in the background, at most ahead chunks past the one being
+    //written, while this thread writes the chunks in order
+    std::vector<Parsed> results( chunks.size());
+    std::vector<char> finished( chunks.size(), 0 );
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t written = 0;
+    bool stop = false;
+    std::atomic<size_t> next{ 0 };
+    std::vector<std::thread> pool;
+    for( unsigned t = 0; t < threads && !chunks.empty(); t++ ) {
+      pool.push_back( std::thread( [&] {
+          Record record;
+          for( size_t i = next++; i < chunks.size(); i = next++ ) {
+            {
+              std::unique_lock<std::mutex> lock( mutex );
+              cv.wait( lock, [&] { return stop || i < written + ahead; } );
+              if( stop ) {
+                break;
+              }
+            }
+            Parsed parsed;
+            parsed.records.reserve( static_cast<size_t>( chunks[i].end - chunks[i].begin ));
+            parseChunk( chunks[i], options.deviceId, record, parsed );
+
+            std::lock_guard<std::mutex> lock( mutex );
+            std::swap( results[i], parsed );
+            finished[i] = 1;
+            cv.notify_all();
+          }
+        } ));
+    }
+
+    store.deferDerived( true );
+    BlockBuilder block;
+    std::string prepared;
+    std::vector<std::pair<uint64_t, DurableCallback> > waiters;
+    total.firstSeq = seq;
+    bool ok = true;
+    for( size_t i = 0; i < chunks.size() && ok; i++ ) {
+      Parsed parsed;
+      {
+        std::unique_lock<std::mutex> lock( mutex );
+        cv.wait( lock, [&] { return finished[i] != 0; } );
+        std::swap( parsed, results[i] );
+        written = i + 1;
+        cv.notify_all();
+      }
+      total.lines += parsed.lines;
+      total.rejected += parsed.rejected;
+
+      forEachRecord( parsed.records, [&]( const uint8_t *body, size_t size ) {
+          if( !ok ) {
+            return;
+          }
+          if( store.prepareRecord( body, size, NULL, 0, prepared )) {
+            body = reinterpret_cast<const uint8_t *>( prepared.data());
+            size = prepared.size();
+          }
+          block.addEncoded( body, size, seq++ );
+          total.entries++;
+          if( block.bytes() >= IMPORT_BLOCK_BYTES ) {
+            block.seal();
+            ok = store.write( block, waiters );
+            block.clear();
+          }
+        });
+    }
+    if( ok && !block.empty()) {
+      block.seal();
+      ok = store.write( block, waiters );
+    }
+
+    {
+      std::lock_guard<std::mutex> lock( mutex );
+      stop = true;
+      cv.notify_all();
+    }
+    for( size_t t = 0; t < pool.size(); t++ ) {
+      pool[t].join();
+    }
+
+    //Everything the load skipped is built now, from whole segments
+    ok = store.deferDerived( false ) && ok;
+    if( ok ) {
+      store.compact();
+    }
+    if( stats != NULL ) {
+      *stats = total;
+    }
+    return ok ? OK : ERR;
+  }
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ **/
+
+#pragma once
+
+// Bulk import of JSON-lines logs.
+//
+// importJsonLines stores the entries of files holding one JSON object per
+// line, in the shape getLogStringById returns, e.g.
+//   {"timestamp":1666000000.25,"pid":12,"deviceId":"cam-3","type":"log",
+//    "level":3,"message":"frame dropped","module":"camera","tags":["a"]}
+// timestamp, in seconds since the epoch, is required. level is a Severity
+// number or its name, e.g. "warning". tid, module, tags, fields, replayed
+// and encoding, base64 for binary messages, are optional. id, site, file,
+// line and type are ignored: entries are numbered after those already
+// stored.
+// A deviceId other than the store's is kept as a string field "deviceId".
+// Blank lines are skipped. Lines that are not an entry, such as those
+// without a timestamp, are counted as rejected but do not stop the import.
+//
+// Files are mapped and cut into chunks of about chunkBytes at line ends.
+// A thread pool parses the chunks with a scanner of its own, which finds
+// the end of a string a vector register at a time, straight into encoded
+// records. The calling thread takes the chunks in order, numbers their
+// entries and writes them in blocks, so entries keep the order of the
+// files. Rollups, filters and indexes are not kept while loading; the
+// store rebuilds them from the blocks once everything is written.
+//
+// Entries are stored with the timestamps of the files, so retention limits
+// apply to them as usual and may drop old entries at the next compaction.
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <lumberjack.hpp>
+#include <lumberjack_record.hpp>
+
+namespace lumberjack {
+
+  class FileStore;
+
+  //Input is handed to the parsing threads in chunks of about this size
+  const size_t IMPORT_CHUNK_BYTES = 4 * 1024 * 1024;
+
+  /**
+   * \brief how to import
+   */
+  struct ImportOptions {
+    unsigned threads = 0;                   //parsing threads, 0 for one per core
+    size_t chunkBytes = IMPORT_CHUNK_BYTES;
+    std::string deviceId;                   //device the store belongs to
+
+    //Called once the files are mapped with the number of lines they hold,
+    //which no import exceeds. Returns the first of that many sequence
+    //numbers set aside for the import. Empty to number entries after the
+    //store's.
+    std::function<uint64_t( uint64_t lines )> reserve;
+  };
+
+  /**
+   * \brief what an import did
+   */
+  struct ImportStats {
+    uint64_t lines = 0;       //lines that were not blank
+    uint64_t entries = 0;     //entries stored
+    uint64_t rejected = 0;    //lines that were not an entry
+    uint64_t bytes = 0;       //bytes of input
+    uint64_t firstSeq = 0;    //sequence number of the first entry stored
+  };
+
+  /**
+   * \brief parses one line of a JSON-lines log into an entry
+   * \param [in] begin first byte of the line
+   * \param [in] end end of the line, without its newline
+   * \param [in] deviceId device the store belongs to
+   * \param [out] record the entry, its vectors reused
+   * \return false if the line is not a JSON object describing an entry,
+   * including one without a timestamp
+   */
+  bool parseJsonLine( const char *begin
+      , const char *end
+      , const std::string &deviceId
+      , Record &record
+      );
+
+  /**
+   * \brief stores the entries of JSON-lines files
+   * \param [in] store open store; the caller must be its writer thread
+   * \param [in] files paths of the files, imported in this order
+   * \param [in] options threads, chunk size, the store's device and where
+   * numbering starts
+   * \param [out] stats what was imported, or NULL
+   * \return OK, or ERR if a file cannot be read or the store cannot be
+   * written
+   *
+   * Files are all opened before anything is stored. The derived files of
+   * sealed segments, including their message indexes with indexMessages,
+   * are rebuilt by a compaction before this returns.
+   */
+  Status importJsonLines( FileStore &store
+      , const std::vector<std::string> &files
+      , const ImportOptions &options
+      , ImportStats *stats = NULL
+      );
+}
@@ -0,0 +1,452 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+
+#include <lumberjack_filter.hpp>
+#include <lumberjack_index.hpp>
+#include <lumberjack_store.hpp>
+
+namespace lumberjack {
+
+  namespace {
+    const char *INDEX_SUFFIX = ".ljidx";
+    const uint8_t INDEX_VERSION = 1;
+
+    //Words between directory offsets
+    const uint32_t STRIDE = 64;
+
+    int compareWord( const uint8_t *data, size_t size, const std::string &word )
+    {
+      int order = memcmp( data, word.data(), std::min( size, word.size()));
+      if( order != 0 ) {
+        return order;
+      }
+      return size < word.size() ? -1 : size > word.size() ? 1 : 0;
+    }
+
+    /**
+     * \brief keeps the entries of a sorted list found in another, stepping
+     * through the shorter one and searching the longer
+     */
+    void intersect( const std::vector<uint64_t> &a
+        , const std::vector<uint64_t> &b
+        , std::vector<uint64_t> &out
+        )
+    {
+      const std::vector<uint64_t> &shorter = a.size() <= b.size() ? a : b;
+      const std::vector<uint64_t> &longer = a.size() <= b.size() ? b : a;
+      out.clear();
+      std::vector<uint64_t>::const_iterator at = longer.begin();
+      for( size_t i = 0; i < shorter.size() && at != longer.end(); i++ ) {
+        at = std::lower_bound( at, longer.end(), shorter[i] );
+        if( at != longer.end() && *at == shorter[i] ) {
+          out.push_back( shorter[i] );
+        }
+      }
+    }
+
+    /**
+     * \brief appends the entries of one segment that match a query
+     * \param [in] source SegmentIndex or IndexBuilder of the segment
+     */
+    template<typename Source>
+    void matchClauses( const Source &source
+        , const TermQuery &query
+        , std::vector<uint64_t> &seqs
+        , uint64_t &postings
+        )
+    {
+      std::vector<std::vector<uint64_t> > clauses( query.clauses.size());
+      std::vector<uint64_t> list;
+      std::vector<uint64_t> merged;
+      for( size_t c = 0; c < clauses.size(); c++ ) {
+        const std::vector<std::string> &words = query.clauses[c];
+        for( size_t w = 0; w < words.size(); w++ ) {
+          source.postings( words[w], list );
+          postings += list.size();
+          merged.clear();
+          std::set_union( clauses[c].begin(), clauses[c].end(), list.begin(), list.end()
+              , std::back_inserter( merged ));
+          clauses[c].swap( merged );
+        }
+        if( clauses[c].empty()) {
+          return;
+        }
+      }
+
+      //Shortest first, so every step is as small as it can be
+      std::sort( clauses.begin(), clauses.end()
+          , []( const std::vector<uint64_t> &a, const std::vector<uint64_t> &b ) {
+            return a.size() < b.size();
+          });
+      for( size_t c = 1; c < clauses.size() && !clauses[0].empty(); c++ ) {
+        intersect( clauses[0], clauses[c], merged );
+        clauses[0].swap( merged );
+      }
+      seqs.insert( seqs.end(), clauses[0].begin(), clauses[0].end());
+    }
+  }
+
+  std::string indexPath( const std::string &segmentPath )
+  {
+    return siblingPath( segmentPath, INDEX_SUFFIX );
+  }
+
+  Status lookupTerms( const std::string &path
+      , const TermQuery &query
+      , std::vector<uint64_t> &seqs
+      , TermStats *stats
+      )
+  {
+    seqs.clear();
+    TermStats local;
+    TermStats &totals = stats != NULL ? *stats : local;
+    totals = TermStats();
+    if( query.clauses.empty()) {
+      return ERR;
+    }
+    for( size_t i = 0; i < query.clauses.size(); i++ ) {
+      if( query.clauses[i].empty()) {
+        return ERR;
+      }
+    }
+
+    std::vector<SegmentInfo> segments;
+    if( !listSegments( path, segments )) {
+      return ERR;
+    }
+
+    std::map<uint32_t, SiteInfo> sites;
+    std::map<uint32_t, MessageTemplate> templates;
+    bool sitesRead = false;
+    std::string data;
+    for( size_t i = 0; i < segments.size(); i++ ) {
+      totals.segments++;
+      SegmentIndex index;
+      if( readFile( indexPath( segments[i].path ), data ) && index.parse( data )) {
+        totals.indexed++;
+        matchClauses( index, query, seqs, totals.postings );
+        continue;
+      }
+
+      //A segment removed meanwhile had its entries moved to an earlier one
+      SegmentReader reader;
+      if( !reader.open( segments[i].path )) {
+        continue;
+      }
+      if( !sitesRead ) {
+        readSites( path, sites );
+        readTemplates( path, templates );
+        sitesRead = true;
+      }
+      IndexBuilder builder;
+      for( std::map<uint32_t, SiteInfo>::const_iterator it = sites.begin(); it != sites.end(); ++it ) {
+        builder.defineSite( it->second );
+      }
+      for( std::map<uint32_t, MessageTemplate>::const_iterator it = templates.begin()
+          ; it != templates.end(); ++it ) {
+        builder.defineTemplate( it->second );
+      }
+      BlockHeader header;
+      while( reader.nextHeader( header )) {
+        if( reader.readData( data )) {
+          builder.addBlock( data );
+        }
+      }
+      builder.finish();
+      matchClauses( builder, query, seqs, totals.postings );
+    }
+
+    //Entries can be written out of order, so segments can overlap
+    std::sort( seqs.begin(), seqs.end());
+    seqs.erase( std::unique( seqs.begin(), seqs.end()), seqs.end());
+    return OK;
+  }
+
+  /////////////////////////////////////////////
+  // SegmentIndex
+  /////////////////////////////////////////////
+  bool SegmentIndex::parse( const std::string &data )
+  {
+    const uint8_t *body = NULL;
+    size_t size = 0;
+    forEachFrame( data, [&]( const uint8_t *frame, size_t length ) {
+        body = frame;
+        size = length;
+        return false;
+      });
+    if( body == NULL || size < 1 + sizeof( uint32_t )) {
+      return false;
+    }
+
+    const uint8_t *end = body + size - sizeof( uint32_t );
+    const uint8_t *ptr = body;
+    uint64_t words = 0;
+    uint32_t entries = 0;
+    memcpy( &entries, end, sizeof( entries ));
+    if( *ptr++ != INDEX_VERSION || !getVarint( ptr, end, base_ ) || !getVarint( ptr, end, words )
+        || entries > static_cast<size_t>( end - ptr ) / sizeof( uint32_t )
+        || entries != ( words + STRIDE - 1 ) / STRIDE ) {
+      return false;
+    }
+
+    body_ = body;
+    words_ = ptr;
+    directory_ = end - entries * sizeof( uint32_t );
+    entries_ = entries;
+    for( uint32_t i = 0; i < entries_; i++ ) {
+      uint32_t offset = 0;
+      memcpy( &offset, directory_ + i * sizeof( offset ), sizeof( offset ));
+      if( offset < static_cast<size_t>( words_ - body_ )
+          || offset >= static_cast<size_t>( directory_ - body_ )) {
+        entries_ = 0;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /////////////////////////////////////////////
+  // Compares the word at an offset of the directory with another
+  /////////////////////////////////////////////
+  int SegmentIndex::compareAt( uint32_t offset, const std::string &word ) const
+  {
+    const uint8_t *ptr = body_ + offset;
+    uint64_t length = 0;
+    if( !getVarint( ptr, directory_, length ) || length > static_cast<uint64_t>( directory_ - ptr )) {
+      return 1;
+    }
+    return compareWord( ptr, static_cast<size_t>( length ), word );
+  }
+
+  void SegmentIndex::postings( const std::string &word, std::vector<uint64_t> &seqs ) const
+  {
+    seqs.clear();
+
+    //First directory entry past the word; the word is in the run before it
+    uint32_t low = 0;
+    uint32_t high = entries_;
+    while( low < high ) {
+      uint32_t mid = low + ( high - low ) / 2;
+      uint32_t offset = 0;
+      memcpy( &offset, directory_ + mid * sizeof( offset ), sizeof( offset ));
+      if( compareAt( offset, word ) <= 0 ) {
+        low = mid + 1;
+      }
+      else {
+        high = mid;
+      }
+    }
+    if( low == 0 ) {
+      return;
+    }
+
+    uint32_t offset = 0;
+    memcpy( &offset, directory_ + ( low - 1 ) * sizeof( offset ), sizeof( offset ));
+    const uint8_t *ptr = body_ + offset;
+    for( uint32_t i = 0; i < STRIDE && ptr < directory_; i++ ) {
+      uint64_t length = 0;
+      uint64_t count = 0;
+      uint64_t bytes = 0;
+      if( !getVarint( ptr, directory_, length ) || length > static_cast<uint64_t>( directory_ - ptr )) {
+        return;
+      }
+      const uint8_t *text = ptr;
+      ptr += length;
+      if( !getVarint( ptr, directory_, count ) || !getVarint( ptr, directory_, bytes )
+          || bytes > static_cast<uint64_t>( directory_ - ptr )) {
+        return;
+      }
+
+      int order = compareWord( text, static_cast<size_t>( length ), word );
+      if( order > 0 ) {
+        return;
+      }
+      if( order == 0 ) {
+        const uint8_t *end = ptr + bytes;
+        uint64_t seq = base_;
+        seqs.reserve( static_cast<size_t>( std::min( count, bytes )));
+        for( uint64_t k = 0; k < count; k++ ) {
+          uint64_t delta = 0;
+          if( !getVarint( ptr, end, delta )) {
+            seqs.clear();
+            return;
+          }
+          seq += delta;
+          seqs.push_back( seq );
+        }
+        return;
+      }
+      ptr += bytes;
+    }
+  }
+
+  /////////////////////////////////////////////
+  // IndexBuilder
+  /////////////////////////////////////////////
+  void IndexBuilder::defineSite( const SiteInfo &site )
+  {
+    std::vector<std::string> &words = siteWords_[site.id];
+    words.clear();
+    const uint8_t *message = reinterpret_cast<const uint8_t *>( site.message.data());
+    forEachWord( message, site.message.size(), [&]( size_t offset, size_t size ) {
+        words.push_back( site.message.substr( offset, size ));
+      });
+  }
+
+  void IndexBuilder::defineTemplate( const MessageTemplate &tmpl )
+  {
+    std::vector<std::string> &words = templateWords_[tmpl.id];
+    words.clear();
+    for( size_t i = 0; i < tmpl.tokens.size(); i++ ) {
+      const std::string &token = tmpl.tokens[i];
+      const uint8_t *data = reinterpret_cast<const uint8_t *>( token.data());
+      forEachWord( data, token.size(), [&]( size_t offset, size_t size ) {
+          words.push_back( token.substr( offset, size ));
+        });
+    }
+  }
+
+  void IndexBuilder::addWord( uint64_t seq, const uint8_t *data, size_t size )
+  {
+    scratch_.assign( reinterpret_cast<const char *>( data ), size );
+    std::vector<uint64_t> &list = postings_[scratch_];
+    if( list.empty() || list.back() != seq ) {
+      list.push_back( seq );
+    }
+  }
+
+  void IndexBuilder::add( const uint8_t *body, size_t size )
+  {
+    BodyStrings strings;
+    if( size < RECORD_HEADER_BYTES || recordVersion( body ) != RECORD_VERSION
+        || isSiteDefinition( body, size ) || !locateStrings( body, size, strings )) {
+      return;
+    }
+    uint64_t seq = recordSeq( body );
+
+    if( strings.site != 0 ) {
+      std::map<uint32_t, std::vector<std::string> >::const_iterator site = siteWords_.find( strings.site );
+      if( site != siteWords_.end()) {
+        for( size_t i = 0; i < site->second.size(); i++ ) {
+          const std::string &word = site->second[i];
+          addWord( seq, reinterpret_cast<const uint8_t *>( word.data()), word.size());
+        }
+      }
+    }
+    uint32_t id = 0;
+    if(( recordFlags( body ) & RECORD_TEMPLATE ) && templateOf( strings.message, strings.messageSize, id )) {
+      std::map<uint32_t, std::vector<std::string> >::const_iterator tmpl = templateWords_.find( id );
+      if( tmpl != templateWords_.end()) {
+        for( size_t i = 0; i < tmpl->second.size(); i++ ) {
+          const std::string &word = tmpl->second[i];
+          addWord( seq, reinterpret_cast<const uint8_t *>( word.data()), word.size());
+        }
+      }
+      forEachVariable( strings.message, strings.messageSize, [&]( const uint8_t *data, size_t length ) {
+          forEachWord( data, length, [&]( size_t offset, size_t word ) {
+              addWord( seq, data + offset, word );
+            });
+        });
+    }
+    else if( recordType( body ) == static_cast<uint8_t>( PayloadType::STRING )) {
+      forEachWord( strings.message, strings.messageSize, [&]( size_t offset, size_t length ) {
+          addWord( seq, strings.message + offset, length );
+        });
+    }
+  }
+
+  void IndexBuilder::addBlock( const std::string &data )
+  {
+    forEachRecord( data, [this]( const uint8_t *body, size_t size ) {
+        add( body, size );
+      });
+  }
+
+  void IndexBuilder::finish()
+  {
+    for( Postings::iterator it = postings_.begin(); it != postings_.end(); ++it ) {
+      std::vector<uint64_t> &list = it->second;
+      if( !std::is_sorted( list.begin(), list.end())) {
+        std::sort( list.begin(), list.end());
+        list.erase( std::unique( list.begin(), list.end()), list.end());
+      }
+    }
+  }
+
+  void IndexBuilder::postings( const std::string &word, std::vector<uint64_t> &seqs ) const
+  {
+    Postings::const_iterator it = postings_.find( word );
+    if( it == postings_.end()) {
+      seqs.clear();
+      return;
+    }
+    seqs = it->second;
+  }
+
+  void IndexBuilder::encode( std::string &file ) const
+  {
+    std::vector<Postings::const_iterator> sorted;
+    sorted.reserve( postings_.size());
+    uint64_t base = UINT64_MAX;
+    for( Postings::const_iterator it = postings_.begin(); it != postings_.end(); ++it ) {
+      sorted.push_back( it );
+      base = std::min( base, it->second.front());
+    }
+    std::sort( sorted.begin(), sorted.end()
+        , []( const Postings::const_iterator &a, const Postings::const_iterator &b ) {
+          return a->first < b->first;
+        });
+    if( sorted.empty()) {
+      base = 0;
+    }
+
+    std::string body;
+    body.push_back( static_cast<char>( INDEX_VERSION ));
+    putVarint( body, base );
+    putVarint( body, sorted.size());
+    std::vector<uint32_t> directory;
+    std::string list;
+    for( size_t i = 0; i < sorted.size(); i++ ) {
+      if( i % STRIDE == 0 ) {
+        directory.push_back( static_cast<uint32_t>( body.size()));
+      }
+      const std::string &word = sorted[i]->first;
+      const std::vector<uint64_t> &seqs = sorted[i]->second;
+      putVarint( body, word.size());
+      body.append( word );
+      putVarint( body, seqs.size());
+      list.clear();
+      uint64_t previous = base;
+      for( size_t k = 0; k < seqs.size(); k++ ) {
+        putVarint( list, seqs[k] - previous );
+        previous = seqs[k];
+      }
+      putVarint( body, list.size());
+      body.append( list );
+    }
+    for( size_t i = 0; i < directory.size(); i++ ) {
+      putFixed<uint32_t>( body, directory[i] );
+    }
+    putFixed<uint32_t>( body, static_cast<uint32_t>( directory.size()));
+
+    file.clear();
+    putFrame( file, body );
+  }
+}
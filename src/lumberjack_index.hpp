@@ -0,0 +1,178 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ **/
+
+#pragma once
+
+// Inverted index of message words.
+//
+// With StoreOptions::indexMessages set, the compactor gives every sealed
+// segment an index file beside it, listing for each word of its entries'
+// messages the sequence numbers of the entries holding it. Words are split
+// as in lumberjack_filter.hpp and entries from a call site are indexed by
+// their site's message and entries stored by a template by its words and
+// their variables'. The current segment gets its index once it is
+// sealed, and the compactor rebuilds the index of a segment it rewrites.
+//
+// An index file is a single frame, a u32 length, a u32 CRC and:
+//   u8 version, varint lowest sequence number of the segment, varint word
+//   count, then for each word in byte order:
+//     varint length + bytes, varint entry count, varint byte count of the
+//     posting list, then the list: each sequence number as a varint delta
+//     from the one before, the first from the segment's lowest,
+//   and then a directory of the u32 offset into the body of every 64th
+//   word, followed by the u32 number of offsets.
+//
+// Lookups binary search the directory, so only the posting lists of the
+// query's words are decoded. Segments without an index, including the
+// current one, are indexed in memory for the lookup, so results are the
+// same either way. A lookup racing the compactor may return entries that
+// it has just dropped.
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <lumberjack.hpp>
+#include <lumberjack_record.hpp>
+#include <lumberjack_template.hpp>
+
+namespace lumberjack {
+
+  /**
+   * \brief words to look up in message indexes
+   *
+   * An entry matches when its message holds at least one word of every
+   * clause, so { { "timed" }, { "out" } } finds entries with both words and
+   * { { "refused", "reset" } } entries with either. Words are case
+   * sensitive and a term that is not a single word matches nothing.
+   */
+  struct TermQuery {
+    std::vector<std::vector<std::string> > clauses;
+  };
+
+  /**
+   * \brief what a term lookup did
+   */
+  struct TermStats {
+    uint64_t segments = 0;    //segments looked at
+    uint64_t indexed = 0;     //segments answered from an index file
+    uint64_t postings = 0;    //sequence numbers read from posting lists
+  };
+
+  /**
+   * \brief finds the entries of a store whose messages hold a query's words
+   * \param [in] path store directory
+   * \param [in] query words to look for
+   * \param [out] seqs sequence numbers of the matching entries, ascending
+   * \param [out] stats what the lookup did, or NULL
+   * \return OK, or ERR if the directory cannot be read or the query has an
+   * empty clause or none at all
+   */
+  Status lookupTerms( const std::string &path
+      , const TermQuery &query
+      , std::vector<uint64_t> &seqs
+      , TermStats *stats = NULL
+      );
+
+  /**
+   * \brief path of the index file kept for a segment
+   */
+  std::string indexPath( const std::string &segmentPath );
+
+  /**
+   * \brief view of an index file, borrowed from the file's bytes
+   */
+  class SegmentIndex {
+    public:
+      /**
+       * \brief checks an index file and finds its directory
+       * \return false if the file is torn or malformed
+       */
+      bool parse( const std::string &data );
+
+      /**
+       * \brief decodes the posting list of a word
+       * \param [out] seqs ascending sequence numbers, empty if the word is
+       * not in the index
+       */
+      void postings( const std::string &word, std::vector<uint64_t> &seqs ) const;
+
+    private:
+      const uint8_t *body_ = NULL;
+      const uint8_t *words_ = NULL;       //first word
+      const uint8_t *directory_ = NULL;   //end of the words
+      uint32_t entries_ = 0;              //offsets in the directory
+      uint64_t base_ = 0;
+
+      int compareAt( uint32_t offset, const std::string &word ) const;
+  };
+
+  /**
+   * \brief collects the posting lists of a segment's words
+   */
+  class IndexBuilder {
+    public:
+      /**
+       * \brief learns the message of a call site
+       */
+      void defineSite( const SiteInfo &site );
+
+      /**
+       * \brief learns the literal words of a message template
+       */
+      void defineTemplate( const MessageTemplate &tmpl );
+
+      /**
+       * \brief adds the words of one encoded record body
+       */
+      void add( const uint8_t *body, size_t size );
+
+      /**
+       * \brief adds the words of every record of a block's data
+       */
+      void addBlock( const std::string &data );
+
+      /**
+       * \brief sorts the posting lists; called before postings() or
+       * encode() once everything is added
+       */
+      void finish();
+
+      /**
+       * \brief copies the posting list of a word
+       * \param [out] seqs ascending sequence numbers, empty if the word was
+       * not added
+       */
+      void postings( const std::string &word, std::vector<uint64_t> &seqs ) const;
+
+      /**
+       * \brief encodes the index file
+       */
+      void encode( std::string &file ) const;
+
+    private:
+      typedef std::unordered_map<std::string, std::vector<uint64_t> > Postings;
+
+      std::map<uint32_t, std::vector<std::string> > siteWords_;
+      std::map<uint32_t, std::vector<std::string> > templateWords_;
+      Postings postings_;
+      std::string scratch_;
+
+      void addWord( uint64_t seq, const uint8_t *data, size_t size );
+  };
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include <lumberjack_levels.hpp>
+
+namespace lumberjack {
+
+  namespace {
+    //Versions are unique across every table in the process, so a call site
+    //used by several loggers never mistakes one logger's table for another's
+    std::atomic<uint64_t> nextVersion( 1 );
+
+    typedef std::pair<std::string, Severity> Entry;
+
+    /**
+     * \brief orders a module entry against a name that is not null terminated
+     */
+    struct NameLess {
+      size_t size;
+
+      bool operator()( const Entry &entry, const char *name ) const {
+        int cmp = memcmp( entry.first.data(), name, std::min( entry.first.size(), size ));
+        return cmp < 0 || ( cmp == 0 && entry.first.size() < size );
+      };
+    };
+  }
+
+  Severity LevelTable::threshold( const char *module, size_t size ) const
+  {
+    while( size > 0 && !modules.empty()) {
+      NameLess less = { size };
+      std::vector<Entry>::const_iterator it
+        = std::lower_bound( modules.begin(), modules.end(), module, less );
+      if( it != modules.end() && it->first.size() == size
+          && memcmp( it->first.data(), module, size ) == 0 ) {
+        return it->second;
+      }
+
+      //Fall back to the parent module
+      const char *dot = static_cast<const char *>( memrchr( module, '.', size ));
+      size = dot == NULL ? 0 : static_cast<size_t>( dot - module );
+    }
+    return root;
+  }
+
+  ModuleLevels::ModuleLevels()
+    : current_( NULL )
+  {
+    publish( new LevelTable());
+  }
+
+  void ModuleLevels::setRoot( Severity level )
+  {
+    std::lock_guard<std::mutex> lock( mutex_ );
+    LevelTable *table = new LevelTable( *current_.load());
+    table->root = level;
+    publish( table );
+  }
+
+  void ModuleLevels::set( const std::string &module, Severity level )
+  {
+    std::lock_guard<std::mutex> lock( mutex_ );
+    LevelTable *table = new LevelTable( *current_.load());
+    NameLess less = { module.size() };
+    std::vector<Entry>::iterator it = std::lower_bound( table->modules.begin()
+        , table->modules.end(), module.c_str(), less );
+    if( it != table->modules.end() && it->first == module ) {
+      it->second = level;
+    }
+    else {
+      table->modules.insert( it, Entry( module, level ));
+    }
+    publish( table );
+  }
+
+  bool ModuleLevels::clear( const std::string &module )
+  {
+    std::lock_guard<std::mutex> lock( mutex_ );
+    const LevelTable *current = current_.load();
+    NameLess less = { module.size() };
+    std::vector<Entry>::const_iterator it = std::lower_bound( current->modules.begin()
+        , current->modules.end(), module.c_str(), less );
+    if( it == current->modules.end() || it->first != module ) {
+      return false;
+    }
+
+    LevelTable *table = new LevelTable( *current );
+    table->modules.erase( table->modules.begin() + ( it - current->modules.begin()));
+    publish( table );
+    return true;
+  }
+
+  void ModuleLevels::replace( const LevelTable &table )
+  {
+    std::lock_guard<std::mutex> lock( mutex_ );
+    LevelTable *next = new LevelTable( table );
+    std::sort( next->modules.begin(), next->modules.end());
+    publish( next );
+  }
+
+  void ModuleLevels::publish( LevelTable *table )
+  {
+    table->version = nextVersion.fetch_add( 1 );
+    tables_.push_back( std::unique_ptr<LevelTable>( table ));
+    current_.store( table, std::memory_order_release );
+  }
+}
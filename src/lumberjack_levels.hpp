@@ -0,0 +1,175 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ **/
+
+#pragma once
+
+// Per-module log levels.
+//
+// Levels live in an immutable table. Readers load the current table through
+// a single atomic pointer and never take a lock; a writer copies the table,
+// changes the copy and publishes it. Replaced tables are kept until the
+// owner is destroyed rather than reclaimed, since a reader may still be
+// looking at one and level changes are rare. Every table carries a
+// process-wide unique version, which lets a call site cache the threshold
+// of its module and skip the lookup until the table changes.
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <lumberjack.hpp>
+
+namespace lumberjack {
+
+  /**
+   * \brief what the level table decided about an entry
+   */
+  enum class Admit : uint8_t {
+    KEEP
+    , FILTERED  //below its module's level
+    , SAMPLED   //removed by sampling
+  };
+
+  /**
+   * \brief one published set of levels
+   */
+  struct LevelTable {
+    uint64_t version = 0;
+    Severity root = ALL;
+
+    //Modules with a level of their own, sorted by name
+    std::vector<std::pair<std::string, Severity> > modules;
+
+    //Keep one of every n entries at each level; 1 keeps them all
+    uint32_t sampleEvery[ALL + 1] = { 1, 1, 1, 1, 1, 1, 1 };
+
+    /**
+     * \brief level in effect for a module
+     * \param [in] module module name, need not be null terminated
+     * \param [in] size length of the module name
+     *
+     * Walks up the dotted hierarchy ("net.tcp", then "net") until a module
+     * with its own level is found. Does not allocate.
+     */
+    Severity threshold( const char *module, size_t size ) const;
+
+    /**
+     * \brief decides whether an entry at level survives sampling
+     *
+     * Counts per thread, so sampled levels never share a cache line.
+     */
+    Admit sample( Severity level ) const
+    {
+      if( level < CRITICAL || level > ALL || sampleEvery[level] <= 1 ) {
+        return Admit::KEEP;
+      }
+      static thread_local uint32_t counts[ALL + 1];
+      return counts[level]++ % sampleEvery[level] == 0 ? Admit::KEEP : Admit::SAMPLED;
+    };
+  };
+
+  /**
+   * \brief current level table plus the tables it replaced
+   */
+  class ModuleLevels {
+    public:
+      ModuleLevels();
+
+      /**
+       * \brief table in effect right now
+       */
+      const LevelTable *table() const
+      {
+        return current_.load( std::memory_order_acquire );
+      };
+
+      /**
+       * \brief checks an entry at level from module against its threshold
+       */
+      Admit admit( Severity level, const char *module, size_t size ) const
+      {
+        const LevelTable *table = current_.load( std::memory_order_acquire );
+        Severity threshold = table->modules.empty()
+          ? table->root : table->threshold( module, size );
+        return level <= threshold ? table->sample( level ) : Admit::FILTERED;
+      };
+
+      /**
+       * \brief checks entries from site against their threshold
+       *
+       * Costs two loads once the site has cached its threshold.
+       */
+      Admit admit( const CallSite &site ) const
+      {
+        return admit( site.level(), site );
+      };
+
+      /**
+       * \brief checks an entry against the threshold cached by its source
+       * \param [in] level level of the entry
+       * \param [in] source call site or logger handle that caches a level
+       */
+      template<typename Source>
+      Admit admit( Severity level, const Source &source ) const
+      {
+        const LevelTable *table = current_.load( std::memory_order_acquire );
+        return level <= threshold( table, source ) ? table->sample( level ) : Admit::FILTERED;
+      };
+
+      /**
+       * \brief level in effect for a source that caches its level
+       */
+      template<typename Source>
+      Severity threshold( const Source &source ) const
+      {
+        return threshold( current_.load( std::memory_order_acquire ), source );
+      };
+
+      void setRoot( Severity level );
+      void set( const std::string &module, Severity level );
+      bool clear( const std::string &module );
+
+      /**
+       * \brief replaces every level and sampling rate in one step
+       */
+      void replace( const LevelTable &table );
+
+    private:
+      std::mutex mutex_;
+      std::atomic<const LevelTable *> current_;
+
+      template<typename Source>
+      static Severity threshold( const LevelTable *table, const Source &source )
+      {
+        Severity threshold;
+        if( !source.cachedLevel( table->version, threshold )) {
+          threshold = table->threshold( source.module().data(), source.module().size());
+          source.cacheLevel( table->version, threshold );
+        }
+        return threshold;
+      };
+      std::vector<std::unique_ptr<LevelTable> > tables_;
+
+      void publish( LevelTable *table );
+
+      ModuleLevels( const ModuleLevels & );
+      ModuleLevels &operator=( const ModuleLevels & );
+  };
+}
@@ -0,0 +1,504 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <lumberjack_record.hpp>
+
+namespace lumberjack {
+
+  namespace {
+    /**
+     * \brief builds the lookup table for the reflected CRC-32C polynomial
+     */
+    struct Crc32cTable {
+      uint32_t table[256];
+
+      Crc32cTable() {
+        for( uint32_t i = 0; i < 256; i++ ) {
+          uint32_t crc = i;
+          for( int j = 0; j < 8; j++ ) {
+            crc = ( crc >> 1 ) ^ ( 0x82f63b78 & ( 0 - ( crc & 1 )));
+          }
+          table[i] = crc;
+        }
+      }
+    };
+
+    const Crc32cTable crcTable;
+
+    bool getString( const uint8_t *&ptr, const uint8_t *end, std::string &value )
+    {
+      uint64_t length = 0;
+      if( !getVarint( ptr, end, length )) {
+        return false;
+      }
+      if( length > static_cast<uint64_t>( end - ptr )) {
+        return false;
+      }
+      value.assign( reinterpret_cast<const char *>( ptr ), length );
+      ptr += length;
+      return true;
+    }
+
+    template<typename T>
+    uint8_t *putFixed( uint8_t *out, T value )
+    {
+      memcpy( out, &value, sizeof(T));
+      return out + sizeof(T);
+    }
+
+    std::string base64( const std::string &data )
+    {
+      static const char *ALPHABET =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+      std::string out;
+      out.reserve(( data.size() + 2 ) / 3 * 4 );
+      for( size_t i = 0; i < data.size(); i += 3 ) {
+        uint32_t bits = static_cast<uint8_t>( data[i] ) << 16;
+        if( i + 1 < data.size()) {
+          bits |= static_cast<uint8_t>( data[i + 1] ) << 8;
+        }
+        if( i + 2 < data.size()) {
+          bits |= static_cast<uint8_t>( data[i + 2] );
+        }
+        out.push_back( ALPHABET[( bits >> 18 ) & 0x3f] );
+        out.push_back( ALPHABET[( bits >> 12 ) & 0x3f] );
+        out.push_back( i + 1 < data.size() ? ALPHABET[( bits >> 6 ) & 0x3f] : '=' );
+        out.push_back( i + 2 < data.size() ? ALPHABET[bits & 0x3f] : '=' );
+      }
+      return out;
+    }
+
+    uint8_t *putBytes( uint8_t *out, const char *data, size_t size )
+    {
+      out = putVarint( out, size );
+      if( size > 0 ) {
+        memcpy( out, data, size );
+      }
+      return out + size;
+    }
+
+    size_t fieldSize( FieldType type, size_t keySize, size_t textSize )
+    {
+      size_t size = 1 + varintSize( keySize ) + keySize;
+      switch( type ) {
+        case FieldType::BOOL:
+          return size + 1;
+        case FieldType::STRING:
+          return size + varintSize( textSize ) + textSize;
+        default:
+          return size + 8;
+      }
+    }
+
+    uint8_t *putField( uint8_t *out
+        , FieldType type
+        , const char *key
+        , size_t keySize
+        , int64_t integer
+        , double real
+        , const char *text
+        , size_t textSize
+        )
+    {
+      *out++ = static_cast<uint8_t>( type );
+      out = putBytes( out, key, keySize );
+      switch( type ) {
+        case FieldType::BOOL:
+          *out++ = integer != 0 ? 1 : 0;
+          return out;
+        case FieldType::STRING:
+          return putBytes( out, text, textSize );
+        case FieldType::DOUBLE:
+          return putFixed( out, real );
+        default:
+          return putFixed( out, integer );
+      }
+    }
+
+    /**
+     * \brief size of everything up to and including the tags
+     */
+    size_t baseSize( const RecordRef &record )
+    {
+      size_t size = RECORD_HEADER_BYTES + (( record.flags & RECORD_SITE ) ? 4 : 0 )
+        + varintSize( record.moduleSize ) + record.moduleSize
+        + varintSize( record.messageSize ) + record.messageSize
+        + varintSize( record.tagCount );
+      for( size_t i = 0; i < record.tagCount; i++ ) {
+        size += varintSize( record.tags[i].size()) + record.tags[i].size();
+      }
+      return size;
+    }
+
+    /**
+     * \brief encodes everything up to and including the tags
+     */
+    uint8_t *encodeBase( const RecordRef &record, uint8_t *out )
+    {
+      out[0] = RECORD_VERSION;
+      out[RECORD_LEVEL_OFFSET] = static_cast<uint8_t>( record.level );
+      out[RECORD_TYPE_OFFSET] = static_cast<uint8_t>( record.type );
+      out[RECORD_FLAGS_OFFSET] = record.flags;
+      out = putFixed( out + RECORD_SEQ_OFFSET, record.seq );
+      out = putFixed( out, record.timestamp );
+      out = putFixed( out, record.pid );
+      out = putFixed( out, record.tid );
+      if( record.flags & RECORD_SITE ) {
+        out = putFixed( out, record.site );
+      }
+
+      out = putBytes( out, record.module, record.moduleSize );
+      out = putBytes( out, record.message, record.messageSize );
+      out = putVarint( out, record.tagCount );
+      for( size_t i = 0; i < record.tagCount; i++ ) {
+        out = putBytes( out, record.tags[i].data(), record.tags[i].size());
+      }
+      return out;
+    }
+
+    bool getField( const uint8_t *&ptr, const uint8_t *end, FieldValue &field )
+    {
+      if( ptr >= end || *ptr > static_cast<uint8_t>( FieldType::TIMESTAMP )) {
+        return false;
+      }
+      field.type = static_cast<FieldType>( *ptr++ );
+      if( !getString( ptr, end, field.key )) {
+        return false;
+      }
+      switch( field.type ) {
+        case FieldType::BOOL:
+          if( ptr >= end ) {
+            return false;
+          }
+          field.integer = *ptr++ != 0;
+          return true;
+        case FieldType::STRING:
+          return getString( ptr, end, field.text );
+        case FieldType::DOUBLE:
+          return getFixed( ptr, end, field.real );
+        default:
+          return getFixed( ptr, end, field.integer );
+      }
+    }
+  }
+
+  uint32_t crc32c( const void *data, size_t size, uint32_t crc )
+  {
+    const uint8_t *ptr = static_cast<const uint8_t *>( data );
+    crc = ~crc;
+    for( size_t i = 0; i < size; i++ ) {
+      crc = crcTable.table[( crc ^ ptr[i] ) & 0xff ] ^ ( crc >> 8 );
+    }
+    return ~crc;
+  }
+
+  void encodeRecord( const Record &record, std::string &out )
+  {
+    RecordRef ref;
+    ref.seq = record.seq;
+    ref.timestamp = record.timestamp;
+    ref.level = record.level;
+    ref.type = record.type;
+    ref.flags = record.flags;
+    ref.pid = record.pid;
+    ref.tid = record.tid;
+    ref.site = record.site;
+    ref.module = record.module.data();
+    ref.moduleSize = record.module.size();
+    ref.message = record.message.data();
+    ref.messageSize = record.message.size();
+    ref.tags = record.tags.empty() ? NULL : &record.tags[0];
+    ref.tagCount = record.tags.size();
+
+    //Decoded fields own their strings, so they are encoded from here
+    size_t size = baseSize( ref ) + varintSize( record.fields.size());
+    for( size_t i = 0; i < record.fields.size(); i++ ) {
+      const FieldValue &field = record.fields[i];
+      size += fieldSize( field.type, field.key.size(), field.text.size());
+    }
+
+    uint32_t length = static_cast<uint32_t>( size );
+    size_t start = out.size();
+    out.resize( start + sizeof( length ) + length );
+    memcpy( &out[start], &length, sizeof( length ));
+
+    uint8_t *ptr = encodeBase( ref, reinterpret_cast<uint8_t *>( &out[start + sizeof( length )] ));
+    ptr = putVarint( ptr, record.fields.size());
+    for( size_t i = 0; i < record.fields.size(); i++ ) {
+      const FieldValue &field = record.fields[i];
+      ptr = putField( ptr, field.type, field.key.data(), field.key.size()
+          , field.integer, field.real, field.text.data(), field.text.size());
+    }
+  }
+
+  size_t encodedSize( const RecordRef &record )
+  {
+    size_t size = baseSize( record ) + varintSize( record.fieldCount );
+    for( size_t i = 0; i < record.fieldCount; i++ ) {
+      const Field &field = record.fields[i];
+      size += fieldSize( field.type(), field.keySize(), field.textSize());
+    }
+    return size;
+  }
+
+  uint8_t *encodeRecord( const RecordRef &record, uint8_t *out )
+  {
+    out = encodeBase( record, out );
+    out = putVarint( out, record.fieldCount );
+    for( size_t i = 0; i < record.fieldCount; i++ ) {
+      const Field &field = record.fields[i];
+      out = putField( out, field.type(), field.key(), field.keySize()
+          , field.integer(), field.real(), field.text(), field.textSize());
+    }
+    return out;
+  }
+
+  bool decodeRecord( const uint8_t *data, size_t size, Record &record )
+  {
+    const uint8_t *ptr = data;
+    const uint8_t *end = data + size;
+
+    if( size < RECORD_SEQ_OFFSET || recordVersion( data ) != RECORD_VERSION ) {
+      return false;
+    }
+    if( recordLevel( data ) > ALL ) {
+      return false;
+    }
+    record.level = static_cast<Severity>( recordLevel( data ));
+    record.type = static_cast<PayloadType>( recordType( data ));
+    record.flags = recordFlags( data );
+    record.site = 0;
+    record.file.clear();
+    record.line = 0;
+    ptr += RECORD_SEQ_OFFSET;
+
+    if( !getFixed( ptr, end, record.seq )
+        || !getFixed( ptr, end, record.timestamp )
+        || !getFixed( ptr, end, record.pid )
+        || !getFixed( ptr, end, record.tid )
+        || (( record.flags & RECORD_SITE ) && !getFixed( ptr, end, record.site ))
+        || !getString( ptr, end, record.module )
+        || !getString( ptr, end, record.message )) {
+      return false;
+    }
+
+    uint64_t count = 0;
+    if( !getVarint( ptr, end, count ) || count > static_cast<uint64_t>( end - ptr )) {
+      return false;
+    }
+    record.tags.resize( count );
+    for( uint64_t i = 0; i < count; i++ ) {
+      if( !getString( ptr, end, record.tags[i] )) {
+        return false;
+      }
+    }
+
+    //Older records stop after the tags
+    record.fields.clear();
+    if( ptr == end ) {
+      return true;
+    }
+    if( !getVarint( ptr, end, count ) || count > static_cast<uint64_t>( end - ptr )) {
+      return false;
+    }
+    record.fields.resize( count );
+    for( uint64_t i = 0; i < count; i++ ) {
+      if( !getField( ptr, end, record.fields[i] )) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  bool locateMessage( const uint8_t *data
+      , size_t size
+      , size_t &start
+      , size_t &offset
+      , size_t &length
+      )
+  {
+    size_t header = RECORD_HEADER_BYTES
+      + (( size > RECORD_FLAGS_OFFSET && ( recordFlags( data ) & RECORD_SITE )) ? 4 : 0 );
+    const uint8_t *ptr = data + header;
+    const uint8_t *end = data + size;
+    uint64_t value = 0;
+
+    //Skip the module
+    if( size < header || !getVarint( ptr, end, value )
+        || value > static_cast<uint64_t>( end - ptr )) {
+      return false;
+    }
+    ptr += value;
+
+    start = ptr - data;
+    if( !getVarint( ptr, end, value ) || value > static_cast<uint64_t>( end - ptr )) {
+      return false;
+    }
+    offset = ptr - data;
+    length = static_cast<size_t>( value );
+    return true;
+  }
+
+  bool locateStrings( const uint8_t *data, size_t size, BodyStrings &strings )
+  {
+    if( size < RECORD_HEADER_BYTES ) {
+      return false;
+    }
+    const uint8_t *ptr = data + RECORD_HEADER_BYTES;
+    const uint8_t *end = data + size;
+    uint64_t value = 0;
+
+    strings.site = 0;
+    if(( recordFlags( data ) & RECORD_SITE ) && !getFixed( ptr, end, strings.site )) {
+      return false;
+    }
+    if( !getVarint( ptr, end, value ) || value > static_cast<uint64_t>( end - ptr )) {
+      return false;
+    }
+    strings.module = ptr;
+    strings.moduleSize = static_cast<size_t>( value );
+    ptr += value;
+
+    if( !getVarint( ptr, end, value ) || value > static_cast<uint64_t>( end - ptr )) {
+      return false;
+    }
+    strings.message = ptr;
+    strings.messageSize = static_cast<size_t>( value );
+    ptr += value;
+
+    if( !getVarint( ptr, end, strings.tagCount )) {
+      return false;
+    }
+    strings.tags = ptr;
+    strings.end = end;
+    return true;
+  }
+
+  bool rewriteMessage( const uint8_t *data
+      , size_t size
+      , const void *message
+      , size_t messageSize
+      , uint8_t flags
+      , std::string &out
+      )
+  {
+    size_t start = 0;
+    size_t offset = 0;
+    size_t length = 0;
+    if( !locateMessage( data, size, start, offset, length )) {
+      return false;
+    }
+
+    out.assign( reinterpret_cast<const char *>( data ), start );
+    out[RECORD_FLAGS_OFFSET] = static_cast<char>( out[RECORD_FLAGS_OFFSET] | flags );
+    putVarint( out, messageSize );
+    out.append( static_cast<const char *>( message ), messageSize );
+    out.append( reinterpret_cast<const char *>( data ) + offset + length
+        , size - offset - length );
+    return true;
+  }
+
+  bool decodeSiteDefinition( const uint8_t *data, size_t size, SiteInfo &site )
+  {
+    Record record;
+    if( !isSiteDefinition( data, size ) || !decodeRecord( data, size, record )) {
+      return false;
+    }
+
+    site.id = record.site;
+    site.level = record.level;
+    site.module.swap( record.module );
+    site.message.swap( record.message );
+    for( size_t i = 0; i < record.fields.size(); i++ ) {
+      if( record.fields[i].key == "file" ) {
+        site.file.swap( record.fields[i].text );
+      }
+      else if( record.fields[i].key == "line" ) {
+        site.line = static_cast<uint32_t>( record.fields[i].integer );
+      }
+    }
+    return true;
+  }
+
+  void applySite( const SiteInfo &site, Record &record )
+  {
+    record.module = site.module;
+    record.message = site.message;
+    record.file = site.file;
+    record.line = site.line;
+  }
+
+  json recordToJson( const Record &record, const std::string &deviceId )
+  {
+    json entry;
+
+    entry["id"] = std::to_string( record.seq );
+    entry["timestamp"] = static_cast<double>( record.timestamp ) / 1e9;
+    entry["pid"] = record.pid;
+    entry["tid"] = record.tid;
+    entry["deviceId"] = deviceId;
+    entry["type"] = "log";
+    entry["level"] = record.level;
+    if( record.type == PayloadType::BINARY ) {
+      entry["encoding"] = "base64";
+      entry["message"] = base64( record.message );
+    }
+    else {
+      entry["message"] = record.message;
+    }
+    if( !record.module.empty()) {
+      entry["module"] = record.module;
+    }
+    entry["tags"] = record.tags;
+    if( record.flags & RECORD_REPLAYED ) {
+      entry["replayed"] = true;
+    }
+    if( record.site != 0 ) {
+      entry["site"] = record.site;
+      entry["file"] = record.file;
+      entry["line"] = record.line;
+    }
+
+    if( !record.fields.empty()) {
+      json fields = json::object();
+      for( size_t i = 0; i < record.fields.size(); i++ ) {
+        const FieldValue &field = record.fields[i];
+        switch( field.type ) {
+          case FieldType::INT64:
+            fields[field.key] = field.integer;
+            break;
+          case FieldType::DOUBLE:
+            fields[field.key] = field.real;
+            break;
+          case FieldType::BOOL:
+            fields[field.key] = field.integer != 0;
+            break;
+          case FieldType::STRING:
+            fields[field.key] = field.text;
+            break;
+          case FieldType::TIMESTAMP:
+            fields[field.key] = static_cast<double>( field.integer ) / 1e9;
+            break;
+        }
+      }
+      entry["fields"] = fields;
+    }
+
+    return entry;
+  }
+}
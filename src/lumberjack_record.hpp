@@ -0,0 +1,446 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ **/
+
+#pragma once
+
+// Binary encoding of a single log entry. This is the format used by the
+// on-disk store and by any transport that moves entries between processes.
+//
+// Each encoded record is framed by a little-endian u32 length followed by:
+//   u8 version, u8 level, u8 payloadType, u8 flags,
+//   u64 seq, i64 timestamp (ns since epoch), u32 pid, u32 tid,
+//   u32 call site id (only with RECORD_SITE),
+//   varint module length + bytes,
+//   varint message length + bytes,
+//   varint tag count, then varint tag length + bytes for each tag,
+//   varint field count, then for each field:
+//     u8 FieldType, varint key length + bytes, and the value as a
+//     little-endian i64 (INT64, TIMESTAMP), an f64 (DOUBLE), a u8 (BOOL) or
+//     varint length + bytes (STRING).
+//
+// Records written before fields existed end after the tags and decode with
+// no fields.
+//
+// For PayloadType::BINARY the message field holds the raw payload bytes. A
+// payload the store moved out of line has RECORD_SPILLED set in the flags and
+// a SpillRef in place of the payload.
+//
+// An entry from a registered call site has RECORD_SITE set and leaves its
+// module and message empty. The site's metadata travels once as a record
+// with RECORD_SITE_DEF also set, which carries the site's module and message
+// and "file" and "line" fields. Stores keep these in their site dictionary
+// instead of the record stream.
+//
+// RECORD_REPLAYED marks an entry that was filtered by its level when it was
+// appended and kept by the flight recorder, then written later as context
+// for an error or on request. Its timestamp is from the original append.
+//
+// RECORD_TEMPLATE marks a string message the store encoded by a mined
+// template, described in lumberjack_template.hpp.
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <lumberjack.hpp>
+
+namespace lumberjack {
+
+  const uint8_t RECORD_VERSION = 1;
+
+  //Flag bits in the record header
+  const uint8_t RECORD_SPILLED = 0x01;
+  const uint8_t RECORD_SITE = 0x02;
+  const uint8_t RECORD_SITE_DEF = 0x04;
+  const uint8_t RECORD_REPLAYED = 0x08;
+  const uint8_t RECORD_TEMPLATE = 0x10;
+
+  //Offsets of the fixed fields at the start of a record body
+  const size_t RECORD_LEVEL_OFFSET = 1;
+  const size_t RECORD_TYPE_OFFSET = 2;
+  const size_t RECORD_FLAGS_OFFSET = 3;
+  const size_t RECORD_SEQ_OFFSET = 4;
+  const size_t RECORD_TIMESTAMP_OFFSET = 12;
+  const size_t RECORD_PID_OFFSET = 20;
+  const size_t RECORD_TID_OFFSET = 24;
+  const size_t RECORD_SITE_OFFSET = 28;   //only with RECORD_SITE
+
+  //Size of the fixed fields, not counting the call site id
+  const size_t RECORD_HEADER_BYTES = 28;
+
+  /**
+   * \brief accessors for the fixed fields of an encoded record body
+   *
+   * The caller checks that the body is long enough to hold the field:
+   * RECORD_HEADER_BYTES for all but the site id, which also needs
+   * RECORD_SITE set and four more bytes.
+   */
+  inline uint8_t recordVersion( const uint8_t *body ) { return body[0]; }
+  inline uint8_t recordLevel( const uint8_t *body ) { return body[RECORD_LEVEL_OFFSET]; }
+  inline uint8_t recordType( const uint8_t *body ) { return body[RECORD_TYPE_OFFSET]; }
+  inline uint8_t recordFlags( const uint8_t *body ) { return body[RECORD_FLAGS_OFFSET]; }
+
+  inline uint64_t recordSeq( const uint8_t *body )
+  {
+    uint64_t seq;
+    memcpy( &seq, body + RECORD_SEQ_OFFSET, sizeof( seq ));
+    return seq;
+  }
+
+  inline int64_t recordTimestamp( const uint8_t *body )
+  {
+    int64_t timestamp;
+    memcpy( &timestamp, body + RECORD_TIMESTAMP_OFFSET, sizeof( timestamp ));
+    return timestamp;
+  }
+
+  inline uint32_t recordPid( const uint8_t *body )
+  {
+    uint32_t pid;
+    memcpy( &pid, body + RECORD_PID_OFFSET, sizeof( pid ));
+    return pid;
+  }
+
+  inline uint32_t recordSite( const uint8_t *body )
+  {
+    uint32_t site;
+    memcpy( &site, body + RECORD_SITE_OFFSET, sizeof( site ));
+    return site;
+  }
+
+  inline void setRecordSeq( uint8_t *body, uint64_t seq )
+  {
+    memcpy( body + RECORD_SEQ_OFFSET, &seq, sizeof( seq ));
+  }
+
+  inline void setRecordSite( uint8_t *body, uint32_t site )
+  {
+    memcpy( body + RECORD_SITE_OFFSET, &site, sizeof( site ));
+  }
+
+  inline void addRecordFlags( uint8_t *body, uint8_t flags )
+  {
+    body[RECORD_FLAGS_OFFSET] |= flags;
+  }
+
+  /**
+   * \brief location of a binary payload stored outside the record stream
+   */
+  struct SpillRef {
+    uint64_t file;
+    uint64_t offset;
+    uint32_t length;
+    uint32_t crc;
+  };
+
+  static_assert( sizeof( SpillRef ) == 24, "SpillRef must be 24 bytes" );
+
+  /**
+   * \brief decoded structured field
+   */
+  struct FieldValue {
+    std::string key;
+    FieldType type = FieldType::INT64;
+    int64_t integer = 0;
+    double real = 0;
+    std::string text;
+  };
+
+  /**
+   * \brief metadata of a call site as kept in a site dictionary
+   */
+  struct SiteInfo {
+    uint32_t id = 0;
+    Severity level = INFO;
+    std::string module;
+    std::string message;
+    std::string file;
+    uint32_t line = 0;
+  };
+
+  /**
+   * \brief decoded representation of a single log entry
+   */
+  struct Record {
+    uint64_t seq = 0;
+    int64_t timestamp = 0;
+    Severity level = INFO;
+    PayloadType type = PayloadType::STRING;
+    uint8_t flags = 0;
+    uint32_t pid = 0;
+    uint32_t tid = 0;
+    uint32_t site = 0;
+    std::string module;
+    std::string message;
+    std::vector<std::string> tags;
+    std::vector<FieldValue> fields;
+
+    //Filled in from the site dictionary when site is set
+    std::string file;
+    uint32_t line = 0;
+  };
+
+  /**
+   * \brief borrowed view of an entry, encoded without copying its strings
+   *
+   * Nothing is owned; the referenced bytes must outlive the encode call.
+   */
+  struct RecordRef {
+    uint64_t seq = 0;
+    int64_t timestamp = 0;
+    Severity level = INFO;
+    PayloadType type = PayloadType::STRING;
+    uint8_t flags = 0;
+    uint32_t pid = 0;
+    uint32_t tid = 0;
+    uint32_t site = 0;
+    const char *module = NULL;
+    size_t moduleSize = 0;
+    const char *message = NULL;
+    size_t messageSize = 0;
+    const std::string *tags = NULL;
+    size_t tagCount = 0;
+    const Field *fields = NULL;
+    size_t fieldCount = 0;
+  };
+
+  /**
+   * \brief appends an unsigned LEB128 varint to a buffer
+   */
+  inline void putVarint( std::string &out, uint64_t value )
+  {
+    while( value >= 0x80 ) {
+      out.push_back( static_cast<char>( (value & 0x7f) | 0x80 ));
+      value >>= 7;
+    }
+    out.push_back( static_cast<char>( value ));
+  }
+
+  /**
+   * \brief writes an unsigned LEB128 varint to raw memory
+   * \return position just past the varint
+   */
+  inline uint8_t *putVarint( uint8_t *out, uint64_t value )
+  {
+    while( value >= 0x80 ) {
+      *out++ = static_cast<uint8_t>(( value & 0x7f ) | 0x80 );
+      value >>= 7;
+    }
+    *out++ = static_cast<uint8_t>( value );
+    return out;
+  }
+
+  /**
+   * \brief number of bytes putVarint writes for value
+   */
+  inline size_t varintSize( uint64_t value )
+  {
+    size_t size = 1;
+    while( value >= 0x80 ) {
+      value >>= 7;
+      size++;
+    }
+    return size;
+  }
+
+  /**
+   * \brief reads an unsigned LEB128 varint
+   * \param [in,out] ptr read position, advanced past the varint
+   * \param [in] end end of the readable region
+   * \param [out] value decoded value
+   * \return true on success, false if the buffer is truncated
+   */
+  inline bool getVarint( const uint8_t *&ptr, const uint8_t *end, uint64_t &value )
+  {
+    value = 0;
+    for( int shift = 0; shift < 64 && ptr < end; shift += 7 ) {
+      uint8_t byte = *ptr++;
+      value |= static_cast<uint64_t>( byte & 0x7f ) << shift;
+      if(( byte & 0x80 ) == 0 ) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * \brief appends a fixed width little-endian integer to a buffer
+   */
+  template<typename T>
+  inline void putFixed( std::string &out, T value )
+  {
+    char bytes[sizeof(T)];
+    memcpy( bytes, &value, sizeof(T));
+    out.append( bytes, sizeof(T));
+  }
+
+  /**
+   * \brief reads a fixed width little-endian integer
+   */
+  template<typename T>
+  inline bool getFixed( const uint8_t *&ptr, const uint8_t *end, T &value )
+  {
+    if( static_cast<size_t>( end - ptr ) < sizeof(T)) {
+      return false;
+    }
+    memcpy( &value, ptr, sizeof(T));
+    ptr += sizeof(T);
+    return true;
+  }
+
+  /**
+   * \brief computes a CRC-32C checksum
+   * \param [in] data bytes to checksum
+   * \param [in] size number of bytes
+   * \param [in] crc running checksum from a previous call
+   * \return updated checksum
+   */
+  uint32_t crc32c( const void *data, size_t size, uint32_t crc = 0 );
+
+  /**
+   * \brief appends a length-framed encoded record to a buffer
+   * \param [in] record entry to encode
+   * \param [in,out] out buffer to append to
+   */
+  void encodeRecord( const Record &record, std::string &out );
+
+  /**
+   * \brief size of the record body encodeRecord writes for a view
+   */
+  size_t encodedSize( const RecordRef &record );
+
+  /**
+   * \brief encodes the body of a record (without its length frame)
+   * \param [in] record entry to encode
+   * \param [out] out destination with at least encodedSize bytes
+   * \return position just past the body
+   *
+   * Does not allocate, so it can encode straight into arena memory.
+   */
+  uint8_t *encodeRecord( const RecordRef &record, uint8_t *out );
+
+  /**
+   * \brief decodes the body of a record (without its length frame)
+   * \param [in] data start of the record body
+   * \param [in] size number of bytes in the body
+   * \param [out] record decoded entry
+   * \return true on success, false if the data is malformed
+   */
+  bool decodeRecord( const uint8_t *data, size_t size, Record &record );
+
+  /**
+   * \brief checks whether an encoded body is a call site definition
+   */
+  inline bool isSiteDefinition( const uint8_t *data, size_t size )
+  {
+    return size > RECORD_FLAGS_OFFSET && ( recordFlags( data ) & RECORD_SITE_DEF ) != 0;
+  }
+
+  /**
+   * \brief decodes a call site definition record
+   * \return false if the body is not a valid definition
+   */
+  bool decodeSiteDefinition( const uint8_t *data, size_t size, SiteInfo &site );
+
+  /**
+   * \brief copies call site metadata into a decoded record
+   */
+  void applySite( const SiteInfo &site, Record &record );
+
+  /**
+   * \brief strings of an encoded record body, borrowed from the body
+   */
+  struct BodyStrings {
+    uint32_t site = 0;
+    const uint8_t *module = NULL;
+    size_t moduleSize = 0;
+    const uint8_t *message = NULL;
+    size_t messageSize = 0;
+    uint64_t tagCount = 0;
+    const uint8_t *tags = NULL;   //first tag's length prefix
+    const uint8_t *end = NULL;    //end of the body
+  };
+
+  /**
+   * \brief finds the module, message and tags of an encoded record body
+   * without copying them
+   * \return false if the body is malformed
+   */
+  bool locateStrings( const uint8_t *data, size_t size, BodyStrings &strings );
+
+  /**
+   * \brief calls f(data, size) for every tag located by locateStrings
+   * \return false if the tags are malformed
+   */
+  template<typename F>
+  bool forEachTag( const BodyStrings &strings, F f )
+  {
+    const uint8_t *ptr = strings.tags;
+    for( uint64_t i = 0; i < strings.tagCount; i++ ) {
+      uint64_t length = 0;
+      if( !getVarint( ptr, strings.end, length )
+          || length > static_cast<uint64_t>( strings.end - ptr )) {
+        return false;
+      }
+      f( ptr, static_cast<size_t>( length ));
+      ptr += length;
+    }
+    return true;
+  }
+
+  /**
+   * \brief finds the message field of an encoded record body
+   * \param [in] data start of the record body
+   * \param [in] size number of bytes in the body
+   * \param [out] start offset of the field's length prefix
+   * \param [out] offset offset of the message bytes
+   * \param [out] length number of message bytes
+   * \return false if the body is malformed
+   */
+  bool locateMessage( const uint8_t *data
+      , size_t size
+      , size_t &start
+      , size_t &offset
+      , size_t &length
+      );
+
+  /**
+   * \brief copies a record body with its message field replaced
+   * \param [in] data start of the record body
+   * \param [in] size number of bytes in the body
+   * \param [in] message replacement message bytes
+   * \param [in] messageSize number of replacement bytes
+   * \param [in] flags flag bits to set in the copy
+   * \param [out] out rewritten body, without a length frame
+   * \return false if the body is malformed
+   */
+  bool rewriteMessage( const uint8_t *data
+      , size_t size
+      , const void *message
+      , size_t messageSize
+      , uint8_t flags
+      , std::string &out
+      );
+
+  /**
+   * \brief renders a record in the JSON shape used by getLogStringById
+   * \param [in] record entry to render
+   * \param [in] deviceId device identifier of the host that created it
+   * \return json object for the entry
+   */
+  json recordToJson( const Record &record, const std::string &deviceId );
+}
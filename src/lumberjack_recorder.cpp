@@ -0,0 +1,209 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstring>
+
+#include <lumberjack_recorder.hpp>
+
+namespace lumberjack {
+
+  namespace {
+    std::atomic<uint64_t> nextId{ 1 };
+
+    //Copies retried before a busy ring is skipped
+    const int COPY_ATTEMPTS = 8;
+  }
+
+  thread_local FlightRecorder::Slot FlightRecorder::slots_[FlightRecorder::SLOTS];
+  thread_local size_t FlightRecorder::nextSlot_ = 0;
+
+  FlightRing::FlightRing( size_t bytes )
+    : buffer_( bytes )
+    , mask_( bytes - 1 )
+  {
+  }
+
+  void FlightRing::record( const RecordRef &record )
+  {
+    const uint64_t capacity = buffer_.size();
+    size_t size = encodedSize( record );
+    uint64_t need = frameBytes( size );
+    if( need > capacity / 4 ) {
+      return;
+    }
+
+    uint64_t version = version_.load( std::memory_order_relaxed );
+    version_.store( version + 1, std::memory_order_relaxed );
+    std::atomic_thread_fence( std::memory_order_release );
+
+    uint64_t head = head_.load( std::memory_order_relaxed );
+    uint64_t start = head;
+    if(( head & mask_ ) + need > capacity ) {
+      start = ( head | mask_ ) + 1;
+    }
+    uint64_t end = start + need;
+
+    //Drop the oldest frames the new one overlaps
+    uint64_t tail = tail_.load( std::memory_order_relaxed );
+    while( tail + capacity < end ) {
+      uint32_t length;
+      memcpy( &length, &buffer_[tail & mask_], sizeof( length ));
+      tail = length == WRAP_MARKER ? ( tail | mask_ ) + 1 : tail + frameBytes( length );
+    }
+    tail_.store( tail, std::memory_order_relaxed );
+
+    if( start != head ) {
+      uint32_t marker = WRAP_MARKER;
+      memcpy( &buffer_[head & mask_], &marker, sizeof( marker ));
+    }
+    uint8_t *frame = &buffer_[start & mask_];
+    uint32_t length = static_cast<uint32_t>( size );
+    memcpy( frame, &length, sizeof( length ));
+    encodeRecord( record, frame + sizeof( length ));
+    head_.store( end, std::memory_order_relaxed );
+
+    version_.store( version + 2, std::memory_order_release );
+  }
+
+  bool FlightRing::copy( std::string &out ) const
+  {
+    const size_t start = out.size();
+    for( int attempt = 0; attempt < COPY_ATTEMPTS; attempt++ ) {
+      uint64_t version = version_.load( std::memory_order_acquire );
+      if( version & 1 ) {
+        continue;
+      }
+
+      uint64_t head = head_.load( std::memory_order_relaxed );
+      uint64_t position = tail_.load( std::memory_order_relaxed );
+      bool torn = head - position > buffer_.size();
+      while( !torn && position < head ) {
+        uint32_t length;
+        memcpy( &length, &buffer_[position & mask_], sizeof( length ));
+        if( length == WRAP_MARKER ) {
+          position = ( position | mask_ ) + 1;
+          continue;
+        }
+        uint64_t offset = position & mask_;
+        if( offset + sizeof( length ) + length > buffer_.size()) {
+          torn = true;
+          break;
+        }
+        out.append( reinterpret_cast<const char *>( &buffer_[offset] ), sizeof( length ) + length );
+        position += frameBytes( length );
+      }
+
+      std::atomic_thread_fence( std::memory_order_acquire );
+      if( !torn && version_.load( std::memory_order_relaxed ) == version ) {
+        return true;
+      }
+      out.resize( start );
+    }
+    return false;
+  }
+
+  void FlightRing::clear()
+  {
+    uint64_t version = version_.load( std::memory_order_relaxed );
+    version_.store( version + 1, std::memory_order_relaxed );
+    std::atomic_thread_fence( std::memory_order_release );
+    tail_.store( head_.load( std::memory_order_relaxed ), std::memory_order_relaxed );
+    version_.store( version + 2, std::memory_order_release );
+  }
+
+  FlightRecorder::FlightRecorder()
+    : id_( nextId.fetch_add( 1 ))
+  {
+  }
+
+  FlightRecorder::~FlightRecorder()
+  {
+    for( size_t i = 0; i < rings_.size(); i++ ) {
+      delete rings_[i].second;
+    }
+  }
+
+  void FlightRecorder::enable( size_t bytes, Severity level )
+  {
+    //Rings are masked, so round up to a power of two
+    size_t rounded = 64;
+    while( rounded < bytes ) {
+      rounded <<= 1;
+    }
+    bytes_.store( rounded, std::memory_order_relaxed );
+    level_.store( static_cast<int>( level ), std::memory_order_relaxed );
+  }
+
+  void FlightRecorder::disable()
+  {
+    level_.store( -1, std::memory_order_relaxed );
+  }
+
+  FlightRing *FlightRecorder::find()
+  {
+    for( size_t i = 0; i < SLOTS; i++ ) {
+      if( slots_[i].owner == id_ ) {
+        return slots_[i].ring;
+      }
+    }
+
+    std::lock_guard<std::mutex> lock( mutex_ );
+    std::thread::id self = std::this_thread::get_id();
+    for( size_t i = 0; i < rings_.size(); i++ ) {
+      if( rings_[i].first == self ) {
+        return rings_[i].second;
+      }
+    }
+    return NULL;
+  }
+
+  FlightRing &FlightRecorder::attach()
+  {
+    FlightRing *ring = NULL;
+    {
+      std::lock_guard<std::mutex> lock( mutex_ );
+      std::thread::id self = std::this_thread::get_id();
+      for( size_t i = 0; i < rings_.size() && ring == NULL; i++ ) {
+        if( rings_[i].first == self ) {
+          ring = rings_[i].second;
+        }
+      }
+      if( ring == NULL ) {
+        ring = new FlightRing( bytes_.load( std::memory_order_relaxed ));
+        rings_.push_back( std::make_pair( self, ring ));
+      }
+    }
+    used_.store( true, std::memory_order_relaxed );
+
+    Slot &slot = slots_[nextSlot_];
+    nextSlot_ = ( nextSlot_ + 1 ) % SLOTS;
+    slot.owner = id_;
+    slot.ring = ring;
+    return *ring;
+  }
+
+  size_t FlightRecorder::copyAll( std::string &out ) const
+  {
+    std::lock_guard<std::mutex> lock( mutex_ );
+    size_t copied = 0;
+    for( size_t i = 0; i < rings_.size(); i++ ) {
+      if( rings_[i].second->copy( out )) {
+        copied++;
+      }
+    }
+    return copied;
+  }
+}
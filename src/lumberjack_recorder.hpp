@@ -0,0 +1,183 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ **/
+
+#pragma once
+
+// Flight recorder.
+//
+// Entries turned away by their level can still be kept in a small ring per
+// thread, encoded exactly as they would be queued and then left alone. When
+// the thread appends an ERROR or CRITICAL entry, what its ring holds is
+// queued just ahead of it; the logger can also queue every thread's ring on
+// demand. Recording costs one encode into memory only that thread writes.
+//
+// A ring holds 4-byte aligned frames of u32 length + record body. Frames
+// never straddle the end of the buffer; a length of WRAP_MARKER means the
+// next frame starts at offset 0. Other threads read a ring under a sequence
+// lock: its version is odd while the owner changes it, and a copy taken
+// while the version moved is thrown away and retried.
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <lumberjack.hpp>
+#include <lumberjack_record.hpp>
+
+namespace lumberjack {
+
+  /**
+   * \brief one thread's ring of recent filtered entries
+   */
+  class FlightRing {
+    public:
+      /**
+       * \param [in] bytes capacity, a power of two
+       */
+      explicit FlightRing( size_t bytes );
+
+      /**
+       * \brief encodes an entry into the ring, overwriting the oldest
+       *
+       * Owner thread only. Entries larger than a quarter of the ring are
+       * not kept.
+       */
+      void record( const RecordRef &record );
+
+      /**
+       * \brief appends the ring's frames, oldest first, to out
+       * \return false if the owner kept changing the ring
+       *
+       * Frames are copied as u32 length + body. Any thread may copy.
+       */
+      bool copy( std::string &out ) const;
+
+      /**
+       * \brief forgets every entry; owner thread only
+       */
+      void clear();
+
+      bool empty() const
+      {
+        return head_.load( std::memory_order_relaxed ) == tail_.load( std::memory_order_relaxed );
+      };
+
+    private:
+      static const uint32_t WRAP_MARKER = 0xffffffff;
+
+      std::vector<uint8_t> buffer_;
+      uint64_t mask_;
+      std::atomic<uint64_t> version_{ 0 };
+      std::atomic<uint64_t> head_{ 0 };
+      std::atomic<uint64_t> tail_{ 0 };
+
+      static size_t frameBytes( size_t size ) { return ( 4 + size + 3 ) & ~static_cast<size_t>( 3 ); };
+
+      FlightRing( const FlightRing & );
+      FlightRing &operator=( const FlightRing & );
+  };
+
+  /**
+   * \brief the flight rings of one logger
+   */
+  class FlightRecorder {
+    public:
+      //Default ring size per thread
+      static const size_t DEFAULT_BYTES = 64 * 1024;
+
+      FlightRecorder();
+      ~FlightRecorder();
+
+      /**
+       * \brief starts recording filtered entries at level or more severe
+       * \param [in] bytes ring size for threads that start recording later
+       * \param [in] level least severe level kept
+       */
+      void enable( size_t bytes, Severity level );
+
+      void disable();
+
+      /**
+       * \brief true if filtered entries at level are recorded
+       */
+      bool keeps( Severity level ) const
+      {
+        return static_cast<int>( level ) <= level_.load( std::memory_order_relaxed );
+      };
+
+      /**
+       * \brief true if any thread may have something recorded
+       */
+      bool active() const
+      {
+        return used_.load( std::memory_order_relaxed );
+      };
+
+      /**
+       * \brief ring of the calling thread, created on first use
+       */
+      FlightRing &local()
+      {
+        for( size_t i = 0; i < SLOTS; i++ ) {
+          if( slots_[i].owner == id_ ) {
+            return *slots_[i].ring;
+          }
+        }
+        return attach();
+      };
+
+      /**
+       * \brief ring of the calling thread, or NULL if it never recorded
+       */
+      FlightRing *find();
+
+      /**
+       * \brief copies every thread's ring, see FlightRing::copy
+       * \return number of rings copied
+       */
+      size_t copyAll( std::string &out ) const;
+
+    private:
+      //Loggers a thread can record for before it has to look up its ring
+      static const size_t SLOTS = 4;
+
+      struct Slot {
+        uint64_t owner;
+        FlightRing *ring;
+      };
+
+      static thread_local Slot slots_[SLOTS];
+      static thread_local size_t nextSlot_;
+
+      uint64_t id_;
+      std::atomic<int> level_{ -1 };
+      std::atomic<size_t> bytes_{ DEFAULT_BYTES };
+      std::atomic<bool> used_{ false };
+      mutable std::mutex mutex_;
+
+      //A thread that reuses an exited thread's id takes over its ring
+      std::vector<std::pair<std::thread::id, FlightRing *> > rings_;
+
+      FlightRing &attach();
+
+      FlightRecorder( const FlightRecorder & );
+      FlightRecorder &operator=( const FlightRecorder & );
+  };
+}
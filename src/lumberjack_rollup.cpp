@@ -0,0 +1,345 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include <lumberjack_rollup.hpp>
+#include <lumberjack_store.hpp>
+
+namespace lumberjack {
+
+  namespace {
+    const char *ROLLUP_SUFFIX = ".ljroll";
+    const uint8_t ROLLUP_VERSION = 1;
+
+    const int64_t NS_PER_MINUTE = 60LL * 1000000000;
+
+    //Names are forgotten when a segment is sealed once there are this many
+    const size_t MAX_NAMES = 65536;
+
+    int64_t floorDiv( int64_t value, int64_t divisor )
+    {
+      int64_t quotient = value / divisor;
+      return ( value % divisor != 0 && value < 0 ) ? quotient - 1 : quotient;
+    }
+
+    uint64_t zigzag( int64_t value )
+    {
+      return ( static_cast<uint64_t>( value ) << 1 ) ^ static_cast<uint64_t>( value >> 63 );
+    }
+
+    int64_t unzigzag( uint64_t value )
+    {
+      return static_cast<int64_t>( value >> 1 ) ^ -static_cast<int64_t>( value & 1 );
+    }
+
+    bool getName( const uint8_t *&ptr, const uint8_t *end, std::string &name )
+    {
+      uint64_t length = 0;
+      if( !getVarint( ptr, end, length ) || length > static_cast<uint64_t>( end - ptr )) {
+        return false;
+      }
+      name.assign( reinterpret_cast<const char *>( ptr ), static_cast<size_t>( length ));
+      ptr += length;
+      return true;
+    }
+
+    /**
+     * \brief one row of a query result while it is being merged
+     */
+    struct RowKey {
+      int64_t bucket;
+      uint8_t level;
+      std::string module;
+      std::string tag;
+
+      bool operator<( const RowKey &other ) const
+      {
+        if( bucket != other.bucket ) {
+          return bucket < other.bucket;
+        }
+        if( level != other.level ) {
+          return level < other.level;
+        }
+        int order = module.compare( other.module );
+        return order != 0 ? order < 0 : tag < other.tag;
+      };
+    };
+
+    /**
+     * \brief adds the counts of one frame that the query asks for
+     * \return false if the frame is malformed
+     */
+    bool mergeFrame( const uint8_t *ptr
+        , const uint8_t *end
+        , const RollupQuery &query
+        , int64_t minutes
+        , std::map<RowKey, uint64_t> &rows
+        )
+    {
+      if( ptr >= end || *ptr++ != ROLLUP_VERSION ) {
+        return false;
+      }
+
+      uint64_t nameCount = 0;
+      if( !getVarint( ptr, end, nameCount ) || nameCount > static_cast<uint64_t>( end - ptr )) {
+        return false;
+      }
+      std::vector<std::string> names( static_cast<size_t>( nameCount ));
+      std::vector<bool> wanted( names.size(), query.module.empty());
+      for( size_t i = 0; i < names.size(); i++ ) {
+        if( !getName( ptr, end, names[i] )) {
+          return false;
+        }
+        if( !query.module.empty()) {
+          const std::string &name = names[i];
+          wanted[i] = name.compare( 0, query.module.size(), query.module ) == 0
+            && ( name.size() == query.module.size() || name[query.module.size()] == '.' );
+        }
+      }
+
+      uint64_t count = 0;
+      if( !getVarint( ptr, end, count )) {
+        return false;
+      }
+      int64_t bucket = 0;
+      RowKey key;
+      for( uint64_t i = 0; i < count; i++ ) {
+        uint64_t delta = 0;
+        uint64_t module = 0;
+        uint64_t tag = 0;
+        uint64_t entries = 0;
+        if( !getVarint( ptr, end, delta ) || ptr >= end ) {
+          return false;
+        }
+        uint8_t level = *ptr++;
+        if( !getVarint( ptr, end, module ) || !getVarint( ptr, end, tag )
+            || !getVarint( ptr, end, entries )
+            || module >= names.size() || tag > names.size()) {
+          return false;
+        }
+        bucket += unzigzag( delta );
+
+        int64_t start = bucket * NS_PER_MINUTE;
+        if( start < query.from || start > query.to || level > query.level
+            || !wanted[module] || ( tag != 0 ) != query.byTag ) {
+          continue;
+        }
+        key.bucket = floorDiv( bucket, minutes ) * minutes * NS_PER_MINUTE;
+        key.level = query.byLevel ? level : static_cast<uint8_t>( ALL );
+        if( query.byModule ) {
+          key.module = names[module];
+        }
+        if( tag != 0 ) {
+          key.tag = names[tag - 1];
+        }
+        rows[key] += entries;
+      }
+      return true;
+    }
+  }
+
+  std::string rollupPath( const std::string &segmentPath )
+  {
+    return siblingPath( segmentPath, ROLLUP_SUFFIX );
+  }
+
+  Status queryRollups( const std::string &path
+      , const RollupQuery &query
+      , std::vector<RollupRow> &rows
+      )
+  {
+    rows.clear();
+    std::vector<SegmentInfo> segments;
+    if( !listSegments( path, segments )) {
+      return ERR;
+    }
+
+    int64_t minutes = std::max<int64_t>( 1
+        , ( static_cast<int64_t>( query.bucketSeconds ) + ROLLUP_BUCKET_SECONDS - 1 ) / ROLLUP_BUCKET_SECONDS );
+    std::map<RowKey, uint64_t> merged;
+    std::string data;
+    for( size_t i = 0; i < segments.size(); i++ ) {
+      //A frame still being appended ends the file early
+      if( readFile( rollupPath( segments[i].path ), data )) {
+        forEachFrame( data, [&]( const uint8_t *body, size_t size ) {
+            return mergeFrame( body, body + size, query, minutes, merged );
+          });
+      }
+    }
+
+    rows.reserve( merged.size());
+    for( std::map<RowKey, uint64_t>::const_iterator it = merged.begin(); it != merged.end(); ++it ) {
+      RollupRow row;
+      row.bucket = it->first.bucket;
+      row.level = static_cast<Severity>( it->first.level );
+      row.module = it->first.module;
+      row.tag = it->first.tag;
+      row.count = it->second;
+      rows.push_back( row );
+    }
+    return OK;
+  }
+
+  /////////////////////////////////////////////
+  // RollupBuilder
+  /////////////////////////////////////////////
+  uint32_t RollupBuilder::intern( const uint8_t *data, size_t size )
+  {
+    scratch_.assign( reinterpret_cast<const char *>( data ), size );
+    std::unordered_map<std::string, uint32_t>::const_iterator it = ids_.find( scratch_ );
+    if( it != ids_.end()) {
+      return it->second;
+    }
+    uint32_t id = static_cast<uint32_t>( names_.size());
+    names_.push_back( scratch_ );
+    ids_[scratch_] = id;
+    return id;
+  }
+
+  void RollupBuilder::defineSite( const SiteInfo &site )
+  {
+    siteModules_[site.id] = intern( reinterpret_cast<const uint8_t *>( site.module.data())
+        , site.module.size());
+  }
+
+  void RollupBuilder::add( const uint8_t *body, size_t size )
+  {
+    if( size < RECORD_HEADER_BYTES || recordVersion( body ) != RECORD_VERSION
+        || recordLevel( body ) > ALL || isSiteDefinition( body, size )) {
+      return;
+    }
+
+    BodyStrings strings;
+    if( !locateStrings( body, size, strings )) {
+      return;
+    }
+
+    Key key;
+    key.bucket = floorDiv( recordTimestamp( body ), NS_PER_MINUTE );
+    key.level = recordLevel( body );
+    key.tag = 0;
+
+    std::map<uint32_t, uint32_t>::const_iterator it = siteModules_.end();
+    if( strings.moduleSize == 0 && strings.site != 0 ) {
+      it = siteModules_.find( strings.site );
+    }
+    key.module = it != siteModules_.end() ? it->second : intern( strings.module, strings.moduleSize );
+    block_[key]++;
+
+    forEachTag( strings, [&]( const uint8_t *tag, size_t length ) {
+        key.tag = intern( tag, length ) + 1;
+        block_[key]++;
+      });
+  }
+
+  void RollupBuilder::addBlock( const std::string &data )
+  {
+    forEachRecord( data, [this]( const uint8_t *body, size_t size ) {
+        add( body, size );
+      });
+  }
+
+  bool RollupBuilder::takeBlock( std::string &frame )
+  {
+    if( block_.empty()) {
+      return false;
+    }
+    encode( block_, frame );
+    for( Counts::const_iterator it = block_.begin(); it != block_.end(); ++it ) {
+      segment_[it->first] += it->second;
+    }
+    block_.clear();
+    return true;
+  }
+
+  void RollupBuilder::encodeSegment( std::string &frame ) const
+  {
+    encode( segment_, frame );
+  }
+
+  void RollupBuilder::reset()
+  {
+    block_.clear();
+    segment_.clear();
+    if( names_.size() < MAX_NAMES ) {
+      return;
+    }
+
+    //Tags can be unbounded, so names are only kept for as long as a segment
+    std::map<uint32_t, std::string> sites;
+    for( std::map<uint32_t, uint32_t>::const_iterator it = siteModules_.begin()
+        ; it != siteModules_.end(); ++it ) {
+      sites[it->first] = names_[it->second];
+    }
+    names_.clear();
+    ids_.clear();
+    siteModules_.clear();
+    for( std::map<uint32_t, std::string>::const_iterator it = sites.begin(); it != sites.end(); ++it ) {
+      siteModules_[it->first] = intern( reinterpret_cast<const uint8_t *>( it->second.data())
+          , it->second.size());
+    }
+  }
+
+  /////////////////////////////////////////////
+  // Encodes counts as a frame with its own name table
+  /////////////////////////////////////////////
+  void RollupBuilder::encode( const Counts &counts, std::string &frame ) const
+  {
+    std::vector<std::pair<Key, uint64_t> > sorted( counts.begin(), counts.end());
+    std::sort( sorted.begin(), sorted.end()
+        , []( const std::pair<Key, uint64_t> &a, const std::pair<Key, uint64_t> &b ) {
+          return a.first < b.first;
+        });
+
+    //Local name indexes, in order of first use
+    std::unordered_map<uint32_t, uint32_t> local;
+    std::vector<uint32_t> used;
+    for( size_t i = 0; i < sorted.size(); i++ ) {
+      const Key &key = sorted[i].first;
+      if( local.insert( std::make_pair( key.module, static_cast<uint32_t>( used.size()))).second ) {
+        used.push_back( key.module );
+      }
+      if( key.tag != 0
+          && local.insert( std::make_pair( key.tag - 1, static_cast<uint32_t>( used.size()))).second ) {
+        used.push_back( key.tag - 1 );
+      }
+    }
+
+    std::string body;
+    body.push_back( static_cast<char>( ROLLUP_VERSION ));
+    putVarint( body, used.size());
+    for( size_t i = 0; i < used.size(); i++ ) {
+      putVarint( body, names_[used[i]].size());
+      body.append( names_[used[i]] );
+    }
+    putVarint( body, sorted.size());
+    int64_t bucket = 0;
+    for( size_t i = 0; i < sorted.size(); i++ ) {
+      const Key &key = sorted[i].first;
+      putVarint( body, zigzag( key.bucket - bucket ));
+      bucket = key.bucket;
+      body.push_back( static_cast<char>( key.level ));
+      putVarint( body, local[key.module] );
+      putVarint( body, key.tag == 0 ? 0 : local[key.tag - 1] + 1 );
+      putVarint( body, sorted[i].second );
+    }
+
+    frame.clear();
+    putFrame( frame, body );
+  }
+}
@@ -0,0 +1,196 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ **/
+
+#pragma once
+
+// Pre-aggregated entry counts.
+//
+// As the store writes each block it counts the block's entries per minute
+// bucket, level and module, and once more per tag. The counts go to a
+// rollup file beside the segment, one frame per block, so the rollups of
+// the current segment are never behind what it holds. When the segment is
+// sealed its frames are condensed into one. Rollups are derived data: the
+// current segment's are rebuilt from its blocks when the store is opened,
+// and the compactor rebuilds any sealed segment's that are missing.
+//
+// A rollup file is a list of frames, each a u32 length, a u32 CRC and:
+//   u8 version,
+//   varint name count, then varint length + bytes for each name,
+//   varint count count, then for each count, in key order:
+//     zigzag varint bucket number delta from the previous count, u8 level,
+//     varint module name index, varint tag name index + 1 (0 for the
+//     count of entries), varint count.
+//
+// Bucket numbers are minutes since the epoch. Module and tag names are
+// interned; each frame carries only the names it uses. Queries merge the
+// frames of every segment, so they cost the same however many entries the
+// counts stand for. A query racing the compactor may miss or double count
+// the segments being rewritten.
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <lumberjack.hpp>
+#include <lumberjack_record.hpp>
+
+namespace lumberjack {
+
+  //Width of a rollup bucket
+  const uint32_t ROLLUP_BUCKET_SECONDS = 60;
+
+  /**
+   * \brief an aggregate question about stored entries
+   */
+  struct RollupQuery {
+    //Buckets starting in this range, in ns since epoch
+    int64_t from = INT64_MIN;
+    int64_t to = INT64_MAX;
+
+    //Width of the rows' buckets, rounded up to whole rollup buckets
+    uint32_t bucketSeconds = ROLLUP_BUCKET_SECONDS;
+
+    //Entries at this level or more severe
+    Severity level = ALL;
+
+    //Only this module and those below it, empty for every module
+    std::string module;
+
+    //Dimensions to keep apart. Rows for dimensions not kept have level ALL
+    //and an empty module. With byTag each tag gets its own rows and
+    //entries without tags are not counted.
+    bool byLevel = true;
+    bool byModule = true;
+    bool byTag = false;
+  };
+
+  /**
+   * \brief one count answered by a rollup query
+   */
+  struct RollupRow {
+    int64_t bucket = 0;    //start of the bucket, ns since epoch
+    Severity level = ALL;
+    std::string module;
+    std::string tag;
+    uint64_t count = 0;
+  };
+
+  /**
+   * \brief answers a rollup query from the rollup files of a store
+   * \param [in] path store directory
+   * \param [in] query what to count
+   * \param [out] rows counts ordered by bucket, level, module and tag
+   * \return OK, or ERR if the directory cannot be read
+   */
+  Status queryRollups( const std::string &path
+      , const RollupQuery &query
+      , std::vector<RollupRow> &rows
+      );
+
+  /**
+   * \brief path of the rollup file kept for a segment
+   */
+  std::string rollupPath( const std::string &segmentPath );
+
+  /**
+   * \brief counts the entries of blocks as they are written
+   */
+  class RollupBuilder {
+    public:
+      /**
+       * \brief learns the module of a call site, whose entries carry none
+       */
+      void defineSite( const SiteInfo &site );
+
+      /**
+       * \brief counts one encoded record body
+       */
+      void add( const uint8_t *body, size_t size );
+
+      /**
+       * \brief counts every record of a block's data
+       */
+      void addBlock( const std::string &data );
+
+      /**
+       * \brief encodes the counts added since the last call as one frame
+       * and folds them into the segment's totals
+       * \return false if nothing was added
+       */
+      bool takeBlock( std::string &frame );
+
+      /**
+       * \brief encodes the segment's totals as one frame
+       */
+      void encodeSegment( std::string &frame ) const;
+
+      /**
+       * \brief forgets every count, keeping names and sites
+       */
+      void reset();
+
+    private:
+      struct Key {
+        int64_t bucket;
+        uint32_t module;
+        uint32_t tag;
+        uint8_t level;
+
+        bool operator==( const Key &other ) const
+        {
+          return bucket == other.bucket && module == other.module
+            && tag == other.tag && level == other.level;
+        };
+
+        bool operator<( const Key &other ) const
+        {
+          if( bucket != other.bucket ) {
+            return bucket < other.bucket;
+          }
+          if( level != other.level ) {
+            return level < other.level;
+          }
+          if( module != other.module ) {
+            return module < other.module;
+          }
+          return tag < other.tag;
+        };
+      };
+
+      struct KeyHash {
+        size_t operator()( const Key &key ) const
+        {
+          uint64_t h = static_cast<uint64_t>( key.bucket ) * 0x9e3779b97f4a7c15ull;
+          h ^= ( static_cast<uint64_t>( key.module ) << 32 | key.tag ) + ( h >> 29 );
+          return static_cast<size_t>( h * 0xbf58476d1ce4e5b9ull + key.level );
+        };
+      };
+
+      typedef std::unordered_map<Key, uint64_t, KeyHash> Counts;
+
+      std::vector<std::string> names_;
+      std::unordered_map<std::string, uint32_t> ids_;
+      std::map<uint32_t, uint32_t> siteModules_;   //site id to module name
+      std::string scratch_;
+      Counts block_;
+      Counts segment_;
+
+      uint32_t intern( const uint8_t *data, size_t size );
+      void encode( const Counts &counts, std::string &frame ) const;
+  };
+}
@@ -0,0 +1,770 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <regex>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined( __x86_64__ )
+#include <immintrin.h>
+#endif
+
+#include <lumberjack_filter.hpp>
+#include <lumberjack_search.hpp>
+#include <lumberjack_store.hpp>
+#include <lumberjack_template.hpp>
+
+namespace lumberjack {
+
+  namespace {
+    //Blocks are handed to the scanning threads in units of about this size
+    const uint64_t UNIT_BYTES = 4 * 1024 * 1024;
+
+    /////////////////////////////////////////////
+    // Substring kernels
+    /////////////////////////////////////////////
+    typedef const uint8_t *( *FindFunction )( const uint8_t *, const uint8_t *, const uint8_t *, size_t );
+
+    const uint8_t *findScalar( const uint8_t *begin
+        , const uint8_t *end
+        , const uint8_t *needle
+        , size_t size
+        )
+    {
+      while( static_cast<size_t>( end - begin ) >= size ) {
+        const uint8_t *hit = static_cast<const uint8_t *>(
+            memchr( begin, needle[0], static_cast<size_t>( end - begin ) - size + 1 ));
+        if( hit == NULL ) {
+          return end;
+        }
+        if( memcmp( hit + 1, needle + 1, size - 1 ) == 0 ) {
+          return hit;
+        }
+        begin = hit + 1;
+      }
+      return end;
+    }
+
+#if defined( __x86_64__ )
+    //Both kernels compare the needle's first and last bytes against a whole
+    //register of positions at once, and only compare the bytes in between
+    //where both agree. Real text rarely gets past that filter.
+    const uint8_t *findSse2( const uint8_t *begin
+        , const uint8_t *end
+        , const uint8_t *needle
+        , size_t size
+        )
+    {
+      const __m128i first = _mm_set1_epi8( static_cast<char>( needle[0] ));
+      const __m128i last = _mm_set1_epi8( static_cast<char>( needle[size - 1] ));
+      const size_t middle = size > 2 ? size - 2 : 0;
+      const uint8_t *ptr = begin;
+      for( ; static_cast<size_t>( end - ptr ) >= size - 1 + 16; ptr += 16 ) {
+        __m128i head = _mm_loadu_si128( reinterpret_cast<const __m128i *>( ptr ));
+        __m128i tail = _mm_loadu_si128( reinterpret_cast<const __m128i *>( ptr + size - 1 ));
+        unsigned mask = static_cast<unsigned>( _mm_movemask_epi8(
+              _mm_and_si128( _mm_cmpeq_epi8( head, first ), _mm_cmpeq_epi8( tail, last ))));
+        while( mask != 0 ) {
+          unsigned bit = static_cast<unsigned>( __builtin_ctz( mask ));
+          if( memcmp( ptr + bit + 1, needle + 1, middle ) == 0 ) {
+            return ptr + bit;
+          }
+          mask &= mask - 1;
+        }
+      }
+      return findScalar( ptr, end, needle, size );
+    }
+
+    __attribute__(( target( "avx2" )))
+    const uint8_t *findAvx2( const uint8_t *begin
+        , const uint8_t *end
+        , const uint8_t *needle
+        , size_t size
+        )
+    {
+      const __m256i first = _mm256_set1_epi8( static_cast<char>( needle[0] ));
+      const __m256i last = _mm256_set1_epi8( static_cast<char>( needle[size - 1] ));
+      const size_t middle = size > 2 ? size - 2 : 0;
+      const uint8_t *ptr = begin;
+      for( ; static_cast<size_t>( end - ptr ) >= size - 1 + 32; ptr += 32 ) {
+        __m256i head = _mm256_loadu_si256( reinterpret_cast<const __m256i *>( ptr ));
+        __m256i tail = _mm256_loadu_si256( reinterpret_cast<const __m256i *>( ptr + size - 1 ));
+        unsigned mask = static_cast<unsigned>( _mm256_movemask_epi8(
+              _mm256_and_si256( _mm256_cmpeq_epi8( head, first ), _mm256_cmpeq_epi8( tail, last ))));
+        while( mask != 0 ) {
+          unsigned bit = static_cast<unsigned>( __builtin_ctz( mask ));
+          if( memcmp( ptr + bit + 1, needle + 1, middle ) == 0 ) {
+            return ptr + bit;
+          }
+          mask &= mask - 1;
+        }
+      }
+      return findSse2( ptr, end, needle, size );
+    }
+#endif
+
+    FindFunction chooseKernel()
+    {
+#if defined( __x86_64__ )
+      __builtin_cpu_init();
+      return __builtin_cpu_supports( "avx2" ) ? findAvx2 : findSse2;
+#else
+      return findScalar;
+#endif
+    }
+
+    const FindFunction findKernel = chooseKernel();
+
+    /////////////////////////////////////////////
+    // Queries
+    /////////////////////////////////////////////
+
+    /**
+     * \brief longest literal that every match of a pattern contains
+     *
+     * Only literals outside groups and brackets are considered, and any
+     * alternation gives up, so the result can be shorter than it might be,
+     * or empty, but never wrong.
+     */
+    std::string requiredLiteral( const std::string &pattern )
+    {
+      std::string best;
+      std::string run;
+      int depth = 0;
+      for( size_t i = 0; i < pattern.size(); i++ ) {
+        char c = pattern[i];
+        bool literal = false;
+        if( c == '|' ) {
+          return std::string();
+        }
+        else if( c == '\\' && i + 1 < pattern.size()) {
+          c = pattern[++i];
+          literal = !isalnum( static_cast<unsigned char>( c ));
+          if( c == 'x' ) {
+            i += 2;
+          }
+          else if( c == 'u' ) {
+            i += 4;
+          }
+          else if( c == 'c' ) {
+            i += 1;
+          }
+        }
+        else if( c == '[' ) {
+          //Skip the class, whose first member may be a ']'
+          size_t close = i + 1;
+          close += close < pattern.size() && pattern[close] == '^';
+          close += close < pattern.size() && pattern[close] == ']';
+          while( close < pattern.size() && pattern[close] != ']' ) {
+            close += pattern[close] == '\\' ? 2 : 1;
+          }
+          i = close;
+        }
+        else if( c == '*' || c == '?' || c == '{' ) {
+          //The atom before a quantifier may be missing altogether
+          if( !run.empty()) {
+            run.erase( run.size() - 1 );
+          }
+          if( c == '{' ) {
+            i = std::min( pattern.find( '}', i ), pattern.size());
+          }
+        }
+        else if( c == '(' ) {
+          depth++;
+        }
+        else if( c == ')' ) {
+          depth--;
+        }
+        else {
+          literal = c != '.' && c != '^' && c != '$' && c != '+';
+        }
+
+        if( literal && depth == 0 ) {
+          run.push_back( c );
+          continue;
+        }
+        //A '+' keeps the atom before it but nothing after is adjacent
+        if( run.size() > best.size()) {
+          best = run;
+        }
+        run.clear();
+      }
+      return run.size() > best.size() ? run : best;
+    }
+
+    /**
+     * \brief decides whether a decoded message matches the query
+     */
+    class Matcher {
+      public:
+        bool prepare( const SearchQuery &query )
+        {
+          text_ = query.text;
+          regex_ = query.regex && !text_.empty();
+          words_ = query.words && !regex_;
+          if( !regex_ ) {
+            literal_ = text_;
+            return true;
+          }
+          try {
+            pattern_ = std::regex( text_, std::regex::ECMAScript | std::regex::optimize );
+          }
+          catch( const std::regex_error & ) {
+            return false;
+          }
+          literal_ = requiredLiteral( text_ );
+          return true;
+        };
+
+        //Bytes every matching message contains, possibly empty
+        const std::string &literal() const { return literal_; };
+
+        bool matches( const std::string &message ) const
+        {
+          if( regex_ ) {
+            return std::regex_search( message, pattern_ );
+          }
+          if( text_.empty() || !words_ ) {
+            return text_.empty() || message.find( text_ ) != std::string::npos;
+          }
+          const uint8_t *data = reinterpret_cast<const uint8_t *>( message.data());
+          for( size_t at = message.find( text_ ); at != std::string::npos; at = message.find( text_, at + 1 )) {
+            size_t end = at + text_.size();
+            if(( at == 0 || !isWordByte( data[at - 1] ))
+                && ( end == message.size() || !isWordByte( data[end] ))) {
+              return true;
+            }
+          }
+          return false;
+        };
+
+        /**
+         * \brief filter keys of the words every match contains
+         */
+        void wordKeys( std::vector<uint64_t> &keys ) const
+        {
+          const uint8_t *data = reinterpret_cast<const uint8_t *>( literal_.data());
+          const size_t size = literal_.size();
+          forEachWord( data, size, [&]( size_t offset, size_t length ) {
+              //A word at an edge of the literal may be part of a longer one
+              if(( offset > 0 || words_ ) && ( offset + length < size || words_ )) {
+                keys.push_back( filterKey( FILTER_WORD, data + offset, length ));
+              }
+            });
+        };
+
+      private:
+        std::string text_;
+        std::string literal_;
+        bool regex_ = false;
+        bool words_ = false;
+        std::regex pattern_;
+    };
+
+    /////////////////////////////////////////////
+    // Segments
+    /////////////////////////////////////////////
+
+    /**
+     * \brief read-only mapping of a segment file
+     */
+    class MappedSegment {
+      public:
+        MappedSegment() {};
+        ~MappedSegment()
+        {
+          if( data_ != NULL ) {
+            ::munmap( const_cast<uint8_t *>( data_ ), size_ );
+          }
+        };
+
+        bool open( const std::string &path )
+        {
+          int fd = ::open( path.c_str(), O_RDONLY );
+          if( fd < 0 ) {
+            return false;
+          }
+          struct stat st;
+          if( fstat( fd, &st ) != 0 || static_cast<size_t>( st.st_size ) < sizeof( SegmentHeader )) {
+            ::close( fd );
+            return false;
+          }
+          size_ = static_cast<size_t>( st.st_size );
+          void *data = ::mmap( NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0 );
+          ::close( fd );
+          if( data == MAP_FAILED ) {
+            return false;
+          }
+          data_ = static_cast<const uint8_t *>( data );
+          return true;
+        };
+
+        const uint8_t *data() const { return data_; };
+        size_t size() const { return size_; };
+
+      private:
+        const uint8_t *data_ = NULL;
+        size_t size_ = 0;
+
+        MappedSegment( const MappedSegment & );
+        MappedSegment &operator=( const MappedSegment & );
+    };
+
+    struct BlockRef {
+      size_t offset;
+      BlockHeader header;
+    };
+
+    struct Segment {
+      SegmentInfo info;
+      MappedSegment file;
+      std::string deviceId;
+      std::vector<BlockRef> blocks;
+      std::string filterData;
+      std::map<uint64_t, BlockFilter> filters;
+    };
+
+    /**
+     * \brief consecutive blocks of one segment scanned together
+     */
+    struct Unit {
+      size_t segment;
+      size_t first;
+      size_t end;
+      int64_t minTimestamp;
+    };
+
+    /**
+     * \brief everything a scanning thread needs to know about the query
+     */
+    struct Scan {
+      const SearchQuery *query;
+      const Matcher *matcher;
+      uint32_t levels;
+      std::vector<uint64_t> keys;
+      std::map<uint32_t, SiteInfo> sites;
+      std::vector<uint32_t> matchingSites;
+      std::map<uint32_t, MessageTemplate> templates;
+      std::vector<uint32_t> matchingTemplates;
+      std::atomic<bool> stop{ false };
+    };
+
+    /**
+     * \brief maps a segment and indexes the blocks that can hold matches
+     */
+    void indexSegment( Segment &segment, const Scan &scan, SearchStats &stats )
+    {
+      if( !segment.file.open( segment.info.path )) {
+        return;
+      }
+      SegmentHeader header;
+      memcpy( &header, segment.file.data(), sizeof( header ));
+      if( header.magic != SEGMENT_MAGIC || header.version != SEGMENT_VERSION ) {
+        return;
+      }
+      segment.deviceId.assign( header.deviceId, strnlen( header.deviceId, sizeof( header.deviceId )));
+      stats.segments++;
+      if( !scan.keys.empty()) {
+        readFilters( segment.info.path, segment.filterData, segment.filters );
+      }
+
+      size_t offset = sizeof( header );
+      const size_t size = segment.file.size();
+      while( size - offset >= sizeof( BlockHeader )) {
+        BlockRef block;
+        memcpy( &block.header, segment.file.data() + offset, sizeof( BlockHeader ));
+        uint32_t headerCrc = block.header.headerCrc;
+        block.header.headerCrc = 0;
+        if( block.header.magic != BLOCK_MAGIC
+            || crc32c( &block.header, sizeof( BlockHeader )) != headerCrc
+            || size - offset - sizeof( BlockHeader ) < block.header.bytes ) {
+          break;
+        }
+        block.header.headerCrc = headerCrc;
+        block.offset = offset + sizeof( BlockHeader );
+        std::map<uint64_t, BlockFilter>::const_iterator filter = segment.filters.find( offset );
+        offset = block.offset + block.header.bytes;
+
+        if(( block.header.levelMask & scan.levels ) == 0
+            || block.header.maxTimestamp < scan.query->from
+            || block.header.minTimestamp > scan.query->to ) {
+          stats.blocksSkipped++;
+          continue;
+        }
+        if( filter != segment.filters.end()) {
+          bool pruned = false;
+          for( size_t k = 0; k < scan.keys.size() && !pruned; k++ ) {
+            pruned = !filter->second.mayContain( scan.keys[k] );
+          }
+          if( pruned ) {
+            stats.blocksPruned++;
+            continue;
+          }
+        }
+        segment.blocks.push_back( block );
+      }
+    }
+
+    /**
+     * \brief decodes a candidate record and keeps it if it matches
+     */
+    void consider( const Segment &segment
+        , const uint8_t *body
+        , size_t size
+        , const Scan &scan
+        , std::vector<SearchMatch> &out
+        , SearchStats &stats
+        )
+    {
+      SearchMatch match;
+      Record &record = match.record;
+      stats.decoded++;
+      if( !decodeRecord( body, size, record )) {
+        return;
+      }
+      if( record.site != 0 ) {
+        std::map<uint32_t, SiteInfo>::const_iterator site = scan.sites.find( record.site );
+        if( site != scan.sites.end()) {
+          applySite( site->second, record );
+        }
+      }
+      if(( record.flags & RECORD_TEMPLATE ) && !applyTemplate( scan.templates, record )) {
+        return;
+      }
+      const SearchQuery &query = *scan.query;
+      if( !query.module.empty() && ( record.module.compare( 0, query.module.size(), query.module ) != 0
+            || ( record.module.size() > query.module.size() && record.module[query.module.size()] != '.' ))) {
+        return;
+      }
+      if( !query.tag.empty()
+          && std::find( record.tags.begin(), record.tags.end(), query.tag ) == record.tags.end()) {
+        return;
+      }
+      if( scan.matcher->matches( record.message )) {
+        match.deviceId = segment.deviceId;
+        out.push_back( match );
+      }
+    }
+
+    /**
+     * \brief finds the matching records of one block
+     */
+    void scanBlock( const Segment &segment
+        , const BlockRef &block
+        , const Scan &scan
+        , std::vector<SearchMatch> &out
+        , SearchStats &stats
+        )
+    {
+      const std::string &literal = scan.matcher->literal();
+      const bool siteCheck = !scan.matchingSites.empty();
+      const bool templateCheck = !scan.matchingTemplates.empty();
+      const uint8_t *data = segment.file.data() + block.offset;
+      const uint8_t *end = data + block.header.bytes;
+      stats.blocks++;
+      stats.bytesScanned += block.header.bytes;
+
+      //The next literal hit, found ahead of the records being walked
+      const uint8_t *hit = data;
+      if( !literal.empty()) {
+        hit = findKernel( data, end, reinterpret_cast<const uint8_t *>( literal.data()), literal.size());
+      }
+
+      bool verified = false;
+      const uint8_t *ptr = data;
+      while( static_cast<size_t>( end - ptr ) >= sizeof( uint32_t )) {
+        if( hit == end && !siteCheck && !templateCheck ) {
+          break;
+        }
+        uint32_t length = 0;
+        memcpy( &length, ptr, sizeof( length ));
+        const uint8_t *body = ptr + sizeof( length );
+        if( length > static_cast<size_t>( end - body )) {
+          break;
+        }
+        const uint8_t *next = body + length;
+        ptr = next;
+
+        if( !literal.empty() && hit < body ) {
+          hit = findKernel( body, end, reinterpret_cast<const uint8_t *>( literal.data()), literal.size());
+        }
+        bool candidate = hit + literal.size() <= next;
+        if( !candidate && siteCheck && length >= RECORD_SITE_OFFSET + sizeof( uint32_t )
+            && ( recordFlags( body ) & RECORD_SITE )) {
+          candidate = std::binary_search( scan.matchingSites.begin(), scan.matchingSites.end()
+              , recordSite( body ));
+        }
+
+        //A templated message may hold the text partly in its template
+        if( !candidate && templateCheck && length >= RECORD_HEADER_BYTES
+            && ( recordFlags( body ) & RECORD_TEMPLATE )) {
+          size_t start = 0;
+          size_t offset = 0;
+          size_t size = 0;
+          uint32_t id = 0;
+          candidate = locateMessage( body, length, start, offset, size )
+            && templateOf( body + offset, size, id )
+            && std::binary_search( scan.matchingTemplates.begin(), scan.matchingTemplates.end(), id );
+        }
+        if( !candidate || length < RECORD_HEADER_BYTES ) {
+          continue;
+        }
+
+        int64_t timestamp = recordTimestamp( body );
+        if( recordLevel( body ) > scan.query->level || timestamp < scan.query->from
+            || timestamp > scan.query->to
+            || recordType( body ) != static_cast<uint8_t>( PayloadType::STRING )) {
+          continue;
+        }
+
+        //Only blocks that produce a candidate are worth checksumming
+        if( !verified ) {
+          if( crc32c( data, block.header.bytes ) != block.header.crc ) {
+            return;
+          }
+          verified = true;
+        }
+        consider( segment, body, length, scan, out, stats );
+      }
+    }
+
+    void addStats( SearchStats &total, const SearchStats &stats )
+    {
+      total.segments += stats.segments;
+      total.blocks += stats.blocks;
+      total.blocksSkipped += stats.blocksSkipped;
+      total.blocksPruned += stats.blocksPruned;
+      total.bytesScanned += stats.bytesScanned;
+      total.decoded += stats.decoded;
+      total.matches += stats.matches;
+    }
+
+    bool olderMatch( const SearchMatch &a, const SearchMatch &b )
+    {
+      if( a.record.timestamp != b.record.timestamp ) {
+        return a.record.timestamp < b.record.timestamp;
+      }
+      return a.record.seq < b.record.seq;
+    }
+
+    /**
+     * \brief position of the oldest match not yet passed on from a unit
+     */
+    struct Cursor {
+      size_t unit;
+      size_t index;
+      const SearchMatch *match;
+
+      //Ordered so the oldest match is on top of the heap
+      bool operator<( const Cursor &other ) const
+      {
+        return olderMatch( *other.match, *match );
+      };
+    };
+  }
+
+  const uint8_t *findBytes( const uint8_t *begin
+      , const uint8_t *end
+      , const char *needle
+      , size_t size
+      )
+  {
+    if( size == 0 ) {
+      return begin;
+    }
+    return findKernel( begin, end, reinterpret_cast<const uint8_t *>( needle ), size );
+  }
+
+  Status searchStore( const std::string &path
+      , const SearchQuery &query
+      , const SearchCallback &each
+      , SearchStats *stats
+      )
+  {
+    Matcher matcher;
+    std::vector<SegmentInfo> infos;
+    if( !matcher.prepare( query ) || !listSegments( path, infos )) {
+      return ERR;
+    }
+
+    Scan scan;
+    scan.query = &query;
+    scan.matcher = &matcher;
+    scan.levels = query.level >= ALL ? 0xffffffffu : ( 2u << query.level ) - 1;
+    matcher.wordKeys( scan.keys );
+    if( !query.module.empty()) {
+      scan.keys.push_back( filterKey( FILTER_MODULE, query.module.data(), query.module.size()));
+    }
+    if( !query.tag.empty()) {
+      scan.keys.push_back( filterKey( FILTER_TAG, query.tag.data(), query.tag.size()));
+    }
+    readSites( path, scan.sites );
+    if( !query.text.empty()) {
+      for( std::map<uint32_t, SiteInfo>::const_iterator it = scan.sites.begin()
+          ; it != scan.sites.end(); ++it ) {
+        if( matcher.matches( it->second.message )) {
+          scan.matchingSites.push_back( it->first );
+        }
+      }
+    }
+    readTemplates( path, scan.templates );
+    if( !matcher.literal().empty()) {
+      for( std::map<uint32_t, MessageTemplate>::const_iterator it = scan.templates.begin()
+          ; it != scan.templates.end(); ++it ) {
+        if( templateMayContain( it->second, matcher.literal())) {
+          scan.matchingTemplates.push_back( it->first );
+        }
+      }
+    }
+
+    unsigned threads = query.threads;
+    if( threads == 0 ) {
+      threads = std::max( 1u, std::thread::hardware_concurrency());
+    }
+
+    //Index every segment's blocks, then cut them into units
+    SearchStats total;
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Segment> > segments( infos.size());
+    {
+      std::atomic<size_t> next{ 0 };
+      std::vector<std::thread> pool;
+      for( unsigned t = 0; t < std::min<size_t>( threads, infos.size()); t++ ) {
+        pool.push_back( std::thread( [&] {
+            SearchStats local;
+            for( size_t i = next++; i < infos.size(); i = next++ ) {
+              segments[i].reset( new Segment );
+              segments[i]->info = infos[i];
+              indexSegment( *segments[i], scan, local );
+            }
+            std::lock_guard<std::mutex> lock( mutex );
+            addStats( total, local );
+          } ));
+      }
+      for( size_t t = 0; t < pool.size(); t++ ) {
+        pool[t].join();
+      }
+    }
+
+    std::vector<Unit> units;
+    for( size_t s = 0; s < segments.size(); s++ ) {
+      const std::vector<BlockRef> &blocks = segments[s]->blocks;
+      for( size_t first = 0; first < blocks.size(); ) {
+        Unit unit = { s, first, first, INT64_MAX };
+        uint64_t bytes = 0;
+        while( unit.end < blocks.size() && ( bytes == 0 || bytes + blocks[unit.end].header.bytes <= UNIT_BYTES )) {
+          bytes += blocks[unit.end].header.bytes;
+          unit.minTimestamp = std::min( unit.minTimestamp, blocks[unit.end].header.minTimestamp );
+          unit.end++;
+        }
+        units.push_back( unit );
+        first = unit.end;
+      }
+    }
+    std::stable_sort( units.begin(), units.end(), []( const Unit &a, const Unit &b ) {
+        return a.minTimestamp < b.minTimestamp;
+      });
+
+    //Scan the units in the background while this thread merges results
+    std::vector<std::vector<SearchMatch> > results( units.size());
+    std::vector<char> finished( units.size(), 0 );
+    std::condition_variable cv;
+    std::atomic<size_t> next{ 0 };
+    std::vector<std::thread> pool;
+    for( unsigned t = 0; t < std::min<size_t>( threads, units.size()); t++ ) {
+      pool.push_back( std::thread( [&] {
+          SearchStats local;
+          for( size_t i = next++; i < units.size(); i = next++ ) {
+            const Unit &unit = units[i];
+            const Segment &segment = *segments[unit.segment];
+            std::vector<SearchMatch> found;
+            for( size_t b = unit.first; b < unit.end && !scan.stop.load( std::memory_order_relaxed ); b++ ) {
+              scanBlock( segment, segment.blocks[b], scan, found, local );
+            }
+            std::sort( found.begin(), found.end(), olderMatch );
+
+            std::lock_guard<std::mutex> lock( mutex );
+            results[i].swap( found );
+            finished[i] = 1;
+            cv.notify_all();
+          }
+          std::lock_guard<std::mutex> lock( mutex );
+          addStats( total, local );
+        } ));
+    }
+
+    //A match is passed on once every unit that could hold an older one is
+    //done, which is every unit dispatched before the first unfinished one
+    std::priority_queue<Cursor> heap;
+    size_t frontier = 0;
+    uint64_t passed = 0;
+    bool stopped = false;
+    while( !stopped && ( frontier < units.size() || !heap.empty())) {
+      {
+        std::unique_lock<std::mutex> lock( mutex );
+        cv.wait( lock, [&] { return frontier == units.size() || finished[frontier]; } );
+        for( ; frontier < units.size() && finished[frontier]; frontier++ ) {
+          if( !results[frontier].empty()) {
+            Cursor cursor = { frontier, 0, &results[frontier][0] };
+            heap.push( cursor );
+          }
+        }
+      }
+
+      int64_t watermark = frontier < units.size() ? units[frontier].minTimestamp : INT64_MAX;
+      while( !heap.empty() && ( frontier == units.size() || heap.top().match->record.timestamp < watermark )) {
+        Cursor cursor = heap.top();
+        heap.pop();
+        passed++;
+        if( !each( *cursor.match ) || ( query.limit != 0 && passed >= query.limit )) {
+          stopped = true;
+          break;
+        }
+        std::vector<SearchMatch> &unitResults = results[cursor.unit];
+        if( ++cursor.index < unitResults.size()) {
+          cursor.match = &unitResults[cursor.index];
+          heap.push( cursor );
+        }
+        else {
+          std::vector<SearchMatch>().swap( unitResults );
+        }
+      }
+    }
+
+    scan.stop = true;
+    for( size_t t = 0; t < pool.size(); t++ ) {
+      pool[t].join();
+    }
+    if( stats != NULL ) {
+      total.matches = passed;
+      *stats = total;
+    }
+    return OK;
+  }
+}
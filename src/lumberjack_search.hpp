@@ -0,0 +1,146 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ **/
+
+#pragma once
+
+// Text search over a store directory.
+//
+// Segments are mapped read-only and their block headers indexed first, so
+// blocks outside the requested time range or levels are never read. The
+// blocks left are split into units of a few megabytes and scanned by a
+// pool of threads. Each unit's message bytes are scanned for the query's
+// literal with a vectorized kernel: SSE2, or AVX2 where the CPU has it.
+// Only records containing a hit are decoded and checked against the query,
+// and a block's checksum is only verified once it yields a candidate.
+//
+// A regular expression is searched for through the longest literal every
+// match must contain. Patterns with no such literal, like "a|b", decode
+// every entry in range. Entries from call sites carry no message of their
+// own, so sites whose message matches are found in the site dictionary
+// first and their entries picked out by site id. Likewise, entries stored
+// by a template are also decoded when their template could hold the
+// literal with some choice of variables.
+//
+// Blocks are also left out when their Bloom filter, described in
+// lumberjack_filter.hpp, shows they lack the query's module or tag, or a
+// word every match must contain. Those words are the ones inside the
+// query's literal, bounded on both sides by other characters, or all of
+// its words when whole words are asked for.
+//
+// Matches are passed back on the calling thread in timestamp order. Units
+// are dispatched by their oldest entry, and a match is only passed on once
+// no unit still being scanned can hold an older one.
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include <lumberjack.hpp>
+#include <lumberjack_record.hpp>
+
+namespace lumberjack {
+
+  /**
+   * \brief what to search a store for
+   */
+  struct SearchQuery {
+    //Substring of the message, or an ECMAScript pattern if regex is set.
+    //Empty matches every entry.
+    std::string text;
+    bool regex = false;
+
+    //Only match text that starts and ends at word boundaries, like grep -w.
+    //Ignored for regular expressions.
+    bool words = false;
+
+    //Only entries of this module or one below it, empty for any
+    std::string module;
+
+    //Only entries with this tag, empty for any
+    std::string tag;
+
+    //Entries at this level or more severe
+    Severity level = ALL;
+
+    //Timestamp range in ns since epoch, inclusive
+    int64_t from = INT64_MIN;
+    int64_t to = INT64_MAX;
+
+    //Stops after this many matches, 0 for no limit
+    size_t limit = 0;
+
+    //Scanning threads, 0 for one per core
+    unsigned threads = 0;
+  };
+
+  /**
+   * \brief one entry found by a search
+   */
+  struct SearchMatch {
+    Record record;
+
+    //Device that wrote the segment holding the entry
+    std::string deviceId;
+  };
+
+  /**
+   * \brief work done by a search
+   */
+  struct SearchStats {
+    uint64_t segments = 0;
+    uint64_t blocks = 0;          //blocks in range that were scanned
+    uint64_t blocksSkipped = 0;   //blocks left out by time or level
+    uint64_t blocksPruned = 0;    //blocks left out by their filter
+    uint64_t bytesScanned = 0;
+    uint64_t decoded = 0;         //candidate records decoded
+    uint64_t matches = 0;
+  };
+
+  /**
+   * \brief called with each match; return false to stop the search
+   */
+  typedef std::function<bool( const SearchMatch & )> SearchCallback;
+
+  /**
+   * \brief searches the segments of a store directory
+   * \param [in] path store directory
+   * \param [in] query what to look for
+   * \param [in] each called with every match, oldest first
+   * \param [out] stats work done, may be NULL
+   * \return OK, or ERR if the directory cannot be read or the pattern is
+   * invalid
+   *
+   * The store may be open for writing meanwhile. Blocks written after the
+   * search started may or may not be seen.
+   */
+  Status searchStore( const std::string &path
+      , const SearchQuery &query
+      , const SearchCallback &each
+      , SearchStats *stats = NULL
+      );
+
+  /**
+   * \brief finds the first occurrence of a byte string
+   * \return start of the occurrence, or end if there is none
+   *
+   * The kernel the search uses, exposed for benchmarks.
+   */
+  const uint8_t *findBytes( const uint8_t *begin
+      , const uint8_t *end
+      , const char *needle
+      , size_t size
+      );
+}
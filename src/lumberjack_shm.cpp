@@ -0,0 +1,472 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <new>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <lumberjack_record.hpp>
+#include <lumberjack_shm.hpp>
+
+namespace lumberjack {
+
+  namespace {
+    const uint16_t CELL_FIRST = 1;
+    const uint16_t CELL_CONTINUATION = 2;
+
+    //Set in the sequence word of a cell while its producer copies into it
+    const uint64_t CELL_WRITING = 1ull << 63;
+
+    //Upper bound on entries handed out by a single drain call
+    const size_t DRAIN_BATCH = 4096;
+
+    //Grace period before the collector checks whether an owner is alive
+    const int64_t OWNER_CHECK_MS = 10;
+
+    size_t headerSize()
+    {
+      return ( sizeof( ShmRingHeader ) + 63 ) & ~static_cast<size_t>( 63 );
+    }
+
+    uint32_t roundPow2( uint32_t value )
+    {
+      uint32_t result = 1;
+      while( result < value ) {
+        result <<= 1;
+      }
+      return result;
+    }
+
+    int64_t nowMs()
+    {
+      return std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    int futex( std::atomic<uint32_t> *word, int op, uint32_t value
+        , const struct timespec *timeout
+        )
+    {
+      return static_cast<int>( syscall( SYS_futex, reinterpret_cast<uint32_t *>( word )
+            , op, value, timeout, NULL, 0 ));
+    }
+  }
+
+  std::string ShmRing::defaultName()
+  {
+    return "/lumberjack-" + std::to_string( getuid());
+  }
+
+  Status ShmRing::open( const std::string &name, const SharedRingOptions &options )
+  {
+    close();
+
+    name_ = name.empty() ? defaultName() : name;
+    pid_ = static_cast<uint32_t>( getpid());
+    abandonMs_ = options.abandonMs;
+
+    int fd = shm_open( name_.c_str(), O_RDWR | O_CREAT, 0660 );
+    if( fd < 0 ) {
+      return ERR;
+    }
+
+    //Serialize initialization between processes racing to create the ring
+    if( flock( fd, LOCK_EX ) != 0 ) {
+      ::close( fd );
+      return ERR;
+    }
+
+    struct stat st;
+    if( fstat( fd, &st ) != 0 ) {
+      ::close( fd );
+      return ERR;
+    }
+
+    //A creator that died before publishing the magic leaves a ring nobody
+    //can use, so whoever holds the lock next sets it up again
+    uint32_t magic = 0;
+    bool create = st.st_size == 0
+      || pread( fd, &magic, sizeof( magic ), 0 ) != static_cast<ssize_t>( sizeof( magic ))
+      || magic != SHM_MAGIC;
+    uint32_t cellCount = roundPow2( options.cells < 2 ? 2 : options.cells );
+    uint32_t cellSize = ( std::max<uint32_t>( options.cellSize, sizeof( ShmCell ) + 8 ) + 7 ) & ~7u;
+    size_t size = create
+      ? headerSize() + static_cast<size_t>( cellCount ) * cellSize
+      : static_cast<size_t>( st.st_size );
+
+    if( create && ftruncate( fd, static_cast<off_t>( size )) != 0 ) {
+      ::close( fd );
+      return ERR;
+    }
+
+    void *base = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    if( base == MAP_FAILED ) {
+      ::close( fd );
+      return ERR;
+    }
+
+    ShmRingHeader *header = static_cast<ShmRingHeader *>( base );
+    if( create ) {
+      header = new ( base ) ShmRingHeader;
+      header->version = SHM_VERSION;
+      header->cellCount = cellCount;
+      header->cellSize = cellSize;
+      header->seqBase.store( 1 );
+      header->dropped.store( 0 );
+      header->abandoned.store( 0 );
+      header->tail.store( 0 );
+      header->head.store( 0 );
+      header->wake.store( 0 );
+      header->sleeping.store( 0 );
+      header->collectorPid.store( 0 );
+
+      char *cells = static_cast<char *>( base ) + headerSize();
+      for( uint32_t i = 0; i < cellCount; i++ ) {
+        ShmCell *c = new ( cells + static_cast<size_t>( i ) * cellSize ) ShmCell;
+        c->seq.store( i );
+        c->owner.store( 0 );
+      }
+      __atomic_store_n( &header->magic, SHM_MAGIC, __ATOMIC_RELEASE );
+    }
+
+    flock( fd, LOCK_UN );
+    ::close( fd );
+
+    if( __atomic_load_n( &header->magic, __ATOMIC_ACQUIRE ) != SHM_MAGIC
+        || header->version != SHM_VERSION
+        || size < headerSize() + static_cast<size_t>( header->cellCount ) * header->cellSize ) {
+      munmap( base, size );
+      return INCOMPATIBLE;
+    }
+
+    base_ = base;
+    size_ = size;
+    header_ = header;
+    cells_ = static_cast<char *>( base ) + headerSize();
+    stalledSince_ = 0;
+    return OK;
+  }
+
+  void ShmRing::close()
+  {
+    if( base_ != NULL ) {
+      munmap( base_, size_ );
+    }
+    base_ = NULL;
+    header_ = NULL;
+    cells_ = NULL;
+  }
+
+  ShmCell *ShmRing::cell( uint64_t pos ) const
+  {
+    size_t index = static_cast<size_t>( pos & ( header_->cellCount - 1 ));
+    return reinterpret_cast<ShmCell *>( cells_ + index * header_->cellSize );
+  }
+
+  size_t ShmRing::payload() const
+  {
+    return header_->cellSize - sizeof( ShmCell );
+  }
+
+  uint64_t ShmRing::dropped() const
+  {
+    return header_ ? header_->dropped.load( std::memory_order_relaxed ) : 0;
+  }
+
+  uint64_t ShmRing::abandoned() const
+  {
+    return header_ ? header_->abandoned.load( std::memory_order_relaxed ) : 0;
+  }
+
+  void ShmRing::becomeCollector( uint64_t nextSeq )
+  {
+    header_->collectorPid.store( pid_ );
+    uint64_t head = header_->head.load();
+    if( nextSeq > header_->seqBase.load() + head ) {
+      header_->seqBase.store( nextSeq - head );
+    }
+  }
+
+  bool ShmRing::push( const void *data, size_t size, uint64_t &seq )
+  {
+    if( header_ == NULL ) {
+      return false;
+    }
+    size_t room = payload();
+    uint64_t count = size == 0 ? 1 : ( size + room - 1 ) / room;
+    if( count > header_->cellCount / 2 ) {
+      header_->dropped.fetch_add( 1, std::memory_order_relaxed );
+      return false;
+    }
+
+    //Claim count consecutive cells. The collector frees cells in order, so
+    //if the last one is free for this lap, all earlier ones are as well.
+    uint64_t pos = header_->tail.load( std::memory_order_relaxed );
+    while( true ) {
+      uint64_t last = pos + count - 1;
+      uint64_t cellSeq = cell( last )->seq.load( std::memory_order_acquire ) & ~CELL_WRITING;
+      int64_t diff = static_cast<int64_t>( cellSeq - last );
+      if( diff == 0 ) {
+        if( header_->tail.compare_exchange_weak( pos, pos + count
+              , std::memory_order_relaxed )) {
+          break;
+        }
+      }
+      else if( diff < 0 ) {
+        header_->dropped.fetch_add( 1, std::memory_order_relaxed );
+        return false;
+      }
+      else {
+        pos = header_->tail.load( std::memory_order_relaxed );
+      }
+    }
+
+    for( uint64_t i = 0; i < count; i++ ) {
+      ShmCell *c = cell( pos + i );
+      if( c->seq.load( std::memory_order_relaxed ) == pos + i ) {
+        c->owner.store( pid_, std::memory_order_relaxed );
+      }
+    }
+
+    //Take each cell before copying into it, and publish it once it is
+    //written. A cell the collector reclaimed because we took too long may
+    //already belong to another producer, so it is left alone and the rest
+    //are published empty, which has the collector drop the entry.
+    const char *src = static_cast<const char *>( data );
+    size_t remaining = size;
+    bool published = true;
+    for( uint64_t i = 0; i < count; i++ ) {
+      ShmCell *c = cell( pos + i );
+      uint64_t expected = pos + i;
+      if( !c->seq.compare_exchange_strong( expected, ( pos + i ) | CELL_WRITING
+            , std::memory_order_acquire, std::memory_order_relaxed )) {
+        published = false;
+        continue;
+      }
+      size_t used = published ? std::min( remaining, room ) : 0;
+      c->flags = i == 0 ? CELL_FIRST : CELL_CONTINUATION;
+      c->used = static_cast<uint16_t>( used );
+      if( i == 0 ) {
+        c->length = static_cast<uint32_t>( size );
+        c->crc = crc32c( data, size );
+      }
+      memcpy( reinterpret_cast<char *>( c + 1 ), src, used );
+      src += used;
+      remaining -= used;
+      c->seq.store( pos + i + 1, std::memory_order_release );
+    }
+
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+    if( header_->sleeping.load( std::memory_order_relaxed )) {
+      wake();
+    }
+
+    if( !published ) {
+      header_->dropped.fetch_add( 1, std::memory_order_relaxed );
+      return false;
+    }
+    seq = header_->seqBase.load( std::memory_order_relaxed ) + pos;
+    return true;
+  }
+
+  void ShmRing::wake()
+  {
+    if( header_ == NULL ) {
+      return;
+    }
+    header_->wake.fetch_add( 1 );
+    futex( &header_->wake, FUTEX_WAKE, 1, NULL );
+  }
+
+  /////////////////////////////////////////////
+  // Returns true once the unpublished cell at pos should be reclaimed
+  /////////////////////////////////////////////
+  bool ShmRing::stalled( uint64_t pos )
+  {
+    int64_t now = nowMs();
+    if( stalledSince_ == 0 || stalledPos_ != pos ) {
+      stalledPos_ = pos;
+      stalledSince_ = now;
+      return false;
+    }
+
+    int64_t waited = now - stalledSince_;
+    if( waited >= OWNER_CHECK_MS && ownerGone( pos )) {
+      return true;
+    }
+    return waited >= static_cast<int64_t>( abandonMs_ );
+  }
+
+  /////////////////////////////////////////////
+  // Returns true if the producer that claimed the cell at pos has exited
+  /////////////////////////////////////////////
+  bool ShmRing::ownerGone( uint64_t pos )
+  {
+    uint32_t owner = cell( pos )->owner.load( std::memory_order_relaxed );
+    return owner != 0 && kill( static_cast<pid_t>( owner ), 0 ) != 0 && errno == ESRCH;
+  }
+
+  /////////////////////////////////////////////
+  // Takes an unpublished cell away from its producer. Returns false if the
+  // producer published it in the meantime, or is copying into it and has
+  // not exited.
+  /////////////////////////////////////////////
+  bool ShmRing::reclaim( uint64_t pos )
+  {
+    uint64_t expected = pos;
+    stalledSince_ = 0;
+    if( cell( pos )->seq.compare_exchange_strong( expected, pos + 1 )) {
+      return true;
+    }
+    return expected == ( pos | CELL_WRITING ) && ownerGone( pos )
+      && cell( pos )->seq.compare_exchange_strong( expected, pos + 1 );
+  }
+
+  size_t ShmRing::drain( const Handler &handler, uint32_t timeoutMs )
+  {
+    if( header_ == NULL ) {
+      return 0;
+    }
+
+    const uint64_t cellCount = header_->cellCount;
+    std::string scratch;
+    size_t delivered = 0;
+
+    while( delivered < DRAIN_BATCH ) {
+      uint64_t head = header_->head.load( std::memory_order_relaxed );
+      ShmCell *first = cell( head );
+      uint64_t cellSeq = first->seq.load( std::memory_order_acquire );
+
+      if( cellSeq != head + 1 ) {
+        if( header_->tail.load( std::memory_order_acquire ) == head ) {
+          break;
+        }
+        //Claimed but not published yet
+        if( !stalled( head )) {
+          break;
+        }
+        if( reclaim( head )) {
+          header_->abandoned.fetch_add( 1, std::memory_order_relaxed );
+          first->owner.store( 0, std::memory_order_relaxed );
+          first->seq.store( head + cellCount, std::memory_order_release );
+          header_->head.store( head + 1, std::memory_order_release );
+        }
+        continue;
+      }
+
+      //A continuation at head belongs to an entry whose first cell was
+      //reclaimed.
+      uint64_t count = 1;
+      bool valid = first->flags == CELL_FIRST;
+      if( valid ) {
+        size_t room = payload();
+        count = first->length == 0 ? 1 : ( first->length + room - 1 ) / room;
+        if( count > cellCount / 2 ) {
+          count = 1;
+          valid = false;
+        }
+      }
+
+      bool waiting = false;
+      for( uint64_t i = 1; i < count; i++ ) {
+        ShmCell *c = cell( head + i );
+        if( c->seq.load( std::memory_order_acquire ) == head + i + 1 ) {
+          continue;
+        }
+        if( !stalled( head + i )) {
+          waiting = true;
+          break;
+        }
+        if( reclaim( head + i )) {
+          header_->abandoned.fetch_add( 1, std::memory_order_relaxed );
+          valid = false;
+        }
+        //A live producer still copying keeps its cell, and the entry
+        //waits for it rather than the cell being freed under it
+        else if( c->seq.load( std::memory_order_acquire ) != head + i + 1 ) {
+          waiting = true;
+          break;
+        }
+      }
+      if( waiting ) {
+        break;
+      }
+
+      if( valid ) {
+        scratch.clear();
+        for( uint64_t i = 0; i < count; i++ ) {
+          ShmCell *c = cell( head + i );
+          if( c->flags != ( i == 0 ? CELL_FIRST : CELL_CONTINUATION )) {
+            valid = false;
+            break;
+          }
+          scratch.append( reinterpret_cast<const char *>( c + 1 ), c->used );
+        }
+        valid = valid && scratch.size() == first->length
+          && crc32c( scratch.data(), scratch.size()) == first->crc;
+      }
+
+      uint64_t seq = header_->seqBase.load( std::memory_order_relaxed ) + head;
+      for( uint64_t i = 0; i < count; i++ ) {
+        ShmCell *c = cell( head + i );
+        c->owner.store( 0, std::memory_order_relaxed );
+        c->seq.store( head + i + cellCount, std::memory_order_release );
+      }
+      header_->head.store( head + count, std::memory_order_release );
+      stalledSince_ = 0;
+
+      if( !valid ) {
+        header_->dropped.fetch_add( 1, std::memory_order_relaxed );
+        continue;
+      }
+      handler( seq, reinterpret_cast<const uint8_t *>( scratch.data()), scratch.size());
+      delivered++;
+    }
+
+    if( delivered > 0 || timeoutMs == 0 ) {
+      return delivered;
+    }
+
+    //Nothing ready. Sleep until a producer wakes us or the timeout passes;
+    //a stalled producer is rechecked on the next call.
+    uint32_t wake = header_->wake.load();
+    header_->sleeping.store( 1 );
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+
+    uint64_t head = header_->head.load( std::memory_order_relaxed );
+    if( cell( head )->seq.load( std::memory_order_acquire ) != head + 1 ) {
+      uint32_t sleepMs = stalledSince_ != 0 ? 1 : timeoutMs;
+      struct timespec timeout;
+      timeout.tv_sec = sleepMs / 1000;
+      timeout.tv_nsec = static_cast<long>( sleepMs % 1000 ) * 1000000;
+      futex( &header_->wake, FUTEX_WAIT, wake, &timeout );
+    }
+    header_->sleeping.store( 0 );
+    return 0;
+  }
+}
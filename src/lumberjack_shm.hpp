@@ -0,0 +1,157 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ **/
+
+#pragma once
+
+// Per-host shared memory ring used by many producer processes and a single
+// collector.
+//
+// The ring is a POSIX shared memory object holding a ShmRingHeader followed
+// by fixed-size cells. Producers claim a run of cells with a CAS on the tail,
+// copy an encoded record into them and publish each cell by advancing its
+// sequence word. Nothing on that path makes a syscall unless the collector
+// is asleep, in which case the producer wakes it through a futex.
+//
+// A producer that dies after claiming cells would otherwise stop the
+// collector forever. Every claimed cell records the owner pid, and the
+// collector reclaims a cell whose owner no longer exists or that has stayed
+// unpublished for longer than the abandon timeout. A producer takes each of
+// its cells with a CAS before copying into it, and the collector only takes
+// a cell being copied into from a producer that has exited, so a producer
+// that was merely slow finds its cells reclaimed and drops the entry
+// instead of overwriting someone else's.
+//
+// A ring whose creator died before it was set up is set up again by the
+// next process to open it.
+
+#include <atomic>
+#include <functional>
+#include <string>
+
+#include <lumberjack.hpp>
+
+namespace lumberjack {
+
+  const uint32_t SHM_MAGIC = 0x4d484a4c;  // "LJHM"
+  const uint32_t SHM_VERSION = 1;
+
+  /**
+   * \brief control block at the start of the shared memory region
+   */
+  struct ShmRingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t cellCount;
+    uint32_t cellSize;
+    std::atomic<uint64_t> seqBase;
+    std::atomic<uint64_t> dropped;
+    std::atomic<uint64_t> abandoned;
+    alignas(64) std::atomic<uint64_t> tail;
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint32_t> wake;
+    std::atomic<uint32_t> sleeping;
+    std::atomic<uint32_t> collectorPid;
+  };
+
+  /**
+   * \brief header of each cell in the ring
+   */
+  struct ShmCell {
+    std::atomic<uint64_t> seq;
+    std::atomic<uint32_t> owner;
+    uint16_t flags;
+    uint16_t used;
+    uint32_t length;
+    uint32_t crc;
+  };
+
+  /**
+   * \brief shared memory ring endpoint, either a producer or the collector
+   */
+  class ShmRing {
+    public:
+      typedef std::function<void( uint64_t seq, const uint8_t *data, size_t size )> Handler;
+
+      ShmRing() {};
+      ~ShmRing() { close(); };
+
+      /**
+       * \brief opens the ring, creating it if it does not exist yet
+       * \param [in] name shared memory object name, empty for the default
+       * \param [in] options ring geometry used when creating it
+       * \return OK on success, INCOMPATIBLE if an existing ring has a
+       *         different layout, ERR on failure
+       */
+      Status open( const std::string &name, const SharedRingOptions &options );
+      void close();
+      bool isOpen() const { return header_ != NULL; };
+
+      /**
+       * \brief default shared memory name for this user
+       */
+      static std::string defaultName();
+
+      /**
+       * \brief copies an encoded record into the ring (producer side)
+       * \param [in] data record body without its length frame
+       * \param [in] size number of bytes
+       * \param [out] seq sequence number the collector will assign
+       * \return false if the ring is full or the entry does not fit
+       */
+      bool push( const void *data, size_t size, uint64_t &seq );
+
+      /**
+       * \brief delivers published entries to handler (collector side)
+       * \param [in] handler called for each entry in ring order
+       * \param [in] timeoutMs how long to sleep when the ring is empty
+       * \return number of entries delivered
+       */
+      size_t drain( const Handler &handler, uint32_t timeoutMs );
+
+      /**
+       * \brief wakes a collector blocked in drain
+       */
+      void wake();
+
+      /**
+       * \brief claims the collector role and aligns ring sequence numbers
+       * \param [in] nextSeq first sequence number the collector expects
+       */
+      void becomeCollector( uint64_t nextSeq );
+
+      uint64_t dropped() const;
+      uint64_t abandoned() const;
+
+    private:
+      std::string name_;
+      void *base_ = NULL;
+      size_t size_ = 0;
+      ShmRingHeader *header_ = NULL;
+      char *cells_ = NULL;
+      uint32_t pid_ = 0;
+      uint32_t abandonMs_ = 1000;
+
+      //Collector-side bookkeeping for the cell at head
+      uint64_t stalledPos_ = 0;
+      int64_t stalledSince_ = 0;
+
+      ShmCell *cell( uint64_t pos ) const;
+      size_t payload() const;
+      bool reclaim( uint64_t pos );
+      bool ownerGone( uint64_t pos );
+      bool stalled( uint64_t pos );
+  };
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Call site registration.
+//
+// A site's id is a CRC-32C of its metadata, so the same call site gets the
+// same id in every process and across restarts, and a store's dictionary
+// stays small no matter how many processes log into it. The process-wide
+// registry only exists to move a site off an id already taken by a
+// different site in this process. Another process may have moved a
+// different site onto that id; the store keeps the first site defined
+// under an id and moves later ones, see FileStore::defineSite.
+
+#include <map>
+#include <mutex>
+
+#include <lumberjack.hpp>
+#include <lumberjack_record.hpp>
+
+namespace lumberjack {
+
+  namespace {
+    /**
+     * \brief ids handed out in this process, keyed to their metadata
+     */
+    class SiteRegistry {
+      public:
+        uint32_t assign( uint32_t id, const std::string &key ) {
+          std::lock_guard<std::mutex> lock( mutex_ );
+          while( true ) {
+            if( id == 0 ) {
+              id = 1;
+            }
+            std::map<uint32_t, std::string>::iterator it = sites_.find( id );
+            if( it == sites_.end()) {
+              sites_[id] = key;
+              return id;
+            }
+            if( it->second == key ) {
+              return id;
+            }
+            id++;
+          }
+        };
+
+      private:
+        std::mutex mutex_;
+        std::map<uint32_t, std::string> sites_;
+    };
+
+    //Never destroyed: sites may be registered during static init and exit
+    SiteRegistry &registry() {
+      static SiteRegistry *instance = new SiteRegistry();
+      return *instance;
+    }
+  }
+
+  CallSite::CallSite( Severity level
+      , const char *module
+      , const char *message
+      , const char *file
+      , uint32_t line
+      )
+    : level_( level )
+    , module_( module == NULL ? "" : module )
+    , message_( message == NULL ? "" : message )
+    , file_( file == NULL ? "" : file )
+    , line_( line )
+  {
+    std::string key;
+    key.push_back( static_cast<char>( level ));
+    key.append( module_ ).push_back( '\0' );
+    key.append( message_ ).push_back( '\0' );
+    key.append( file_ ).push_back( '\0' );
+    putFixed( key, line );
+
+    id_ = registry().assign( crc32c( key.data(), key.size()), key );
+  }
+}
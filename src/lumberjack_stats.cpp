@@ -0,0 +1,166 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+#include <lumberjack_stats.hpp>
+
+namespace lumberjack {
+
+  namespace {
+    const size_t CACHE_LINE = 64;
+
+    //Ids are never reused, so a thread's slot for a destroyed logger can
+    //never match a new one
+    std::atomic<uint64_t> nextId( 1 );
+  }
+
+  thread_local StatsShards::Slot StatsShards::slots_[StatsShards::SLOTS];
+  thread_local size_t StatsShards::nextSlot_ = 0;
+
+  StatsShards::StatsShards()
+    : id_( nextId.fetch_add( 1 ))
+  {
+  }
+
+  StatsShards::~StatsShards()
+  {
+    for( size_t i = 0; i < shards_.size(); i++ ) {
+      shards_[i].second->~StatsShard();
+      free( shards_[i].second );
+    }
+  }
+
+  StatsShard &StatsShards::attach()
+  {
+    StatsShard *shard = NULL;
+    {
+      std::lock_guard<std::mutex> lock( mutex_ );
+      std::thread::id self = std::this_thread::get_id();
+      for( size_t i = 0; i < shards_.size() && shard == NULL; i++ ) {
+        if( shards_[i].first == self ) {
+          shard = shards_[i].second;
+        }
+      }
+      if( shard == NULL ) {
+        //Whole cache lines, so no other allocation shares them
+        const size_t size = ( sizeof( StatsShard ) + CACHE_LINE - 1 ) & ~( CACHE_LINE - 1 );
+        void *memory = NULL;
+        if( posix_memalign( &memory, CACHE_LINE, size ) != 0 ) {
+          throw std::bad_alloc();
+        }
+        shard = new( memory ) StatsShard();
+        shards_.push_back( std::make_pair( self, shard ));
+      }
+    }
+
+    Slot &slot = slots_[nextSlot_];
+    nextSlot_ = ( nextSlot_ + 1 ) % SLOTS;
+    slot.owner = id_;
+    slot.shard = shard;
+    return *shard;
+  }
+
+  void StatsShards::sum( Stats &stats ) const
+  {
+    std::lock_guard<std::mutex> lock( mutex_ );
+    for( size_t i = 0; i < shards_.size(); i++ ) {
+      const StatsShard &shard = *shards_[i].second;
+      stats.appended += shard.appended.load( std::memory_order_relaxed );
+      stats.filtered += shard.filtered.load( std::memory_order_relaxed );
+      stats.sampled += shard.sampled.load( std::memory_order_relaxed );
+      stats.dropped += shard.dropped.load( std::memory_order_relaxed );
+      stats.bytesEncoded += shard.bytes.load( std::memory_order_relaxed );
+    }
+  }
+
+  LatencyHistogram::LatencyHistogram()
+  {
+    for( size_t i = 0; i < BUCKETS; i++ ) {
+      counts_[i].store( 0, std::memory_order_relaxed );
+    }
+  }
+
+  size_t LatencyHistogram::index( uint64_t value )
+  {
+    if( value < SUB_BUCKETS ) {
+      return static_cast<size_t>( value );
+    }
+    size_t exponent = 63 - __builtin_clzll( value );
+    size_t shift = exponent - SUB_BITS;
+    return ( exponent - SUB_BITS + 1 ) * SUB_BUCKETS
+      + static_cast<size_t>(( value >> shift ) & ( SUB_BUCKETS - 1 ));
+  }
+
+  uint64_t LatencyHistogram::highest( size_t index )
+  {
+    if( index < SUB_BUCKETS ) {
+      return index;
+    }
+    size_t shift = index / SUB_BUCKETS - 1;
+    uint64_t lowest = static_cast<uint64_t>( SUB_BUCKETS + index % SUB_BUCKETS ) << shift;
+    return lowest + (( static_cast<uint64_t>( 1 ) << shift ) - 1 );
+  }
+
+  void LatencyHistogram::record( uint64_t ns )
+  {
+    std::atomic<uint64_t> &bucket = counts_[index( ns )];
+    bucket.store( bucket.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+    sum_.store( sum_.load( std::memory_order_relaxed ) + ns, std::memory_order_relaxed );
+    if( ns < min_.load( std::memory_order_relaxed )) {
+      min_.store( ns, std::memory_order_relaxed );
+    }
+    if( ns > max_.load( std::memory_order_relaxed )) {
+      max_.store( ns, std::memory_order_relaxed );
+    }
+  }
+
+  LatencyStats LatencyHistogram::snapshot() const
+  {
+    LatencyStats stats;
+    std::vector<uint64_t> counts( BUCKETS );
+    uint64_t total = 0;
+    for( size_t i = 0; i < BUCKETS; i++ ) {
+      counts[i] = counts_[i].load( std::memory_order_relaxed );
+      total += counts[i];
+    }
+    if( total == 0 ) {
+      return stats;
+    }
+
+    stats.count = total;
+    stats.min = min_.load( std::memory_order_relaxed );
+    stats.max = max_.load( std::memory_order_relaxed );
+    stats.mean = sum_.load( std::memory_order_relaxed ) / total;
+
+    //Each percentile reports the top of the bucket it falls in
+    const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    uint64_t *values[] = { &stats.p50, &stats.p90, &stats.p99, &stats.p999 };
+    uint64_t seen = 0;
+    size_t next = 0;
+    for( size_t i = 0; i < BUCKETS && next < 4; i++ ) {
+      seen += counts[i];
+      while( next < 4 && seen >= static_cast<uint64_t>( quantiles[next] * total + 0.5 )
+          && seen > 0 ) {
+        *values[next] = std::min( highest( i ), stats.max );
+        next++;
+      }
+    }
+    return stats;
+  }
+}
@@ -0,0 +1,140 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ **/
+
+#pragma once
+
+// Self-instrumentation.
+//
+// Producer-side counters live in per-thread shards. Each shard sits on its
+// own cache lines and has a single writer, so counting on the append path
+// is a plain load and store to memory no other thread writes. Shards are
+// only summed when someone asks for the stats.
+//
+// Latency histograms use HDR-style buckets: exact below 16, then 16
+// linear sub-buckets per power of two, which keeps every bucket within
+// about 6% of the values it holds.
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <lumberjack.hpp>
+
+namespace lumberjack {
+
+  /**
+   * \brief counters written by one producer thread
+   */
+  struct StatsShard {
+    std::atomic<uint64_t> appended{ 0 };
+    std::atomic<uint64_t> filtered{ 0 };
+    std::atomic<uint64_t> sampled{ 0 };
+    std::atomic<uint64_t> dropped{ 0 };
+    std::atomic<uint64_t> bytes{ 0 };
+
+    /**
+     * \brief adds to a counter only the owning thread writes
+     */
+    static void add( std::atomic<uint64_t> &counter, uint64_t count )
+    {
+      counter.store( counter.load( std::memory_order_relaxed ) + count
+          , std::memory_order_relaxed );
+    };
+  };
+
+  /**
+   * \brief the shards of one logger
+   */
+  class StatsShards {
+    public:
+      StatsShards();
+      ~StatsShards();
+
+      /**
+       * \brief shard of the calling thread
+       *
+       * Allocates only the first time a thread counts for this logger. A
+       * thread counting for more loggers than it has slots for finds its
+       * shard again under the lock.
+       */
+      StatsShard &local()
+      {
+        for( size_t i = 0; i < SLOTS; i++ ) {
+          if( slots_[i].owner == id_ ) {
+            return *slots_[i].shard;
+          }
+        }
+        return attach();
+      };
+
+      /**
+       * \brief adds every shard's counters to stats
+       */
+      void sum( Stats &stats ) const;
+
+    private:
+      //Loggers a thread can count for before it has to look up its shard
+      static const size_t SLOTS = 4;
+
+      struct Slot {
+        uint64_t owner;
+        StatsShard *shard;
+      };
+
+      static thread_local Slot slots_[SLOTS];
+      static thread_local size_t nextSlot_;
+
+      uint64_t id_;
+      mutable std::mutex mutex_;
+
+      //A thread that reuses an exited thread's id takes over its shard
+      std::vector<std::pair<std::thread::id, StatsShard *> > shards_;
+
+      StatsShard &attach();
+
+      StatsShards( const StatsShards & );
+      StatsShards &operator=( const StatsShards & );
+  };
+
+  /**
+   * \brief HDR-style latency histogram with a single writer
+   *
+   * Readers may take a snapshot while the writer records.
+   */
+  class LatencyHistogram {
+    public:
+      LatencyHistogram();
+
+      void record( uint64_t ns );
+
+      LatencyStats snapshot() const;
+
+    private:
+      static const size_t SUB_BITS = 4;
+      static const size_t SUB_BUCKETS = 1 << SUB_BITS;
+      static const size_t BUCKETS = ( 64 - SUB_BITS + 1 ) * SUB_BUCKETS;
+
+      std::atomic<uint64_t> counts_[BUCKETS];
+      std::atomic<uint64_t> sum_{ 0 };
+      std::atomic<uint64_t> min_{ UINT64_MAX };
+      std::atomic<uint64_t> max_{ 0 };
+
+      static size_t index( uint64_t value );
+      static uint64_t highest( size_t index );
+  };
+}
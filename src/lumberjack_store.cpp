@@ -0,0 +1,2023 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <lumberjack_store.hpp>
+
+namespace lumberjack {
+
+  namespace {
+    const char *SEGMENT_SUFFIX = ".ljseg";
+    const char *BLOB_SUFFIX = ".ljblob";
+    const char *SITE_DICTIONARY = "sites.ljdict";
+    const char *TEMP_SUFFIX = ".tmp";
+    const char *MERGE_SUFFIX = ".ljmerge";
+
+    //Sealed segments under segmentBytes / SMALL_SEGMENT are merged
+    const uint64_t SMALL_SEGMENT = 4;
+
+    //Block size written by compaction
+    const size_t COMPACT_BLOCK_BYTES = 256 * 1024;
+
+    //A failed flush is retried after this long, doubling up to the maximum
+    const uint32_t SYNC_RETRY_MS = 10;
+    const uint32_t SYNC_RETRY_MAX_MS = 1000;
+
+    //ioprio_set has no glibc wrapper; values from linux/ioprio.h
+    const int IOPRIO_WHO_THREAD = 1;
+    const int IOPRIO_IDLE = 3 << 13;
+
+    std::string segmentName( uint64_t firstSeq )
+    {
+      char name[32];
+      snprintf( name, sizeof( name ), "%016llx%s"
+          , static_cast<unsigned long long>( firstSeq )
+          , SEGMENT_SUFFIX
+          );
+      return name;
+    }
+
+    std::string blobName( uint64_t file )
+    {
+      char name[32];
+      snprintf( name, sizeof( name ), "%016llx%s"
+          , static_cast<unsigned long long>( file )
+          , BLOB_SUFFIX
+          );
+      return name;
+    }
+
+    bool readFull( int fd, void *data, size_t size, uint64_t offset )
+    {
+      char *ptr = static_cast<char *>( data );
+      while( size > 0 ) {
+        ssize_t count = ::pread( fd, ptr, size, offset );
+        if( count < 0 && errno == EINTR ) {
+          continue;
+        }
+        if( count <= 0 ) {
+          return false;
+        }
+        ptr += count;
+        size -= count;
+        offset += count;
+      }
+      return true;
+    }
+
+    void syncDirectory( const std::string &path )
+    {
+      int fd = ::open( path.c_str(), O_RDONLY | O_DIRECTORY );
+      if( fd >= 0 ) {
+        ::fsync( fd );
+        ::close( fd );
+      }
+    }
+
+    /**
+     * \brief lists the files named by a 16 digit hex number and a suffix
+     * \return false if the directory cannot be read
+     */
+    bool listNumbered( const std::string &path
+        , const std::string &suffix
+        , std::vector<uint64_t> &numbers
+        )
+    {
+      DIR *dir = ::opendir( path.c_str());
+      if( dir == NULL ) {
+        return false;
+      }
+      for( struct dirent *ent = ::readdir( dir ); ent != NULL; ent = ::readdir( dir )) {
+        std::string name( ent->d_name );
+        if( name.size() == 16 + suffix.size()
+            && name.compare( 16, std::string::npos, suffix ) == 0 ) {
+          numbers.push_back( strtoull( name.substr( 0, 16 ).c_str(), NULL, 16 ));
+        }
+      }
+      ::closedir( dir );
+      std::sort( numbers.begin(), numbers.end());
+      return true;
+    }
+
+    uint64_t fileBytes( const std::string &path )
+    {
+      struct stat st;
+      return ::stat( path.c_str(), &st ) == 0 ? static_cast<uint64_t>( st.st_size ) : 0;
+    }
+
+    /**
+     * \brief oldest timestamp kept for each level, INT64_MIN for no limit
+     */
+    void retentionCutoffs( const StoreOptions &options, int64_t now, int64_t *cutoffs )
+    {
+      for( int level = CRITICAL; level <= ALL; level++ ) {
+        uint32_t seconds = options.retainSeconds;
+        if( level < ALL && options.levelRetainSeconds[level] != 0 ) {
+          seconds = options.levelRetainSeconds[level];
+        }
+        cutoffs[level] = seconds == 0 ? INT64_MIN
+          : now - static_cast<int64_t>( seconds ) * 1000000000;
+      }
+    }
+
+    /**
+     * \brief seals a block, writes it at offset and clears it
+     */
+    bool writeBlock( int fd, BlockBuilder &block, uint64_t &offset )
+    {
+      block.seal();
+      struct iovec iov[2];
+      iov[0].iov_base = const_cast<BlockHeader *>( &block.header());
+      iov[0].iov_len = sizeof( BlockHeader );
+      iov[1].iov_base = const_cast<char *>( block.data().data());
+      iov[1].iov_len = block.data().size();
+      bool ok = writeFull( fd, iov, 2, offset );
+      offset += sizeof( BlockHeader ) + block.bytes();
+      block.clear();
+      return ok;
+    }
+
+    /**
+     * \brief calls f(frame, bytes, site) for every definition in a site
+     * dictionary, stopping at the first torn or corrupt one
+     * \return number of bytes holding valid definitions
+     */
+    template<typename F>
+    size_t forEachSiteFrame( const std::string &data, F f )
+    {
+      const uint8_t *start = reinterpret_cast<const uint8_t *>( data.data());
+      const uint8_t *ptr = start;
+      const uint8_t *end = start + data.size();
+      while( ptr < end ) {
+        uint32_t length = 0;
+        uint32_t crc = 0;
+        const uint8_t *frame = ptr;
+        SiteInfo site;
+        if( !getFixed( ptr, end, length ) || !getFixed( ptr, end, crc )
+            || length > static_cast<size_t>( end - ptr )
+            || crc32c( ptr, length ) != crc
+            || !decodeSiteDefinition( ptr, length, site )) {
+          return static_cast<size_t>( frame - start );
+        }
+        ptr += length;
+        f( frame, static_cast<size_t>( ptr - frame ), site );
+      }
+      return data.size();
+    }
+
+    /**
+     * \brief everything that identifies a call site, as CallSite hashes it
+     */
+    std::string siteKey( const SiteInfo &site )
+    {
+      std::string key;
+      key.push_back( static_cast<char>( site.level ));
+      key.append( site.module ).push_back( '\0' );
+      key.append( site.message ).push_back( '\0' );
+      key.append( site.file ).push_back( '\0' );
+      putFixed( key, site.line );
+      return key;
+    }
+  }
+
+  bool listSegments( const std::string &path, std::vector<SegmentInfo> &segments )
+  {
+    std::vector<uint64_t> numbers;
+    if( !listNumbered( path, SEGMENT_SUFFIX, numbers )) {
+      return false;
+    }
+    for( size_t i = 0; i < numbers.size(); i++ ) {
+      SegmentInfo info;
+      info.path = path + "/" + segmentName( numbers[i] );
+      info.firstSeq = numbers[i];
+      segments.push_back( info );
+    }
+    return true;
+  }
+
+  bool readSites( const std::string &path, std::map<uint32_t, SiteInfo> &sites )
+  {
+    int fd = ::open(( path + "/" + SITE_DICTIONARY ).c_str(), O_RDONLY );
+    if( fd < 0 ) {
+      return errno == ENOENT;
+    }
+    struct stat st;
+    std::string data;
+    bool ok = fstat( fd, &st ) == 0;
+    if( ok ) {
+      data.resize( static_cast<size_t>( st.st_size ));
+      ok = data.empty() || readFull( fd, &data[0], data.size(), 0 );
+    }
+    ::close( fd );
+
+    //A definition still being appended is left for the next read. An id
+    //belongs to the first site defined under it.
+    if( ok ) {
+      forEachSiteFrame( data, [&sites]( const uint8_t *, size_t, const SiteInfo &site ) {
+          sites.insert( std::make_pair( site.id, site ));
+        });
+    }
+    return ok;
+  }
+
+  std::string siblingPath( const std::string &segmentPath, const char *suffix )
+  {
+    size_t length = strlen( SEGMENT_SUFFIX );
+    if( segmentPath.size() >= length
+        && segmentPath.compare( segmentPath.size() - length, length, SEGMENT_SUFFIX ) == 0 ) {
+      return segmentPath.substr( 0, segmentPath.size() - length ) + suffix;
+    }
+    return segmentPath + suffix;
+  }
+
+  void putFrame( std::string &out, const std::string &body )
+  {
+    putFixed<uint32_t>( out, static_cast<uint32_t>( body.size()));
+    putFixed<uint32_t>( out, crc32c( body.data(), body.size()));
+    out.append( body );
+  }
+
+  bool readFile( const std::string &path, std::string &data )
+  {
+    int fd = ::open( path.c_str(), O_RDONLY );
+    if( fd < 0 ) {
+      return false;
+    }
+    struct stat st;
+    bool ok = fstat( fd, &st ) == 0;
+    if( ok ) {
+      data.resize( static_cast<size_t>( st.st_size ));
+      ok = data.empty() || readFull( fd, &data[0], data.size(), 0 );
+    }
+    ::close( fd );
+    return ok;
+  }
+
+  bool replaceFile( const std::string &path, const std::string &data, bool sync )
+  {
+    std::string temp = path + TEMP_SUFFIX;
+    int fd = ::open( temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    if( fd < 0 ) {
+      return false;
+    }
+    struct iovec iov = { const_cast<char *>( data.data()), data.size() };
+    bool ok = ( data.empty() || writeFull( fd, &iov, 1, 0 )) && ( !sync || ::fdatasync( fd ) == 0 );
+    ::close( fd );
+    if( !ok || ::rename( temp.c_str(), path.c_str()) != 0 ) {
+      ::unlink( temp.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  bool appendFile( int fd, const std::string &data )
+  {
+    size_t done = 0;
+    while( done < data.size()) {
+      ssize_t count = ::write( fd, data.data() + done, data.size() - done );
+      if( count < 0 && errno == EINTR ) {
+        continue;
+      }
+      if( count <= 0 ) {
+        return false;
+      }
+      done += count;
+    }
+    return true;
+  }
+
+  /////////////////////////////////////////////
+  // SegmentReader
+  /////////////////////////////////////////////
+  bool SegmentReader::open( const std::string &path )
+  {
+    close();
+    fd_ = ::open( path.c_str(), O_RDONLY );
+    if( fd_ < 0 ) {
+      return false;
+    }
+
+    struct stat st;
+    if( fstat( fd_, &st ) != 0 ) {
+      close();
+      return false;
+    }
+    size_ = static_cast<uint64_t>( st.st_size );
+
+    if( !readFull( fd_, &segment_, sizeof( segment_ ), 0 )
+        || segment_.magic != SEGMENT_MAGIC
+        || segment_.version != SEGMENT_VERSION ) {
+      close();
+      return false;
+    }
+    offset_ = sizeof( segment_ );
+    pending_ = 0;
+    return true;
+  }
+
+  void SegmentReader::close()
+  {
+    if( fd_ >= 0 ) {
+      ::close( fd_ );
+    }
+    fd_ = -1;
+  }
+
+  bool SegmentReader::nextHeader( BlockHeader &header )
+  {
+    if( fd_ < 0 ) {
+      return false;
+    }
+    skipData();
+    if( offset_ + sizeof( header ) > size_ ) {
+      return false;
+    }
+    if( !readFull( fd_, &header, sizeof( header ), offset_ )) {
+      return false;
+    }
+
+    uint32_t headerCrc = header.headerCrc;
+    header.headerCrc = 0;
+    bool valid = header.magic == BLOCK_MAGIC
+        && crc32c( &header, sizeof( header )) == headerCrc
+        && offset_ + sizeof( header ) + header.bytes <= size_;
+    header.headerCrc = headerCrc;
+    if( !valid ) {
+      return false;
+    }
+
+    offset_ += sizeof( header );
+    pending_ = header.bytes;
+    pendingCrc_ = header.crc;
+    return true;
+  }
+
+  bool SegmentReader::readData( std::string &data )
+  {
+    data.resize( pending_ );
+    if( pending_ > 0 && !readFull( fd_, &data[0], pending_, offset_ )) {
+      return false;
+    }
+    offset_ += pending_;
+    pending_ = 0;
+    return crc32c( data.data(), data.size()) == pendingCrc_;
+  }
+
+  void SegmentReader::skipData()
+  {
+    offset_ += pending_;
+    pending_ = 0;
+  }
+
+  namespace {
+    /**
+     * \brief finishes a rewrite that crashed after writing its marker
+     * \param [in] path store directory
+     * \param [in] first path of the segment the run was merged into
+     * \return false if the merge could not be finished
+     */
+    bool finishMerge( const std::string &path, const std::string &first )
+    {
+      std::string marker = first + MERGE_SUFFIX;
+      std::string rest;
+      if( !readFile( marker, rest ) || rest.size() % sizeof( uint64_t ) != 0 ) {
+        return false;
+      }
+
+      //The new file is still beside the first segment if the crash came
+      //before its rename
+      std::string temp = first + TEMP_SUFFIX;
+      if( ::access( temp.c_str(), F_OK ) == 0 ) {
+        ::unlink( rollupPath( first ).c_str());
+        ::unlink( filterPath( first ).c_str());
+        ::unlink( indexPath( first ).c_str());
+        if( ::rename( temp.c_str(), first.c_str()) != 0 ) {
+          return false;
+        }
+      }
+
+      const uint8_t *ptr = reinterpret_cast<const uint8_t *>( rest.data());
+      const uint8_t *end = ptr + rest.size();
+      uint64_t firstSeq = 0;
+      while( getFixed( ptr, end, firstSeq )) {
+        std::string segment = path + "/" + segmentName( firstSeq );
+        ::unlink( rollupPath( segment ).c_str());
+        ::unlink( filterPath( segment ).c_str());
+        ::unlink( indexPath( segment ).c_str());
+        ::unlink( segment.c_str());
+      }
+      syncDirectory( path );
+      return ::unlink( marker.c_str()) == 0;
+    }
+  }
+
+  /////////////////////////////////////////////
+  // FileStore
+  /////////////////////////////////////////////
+  Status FileStore::open( const std::string &path
+      , const StoreOptions &options
+      , const std::string &deviceId
+      )
+  {
+    close();
+
+    if( ::mkdir( path.c_str(), 0755 ) != 0 && errno != EEXIST ) {
+      return ERR;
+    }
+
+    //A rewrite whose marker is on disk is finished first: its new file
+    //replaces the first segment of the run and the rest are removed
+    std::vector<uint64_t> merges;
+    listNumbered( path, std::string( SEGMENT_SUFFIX ) + MERGE_SUFFIX, merges );
+    for( size_t i = 0; i < merges.size(); i++ ) {
+      if( !finishMerge( path, path + "/" + segmentName( merges[i] ))) {
+        return ERR;
+      }
+    }
+
+    std::vector<SegmentInfo> segments;
+    if( !listSegments( path, segments )) {
+      return ERR;
+    }
+
+    //A rewrite interrupted before its marker leaves only temporary files
+    std::vector<uint64_t> temps;
+    listNumbered( path, std::string( SEGMENT_SUFFIX ) + TEMP_SUFFIX, temps );
+    for( size_t i = 0; i < temps.size(); i++ ) {
+      ::unlink(( path + "/" + segmentName( temps[i] ) + TEMP_SUFFIX ).c_str());
+    }
+    for( size_t i = 0; i < segments.size(); i++ ) {
+      ::unlink(( segments[i].path + MERGE_SUFFIX + TEMP_SUFFIX ).c_str());
+      ::unlink(( rollupPath( segments[i].path ) + TEMP_SUFFIX ).c_str());
+      ::unlink(( filterPath( segments[i].path ) + TEMP_SUFFIX ).c_str());
+      ::unlink(( indexPath( segments[i].path ) + TEMP_SUFFIX ).c_str());
+    }
+
+    std::unique_lock<std::mutex> lock( mutex_ );
+    path_ = path;
+    options_ = options;
+    writer_ = createFileWriter( options.backend, options.ioDepth );
+    deviceId_ = deviceId;
+    segments_ = segments;
+    nextSeq_ = 1;
+    deferred_ = false;
+    rollup_ = RollupBuilder();
+    filter_ = FilterBuilder();
+    miner_ = TemplateMiner();
+
+    //Sites and templates first, so the recovered segment's derived files
+    //know them
+    bool opened = loadSites() && loadTemplates();
+    if( opened ) {
+      opened = segments_.empty() ? openSegment( nextSeq_ ) : recoverSegment( segments_.back());
+    }
+    if( !opened ) {
+      if( dictFd_ >= 0 ) {
+        ::close( dictFd_ );
+        dictFd_ = -1;
+      }
+      if( templateFd_ >= 0 ) {
+        ::close( templateFd_ );
+        templateFd_ = -1;
+      }
+      writer_.reset();
+      return ERR;
+    }
+
+    writtenBlocks_ = 0;
+    durableBlocks_ = 0;
+    unsyncedEntries_ = 0;
+    criticalPending_ = false;
+    lastSync_ = Clock::now();
+    retryAt_ = Clock::time_point();
+    retryMs_ = 0;
+    compactDue_ = false;
+    running_ = true;
+    lock.unlock();
+
+    syncer_ = std::thread( &FileStore::syncLoop, this );
+    if( options.compactIntervalMs > 0 ) {
+      compactor_ = std::thread( &FileStore::compactLoop, this );
+    }
+    return OK;
+  }
+
+  void FileStore::close()
+  {
+    std::unique_lock<std::mutex> lock( mutex_ );
+    if( !running_ ) {
+      return;
+    }
+    running_ = false;
+    cv_.notify_all();
+    compactCv_.notify_all();
+    lock.unlock();
+
+    if( syncer_.joinable()) {
+      syncer_.join();
+    }
+    if( compactor_.joinable()) {
+      compactor_.join();
+    }
+
+    //A pass run by compact() gives up once it sees the store closing
+    std::lock_guard<std::mutex> pass( compactMutex_ );
+    lock.lock();
+    bool durable = writer_->drain();
+    if( writtenBlocks_ > durableBlocks_
+        && ( options_.durability != Durability::NONE || !waiters_.empty())) {
+      durable = syncFiles( fd_, blobDirty_ ? blobFd_ : -1 ) && durable;
+    }
+    if( durable ) {
+      durableBlocks_ = writtenBlocks_;
+    }
+    std::deque<std::pair<uint64_t, DurableCallback> > waiters;
+    waiters.swap( waiters_ );
+    writer_->release( fd_ );
+    ::close( fd_ );
+    fd_ = -1;
+    closeDerived();
+    closeBlob();
+    ::close( dictFd_ );
+    dictFd_ = -1;
+    sites_.clear();
+    siteIds_.clear();
+    siteMoves_.clear();
+    ::close( templateFd_ );
+    templateFd_ = -1;
+    templates_.clear();
+    writer_.reset();
+    lock.unlock();
+
+    for( size_t i = 0; i < waiters.size(); i++ ) {
+      waiters[i].second( durable );
+    }
+  }
+
+  bool FileStore::isOpen()
+  {
+    std::lock_guard<std::mutex> lock( mutex_ );
+    return running_;
+  }
+
+  uint64_t FileStore::nextSeq()
+  {
+    std::lock_guard<std::mutex> lock( mutex_ );
+    return nextSeq_;
+  }
+
+  std::vector<SegmentInfo> FileStore::segments()
+  {
+    std::lock_guard<std::mutex> lock( mutex_ );
+    return segments_;
+  }
+
+  const char *FileStore::backend()
+  {
+    std::lock_guard<std::mutex> lock( mutex_ );
+    return writer_ ? writer_->name() : "none";
+  }
+
+  std::string FileStore::directory()
+  {
+    std::lock_guard<std::mutex> lock( mutex_ );
+    return path_;
+  }
+
+  /////////////////////////////////////////////
+  // Creates a new segment file and makes it current. Called with mutex_ held.
+  /////////////////////////////////////////////
+  bool FileStore::openSegment( uint64_t firstSeq )
+  {
+    SegmentInfo info;
+    info.path = path_ + "/" + segmentName( firstSeq );
+    info.firstSeq = firstSeq;
+
+    int fd = ::open( info.path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644 );
+    if( fd < 0 ) {
+      return false;
+    }
+
+    SegmentHeader header;
+    memset( &header, 0, sizeof( header ));
+    header.magic = SEGMENT_MAGIC;
+    header.version = SEGMENT_VERSION;
+    header.firstSeq = firstSeq;
+    header.created = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    strncpy( header.deviceId, deviceId_.c_str(), sizeof( header.deviceId ) - 1 );
+
+    struct iovec iov = { &header, sizeof( header ) };
+    if( !writeFull( fd, &iov, 1, 0 )) {
+      ::close( fd );
+      return false;
+    }
+    if( options_.durability != Durability::NONE ) {
+      ::fdatasync( fd );
+      syncDirectory( path_ );
+    }
+
+    fd_ = fd;
+    offset_ = sizeof( header );
+    if( segments_.empty() || segments_.back().path != info.path ) {
+      segments_.push_back( info );
+    }
+    segments_.back().lowestSeq = firstSeq;
+
+    //Derived files only speed up queries, so the segment is usable without
+    rollup_.reset();
+    if( deferred_ ) {
+      ::unlink( rollupPath( info.path ).c_str());
+      ::unlink( filterPath( info.path ).c_str());
+      return true;
+    }
+    rollupFd_ = ::open( rollupPath( info.path ).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644 );
+    filterFd_ = ::open( filterPath( info.path ).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644 );
+    return true;
+  }
+
+  /////////////////////////////////////////////
+  // Reopens the last segment, truncating any torn block at its tail.
+  // Called with mutex_ held.
+  /////////////////////////////////////////////
+  bool FileStore::recoverSegment( const SegmentInfo &segment )
+  {
+    SegmentReader reader;
+    if( !reader.open( segment.path )) {
+      //An unreadable header means the segment was never completed
+      segments_.pop_back();
+      nextSeq_ = segment.firstSeq;
+      return openSegment( segment.firstSeq );
+    }
+
+    //Frames may have been appended for blocks that were then torn, so the
+    //derived files are rebuilt from the blocks that survive
+    nextSeq_ = segment.firstSeq;
+    uint64_t good = rebuildDerived( reader, segment.path );
+    reader.close();
+
+    fd_ = ::open( segment.path.c_str(), O_RDWR );
+    if( fd_ < 0 ) {
+      return false;
+    }
+    if( ::ftruncate( fd_, static_cast<off_t>( good )) != 0 ) {
+      ::close( fd_ );
+      fd_ = -1;
+      return false;
+    }
+    offset_ = good;
+    return true;
+  }
+
+  /////////////////////////////////////////////
+  // Rebuilds the rollups and filters of the current segment from the
+  // blocks the reader has left and reopens them for appending. Returns the
+  // offset just past the last readable block. Called with mutex_ held.
+  /////////////////////////////////////////////
+  uint64_t FileStore::rebuildDerived( SegmentReader &reader, const std::string &segmentPath )
+  {
+    uint64_t good = reader.offset();
+    BlockHeader header;
+    std::string data;
+    std::string filters;
+    rollup_.reset();
+    uint64_t lowest = segments_.back().firstSeq;
+    while( reader.nextHeader( header )) {
+      uint64_t offset = reader.offset() - sizeof( header );
+      if( !reader.readData( data )) {
+        break;
+      }
+      good = reader.offset();
+      nextSeq_ = std::max( nextSeq_, header.lastSeq + 1 );
+      lowest = std::min( lowest, header.firstSeq );
+      rollup_.addBlock( data );
+      filter_.addBlock( data );
+      filter_.take( offset, filters );
+    }
+
+    closeDerived();
+    std::string path = rollupPath( segmentPath );
+    rollup_.takeBlock( frame_ );
+    rollup_.encodeSegment( frame_ );
+    replaceFile( path, frame_, false );
+    rollupFd_ = ::open( path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644 );
+    path = filterPath( segmentPath );
+    replaceFile( path, filters, false );
+    filterFd_ = ::open( path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644 );
+    segments_.back().lowestSeq = lowest;
+    return good;
+  }
+
+  bool FileStore::deferDerived( bool defer )
+  {
+    std::unique_lock<std::mutex> lock( mutex_ );
+    if( !running_ ) {
+      return false;
+    }
+    if( defer == deferred_ ) {
+      return true;
+    }
+    deferred_ = defer;
+    const std::string &current = segments_.back().path;
+    if( defer ) {
+      closeDerived();
+      ::unlink( rollupPath( current ).c_str());
+      ::unlink( filterPath( current ).c_str());
+      return true;
+    }
+
+    //Blocks still in flight have to land before they can be read back
+    cv_.wait( lock, [this] { return !syncing_; } );
+    SegmentReader reader;
+    if( !writer_->drain() || !reader.open( current )) {
+      return false;
+    }
+    rebuildDerived( reader, current );
+    compactDue_ = true;
+    compactCv_.notify_all();
+    return true;
+  }
+
+  /////////////////////////////////////////////
+  // Closes the derived files of the current segment. Called with mutex_
+  // held.
+  /////////////////////////////////////////////
+  void FileStore::closeDerived()
+  {
+    if( rollupFd_ >= 0 ) {
+      ::close( rollupFd_ );
+      rollupFd_ = -1;
+    }
+    if( filterFd_ >= 0 ) {
+      ::close( filterFd_ );
+      filterFd_ = -1;
+    }
+  }
+
+  /////////////////////////////////////////////
+  // Replaces the per block rollups of the segment being sealed with its
+  // totals. Called by the writer thread with mutex_ held.
+  /////////////////////////////////////////////
+  bool FileStore::sealRollup( const std::string &segmentPath )
+  {
+    rollup_.takeBlock( frame_ );
+    rollup_.encodeSegment( frame_ );
+    return replaceFile( rollupPath( segmentPath ), frame_
+        , options_.durability != Durability::NONE );
+  }
+
+  bool FileStore::write( const BlockBuilder &block
+      , std::vector<std::pair<uint64_t, DurableCallback> > &waiters
+      )
+  {
+    const BlockHeader &header = block.header();
+
+    std::unique_lock<std::mutex> lock( mutex_ );
+    if( !running_ || block.empty()) {
+      return false;
+    }
+
+    //Roll to a new segment once the current one is full. Data in the old
+    //segment is flushed first since the syncer only tracks the current file.
+    if( offset_ > sizeof( SegmentHeader )
+        && offset_ + sizeof( header ) + header.bytes > options_.segmentBytes ) {
+      cv_.wait( lock, [this] { return !syncing_; } );
+
+      bool durable = writer_->drain();
+      if( writtenBlocks_ > durableBlocks_
+          && ( options_.durability != Durability::NONE || !waiters_.empty())) {
+        durable = syncFiles( fd_, blobDirty_ ? blobFd_ : -1 ) && durable;
+        if( durable ) {
+          durableBlocks_ = writtenBlocks_;
+        }
+      }
+      std::deque<std::pair<uint64_t, DurableCallback> > done;
+      done.swap( waiters_ );
+      writer_->release( fd_ );
+      ::close( fd_ );
+      fd_ = -1;
+      closeBlob();
+      closeDerived();
+      if( !deferred_ ) {
+        sealRollup( segments_.back().path );
+      }
+
+      bool opened = openSegment( std::max( nextSeq_, header.firstSeq ));
+      compactDue_ = true;
+      compactCv_.notify_all();
+      lock.unlock();
+      for( size_t i = 0; i < done.size(); i++ ) {
+        done[i].second( durable );
+      }
+      if( !opened ) {
+        return false;
+      }
+      lock.lock();
+    }
+
+    int fd = fd_;
+    uint64_t offset = offset_;
+    offset_ += sizeof( header ) + header.bytes;
+    lock.unlock();
+
+    //Only the writer thread modifies fd_ and offset_, so the write itself
+    //happens without holding the lock. With the io_uring backend this only
+    //submits the write; the syncer's flush is ordered behind it.
+    struct iovec iov[2];
+    iov[0].iov_base = const_cast<BlockHeader *>( &header );
+    iov[0].iov_len = sizeof( header );
+    iov[1].iov_base = const_cast<char *>( block.data().data());
+    iov[1].iov_len = block.data().size();
+    bool ok = writer_->write( fd, iov, 2, offset );
+
+    //Counted as soon as the write is issued. A block that is then lost is
+    //left out again when the segment is recovered.
+    if( ok && !deferred_ ) {
+      rollup_.addBlock( block.data());
+      if( rollup_.takeBlock( frame_ ) && rollupFd_ >= 0 ) {
+        appendFile( rollupFd_, frame_ );
+      }
+      frame_.clear();
+      filter_.addBlock( block.data());
+      if( filter_.take( offset, frame_ ) && filterFd_ >= 0 ) {
+        appendFile( filterFd_, frame_ );
+      }
+    }
+
+    lock.lock();
+    if( !ok ) {
+      offset_ = offset;
+      lock.unlock();
+      for( size_t i = 0; i < waiters.size(); i++ ) {
+        waiters[i].second( false );
+      }
+      waiters.clear();
+      return false;
+    }
+
+    Clock::time_point now = Clock::now();
+    if( writtenBlocks_ == durableBlocks_ ) {
+      firstDirty_ = now;
+    }
+    writtenBlocks_++;
+    nextSeq_ = std::max( nextSeq_, header.lastSeq + 1 );
+    SegmentInfo &current = segments_.back();
+    current.lowestSeq = std::min( current.lowestSeq, header.firstSeq );
+    unsyncedEntries_ += header.count;
+    if( header.levelMask & ( 1u << CRITICAL )) {
+      criticalPending_ = true;
+    }
+    //Waiters are completed in block order, whatever their entries' numbers
+    for( size_t i = 0; i < waiters.size(); i++ ) {
+      waiters_.push_back( std::make_pair( writtenBlocks_, waiters[i].second ));
+    }
+    waiters.clear();
+    cv_.notify_all();
+    return true;
+  }
+
+  bool FileStore::read( uint64_t seq, Record &record )
+  {
+    //A compaction that moved entries while they were looked for may have
+    //hidden them, so look again until the segments hold still
+    bool found = false;
+    bool drained = false;
+    for( ;; ) {
+      std::vector<SegmentInfo> segments;
+      uint64_t generation = 0;
+      FileWriter *writer = NULL;
+      {
+        std::lock_guard<std::mutex> lock( mutex_ );
+        segments = segments_;
+        generation = generation_;
+        if( !drained && seq < nextSeq_ ) {
+          writer = writer_.get();
+        }
+      }
+      found = find( segments, seq, record );
+
+      //With io_uring, write() returns once the block is submitted, so an
+      //entry it has numbered may not have landed yet
+      if( !found && writer != NULL ) {
+        writer->drain();
+        drained = true;
+        continue;
+      }
+
+      std::lock_guard<std::mutex> lock( mutex_ );
+      if( generation == generation_ ) {
+        learnLowest( segments );
+      }
+      if( found || generation == generation_ ) {
+        break;
+      }
+    }
+
+    if( found && ( record.flags & RECORD_SPILLED )) {
+      found = resolveSpill( record );
+    }
+    if( found && ( record.flags & RECORD_TEMPLATE )) {
+      std::lock_guard<std::mutex> lock( mutex_ );
+      found = applyTemplate( templates_, record );
+    }
+    if( found && record.site != 0 ) {
+      std::lock_guard<std::mutex> lock( mutex_ );
+      std::map<uint32_t, SiteInfo>::const_iterator site = sites_.find( record.site );
+      if( site != sites_.end()) {
+        applySite( site->second, record );
+      }
+    }
+    return found;
+  }
+
+  /////////////////////////////////////////////
+  // Looks an entry up in a snapshot of the segment list, noting the lowest
+  // entry number of each segment it reads through
+  /////////////////////////////////////////////
+  bool FileStore::find( std::vector<SegmentInfo> &segments, uint64_t seq, Record &record )
+  {
+    //Start at the last segment that starts at or before the requested
+    //entry. Lower priority entries can be written after higher numbered
+    //ones, so the entry may also be in a later segment, and block ranges
+    //may overlap.
+    std::vector<SegmentInfo>::iterator it = segments.end();
+    while( it != segments.begin() && ( it - 1 )->firstSeq > seq ) {
+      --it;
+    }
+    if( it != segments.begin()) {
+      --it;
+    }
+
+    //Later segments holding nothing that low are passed over unread
+    bool found = false;
+    for( ; it != segments.end() && !found; ++it ) {
+      SegmentReader reader;
+      if( it->lowestSeq > seq || !reader.open( it->path )) {
+        continue;
+      }
+
+      BlockHeader header;
+      std::string data;
+      uint64_t lowest = it->firstSeq;
+      while( !found && reader.nextHeader( header )) {
+        lowest = std::min( lowest, header.firstSeq );
+        if( seq < header.firstSeq || seq > header.lastSeq ) {
+          continue;
+        }
+        if( !reader.readData( data )) {
+          return false;
+        }
+        forEachRecord( data, [&]( const uint8_t *body, size_t size ) {
+            if( !found && size >= RECORD_HEADER_BYTES && recordSeq( body ) == seq ) {
+              found = decodeRecord( body, size, record );
+            }
+          });
+      }
+      if( !found && it->lowestSeq == 0 ) {
+        it->lowestSeq = lowest;
+      }
+    }
+    return found;
+  }
+
+  /////////////////////////////////////////////
+  // Keeps the lowest entry numbers find() noted in a snapshot. Called with
+  // mutex_ held while the segments are those of the snapshot.
+  /////////////////////////////////////////////
+  void FileStore::learnLowest( const std::vector<SegmentInfo> &segments )
+  {
+    for( size_t i = 0; i < segments.size() && i < segments_.size(); i++ ) {
+      if( segments_[i].lowestSeq == 0 && segments_[i].path == segments[i].path ) {
+        segments_[i].lowestSeq = segments[i].lowestSeq;
+      }
+    }
+  }
+
+  bool FileStore::prepareRecord( const uint8_t *body
+      , size_t size
+      , const void *payload
+      , size_t payloadSize
+      , std::string &out
+      )
+  {
+    if( !moveSite( body, size )) {
+      return prepareMessage( body, size, payload, payloadSize, out );
+    }
+    if( !prepareMessage( reinterpret_cast<const uint8_t *>( moved_.data()), moved_.size()
+          , payload, payloadSize, out )) {
+      out.swap( moved_ );
+    }
+    return true;
+  }
+
+  /////////////////////////////////////////////
+  // Places, spills or templates the message of a record
+  /////////////////////////////////////////////
+  bool FileStore::prepareMessage( const uint8_t *body
+      , size_t size
+      , const void *payload
+      , size_t payloadSize
+      , std::string &out
+      )
+  {
+    if( size >= RECORD_HEADER_BYTES && recordType( body ) == static_cast<uint8_t>( PayloadType::STRING )) {
+      return options_.mineTemplates && payload == NULL && mineTemplate( body, size, out );
+    }
+    if( size < RECORD_HEADER_BYTES || recordType( body ) != static_cast<uint8_t>( PayloadType::BINARY )
+        || ( recordFlags( body ) & RECORD_SPILLED )) {
+      return false;
+    }
+
+    bool separate = payload != NULL;
+    if( !separate ) {
+      size_t start = 0;
+      size_t offset = 0;
+      if( !locateMessage( body, size, start, offset, payloadSize )) {
+        return false;
+      }
+      payload = body + offset;
+    }
+
+    SpillRef ref;
+    if( options_.spillBytes > 0 && payloadSize >= options_.spillBytes
+        && spill( payload, payloadSize, ref )) {
+      return rewriteMessage( body, size, &ref, sizeof( ref ), RECORD_SPILLED, out );
+    }
+
+    //Kept inline: below the threshold, or the blob file could not be written
+    return separate && rewriteMessage( body, size, payload, payloadSize, 0, out );
+  }
+
+  /////////////////////////////////////////////
+  // Appends a payload to the blob file of the current segment
+  /////////////////////////////////////////////
+  bool FileStore::spill( const void *data, size_t size, SpillRef &ref )
+  {
+    ref.length = static_cast<uint32_t>( size );
+    ref.crc = crc32c( data, size );
+
+    std::unique_lock<std::mutex> lock( mutex_ );
+    if( !running_ ) {
+      return false;
+    }
+
+    uint64_t file = segments_.back().firstSeq;
+    if( blobFd_ < 0 || blobFile_ != file ) {
+      closeBlob();
+      std::string path = path_ + "/" + blobName( file );
+      blobFd_ = ::open( path.c_str(), O_RDWR | O_CREAT, 0644 );
+      if( blobFd_ < 0 ) {
+        return false;
+      }
+
+      //Space left by payloads whose records were torn is not reused
+      struct stat st;
+      blobOffset_ = fstat( blobFd_, &st ) == 0 ? static_cast<uint64_t>( st.st_size ) : 0;
+      blobFile_ = file;
+      if( blobOffset_ == 0 && options_.durability != Durability::NONE ) {
+        syncDirectory( path_ );
+      }
+    }
+
+    ref.file = file;
+    ref.offset = blobOffset_;
+    blobOffset_ += size;
+    int fd = blobFd_;
+    lock.unlock();
+
+    struct iovec iov = { const_cast<void *>( data ), size };
+    bool ok = writeFull( fd, &iov, 1, ref.offset );
+
+    //Marked dirty only once written, so a sync that starts before the
+    //write finishes does not clear it
+    lock.lock();
+    if( ok ) {
+      blobDirty_ = true;
+    }
+    return ok;
+  }
+
+  /////////////////////////////////////////////
+  // Replaces a SpillRef in a record with the payload it points to
+  /////////////////////////////////////////////
+  bool FileStore::resolveSpill( Record &record )
+  {
+    SpillRef ref;
+    if( record.message.size() != sizeof( ref )) {
+      return false;
+    }
+    memcpy( &ref, record.message.data(), sizeof( ref ));
+
+    std::string path = path_ + "/" + blobName( ref.file );
+    int fd = ::open( path.c_str(), O_RDONLY );
+    if( fd < 0 ) {
+      return false;
+    }
+    std::string payload( ref.length, '\0' );
+    bool ok = ref.length == 0 || readFull( fd, &payload[0], ref.length, ref.offset );
+    ::close( fd );
+    if( !ok || crc32c( payload.data(), payload.size()) != ref.crc ) {
+      return false;
+    }
+
+    record.message.swap( payload );
+    record.flags &= ~RECORD_SPILLED;
+    return true;
+  }
+
+  /////////////////////////////////////////////
+  // Flushes the blob file, then the segment. Payloads must be durable no
+  // later than the records that refer to them.
+  /////////////////////////////////////////////
+  bool FileStore::syncFiles( int fd, int blobFd )
+  {
+    bool ok = blobFd < 0 || ::fdatasync( blobFd ) == 0;
+    return writer_->sync( fd ) && ok;
+  }
+
+  /////////////////////////////////////////////
+  // Closes the blob file. Called with mutex_ held.
+  /////////////////////////////////////////////
+  void FileStore::closeBlob()
+  {
+    if( blobFd_ >= 0 ) {
+      ::close( blobFd_ );
+    }
+    blobFd_ = -1;
+    blobDirty_ = false;
+  }
+
+  /////////////////////////////////////////////
+  // Opens the site dictionary and loads its definitions, dropping a torn
+  // definition at its tail. Called with mutex_ held.
+  /////////////////////////////////////////////
+  bool FileStore::loadSites()
+  {
+    std::string path = path_ + "/" + SITE_DICTIONARY;
+    dictFd_ = ::open( path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644 );
+    if( dictFd_ < 0 ) {
+      return false;
+    }
+
+    struct stat st;
+    if( fstat( dictFd_, &st ) != 0 ) {
+      return false;
+    }
+
+    std::string data( static_cast<size_t>( st.st_size ), '\0' );
+    if( !data.empty() && !readFull( dictFd_, &data[0], data.size(), 0 )) {
+      return false;
+    }
+
+    sites_.clear();
+    siteIds_.clear();
+    size_t valid = forEachSiteFrame( data, [this]( const uint8_t *, size_t, const SiteInfo &site ) {
+        addSite( site );
+      });
+
+    if( valid != data.size() && ::ftruncate( dictFd_, static_cast<off_t>( valid )) != 0 ) {
+      return false;
+    }
+    return true;
+  }
+
+  /////////////////////////////////////////////
+  // Keeps a site unless its id is taken. Called with mutex_ held.
+  /////////////////////////////////////////////
+  bool FileStore::addSite( const SiteInfo &site )
+  {
+    if( !sites_.insert( std::make_pair( site.id, site )).second ) {
+      return false;
+    }
+    siteIds_[siteKey( site )] = site.id;
+    rollup_.defineSite( site );
+    filter_.defineSite( site );
+    return true;
+  }
+
+  bool FileStore::defineSite( const uint8_t *body, size_t size )
+  {
+    SiteInfo site;
+    if( !decodeSiteDefinition( body, size, site )) {
+      return false;
+    }
+    std::pair<uint32_t, uint32_t> announced( recordPid( body ), site.id );
+
+    std::lock_guard<std::mutex> lock( mutex_ );
+    if( !running_ ) {
+      return false;
+    }
+
+    //Entries of the site go under the id the store already has for it
+    std::string key = siteKey( site );
+    std::map<std::string, uint32_t>::const_iterator known = siteIds_.find( key );
+    if( known != siteIds_.end()) {
+      if( known->second == site.id ) {
+        siteMoves_.erase( announced );
+      }
+      else {
+        siteMoves_[announced] = known->second;
+      }
+      return true;
+    }
+
+    //A different site owns the id, so this one takes the next free id
+    std::string moved;
+    if( sites_.count( site.id )) {
+      do {
+        if( ++site.id == 0 ) {
+          site.id = 1;
+        }
+      } while( sites_.count( site.id ));
+      moved.assign( reinterpret_cast<const char *>( body ), size );
+      setRecordSite( reinterpret_cast<uint8_t *>( &moved[0] ), site.id );
+      body = reinterpret_cast<const uint8_t *>( moved.data());
+    }
+
+    //Definitions are rare, so each is written and flushed on its own before
+    //any block that refers to it
+    uint32_t length = static_cast<uint32_t>( size );
+    uint32_t crc = crc32c( body, size );
+    struct iovec iov[3] = {
+      { &length, sizeof( length ) },
+      { &crc, sizeof( crc ) },
+      { const_cast<uint8_t *>( body ), size }
+    };
+    if( ::writev( dictFd_, iov, 3 ) != static_cast<ssize_t>( sizeof( length ) + sizeof( crc ) + size )) {
+      return false;
+    }
+    if( options_.durability != Durability::NONE ) {
+      ::fdatasync( dictFd_ );
+      if( dictMoved_ ) {
+        syncDirectory( path_ );
+      }
+    }
+
+    addSite( site );
+    if( site.id == announced.second ) {
+      siteMoves_.erase( announced );
+    }
+    else {
+      siteMoves_[announced] = site.id;
+    }
+    return true;
+  }
+
+  /////////////////////////////////////////////
+  // Gives an entry the id its call site has in this store, in moved_
+  /////////////////////////////////////////////
+  bool FileStore::moveSite( const uint8_t *body, size_t size )
+  {
+    if( siteMoves_.empty() || size < RECORD_HEADER_BYTES + sizeof( uint32_t )
+        || ( recordFlags( body ) & ( RECORD_SITE | RECORD_SITE_DEF )) != RECORD_SITE ) {
+      return false;
+    }
+    std::map<std::pair<uint32_t, uint32_t>, uint32_t>::const_iterator it
+      = siteMoves_.find( std::make_pair( recordPid( body ), recordSite( body )));
+    if( it == siteMoves_.end()) {
+      return false;
+    }
+    moved_.assign( reinterpret_cast<const char *>( body ), size );
+    setRecordSite( reinterpret_cast<uint8_t *>( &moved_[0] ), it->second );
+    return true;
+  }
+
+  /////////////////////////////////////////////
+  // Opens the template dictionary and teaches its templates to the miner,
+  // dropping a torn definition at its tail. Called with mutex_ held.
+  /////////////////////////////////////////////
+  bool FileStore::loadTemplates()
+  {
+    std::string path = templateDictionary( path_ );
+    templateFd_ = ::open( path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644 );
+    if( templateFd_ < 0 ) {
+      return false;
+    }
+
+    struct stat st;
+    if( fstat( templateFd_, &st ) != 0 ) {
+      return false;
+    }
+
+    std::string data( static_cast<size_t>( st.st_size ), '\0' );
+    if( !data.empty() && !readFull( templateFd_, &data[0], data.size(), 0 )) {
+      return false;
+    }
+
+    templates_.clear();
+    size_t valid = parseTemplates( data, templates_ );
+    for( std::map<uint32_t, MessageTemplate>::const_iterator it = templates_.begin()
+        ; it != templates_.end(); ++it ) {
+      miner_.learn( it->second );
+      filter_.defineTemplate( it->second );
+    }
+
+    if( valid != data.size() && ::ftruncate( templateFd_, static_cast<off_t>( valid )) != 0 ) {
+      return false;
+    }
+    return true;
+  }
+
+  /////////////////////////////////////////////
+  // Encodes a string record by its template. Called by the writer thread.
+  /////////////////////////////////////////////
+  bool FileStore::mineTemplate( const uint8_t *body, size_t size, std::string &out )
+  {
+    size_t start = 0;
+    size_t offset = 0;
+    size_t length = 0;
+    if(( recordFlags( body ) & ( RECORD_SITE | RECORD_TEMPLATE ))
+        || !locateMessage( body, size, start, offset, length )) {
+      return false;
+    }
+
+    const MessageTemplate *defined = NULL;
+    bool shorter = miner_.encode( body + offset, length, templated_, defined );
+
+    //A template that could not be stored must not be referred to, so the
+    //miner is started over without it
+    if( defined != NULL && !defineTemplate( *defined )) {
+      miner_ = TemplateMiner();
+      std::lock_guard<std::mutex> lock( mutex_ );
+      for( std::map<uint32_t, MessageTemplate>::const_iterator it = templates_.begin()
+          ; it != templates_.end(); ++it ) {
+        miner_.learn( it->second );
+      }
+      return false;
+    }
+    return shorter && rewriteMessage( body, size, templated_.data(), templated_.size()
+        , RECORD_TEMPLATE, out );
+  }
+
+  /////////////////////////////////////////////
+  // Appends a template to the dictionary ahead of the records using it.
+  // Called by the writer thread.
+  /////////////////////////////////////////////
+  bool FileStore::defineTemplate( const MessageTemplate &tmpl )
+  {
+    std::string body;
+    std::string frame;
+    encodeTemplate( tmpl, body );
+    putFrame( frame, body );
+
+    std::lock_guard<std::mutex> lock( mutex_ );
+    if( !running_ || !appendFile( templateFd_, frame )) {
+      return false;
+    }
+    if( options_.durability != Durability::NONE ) {
+      ::fdatasync( templateFd_ );
+    }
+    templates_[tmpl.id] = tmpl;
+    filter_.defineTemplate( tmpl );
+    return true;
+  }
+
+  /////////////////////////////////////////////
+  // Decides whether the syncer should flush now. Called with mutex_ held.
+  /////////////////////////////////////////////
+  bool FileStore::syncDue( Clock::time_point now )
+  {
+    if( writtenBlocks_ <= durableBlocks_ || now < retryAt_ ) {
+      return false;
+    }
+
+    switch( options_.durability ) {
+      case Durability::NONE:
+        return !waiters_.empty();
+      case Durability::SYNC_CRITICAL:
+        return criticalPending_ || !waiters_.empty();
+      case Durability::INTERVAL:
+        return now - lastSync_ >= std::chrono::microseconds( options_.intervalUs );
+      case Durability::GROUP:
+        return unsyncedEntries_ >= options_.groupEntries
+          || now - firstDirty_ >= std::chrono::microseconds( options_.groupUs );
+    }
+    return false;
+  }
+
+  /////////////////////////////////////////////
+  // Returns when the syncer should next wake up. Called with mutex_ held.
+  /////////////////////////////////////////////
+  FileStore::Clock::time_point FileStore::syncDeadline()
+  {
+    if( writtenBlocks_ > durableBlocks_ ) {
+      if( retryAt_ > Clock::now()) {
+        return retryAt_;
+      }
+      if( options_.durability == Durability::INTERVAL ) {
+        return lastSync_ + std::chrono::microseconds( options_.intervalUs );
+      }
+      if( options_.durability == Durability::GROUP ) {
+        return firstDirty_ + std::chrono::microseconds( options_.groupUs );
+      }
+    }
+    return Clock::now() + std::chrono::seconds( 1 );
+  }
+
+  void FileStore::syncLoop()
+  {
+    std::unique_lock<std::mutex> lock( mutex_ );
+    while( running_ ) {
+      Clock::time_point now = Clock::now();
+      if( !syncDue( now )) {
+        cv_.wait_until( lock, syncDeadline());
+        continue;
+      }
+
+      //Everything written so far is covered by this flush, so all waiters
+      //up to target share it.
+      uint64_t target = writtenBlocks_;
+      uint64_t entries = unsyncedEntries_;
+      int fd = fd_;
+      int blobFd = blobDirty_ ? blobFd_ : -1;
+      blobDirty_ = false;
+      syncing_ = true;
+      lock.unlock();
+
+      bool durable = syncFiles( fd, blobFd );
+
+      lock.lock();
+      syncing_ = false;
+      if( !durable && blobFd >= 0 ) {
+        blobDirty_ = true;
+      }
+      lastSync_ = Clock::now();
+      if( durable ) {
+        durableBlocks_ = std::max( durableBlocks_, target );
+        unsyncedEntries_ -= std::min( unsyncedEntries_, entries );
+        criticalPending_ = criticalPending_ && writtenBlocks_ > target;
+        firstDirty_ = lastSync_;
+        retryAt_ = Clock::time_point();
+        retryMs_ = 0;
+      } else {
+        //The blocks stay pending, so back off rather than flush again at
+        //once. The waiters up to target are failed below; later ones wait
+        //for the retry.
+        retryMs_ = retryMs_ == 0 ? SYNC_RETRY_MS : std::min( retryMs_ * 2, SYNC_RETRY_MAX_MS );
+        retryAt_ = lastSync_ + std::chrono::milliseconds( retryMs_ );
+      }
+
+      std::vector<std::pair<uint64_t, DurableCallback> > done;
+      while( !waiters_.empty() && waiters_.front().first <= target ) {
+        done.push_back( waiters_.front());
+        waiters_.pop_front();
+      }
+      cv_.notify_all();
+      lock.unlock();
+
+      for( size_t i = 0; i < done.size(); i++ ) {
+        done[i].second( durable );
+      }
+      lock.lock();
+    }
+  }
+
+  /////////////////////////////////////////////
+  // Compaction
+  /////////////////////////////////////////////
+  bool FileStore::compact()
+  {
+    return compactPass( false );
+  }
+
+  bool FileStore::compactPass( bool paced )
+  {
+    std::lock_guard<std::mutex> pass( compactMutex_ );
+    std::unique_lock<std::mutex> lock( mutex_ );
+    if( !running_ ) {
+      return false;
+    }
+    std::vector<SegmentInfo> segments = segments_;
+    StoreOptions options = options_;
+    lock.unlock();
+
+    int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    int64_t cutoffs[ALL + 1];
+    retentionCutoffs( options, now, cutoffs );
+
+    //Everything counts toward the size limit: the current segment, and blob
+    //files, which go with the segment they are named into
+    std::vector<uint64_t> blobs;
+    listNumbered( path_, BLOB_SUFFIX, blobs );
+    std::vector<uint64_t> fileSize( segments.size(), 0 );
+    std::vector<uint64_t> footprint( segments.size(), 0 );
+    uint64_t total = 0;
+    size_t blob = 0;
+    for( size_t i = 0; i < segments.size(); i++ ) {
+      fileSize[i] = fileBytes( segments[i].path );
+      footprint[i] = fileSize[i];
+      bool last = i + 1 == segments.size();
+      for( ; blob < blobs.size() && ( last || blobs[blob] < segments[i + 1].firstSeq ); blob++ ) {
+        uint64_t size = fileBytes( path_ + "/" + blobName( blobs[blob] ));
+        total += size;
+        if( blobs[blob] >= segments[i].firstSeq ) {
+          footprint[i] += size;
+        }
+      }
+      total += fileSize[i];
+    }
+
+    //Sealed segments are deleted once all they hold has expired or while
+    //the store is too large. What is left is grouped into runs to rewrite:
+    //neighbours small enough to share a segment, and segments that hold
+    //expired entries.
+    std::vector<SegmentInfo> doomed;
+    std::vector<std::vector<SegmentInfo> > runs;
+    std::vector<SegmentInfo> run;
+    uint64_t runBytes = 0;
+    bool runStale = false;
+    for( size_t i = 0; i + 1 < segments.size(); i++ ) {
+      bool readable = false;
+      bool expired = true;
+      bool stale = false;
+      SegmentReader reader;
+      if( reader.open( segments[i].path )) {
+        readable = true;
+        BlockHeader header;
+        while( reader.nextHeader( header )) {
+          for( int level = CRITICAL; level <= ALL; level++ ) {
+            if( header.levelMask & ( 1u << level )) {
+              expired = expired && header.maxTimestamp < cutoffs[level];
+              stale = stale || header.minTimestamp < cutoffs[level];
+            }
+          }
+        }
+      }
+
+      bool oversize = options.retainBytes > 0 && total > options.retainBytes;
+      if( oversize || ( readable && expired )) {
+        doomed.push_back( segments[i] );
+        total -= std::min( total, footprint[i] );
+        continue;
+      }
+
+      bool candidate = readable && ( stale || fileSize[i] < options.segmentBytes / SMALL_SEGMENT );
+      if( !run.empty() && ( !candidate || runBytes + fileSize[i] > options.segmentBytes )) {
+        if( run.size() > 1 || runStale ) {
+          runs.push_back( run );
+        }
+        run.clear();
+        runBytes = 0;
+        runStale = false;
+      }
+      if( candidate ) {
+        run.push_back( segments[i] );
+        runBytes += fileSize[i];
+        runStale = runStale || stale;
+      }
+    }
+    if( run.size() > 1 || runStale ) {
+      runs.push_back( run );
+    }
+
+    removeSegments( doomed );
+    bool ok = true;
+    for( size_t i = 0; i < runs.size() && ok; i++ ) {
+      ok = rewrite( runs[i], cutoffs, paced ? options.compactBytesPerSec : 0 );
+    }
+    removeOrphanBlobs();
+    ok = ok && backfillDerived( paced ? options.compactBytesPerSec : 0 );
+    return compactSites() && ok;
+  }
+
+  /////////////////////////////////////////////
+  // Rewrites a run of neighbouring sealed segments into one, named after
+  // the first, leaving out entries older than their level's cutoff
+  /////////////////////////////////////////////
+  bool FileStore::rewrite( const std::vector<SegmentInfo> &run
+      , const int64_t *cutoffs
+      , uint64_t bytesPerSec
+      )
+  {
+    std::string temp = run[0].path + TEMP_SUFFIX;
+    int fd = ::open( temp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644 );
+    if( fd < 0 ) {
+      return false;
+    }
+
+    Clock::time_point start = Clock::now();
+    uint64_t moved = 0;
+    uint64_t offset = 0;
+    uint64_t dropped = 0;
+    BlockBuilder block;
+    RollupBuilder rollup;
+    FilterBuilder filter;
+    IndexBuilder index;
+    std::string filters;
+    seedBuilders( rollup, filter, index );
+    std::string data;
+    bool indexed = false;
+    {
+      std::lock_guard<std::mutex> lock( mutex_ );
+      indexed = options_.indexMessages;
+    }
+    bool ok = true;
+    for( size_t i = 0; i < run.size() && ok; i++ ) {
+      SegmentReader reader;
+      if( !reader.open( run[i].path )) {
+        ok = false;
+        break;
+      }
+      if( i == 0 ) {
+        SegmentHeader header = reader.header();
+        struct iovec iov = { &header, sizeof( header ) };
+        ok = writeFull( fd, &iov, 1, 0 );
+        offset = sizeof( header );
+      }
+
+      BlockHeader header;
+      while( ok && reader.nextHeader( header )) {
+        //A block failing its checksum was unreadable already
+        if( !reader.readData( data )) {
+          dropped += header.count;
+          continue;
+        }
+        moved += sizeof( header ) + data.size();
+        forEachRecord( data, [&]( const uint8_t *body, size_t size ) {
+            if( size < RECORD_HEADER_BYTES || recordLevel( body ) > ALL ) {
+              dropped++;
+              return;
+            }
+            if( recordTimestamp( body ) < cutoffs[recordLevel( body )]
+                || !block.addEncoded( body, size, recordSeq( body ))) {
+              dropped++;
+              return;
+            }
+            rollup.add( body, size );
+            filter.add( body, size );
+            if( indexed ) {
+              index.add( body, size );
+            }
+          });
+
+        if( block.bytes() >= COMPACT_BLOCK_BYTES ) {
+          moved += sizeof( BlockHeader ) + block.bytes();
+          filter.take( offset, filters );
+          ok = writeBlock( fd, block, offset );
+        }
+        ok = ok && pace( start, moved, bytesPerSec );
+      }
+    }
+    if( ok && !block.empty()) {
+      filter.take( offset, filters );
+      ok = writeBlock( fd, block, offset );
+    }
+
+    //A lone segment that lost nothing is left as it is
+    bool changed = dropped > 0 || run.size() > 1;
+    bool empty = offset <= sizeof( SegmentHeader );
+    if( ok && changed && !empty ) {
+      ok = ::fdatasync( fd ) == 0;
+    }
+    ::close( fd );
+    if( !ok || !changed || empty ) {
+      ::unlink( temp.c_str());
+      if( ok && changed ) {
+        removeSegments( run );
+      }
+      return ok;
+    }
+
+    //The marker decides the merge: from here on a crash is finished by
+    //the next open rather than leaving entries in two segments
+    std::string marker = run[0].path + MERGE_SUFFIX;
+    std::string rest;
+    for( size_t i = 1; i < run.size(); i++ ) {
+      putFixed<uint64_t>( rest, run[i].firstSeq );
+    }
+    if( !replaceFile( marker, rest, true )) {
+      ::unlink( temp.c_str());
+      return false;
+    }
+    syncDirectory( path_ );
+
+    //The old derived files are gone before the segment is replaced, so a
+    //crash leaves them missing rather than wrong, and the next pass
+    //rebuilds them
+    ::unlink( rollupPath( run[0].path ).c_str());
+    ::unlink( filterPath( run[0].path ).c_str());
+    ::unlink( indexPath( run[0].path ).c_str());
+    if( ::rename( temp.c_str(), run[0].path.c_str()) != 0 ) {
+      //Left for the next open to finish, which the marker guarantees
+      return false;
+    }
+
+    //The merged segment may now hold entries below its old lowest
+    {
+      std::lock_guard<std::mutex> lock( mutex_ );
+      for( size_t i = 0; i < segments_.size(); i++ ) {
+        if( segments_[i].path == run[0].path ) {
+          segments_[i].lowestSeq = 0;
+        }
+      }
+      generation_++;
+    }
+    rollup.takeBlock( data );
+    rollup.encodeSegment( data );
+    replaceFile( rollupPath( run[0].path ), data, true );
+    replaceFile( filterPath( run[0].path ), filters, true );
+    if( indexed ) {
+      index.finish();
+      index.encode( data );
+      replaceFile( indexPath( run[0].path ), data, true );
+    }
+    syncDirectory( path_ );
+    removeSegments( std::vector<SegmentInfo>( run.begin() + 1, run.end()));
+    ::unlink( marker.c_str());
+    return true;
+  }
+
+  /////////////////////////////////////////////
+  // Holds a paced pass back to bytesPerSec since start, and waits out any
+  // flush of the ingest path. Returns false once the store is closing.
+  /////////////////////////////////////////////
+  bool FileStore::pace( Clock::time_point start, uint64_t bytes, uint64_t bytesPerSec )
+  {
+    std::unique_lock<std::mutex> lock( mutex_ );
+    if( bytesPerSec > 0 ) {
+      Clock::time_point due = start + std::chrono::microseconds( bytes * 1000000 / bytesPerSec );
+      compactCv_.wait_until( lock, due, [this] { return !running_; } );
+      cv_.wait( lock, [this] { return !syncing_ || !running_; } );
+    }
+    return running_;
+  }
+
+  /////////////////////////////////////////////
+  // Drops segments from the store, then deletes their files
+  /////////////////////////////////////////////
+  void FileStore::removeSegments( const std::vector<SegmentInfo> &doomed )
+  {
+    if( doomed.empty()) {
+      return;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock( mutex_ );
+      for( size_t i = 0; i < doomed.size(); i++ ) {
+        for( size_t j = 0; j < segments_.size(); j++ ) {
+          if( segments_[j].path == doomed[i].path ) {
+            segments_.erase( segments_.begin() + j );
+            break;
+          }
+        }
+      }
+      generation_++;
+    }
+
+    //Derived files first: a segment left without them gets them rebuilt
+    for( size_t i = 0; i < doomed.size(); i++ ) {
+      ::unlink( rollupPath( doomed[i].path ).c_str());
+      ::unlink( filterPath( doomed[i].path ).c_str());
+      ::unlink( indexPath( doomed[i].path ).c_str());
+      ::unlink( doomed[i].path.c_str());
+    }
+    syncDirectory( path_ );
+  }
+
+  /////////////////////////////////////////////
+  // Deletes blob files no remaining segment can refer to. Payloads spilled
+  // just before a segment rolled belong to entries at the start of the next
+  // one, so the newest blob older than every segment is kept.
+  /////////////////////////////////////////////
+  void FileStore::removeOrphanBlobs()
+  {
+    uint64_t oldest = 0;
+    {
+      std::lock_guard<std::mutex> lock( mutex_ );
+      if( segments_.empty()) {
+        return;
+      }
+      oldest = segments_.front().firstSeq;
+    }
+
+    std::vector<uint64_t> blobs;
+    listNumbered( path_, BLOB_SUFFIX, blobs );
+    for( size_t i = 0; i + 1 < blobs.size() && blobs[i + 1] < oldest; i++ ) {
+      ::unlink(( path_ + "/" + blobName( blobs[i] )).c_str());
+    }
+  }
+
+  /////////////////////////////////////////////
+  // Rewrites the site dictionary with only the first definition of each
+  // id, once the rest makes up more than half of it. mutex_ is only taken
+  // to bring over definitions added meanwhile and swap in the new file.
+  /////////////////////////////////////////////
+  bool FileStore::compactSites()
+  {
+    int dictFd = -1;
+    {
+      std::lock_guard<std::mutex> lock( mutex_ );
+      if( !running_ ) {
+        return false;
+      }
+      dictFd = dictFd_;
+    }
+
+    //Only a compaction pass replaces dictFd_, and close() waits for it
+    struct stat st;
+    if( fstat( dictFd, &st ) != 0 ) {
+      return false;
+    }
+    std::string data( static_cast<size_t>( st.st_size ), '\0' );
+    if( !data.empty() && !readFull( dictFd, &data[0], data.size(), 0 )) {
+      return false;
+    }
+
+    //A definition being appended during the read is brought over below
+    const uint8_t *start = reinterpret_cast<const uint8_t *>( data.data());
+    std::map<uint32_t, std::pair<size_t, size_t> > first;
+    size_t read = forEachSiteFrame( data, [&]( const uint8_t *frame, size_t bytes, const SiteInfo &site ) {
+        first.insert( std::make_pair( site.id
+            , std::make_pair( static_cast<size_t>( frame - start ), bytes )));
+      });
+    std::string kept;
+    for( std::map<uint32_t, std::pair<size_t, size_t> >::const_iterator it = first.begin()
+        ; it != first.end(); ++it ) {
+      kept.append( data, it->second.first, it->second.second );
+    }
+    if( kept.size() * 2 >= read ) {
+      return true;
+    }
+
+    std::string path = path_ + "/" + SITE_DICTIONARY;
+    std::string temp = path + TEMP_SUFFIX;
+    int fd = ::open( temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    if( fd < 0 ) {
+      return false;
+    }
+    struct iovec iov = { &kept[0], kept.size() };
+    bool ok = writeFull( fd, &iov, 1, 0 ) && ::fdatasync( fd ) == 0;
+
+    std::unique_lock<std::mutex> lock( mutex_ );
+    ok = ok && running_ && fstat( dictFd_, &st ) == 0;
+    if( ok && static_cast<size_t>( st.st_size ) > read ) {
+      std::string added( static_cast<size_t>( st.st_size ) - read, '\0' );
+      struct iovec tail = { &added[0], added.size() };
+      ok = readFull( dictFd_, &added[0], added.size(), read )
+        && writeFull( fd, &tail, 1, kept.size())
+        && ::fdatasync( fd ) == 0;
+    }
+    ::close( fd );
+    if( !ok || ::rename( temp.c_str(), path.c_str()) != 0 ) {
+      ::unlink( temp.c_str());
+      return false;
+    }
+    int newFd = ::open( path.c_str(), O_RDWR | O_APPEND );
+    if( newFd < 0 ) {
+      return false;
+    }
+    ::close( dictFd_ );
+    dictFd_ = newFd;
+
+    //Until the rename is flushed, defineSite flushes it itself
+    dictMoved_ = true;
+    lock.unlock();
+    syncDirectory( path_ );
+    lock.lock();
+    dictMoved_ = false;
+    return true;
+  }
+
+  /////////////////////////////////////////////
+  // Teaches builders of derived files the known call sites and templates
+  /////////////////////////////////////////////
+  void FileStore::seedBuilders( RollupBuilder &rollup, FilterBuilder &filter, IndexBuilder &index )
+  {
+    std::lock_guard<std::mutex> lock( mutex_ );
+    for( std::map<uint32_t, SiteInfo>::const_iterator it = sites_.begin(); it != sites_.end(); ++it ) {
+      rollup.defineSite( it->second );
+      filter.defineSite( it->second );
+      if( options_.indexMessages ) {
+        index.defineSite( it->second );
+      }
+    }
+    for( std::map<uint32_t, MessageTemplate>::const_iterator it = templates_.begin()
+        ; it != templates_.end(); ++it ) {
+      filter.defineTemplate( it->second );
+      if( options_.indexMessages ) {
+        index.defineTemplate( it->second );
+      }
+    }
+  }
+
+  /////////////////////////////////////////////
+  // Rebuilds the derived files sealed segments are missing, such as those
+  // written before a kind of file was kept or interrupted by a crash, and
+  // gives newly sealed segments their index
+  /////////////////////////////////////////////
+  bool FileStore::backfillDerived( uint64_t bytesPerSec )
+  {
+    std::vector<SegmentInfo> segments;
+    bool indexed = false;
+    {
+      std::lock_guard<std::mutex> lock( mutex_ );
+      if( !running_ ) {
+        return false;
+      }
+      segments = segments_;
+      indexed = options_.indexMessages;
+    }
+
+    Clock::time_point start = Clock::now();
+    uint64_t moved = 0;
+    BlockHeader header;
+    std::string data;
+    bool ok = true;
+    for( size_t i = 0; i + 1 < segments.size() && ok; i++ ) {
+      std::string rollupFile = rollupPath( segments[i].path );
+      std::string filterFile = filterPath( segments[i].path );
+      std::string indexFile = indexPath( segments[i].path );
+      bool rollups = fileBytes( rollupFile ) == 0;
+      bool filters = ::access( filterFile.c_str(), F_OK ) != 0;
+      bool words = indexed && ::access( indexFile.c_str(), F_OK ) != 0;
+      SegmentReader reader;
+      if(( !rollups && !filters && !words ) || !reader.open( segments[i].path )) {
+        continue;
+      }
+
+      RollupBuilder rollup;
+      FilterBuilder filter;
+      IndexBuilder index;
+      std::string frames;
+      seedBuilders( rollup, filter, index );
+      while( ok && reader.nextHeader( header )) {
+        uint64_t offset = reader.offset() - sizeof( header );
+        if( reader.readData( data )) {
+          if( rollups ) {
+            rollup.addBlock( data );
+          }
+          if( filters ) {
+            filter.addBlock( data );
+            filter.take( offset, frames );
+          }
+          if( words ) {
+            index.addBlock( data );
+          }
+        }
+        moved += sizeof( header ) + header.bytes;
+        ok = pace( start, moved, bytesPerSec );
+      }
+      if( ok && rollups ) {
+        rollup.takeBlock( data );
+        rollup.encodeSegment( data );
+        ok = replaceFile( rollupFile, data, true );
+      }
+      if( ok && filters ) {
+        ok = replaceFile( filterFile, frames, true );
+      }
+      if( ok && words ) {
+        index.finish();
+        index.encode( data );
+        ok = replaceFile( indexFile, data, true );
+      }
+    }
+    return ok;
+  }
+
+  void FileStore::compactLoop()
+  {
+    //Best effort: compaction only gets the CPU and disk nobody else wants
+    pid_t tid = static_cast<pid_t>( ::syscall( SYS_gettid ));
+    ::setpriority( PRIO_PROCESS, tid, 19 );
+    ::syscall( SYS_ioprio_set, IOPRIO_WHO_THREAD, tid, IOPRIO_IDLE );
+
+    std::unique_lock<std::mutex> lock( mutex_ );
+    std::chrono::milliseconds interval( options_.compactIntervalMs );
+    while( running_ ) {
+      compactCv_.wait_for( lock, interval, [this] { return !running_ || compactDue_; } );
+      if( !running_ ) {
+        break;
+      }
+      compactDue_ = false;
+      lock.unlock();
+      compactPass( true );
+      lock.lock();
+    }
+  }
+}
@@ -0,0 +1,613 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ **/
+
+#pragma once
+
+// File-backed log store.
+//
+// A store is a directory of segment files named by the next sequence number
+// at the time they were started. Entries are usually written in order, but
+// lower priority entries may follow higher numbered ones, so a block's
+// firstSeq and lastSeq bound its entries rather than being its first and
+// last. Each segment starts with a SegmentHeader and is followed
+// by blocks. A block is one batch written by the consumer: a BlockHeader and
+// the length-framed records described in lumberjack_record.hpp. Blocks carry
+// a CRC so a torn write at the tail of the last segment is detected and
+// truncated when the store is reopened.
+//
+// Large binary payloads are spilled to a blob file named after the segment
+// that was current when they were written. The record keeps a SpillRef in
+// place of the payload and read() resolves it transparently.
+//
+// Call site definitions are kept in sites.ljdict, a list of definition
+// records each framed by a u32 length and a u32 CRC. read() fills in the
+// module, message, file and line of entries that carry only a site id.
+//
+// With mineTemplates the writer thread stores string messages by the
+// templates it learns from them, kept in templates.ljdict as described in
+// lumberjack_template.hpp, and read() puts the messages back together.
+//
+// A compactor thread enforces the retention limits in StoreOptions. It never
+// touches the current segment. Segments whose entries have all expired are
+// deleted, as are the oldest segments while the store is over its size
+// limit. Runs of small neighbouring segments, and segments holding expired
+// entries, are rewritten into one segment named after the first of them,
+// with the expired entries left out and block headers rebuilt. The new file
+// is written beside the old one and flushed. A marker naming the rest of
+// the run, <segment>.ljmerge, is then written and flushed. Once the marker
+// is on disk the merge is decided: the new file is renamed over the first
+// segment, the rest are unlinked and the marker goes last. A store opened
+// after a crash finishes any merge whose marker it finds, so no entry is
+// ever left in two segments. Spilled payloads stay in their blob files,
+// which are deleted once no segment that could refer to them is left. The
+// site dictionary is rewritten once superseded definitions make up most
+// of it.
+//
+// Each segment has files derived from its blocks beside it: rollups of
+// entry counts, described in lumberjack_rollup.hpp, per block filters,
+// described in lumberjack_filter.hpp, and with indexMessages an index of
+// message words, described in lumberjack_index.hpp, which only sealed
+// segments get. The compactor deletes and rebuilds them with the segment,
+// and rebuilds any a sealed segment is missing. A bulk load leaves them
+// all missing while it writes, through deferDerived.
+//
+// The compactor runs at idle CPU and I/O priority, paces itself to
+// compactBytesPerSec of reads and writes, and waits out every flush of the
+// ingest path. Readers that raced a rewrite retry their lookup.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <lumberjack.hpp>
+#include <lumberjack_filter.hpp>
+#include <lumberjack_index.hpp>
+#include <lumberjack_record.hpp>
+#include <lumberjack_rollup.hpp>
+#include <lumberjack_template.hpp>
+#include <lumberjack_writer.hpp>
+
+namespace lumberjack {
+
+  const uint32_t SEGMENT_MAGIC = 0x47534a4c;  // "LJSG"
+  const uint32_t BLOCK_MAGIC = 0x4b424a4c;    // "LJBK"
+  const uint32_t SEGMENT_VERSION = 1;
+
+  /**
+   * \brief fixed header at the start of every segment file
+   */
+  struct SegmentHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t firstSeq;
+    int64_t created;
+    char deviceId[40];
+  };
+
+  /**
+   * \brief fixed header in front of every block of records
+   */
+  struct BlockHeader {
+    uint32_t magic;
+    uint32_t bytes;
+    uint32_t count;
+    uint32_t levelMask;
+    uint64_t firstSeq;
+    uint64_t lastSeq;
+    int64_t minTimestamp;
+    int64_t maxTimestamp;
+    uint32_t crc;
+    uint32_t headerCrc;
+  };
+
+  static_assert( sizeof( SegmentHeader ) == 64, "SegmentHeader must be 64 bytes" );
+  static_assert( sizeof( BlockHeader ) == 56, "BlockHeader must be 56 bytes" );
+
+  /**
+   * \brief calls f(body, size) for every length-framed record in a block
+   * \return false if the block data is malformed
+   */
+  template<typename F>
+  bool forEachRecord( const std::string &data, F f )
+  {
+    const uint8_t *ptr = reinterpret_cast<const uint8_t *>( data.data());
+    const uint8_t *end = ptr + data.size();
+    while( ptr < end ) {
+      uint32_t length = 0;
+      if( !getFixed( ptr, end, length ) || length > static_cast<size_t>( end - ptr )) {
+        return false;
+      }
+      f( ptr, static_cast<size_t>( length ));
+      ptr += length;
+    }
+    return true;
+  }
+
+  /**
+   * \brief accumulates encoded records into a block
+   */
+  class BlockBuilder {
+    public:
+      BlockBuilder() { clear(); };
+
+      /**
+       * \brief encodes a record into the block
+       */
+      void add( const Record &record )
+      {
+        if( header_.count == 0 ) {
+          header_.firstSeq = record.seq;
+          header_.lastSeq = record.seq;
+          header_.minTimestamp = record.timestamp;
+          header_.maxTimestamp = record.timestamp;
+        }
+        header_.firstSeq = std::min( header_.firstSeq, record.seq );
+        header_.lastSeq = std::max( header_.lastSeq, record.seq );
+        header_.count++;
+        header_.levelMask |= 1u << record.level;
+        if( record.timestamp < header_.minTimestamp ) {
+          header_.minTimestamp = record.timestamp;
+        }
+        if( record.timestamp > header_.maxTimestamp ) {
+          header_.maxTimestamp = record.timestamp;
+        }
+        encodeRecord( record, data_ );
+      };
+
+      /**
+       * \brief copies an already encoded record into the block
+       * \param [in] body record body without its length frame
+       * \param [in] size number of bytes in the body
+       * \param [in] seq sequence number to store in place of the original
+       * \return false if the body is not a valid record header
+       */
+      bool addEncoded( const uint8_t *body, size_t size, uint64_t seq )
+      {
+        if( size < RECORD_HEADER_BYTES || recordVersion( body ) != RECORD_VERSION
+            || recordLevel( body ) > ALL ) {
+          return false;
+        }
+        int64_t timestamp = recordTimestamp( body );
+
+        if( header_.count == 0 ) {
+          header_.firstSeq = seq;
+          header_.lastSeq = seq;
+          header_.minTimestamp = timestamp;
+          header_.maxTimestamp = timestamp;
+        }
+        header_.firstSeq = std::min( header_.firstSeq, seq );
+        header_.lastSeq = std::max( header_.lastSeq, seq );
+        header_.count++;
+        header_.levelMask |= 1u << recordLevel( body );
+        if( timestamp < header_.minTimestamp ) {
+          header_.minTimestamp = timestamp;
+        }
+        if( timestamp > header_.maxTimestamp ) {
+          header_.maxTimestamp = timestamp;
+        }
+
+        putFixed<uint32_t>( data_, static_cast<uint32_t>( size ));
+        size_t start = data_.size();
+        data_.append( reinterpret_cast<const char *>( body ), size );
+        setRecordSeq( reinterpret_cast<uint8_t *>( &data_[start] ), seq );
+        return true;
+      };
+
+      /**
+       * \brief finalizes sizes and checksums before the block is written
+       */
+      void seal()
+      {
+        header_.bytes = static_cast<uint32_t>( data_.size());
+        header_.crc = crc32c( data_.data(), data_.size());
+        header_.headerCrc = 0;
+        header_.headerCrc = crc32c( &header_, sizeof( header_ ));
+      };
+
+      void clear()
+      {
+        memset( &header_, 0, sizeof( header_ ));
+        header_.magic = BLOCK_MAGIC;
+        data_.clear();
+      };
+
+      bool empty() const { return header_.count == 0; };
+      uint32_t count() const { return header_.count; };
+      size_t bytes() const { return data_.size(); };
+      const BlockHeader &header() const { return header_; };
+      const std::string &data() const { return data_; };
+
+    private:
+      BlockHeader header_;
+      std::string data_;
+  };
+
+  /**
+   * \brief sequential reader for the blocks of one segment file
+   */
+  class SegmentReader {
+    public:
+      SegmentReader() {};
+      ~SegmentReader() { close(); };
+
+      /**
+       * \brief opens a segment and validates its header
+       * \param [in] path path of the segment file
+       * \return true on success, false on failure
+       */
+      bool open( const std::string &path );
+      void close();
+
+      /**
+       * \brief reads and validates the header of the next block
+       * \param [out] header block header
+       * \return false at the end of the segment or on a corrupt header
+       */
+      bool nextHeader( BlockHeader &header );
+
+      /**
+       * \brief reads the records of the block returned by nextHeader
+       * \param [out] data encoded records
+       * \return false if the data is short or fails its checksum
+       */
+      bool readData( std::string &data );
+
+      /**
+       * \brief skips the records of the block returned by nextHeader
+       */
+      void skipData();
+
+      const SegmentHeader &header() const { return segment_; };
+      uint64_t offset() const { return offset_; };
+      uint64_t size() const { return size_; };
+
+    private:
+      int fd_ = -1;
+      uint64_t size_ = 0;
+      uint64_t offset_ = 0;
+      uint32_t pending_ = 0;
+      uint32_t pendingCrc_ = 0;
+      SegmentHeader segment_;
+  };
+
+  /**
+   * \brief description of one segment in a store
+   */
+  struct SegmentInfo {
+    std::string path;
+    uint64_t firstSeq;
+
+    //No entry in the segment is numbered below this; 0 while unknown.
+    //Lower lanes can land in a later segment than higher numbers, so it
+    //may be below firstSeq.
+    uint64_t lowestSeq = 0;
+  };
+
+  /**
+   * \brief lists the segments of a store directory in sequence order
+   * \return false if the directory cannot be read
+   */
+  bool listSegments( const std::string &path, std::vector<SegmentInfo> &segments );
+
+  /**
+   * \brief path of a file kept beside a segment, such as its rollups
+   * \param [in] segmentPath path of the segment file
+   * \param [in] suffix suffix replacing the segment's
+   */
+  std::string siblingPath( const std::string &segmentPath, const char *suffix );
+
+  /**
+   * \brief calls f(body, size) for every frame of a file of u32 length
+   * and u32 CRC framed records, stopping at the first torn or corrupt one
+   * or when f returns false
+   */
+  template<typename F>
+  void forEachFrame( const std::string &data, F f )
+  {
+    const uint8_t *ptr = reinterpret_cast<const uint8_t *>( data.data());
+    const uint8_t *end = ptr + data.size();
+    while( ptr < end ) {
+      uint32_t length = 0;
+      uint32_t crc = 0;
+      if( !getFixed( ptr, end, length ) || !getFixed( ptr, end, crc )
+          || length > static_cast<size_t>( end - ptr )
+          || crc32c( ptr, length ) != crc
+          || !f( ptr, static_cast<size_t>( length ))) {
+        return;
+      }
+      ptr += length;
+    }
+  }
+
+  /**
+   * \brief appends a u32 length and u32 CRC framed record to a buffer
+   */
+  void putFrame( std::string &out, const std::string &body );
+
+  /**
+   * \brief reads a whole file
+   * \return false if it is missing or cannot be read
+   */
+  bool readFile( const std::string &path, std::string &data );
+
+  /**
+   * \brief replaces a file through a temporary file and a rename
+   * \param [in] sync flush the new file before it replaces the old one
+   */
+  bool replaceFile( const std::string &path, const std::string &data, bool sync );
+
+  /**
+   * \brief appends to a file opened with O_APPEND
+   */
+  bool appendFile( int fd, const std::string &data );
+
+  /**
+   * \brief reads the site dictionary of a store directory
+   * \return false if the dictionary exists but cannot be read
+   *
+   * Does not modify the store, so it is safe while a writer has it open.
+   */
+  bool readSites( const std::string &path, std::map<uint32_t, SiteInfo> &sites );
+
+  /**
+   * \brief append-only segmented file store with configurable durability
+   *
+   * write() is called by a single writer thread. A background syncer thread
+   * issues fdatasync according to the configured Durability mode so that
+   * every entry written before the sync shares the same flush.
+   */
+  class FileStore {
+    public:
+      FileStore() {};
+      ~FileStore() { close(); };
+
+      /**
+       * \brief opens or creates a store directory
+       * \param [in] path directory containing the segments
+       * \param [in] options durability and segment size settings
+       * \param [in] deviceId device identifier recorded in new segments
+       * \return OK on success, ERR on failure
+       */
+      Status open( const std::string &path
+          , const StoreOptions &options
+          , const std::string &deviceId
+          );
+
+      /**
+       * \brief flushes outstanding data and closes the store
+       *
+       * Waiters still pending are completed with the result of a final sync.
+       */
+      void close();
+
+      bool isOpen();
+
+      /**
+       * \brief sequence number following the last entry in the store
+       */
+      uint64_t nextSeq();
+
+      /**
+       * \brief writes a sealed block to the current segment
+       * \param [in] block block to write
+       * \param [in] waiters callbacks to fire once the block is durable
+       * \return true on success, false on failure
+       */
+      bool write( const BlockBuilder &block
+          , std::vector<std::pair<uint64_t, DurableCallback> > &waiters
+          );
+
+      /**
+       * \brief prepares an encoded record body for the store
+       * \param [in] body encoded record body
+       * \param [in] size number of bytes in the body
+       * \param [in] payload binary payload held outside the body, or NULL
+       * \param [in] payloadSize number of payload bytes
+       * \param [out] out body to store instead of the original
+       * \return true if out replaces body, false to store body unchanged
+       *
+       * A payload passed separately is placed into the record's message
+       * field. A binary payload of spillBytes or more is written to the
+       * blob file and replaced by a SpillRef. With mineTemplates a string
+       * message is replaced by its template id and variables when that is
+       * shorter. An entry whose call site the store keeps under another
+       * id, see defineSite, is given that id. Called by the writer thread.
+       */
+      bool prepareRecord( const uint8_t *body
+          , size_t size
+          , const void *payload
+          , size_t payloadSize
+          , std::string &out
+          );
+
+      /**
+       * \brief adds a call site definition record to the site dictionary
+       * \param [in] body encoded definition record
+       * \param [in] size number of bytes in the body
+       * \return false if the record is invalid or could not be written
+       *
+       * Definitions already in the dictionary are not written again. An id
+       * belongs to the first site defined under it. Processes that resolved
+       * a crc32c collision differently may announce another site under the
+       * same id; that site is kept under an id of its own, and later
+       * entries of the announcing process are moved to it by
+       * prepareRecord. Called by the writer thread.
+       */
+      bool defineSite( const uint8_t *body, size_t size );
+
+      /**
+       * \brief stops or resumes keeping derived files as blocks are written
+       * \param [in] defer true before a bulk load, false once it is done
+       * \return false if the store is closed or the current segment's
+       * derived files could not be rebuilt
+       *
+       * While deferred, segments get no rollups or filters. Resuming
+       * rebuilds those of the current segment from its blocks and wakes
+       * the compactor, which backfills the sealed segments' files and
+       * indexes; compact() does the same at once. Called by the writer
+       * thread.
+       */
+      bool deferDerived( bool defer );
+
+      /**
+       * \brief reads a single entry by sequence number
+       * \param [in] seq sequence number of the entry
+       * \param [out] record decoded entry
+       * \return true if the entry was found
+       *
+       * Finds every entry whose block write() has returned for, waiting
+       * for io_uring writes still in flight if it has to.
+       */
+      bool read( uint64_t seq, Record &record );
+
+      /**
+       * \brief returns the segments in sequence order
+       */
+      std::vector<SegmentInfo> segments();
+
+      /**
+       * \brief applies retention and compacts sealed segments now
+       * \return false if a rewrite failed or the store closed meanwhile
+       *
+       * Unlike the background compactor this pass is not paced.
+       */
+      bool compact();
+
+      /**
+       * \brief name of the writer backend in use
+       */
+      const char *backend();
+
+      /**
+       * \brief directory the store was opened in
+       */
+      std::string directory();
+
+    private:
+      typedef std::chrono::steady_clock Clock;
+
+      std::mutex mutex_;
+      std::condition_variable cv_;
+      std::thread syncer_;
+      std::thread compactor_;
+      std::condition_variable compactCv_;
+      bool running_ = false;
+      bool syncing_ = false;
+      bool compactDue_ = false;
+
+      //Held for a whole compaction pass, so passes never overlap
+      std::mutex compactMutex_;
+
+      //Changes whenever compaction moves or deletes entries
+      uint64_t generation_ = 0;
+
+      std::string path_;
+      std::string deviceId_;
+      StoreOptions options_;
+      std::vector<SegmentInfo> segments_;
+      std::unique_ptr<FileWriter> writer_;
+
+      int fd_ = -1;
+      uint64_t offset_ = 0;
+
+      //Derived files of the current segment, owned by the writer thread
+      //like fd_
+      RollupBuilder rollup_;
+      FilterBuilder filter_;
+      std::string frame_;
+      int rollupFd_ = -1;
+      int filterFd_ = -1;
+      bool deferred_ = false;
+
+      int blobFd_ = -1;
+      uint64_t blobFile_ = 0;
+      uint64_t blobOffset_ = 0;
+      bool blobDirty_ = false;
+      int dictFd_ = -1;
+      bool dictMoved_ = false;      //dictionary renamed, directory not flushed
+      std::map<uint32_t, SiteInfo> sites_;
+      std::map<std::string, uint32_t> siteIds_;     //site key to its id
+
+      //Sites kept under another id than their process announced, by pid
+      //and announced id. Owned by the writer thread and kept in memory
+      //only: producers announce their sites again after a send fails.
+      std::map<std::pair<uint32_t, uint32_t>, uint32_t> siteMoves_;
+      std::string moved_;
+
+      //The miner is owned by the writer thread; templates_ is shared
+      TemplateMiner miner_;
+      std::string templated_;
+      int templateFd_ = -1;
+      std::map<uint32_t, MessageTemplate> templates_;
+      uint64_t nextSeq_ = 1;
+
+      uint64_t writtenBlocks_ = 0;
+      uint64_t durableBlocks_ = 0;
+      uint64_t unsyncedEntries_ = 0;
+      bool criticalPending_ = false;
+      Clock::time_point firstDirty_;
+      Clock::time_point lastSync_;
+      Clock::time_point retryAt_;     //no flush before this after a failure
+      uint32_t retryMs_ = 0;
+      std::deque<std::pair<uint64_t, DurableCallback> > waiters_;
+
+      bool openSegment( uint64_t firstSeq );
+      bool recoverSegment( const SegmentInfo &segment );
+      uint64_t rebuildDerived( SegmentReader &reader, const std::string &segmentPath );
+      bool find( std::vector<SegmentInfo> &segments, uint64_t seq, Record &record );
+      void learnLowest( const std::vector<SegmentInfo> &segments );
+      bool loadSites();
+      bool addSite( const SiteInfo &site );
+      bool moveSite( const uint8_t *body, size_t size );
+      bool prepareMessage( const uint8_t *body
+          , size_t size
+          , const void *payload
+          , size_t payloadSize
+          , std::string &out
+          );
+      bool loadTemplates();
+      bool mineTemplate( const uint8_t *body, size_t size, std::string &out );
+      bool defineTemplate( const MessageTemplate &tmpl );
+      bool spill( const void *data, size_t size, SpillRef &ref );
+      bool resolveSpill( Record &record );
+      bool syncFiles( int fd, int blobFd );
+      void closeBlob();
+      bool syncDue( Clock::time_point now );
+      Clock::time_point syncDeadline();
+      void syncLoop();
+      bool compactPass( bool paced );
+      bool rewrite( const std::vector<SegmentInfo> &run
+          , const int64_t *cutoffs
+          , uint64_t bytesPerSec
+          );
+      bool pace( Clock::time_point start, uint64_t bytes, uint64_t bytesPerSec );
+      void removeSegments( const std::vector<SegmentInfo> &doomed );
+      void removeOrphanBlobs();
+      bool compactSites();
+      void seedBuilders( RollupBuilder &rollup, FilterBuilder &filter, IndexBuilder &index );
+      void closeDerived();
+      bool sealRollup( const std::string &segmentPath );
+      bool backfillDerived( uint64_t bytesPerSec );
+      void compactLoop();
+  };
+}
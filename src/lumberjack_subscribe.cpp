@@ -0,0 +1,238 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <chrono>
+#include <cstring>
+
+#include <lumberjack_subscribe.hpp>
+
+namespace lumberjack {
+
+  namespace {
+    //Expected index before a subscription has read its first frame
+    const uint64_t UNKNOWN = UINT64_MAX;
+  }
+
+  BroadcastRing::BroadcastRing( size_t bytes )
+    : buffer_( bytes )
+    , mask_( bytes - 1 )
+  {
+  }
+
+  uint64_t BroadcastRing::frameEnd( uint64_t position ) const
+  {
+    uint32_t length;
+    memcpy( &length, &buffer_[position & mask_], sizeof( length ));
+    if( length == WRAP_MARKER ) {
+      return ( position | mask_ ) + 1;
+    }
+    return position + frameBytes( length );
+  }
+
+  void BroadcastRing::publish( const uint8_t *body, size_t size, uint64_t seq )
+  {
+    const uint64_t capacity = buffer_.size();
+    const uint64_t need = frameBytes( size );
+    if( need > capacity / 4 ) {
+      return;
+    }
+
+    //Frames never straddle the end of the buffer
+    uint64_t head = head_.load( std::memory_order_relaxed );
+    uint64_t start = head;
+    if(( head & mask_ ) + need > capacity ) {
+      start = ( head | mask_ ) + 1;
+    }
+    uint64_t end = start + need;
+
+    //Retire every frame the new one overlaps before touching its bytes, so
+    //a reader that sees the old tail knows its frame was still intact
+    uint64_t tail = tail_.load( std::memory_order_relaxed );
+    while( tail + capacity < end ) {
+      tail = frameEnd( tail );
+    }
+    tail_.store( tail, std::memory_order_relaxed );
+    std::atomic_thread_fence( std::memory_order_release );
+
+    if( start != head ) {
+      uint32_t marker = WRAP_MARKER;
+      memcpy( &buffer_[head & mask_], &marker, sizeof( marker ));
+    }
+
+    uint8_t *frame = &buffer_[start & mask_];
+    uint32_t length = static_cast<uint32_t>( size );
+    uint32_t reserved = 0;
+    uint64_t index = index_++;
+    memcpy( frame, &length, sizeof( length ));
+    memcpy( frame + 4, &reserved, sizeof( reserved ));
+    memcpy( frame + 8, &index, sizeof( index ));
+    memcpy( frame + 16, &seq, sizeof( seq ));
+    memcpy( frame + FRAME_HEADER, body, size );
+
+    head_.store( end, std::memory_order_release );
+  }
+
+  void BroadcastRing::defineSite( const uint8_t *body, size_t size )
+  {
+    SiteInfo site;
+    if( decodeSiteDefinition( body, size, site )) {
+      std::lock_guard<std::mutex> lock( sitesMutex_ );
+      sites_[site.id] = site;
+    }
+  }
+
+  bool BroadcastRing::findSite( uint32_t id, SiteInfo &site )
+  {
+    std::lock_guard<std::mutex> lock( sitesMutex_ );
+    std::map<uint32_t, SiteInfo>::const_iterator it = sites_.find( id );
+    if( it == sites_.end()) {
+      return false;
+    }
+    site = it->second;
+    return true;
+  }
+
+  void BroadcastRing::notify()
+  {
+    //Pairs with the increment in poll so a waiter is never missed
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+    if( waiting_.load( std::memory_order_relaxed ) > 0 ) {
+      std::lock_guard<std::mutex> lock( waitMutex_ );
+      waitCv_.notify_all();
+    }
+  }
+
+  Subscription::Subscription( BroadcastRing &ring, const SubscriptionFilter &filter )
+    : ring_( ring )
+    , filter_( filter )
+    , cursor_( ring.head_.load( std::memory_order_acquire ))
+    , expected_( UNKNOWN )
+  {
+    ring_.subscribers_++;
+  }
+
+  Subscription::~Subscription()
+  {
+    ring_.subscribers_--;
+  }
+
+  bool Subscription::matches( const Record &record ) const
+  {
+    if( record.level > filter_.level ) {
+      return false;
+    }
+    //The module itself or anything below it in the dotted hierarchy
+    const std::string &module = filter_.module;
+    const std::string &name = record.module;
+    if( !module.empty() && ( name.compare( 0, module.size(), module ) != 0
+          || ( name.size() > module.size() && name[module.size()] != '.' ))) {
+      return false;
+    }
+    return !filter_.match || filter_.match( record );
+  }
+
+  void Subscription::lag( uint64_t missed )
+  {
+    missed_ += missed;
+    if( filter_.lagged ) {
+      filter_.lagged( missed );
+    }
+  }
+
+  size_t Subscription::poll( const Handler &handler
+      , uint32_t timeoutMs
+      , size_t max
+      )
+  {
+    if( timeoutMs > 0 && ring_.head_.load( std::memory_order_acquire ) == cursor_ ) {
+      ring_.waiting_++;
+      std::unique_lock<std::mutex> lock( ring_.waitMutex_ );
+      ring_.waitCv_.wait_for( lock, std::chrono::milliseconds( timeoutMs ), [this] {
+          return ring_.head_.load( std::memory_order_acquire ) != cursor_;
+        } );
+      lock.unlock();
+      ring_.waiting_--;
+    }
+
+    const uint64_t capacity = ring_.buffer_.size();
+    const uint8_t *buffer = &ring_.buffer_[0];
+    uint64_t head = ring_.head_.load( std::memory_order_acquire );
+    size_t handled = 0;
+    size_t read = 0;
+
+    while( cursor_ < head && read < max ) {
+      //Fell behind: resume at the oldest intact frame
+      if( cursor_ < ring_.tail_.load( std::memory_order_acquire )) {
+        cursor_ = ring_.tail_.load( std::memory_order_acquire );
+        continue;
+      }
+
+      uint64_t offset = cursor_ & ring_.mask_;
+      uint32_t length;
+      uint64_t index;
+      uint64_t seq;
+      memcpy( &length, buffer + offset, sizeof( length ));
+      memcpy( &index, buffer + offset + 8, sizeof( index ));
+      memcpy( &seq, buffer + offset + 16, sizeof( seq ));
+
+      bool wrap = length == BroadcastRing::WRAP_MARKER;
+      bool valid = !wrap
+        && offset + BroadcastRing::FRAME_HEADER + length <= capacity
+        && decodeRecord( buffer + offset + BroadcastRing::FRAME_HEADER, length, record_ );
+
+      //Anything read above is only trustworthy if the frame was not
+      //retired meanwhile
+      std::atomic_thread_fence( std::memory_order_acquire );
+      if( ring_.tail_.load( std::memory_order_relaxed ) > cursor_ ) {
+        continue;
+      }
+
+      if( wrap ) {
+        cursor_ = ( cursor_ | ring_.mask_ ) + 1;
+        continue;
+      }
+      cursor_ += BroadcastRing::frameBytes( length );
+      read++;
+      if( expected_ != UNKNOWN && index > expected_ ) {
+        lag( index - expected_ );
+      }
+      expected_ = index + 1;
+      if( !valid ) {
+        continue;
+      }
+
+      record_.seq = seq;
+      if( record_.site != 0 ) {
+        std::map<uint32_t, SiteInfo>::const_iterator it = sites_.find( record_.site );
+        if( it == sites_.end()) {
+          SiteInfo site;
+          if( ring_.findSite( record_.site, site )) {
+            it = sites_.insert( std::make_pair( site.id, site )).first;
+          }
+        }
+        if( it != sites_.end()) {
+          applySite( it->second, record_ );
+        }
+      }
+
+      if( matches( record_ )) {
+        handler( record_ );
+        handled++;
+      }
+    }
+    return handled;
+  }
+}
@@ -0,0 +1,182 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ **/
+
+#pragma once
+
+// In-process live subscriptions.
+//
+// The consumer thread copies every entry it writes into one broadcast ring,
+// a byte buffer whose write position only grows. Each subscription reads
+// the ring through its own cursor, decoding straight out of the shared
+// bytes, so an entry is stored once no matter how many subscribers there
+// are. The writer never waits for readers: before it overwrites old bytes
+// it advances the ring's tail, and a reader whose cursor has fallen behind
+// the tail skips ahead and is told how many entries it missed.
+//
+// Ring layout: 8-byte aligned frames of
+//   u32 length, u32 reserved, u64 index, u64 seq, body[length]
+// where index counts frames published. A length of WRAP_MARKER means the
+// rest of the buffer is unused and the next frame starts at offset 0.
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <lumberjack.hpp>
+#include <lumberjack_record.hpp>
+
+namespace lumberjack {
+
+  /**
+   * \brief what a subscription wants to see
+   */
+  struct SubscriptionFilter {
+    //Entries at this level or more severe
+    Severity level = ALL;
+
+    //Entries from this module and its submodules, empty for all
+    std::string module;
+
+    //Further test applied to entries that pass the above, may be empty
+    std::function<bool( const Record & )> match;
+
+    //Called with the number of entries the subscriber was too slow to read
+    std::function<void( uint64_t missed )> lagged;
+  };
+
+  /**
+   * \brief single-writer broadcast ring shared by all subscriptions
+   */
+  class BroadcastRing {
+    public:
+      //Default capacity; must be a power of two
+      static const size_t DEFAULT_BYTES = 4 * 1024 * 1024;
+
+      explicit BroadcastRing( size_t bytes = DEFAULT_BYTES );
+
+      /**
+       * \brief true if anyone is subscribed; checked before publishing
+       */
+      bool active() const
+      {
+        return subscribers_.load( std::memory_order_relaxed ) > 0;
+      };
+
+      /**
+       * \brief copies one encoded entry into the ring
+       * \param [in] body encoded record body
+       * \param [in] size body length
+       * \param [in] seq sequence number assigned to the entry
+       *
+       * Only the consumer thread publishes. Entries larger than a quarter
+       * of the ring are skipped.
+       */
+      void publish( const uint8_t *body, size_t size, uint64_t seq );
+
+      /**
+       * \brief records a call site definition for subscribers to resolve
+       */
+      void defineSite( const uint8_t *body, size_t size );
+
+      /**
+       * \brief wakes subscribers waiting in poll
+       */
+      void notify();
+
+    private:
+      static const uint32_t WRAP_MARKER = 0xffffffff;
+      static const size_t FRAME_HEADER = 24;
+
+      std::vector<uint8_t> buffer_;
+      uint64_t mask_;
+      uint64_t index_ = 0;
+      //Padded apart so readers polling head_ do not share a line with tail_;
+      //alignas would need C++17 aligned new for the heap allocated ring
+      char padHead_[64];
+      std::atomic<uint64_t> head_{ 0 };
+      char padTail_[64];
+      std::atomic<uint64_t> tail_{ 0 };
+      char padEnd_[64];
+      std::atomic<uint32_t> subscribers_{ 0 };
+
+      std::mutex waitMutex_;
+      std::condition_variable waitCv_;
+      std::atomic<uint32_t> waiting_{ 0 };
+
+      std::mutex sitesMutex_;
+      std::map<uint32_t, SiteInfo> sites_;
+
+      static size_t frameBytes( size_t size ) { return ( FRAME_HEADER + size + 7 ) & ~7ull; };
+      uint64_t frameEnd( uint64_t position ) const;
+      bool findSite( uint32_t id, SiteInfo &site );
+
+      friend class Subscription;
+
+      BroadcastRing( const BroadcastRing & );
+      BroadcastRing &operator=( const BroadcastRing & );
+  };
+
+  /**
+   * \brief one subscriber's cursor into the broadcast ring
+   *
+   * Sees entries written after it was created. A subscription must not
+   * outlive the Lumberjack it came from, and is read by one thread.
+   */
+  class Subscription {
+    public:
+      typedef std::function<void( const Record &record )> Handler;
+
+      Subscription( BroadcastRing &ring, const SubscriptionFilter &filter );
+      ~Subscription();
+
+      /**
+       * \brief hands entries that match the filter to handler
+       * \param [in] handler called once per matching entry
+       * \param [in] timeoutMs time to wait if nothing is ready yet
+       * \param [in] max most entries to read, matching or not
+       * \return number of entries handed to handler
+       */
+      size_t poll( const Handler &handler
+          , uint32_t timeoutMs = 0
+          , size_t max = SIZE_MAX
+          );
+
+      /**
+       * \brief entries missed so far because the subscriber fell behind
+       */
+      uint64_t missed() const { return missed_; };
+
+    private:
+      BroadcastRing &ring_;
+      SubscriptionFilter filter_;
+      uint64_t cursor_;
+      uint64_t expected_;
+      uint64_t missed_ = 0;
+      Record record_;
+      std::map<uint32_t, SiteInfo> sites_;
+
+      bool matches( const Record &record ) const;
+      void lag( uint64_t missed );
+
+      Subscription( const Subscription & );
+      Subscription &operator=( const Subscription & );
+  };
+}
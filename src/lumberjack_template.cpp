@@ -0,0 +1,522 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <lumberjack_store.hpp>
+#include <lumberjack_template.hpp>
+
+namespace lumberjack {
+
+  namespace {
+    const char *TEMPLATE_FILE = "templates.ljdict";
+
+    const uint8_t TOKEN_LITERAL = 0;
+    const uint8_t TOKEN_VARIABLE = 1;
+
+    //Messages with more tokens are stored as they are
+    const size_t MAX_TOKENS = 128;
+
+    //Clusters per group of token count and first token
+    const size_t MAX_LEAF_CLUSTERS = 32;
+
+    //Once this many templates are defined, no cluster is added or widened
+    const uint32_t MAX_TEMPLATES = 65536;
+
+    inline bool hasDigit( const uint8_t *data, size_t size )
+    {
+      for( size_t i = 0; i < size; i++ ) {
+        if( data[i] >= '0' && data[i] <= '9' ) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    inline bool sameToken( const std::string &literal, const uint8_t *data, size_t size )
+    {
+      return literal.size() == size && ( size == 0 || memcmp( literal.data(), data, size ) == 0 );
+    }
+
+    /**
+     * \brief splits a message at every space
+     */
+    void tokenize( const uint8_t *message
+        , size_t size
+        , std::vector<std::pair<const uint8_t *, size_t> > &tokens
+        )
+    {
+      tokens.clear();
+      const uint8_t *end = message + size;
+      const uint8_t *start = message;
+      for( ;; ) {
+        const uint8_t *space = static_cast<const uint8_t *>( memchr( start, ' ', end - start ));
+        if( space == NULL ) {
+          tokens.push_back( std::make_pair( start, static_cast<size_t>( end - start )));
+          return;
+        }
+        tokens.push_back( std::make_pair( start, static_cast<size_t>( space - start )));
+        start = space + 1;
+      }
+    }
+
+    bool inModule( const uint8_t *module, size_t size, const std::string &query )
+    {
+      return query.empty() || ( size >= query.size() && memcmp( module, query.data(), query.size()) == 0
+          && ( size == query.size() || module[query.size()] == '.' ));
+    }
+
+    bool largerRow( const TemplateRow &a, const TemplateRow &b )
+    {
+      if( a.count != b.count ) {
+        return a.count > b.count;
+      }
+      return a.cluster < b.cluster;
+    }
+  }
+
+  std::string MessageTemplate::text() const
+  {
+    std::string out;
+    for( size_t i = 0; i < tokens.size(); i++ ) {
+      if( i > 0 ) {
+        out.push_back( ' ' );
+      }
+      out += variable[i] ? "<*>" : tokens[i];
+    }
+    return out;
+  }
+
+  Status queryTemplates( const std::string &path
+      , const TemplateQuery &query
+      , std::vector<TemplateRow> &rows
+      )
+  {
+    rows.clear();
+    std::vector<SegmentInfo> segments;
+    std::map<uint32_t, MessageTemplate> templates;
+    if( !listSegments( path, segments ) || !readTemplates( path, templates )) {
+      return ERR;
+    }
+    std::map<uint32_t, SiteInfo> sites;
+    if( !query.module.empty()) {
+      readSites( path, sites );
+    }
+
+    //Only the template id of each entry is read; nothing is decoded
+    uint32_t levels = query.level >= ALL ? 0xffffffffu : ( 2u << query.level ) - 1;
+    std::map<uint32_t, uint64_t> counts;
+    BlockHeader header;
+    std::string data;
+    for( size_t i = 0; i < segments.size(); i++ ) {
+      SegmentReader reader;
+      if( !reader.open( segments[i].path )) {
+        continue;
+      }
+      while( reader.nextHeader( header )) {
+        if(( header.levelMask & levels ) == 0 || header.maxTimestamp < query.from
+            || header.minTimestamp > query.to ) {
+          reader.skipData();
+          continue;
+        }
+        if( !reader.readData( data )) {
+          continue;
+        }
+        forEachRecord( data, [&]( const uint8_t *body, size_t size ) {
+            BodyStrings strings;
+            if( size < RECORD_HEADER_BYTES || isSiteDefinition( body, size )
+                || recordLevel( body ) > query.level || !locateStrings( body, size, strings )) {
+              return;
+            }
+            int64_t timestamp = recordTimestamp( body );
+            if( timestamp < query.from || timestamp > query.to ) {
+              return;
+            }
+            if( !query.module.empty()) {
+              const uint8_t *module = strings.module;
+              size_t moduleSize = strings.moduleSize;
+              std::map<uint32_t, SiteInfo>::const_iterator site = sites.find( strings.site );
+              if( strings.site != 0 && site != sites.end()) {
+                module = reinterpret_cast<const uint8_t *>( site->second.module.data());
+                moduleSize = site->second.module.size();
+              }
+              if( !inModule( module, moduleSize, query.module )) {
+                return;
+              }
+            }
+
+            uint32_t cluster = 0;
+            uint32_t id = 0;
+            if(( recordFlags( body ) & RECORD_TEMPLATE ) && templateOf( strings.message, strings.messageSize, id )) {
+              std::map<uint32_t, MessageTemplate>::const_iterator it = templates.find( id );
+              if( it != templates.end()) {
+                cluster = it->second.cluster;
+              }
+            }
+            counts[cluster]++;
+          });
+      }
+    }
+
+    //Templates are read in id order, so each cluster ends at its latest
+    std::map<uint32_t, std::string> texts;
+    for( std::map<uint32_t, MessageTemplate>::const_iterator it = templates.begin(); it != templates.end(); ++it ) {
+      texts[it->second.cluster] = it->second.text();
+    }
+    rows.reserve( counts.size());
+    for( std::map<uint32_t, uint64_t>::const_iterator it = counts.begin(); it != counts.end(); ++it ) {
+      TemplateRow row;
+      row.cluster = it->first;
+      if( it->first != 0 ) {
+        row.text = texts[it->first];
+      }
+      row.count = it->second;
+      rows.push_back( row );
+    }
+    std::sort( rows.begin(), rows.end(), largerRow );
+    return OK;
+  }
+
+  std::string templateDictionary( const std::string &path )
+  {
+    return path + "/" + TEMPLATE_FILE;
+  }
+
+  void encodeTemplate( const MessageTemplate &tmpl, std::string &body )
+  {
+    body.clear();
+    putVarint( body, tmpl.id );
+    putVarint( body, tmpl.cluster );
+    putVarint( body, tmpl.tokens.size());
+    for( size_t i = 0; i < tmpl.tokens.size(); i++ ) {
+      if( tmpl.variable[i] ) {
+        body.push_back( static_cast<char>( TOKEN_VARIABLE ));
+        continue;
+      }
+      body.push_back( static_cast<char>( TOKEN_LITERAL ));
+      putVarint( body, tmpl.tokens[i].size());
+      body += tmpl.tokens[i];
+    }
+  }
+
+  bool decodeTemplate( const uint8_t *data, size_t size, MessageTemplate &tmpl )
+  {
+    const uint8_t *ptr = data;
+    const uint8_t *end = data + size;
+    uint64_t id = 0;
+    uint64_t cluster = 0;
+    uint64_t count = 0;
+    if( !getVarint( ptr, end, id ) || !getVarint( ptr, end, cluster ) || !getVarint( ptr, end, count )
+        || id == 0 || id > UINT32_MAX || cluster == 0 || cluster > UINT32_MAX
+        || count == 0 || count > static_cast<uint64_t>( end - ptr )) {
+      return false;
+    }
+
+    tmpl.id = static_cast<uint32_t>( id );
+    tmpl.cluster = static_cast<uint32_t>( cluster );
+    tmpl.tokens.assign( static_cast<size_t>( count ), std::string());
+    tmpl.variable.assign( static_cast<size_t>( count ), 0 );
+    for( size_t i = 0; i < tmpl.tokens.size(); i++ ) {
+      if( ptr == end ) {
+        return false;
+      }
+      uint8_t kind = *ptr++;
+      if( kind == TOKEN_VARIABLE ) {
+        tmpl.variable[i] = 1;
+        continue;
+      }
+      uint64_t length = 0;
+      if( kind != TOKEN_LITERAL || !getVarint( ptr, end, length )
+          || length > static_cast<uint64_t>( end - ptr )) {
+        return false;
+      }
+      tmpl.tokens[i].assign( reinterpret_cast<const char *>( ptr ), static_cast<size_t>( length ));
+      ptr += length;
+    }
+    return ptr == end;
+  }
+
+  size_t parseTemplates( const std::string &data, std::map<uint32_t, MessageTemplate> &templates )
+  {
+    const uint8_t *start = reinterpret_cast<const uint8_t *>( data.data());
+    size_t valid = 0;
+    forEachFrame( data, [&]( const uint8_t *body, size_t size ) {
+        MessageTemplate tmpl;
+        if( !decodeTemplate( body, size, tmpl )) {
+          return false;
+        }
+        templates[tmpl.id] = tmpl;
+        valid = static_cast<size_t>( body + size - start );
+        return true;
+      });
+    return valid;
+  }
+
+  bool readTemplates( const std::string &path, std::map<uint32_t, MessageTemplate> &templates )
+  {
+    std::string data;
+    if( !readFile( templateDictionary( path ), data )) {
+      return errno == ENOENT;
+    }
+
+    //A definition still being appended is left for the next read
+    parseTemplates( data, templates );
+    return true;
+  }
+
+  bool expandTemplate( const MessageTemplate &tmpl
+      , const uint8_t *message
+      , size_t size
+      , std::string &out
+      )
+  {
+    out.clear();
+    size_t token = 0;
+    bool fits = forEachVariable( message, size, [&]( const uint8_t *data, size_t length ) {
+        while( token < tmpl.tokens.size() && !tmpl.variable[token] ) {
+          if( token > 0 ) {
+            out.push_back( ' ' );
+          }
+          out += tmpl.tokens[token++];
+        }
+        if( token < tmpl.tokens.size()) {
+          if( token > 0 ) {
+            out.push_back( ' ' );
+          }
+          out.append( reinterpret_cast<const char *>( data ), length );
+        }
+        token++;
+      });
+    while( fits && token < tmpl.tokens.size()) {
+      if( tmpl.variable[token] ) {
+        return false;
+      }
+      if( token > 0 ) {
+        out.push_back( ' ' );
+      }
+      out += tmpl.tokens[token++];
+    }
+    return fits && token == tmpl.tokens.size();
+  }
+
+  bool applyTemplate( const std::map<uint32_t, MessageTemplate> &templates, Record &record )
+  {
+    uint32_t id = 0;
+    const uint8_t *message = reinterpret_cast<const uint8_t *>( record.message.data());
+    if( !templateOf( message, record.message.size(), id )) {
+      return false;
+    }
+    std::map<uint32_t, MessageTemplate>::const_iterator it = templates.find( id );
+    std::string text;
+    if( it == templates.end() || !expandTemplate( it->second, message, record.message.size(), text )) {
+      return false;
+    }
+    record.message.swap( text );
+    record.flags &= ~RECORD_TEMPLATE;
+    return true;
+  }
+
+  /////////////////////////////////////////////
+  // Runs the literal through the template as an automaton whose variables
+  // match any run of non-space bytes, starting anywhere in the template
+  /////////////////////////////////////////////
+  bool templateMayContain( const MessageTemplate &tmpl, const std::string &literal )
+  {
+    //Pattern elements: a byte, or -1 for a variable
+    std::vector<int> pattern;
+    for( size_t i = 0; i < tmpl.tokens.size(); i++ ) {
+      if( i > 0 ) {
+        pattern.push_back( ' ' );
+      }
+      if( tmpl.variable[i] ) {
+        pattern.push_back( -1 );
+        continue;
+      }
+      for( size_t c = 0; c < tmpl.tokens[i].size(); c++ ) {
+        pattern.push_back( static_cast<uint8_t>( tmpl.tokens[i][c] ));
+      }
+    }
+
+    //A variable may match nothing, so reaching one also reaches what follows
+    std::vector<uint8_t> states( pattern.size() + 1, 1 );
+    std::vector<uint8_t> next( pattern.size() + 1 );
+    for( size_t i = 0; i < literal.size(); i++ ) {
+      int c = static_cast<uint8_t>( literal[i] );
+      std::fill( next.begin(), next.end(), 0 );
+      bool any = false;
+      for( size_t p = 0; p < pattern.size(); p++ ) {
+        if( !states[p] ) {
+          continue;
+        }
+        if( pattern[p] == c ) {
+          next[p + 1] = 1;
+          any = true;
+        }
+        else if( pattern[p] < 0 && c != ' ' ) {
+          next[p] = 1;
+          any = true;
+        }
+      }
+      if( !any ) {
+        return false;
+      }
+      for( size_t p = 0; p < pattern.size(); p++ ) {
+        if( next[p] && pattern[p] < 0 ) {
+          next[p + 1] = 1;
+        }
+      }
+      states.swap( next );
+    }
+    return true;
+  }
+
+  /////////////////////////////////////////////
+  // TemplateMiner
+  /////////////////////////////////////////////
+  void TemplateMiner::leafKey( size_t count, const uint8_t *first, size_t size, bool variable )
+  {
+    key_.clear();
+    putVarint( key_, count );
+    if( variable ) {
+      key_.push_back( '\1' );
+      return;
+    }
+    key_.push_back( '\0' );
+    key_.append( reinterpret_cast<const char *>( first ), size );
+  }
+
+  void TemplateMiner::learn( const MessageTemplate &tmpl )
+  {
+    if( tmpl.tokens.empty() || tmpl.tokens.size() != tmpl.variable.size()) {
+      return;
+    }
+    nextId_ = std::max( nextId_, tmpl.id + 1 );
+    nextCluster_ = std::max( nextCluster_, tmpl.cluster + 1 );
+
+    std::unordered_map<uint32_t, size_t>::const_iterator it = byCluster_.find( tmpl.cluster );
+    if( it != byCluster_.end()) {
+      clusters_[it->second] = tmpl;
+      return;
+    }
+    byCluster_[tmpl.cluster] = clusters_.size();
+    leafKey( tmpl.tokens.size(), reinterpret_cast<const uint8_t *>( tmpl.tokens[0].data())
+        , tmpl.tokens[0].size(), tmpl.variable[0] != 0 );
+    leaves_[key_].push_back( clusters_.size());
+    clusters_.push_back( tmpl );
+  }
+
+  bool TemplateMiner::encode( const uint8_t *message
+      , size_t size
+      , std::string &out
+      , const MessageTemplate *&defined
+      )
+  {
+    defined = NULL;
+    if( size == 0 ) {
+      return false;
+    }
+    tokenize( message, size, tokens_ );
+    const size_t count = tokens_.size();
+    if( count > MAX_TOKENS ) {
+      return false;
+    }
+
+    //Messages starting with a number or id share a group
+    bool firstVariable = hasDigit( tokens_[0].first, tokens_[0].second );
+    leafKey( count, tokens_[0].first, tokens_[0].second, firstVariable );
+    std::vector<size_t> &leaf = leaves_[key_];
+
+    //The most similar cluster, preferring the one with fewer variables
+    MessageTemplate *best = NULL;
+    size_t bestScore = 0;
+    size_t bestVariables = 0;
+    for( size_t i = 0; i < leaf.size(); i++ ) {
+      MessageTemplate &tmpl = clusters_[leaf[i]];
+      size_t score = 0;
+      size_t variables = 0;
+      for( size_t t = 0; t < count; t++ ) {
+        if( tmpl.variable[t] ) {
+          variables++;
+          score++;
+        }
+        else if( sameToken( tmpl.tokens[t], tokens_[t].first, tokens_[t].second )) {
+          score++;
+        }
+      }
+      if( score * 2 >= count && ( best == NULL || score > bestScore
+            || ( score == bestScore && variables < bestVariables ))) {
+        best = &tmpl;
+        bestScore = score;
+        bestVariables = variables;
+      }
+    }
+
+    if( best == NULL ) {
+      if( leaf.size() >= MAX_LEAF_CLUSTERS || nextId_ > MAX_TEMPLATES ) {
+        return false;
+      }
+      MessageTemplate tmpl;
+      tmpl.id = nextId_++;
+      tmpl.cluster = nextCluster_++;
+      tmpl.tokens.resize( count );
+      tmpl.variable.resize( count, 0 );
+      for( size_t t = 0; t < count; t++ ) {
+        if( hasDigit( tokens_[t].first, tokens_[t].second )) {
+          tmpl.variable[t] = 1;
+        }
+        else {
+          tmpl.tokens[t].assign( reinterpret_cast<const char *>( tokens_[t].first ), tokens_[t].second );
+        }
+      }
+      byCluster_[tmpl.cluster] = clusters_.size();
+      leaf.push_back( clusters_.size());
+      clusters_.push_back( tmpl );
+      best = &clusters_.back();
+      defined = best;
+    }
+    else if( bestScore < count ) {
+      //Widening makes a new template; records already written keep theirs
+      if( nextId_ > MAX_TEMPLATES ) {
+        return false;
+      }
+      for( size_t t = 0; t < count; t++ ) {
+        if( !best->variable[t] && !sameToken( best->tokens[t], tokens_[t].first, tokens_[t].second )) {
+          best->variable[t] = 1;
+          best->tokens[t].clear();
+        }
+      }
+      best->id = nextId_++;
+      defined = best;
+    }
+
+    out.clear();
+    putVarint( out, best->id );
+    size_t variables = 0;
+    for( size_t t = 0; t < count; t++ ) {
+      variables += best->variable[t];
+    }
+    putVarint( out, variables );
+    for( size_t t = 0; t < count && out.size() < size; t++ ) {
+      if( best->variable[t] ) {
+        putVarint( out, tokens_[t].second );
+        out.append( reinterpret_cast<const char *>( tokens_[t].first ), tokens_[t].second );
+      }
+    }
+    return out.size() < size;
+  }
+}
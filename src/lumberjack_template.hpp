@@ -0,0 +1,246 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ **/
+
+#pragma once
+
+// Message templates.
+//
+// With StoreOptions::mineTemplates set, the writer thread clusters string
+// messages by their shape as they are stored, in the manner of the Drain
+// log parser. A message is split into tokens at every space, so joining the
+// tokens with single spaces gives it back exactly. Messages are grouped by
+// token count and first token, and within a group a message joins the most
+// similar cluster when at least half of its tokens agree with the cluster's
+// template. Tokens where the members of a cluster differ, and tokens
+// holding digits, are variables; the rest are literal.
+//
+// A template, once defined, never changes. When a message widens its
+// cluster, turning another token into a variable, the cluster gets a new
+// template with a new id, so the cluster id stays the same for group-by
+// queries while records keep naming the template they were encoded with.
+//
+// Templates are kept in templates.ljdict in the store directory, a list of
+// frames each a u32 length, a u32 CRC and:
+//   varint template id, varint cluster id, varint token count, then for
+//   each token a u8 kind, 0 for a literal followed by varint length +
+//   bytes, or 1 for a variable.
+// Each is written and flushed before any block that refers to it.
+//
+// A record stored by its template has RECORD_TEMPLATE set and its message
+// field holds varint template id, varint variable count, then varint
+// length + bytes for each variable. A message is only stored this way when
+// that is shorter. read() and searches put the original message back.
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <lumberjack.hpp>
+#include <lumberjack_record.hpp>
+
+namespace lumberjack {
+
+  /**
+   * \brief tokens of a message shape, with variables where messages differ
+   */
+  struct MessageTemplate {
+    uint32_t id = 0;
+    uint32_t cluster = 0;
+    std::vector<std::string> tokens;    //empty for variables
+    std::vector<uint8_t> variable;      //1 where the token is a variable
+
+    /**
+     * \brief the template as text, with each variable shown as <*>
+     */
+    std::string text() const;
+  };
+
+  /**
+   * \brief a group-by-template question about stored entries
+   */
+  struct TemplateQuery {
+    //Entries in this range, in ns since epoch
+    int64_t from = INT64_MIN;
+    int64_t to = INT64_MAX;
+
+    //Entries at this level or more severe
+    Severity level = ALL;
+
+    //Only this module and those below it, empty for every module
+    std::string module;
+  };
+
+  /**
+   * \brief the entries of one template cluster
+   *
+   * Entries stored without a template are counted in a row with cluster 0
+   * and empty text.
+   */
+  struct TemplateRow {
+    uint32_t cluster = 0;
+    std::string text;       //latest template of the cluster
+    uint64_t count = 0;
+  };
+
+  /**
+   * \brief counts the entries of a store per template cluster
+   * \param [in] path store directory
+   * \param [in] query entries to count
+   * \param [out] rows counts, largest first
+   * \return OK, or ERR if the directory cannot be read
+   */
+  Status queryTemplates( const std::string &path
+      , const TemplateQuery &query
+      , std::vector<TemplateRow> &rows
+      );
+
+  /**
+   * \brief path of the template dictionary of a store directory
+   */
+  std::string templateDictionary( const std::string &path );
+
+  /**
+   * \brief encodes a template as the body of a dictionary frame
+   */
+  void encodeTemplate( const MessageTemplate &tmpl, std::string &body );
+
+  /**
+   * \brief decodes the body of a dictionary frame
+   * \return false if the body is malformed
+   */
+  bool decodeTemplate( const uint8_t *data, size_t size, MessageTemplate &tmpl );
+
+  /**
+   * \brief decodes the templates of a dictionary file's contents
+   * \return length of the valid frames, short of the data's if the last
+   * frame is torn
+   */
+  size_t parseTemplates( const std::string &data, std::map<uint32_t, MessageTemplate> &templates );
+
+  /**
+   * \brief reads the template dictionary of a store directory
+   * \return false if the dictionary exists but cannot be read
+   *
+   * Does not modify the store, so it is safe while a writer has it open.
+   */
+  bool readTemplates( const std::string &path, std::map<uint32_t, MessageTemplate> &templates );
+
+  /**
+   * \brief reads the template id of a templated message field
+   */
+  inline bool templateOf( const uint8_t *message, size_t size, uint32_t &id )
+  {
+    uint64_t value = 0;
+    if( !getVarint( message, message + size, value ) || value > UINT32_MAX ) {
+      return false;
+    }
+    id = static_cast<uint32_t>( value );
+    return true;
+  }
+
+  /**
+   * \brief calls f(data, size) for every variable of a templated message
+   * field
+   * \return false if the field is malformed
+   */
+  template<typename F>
+  bool forEachVariable( const uint8_t *message, size_t size, F f )
+  {
+    const uint8_t *ptr = message;
+    const uint8_t *end = message + size;
+    uint64_t id = 0;
+    uint64_t count = 0;
+    if( !getVarint( ptr, end, id ) || !getVarint( ptr, end, count )) {
+      return false;
+    }
+    for( uint64_t i = 0; i < count; i++ ) {
+      uint64_t length = 0;
+      if( !getVarint( ptr, end, length ) || length > static_cast<uint64_t>( end - ptr )) {
+        return false;
+      }
+      f( ptr, static_cast<size_t>( length ));
+      ptr += length;
+    }
+    return ptr == end;
+  }
+
+  /**
+   * \brief rebuilds a message from its template and variables
+   * \return false if the field does not fit the template
+   */
+  bool expandTemplate( const MessageTemplate &tmpl
+      , const uint8_t *message
+      , size_t size
+      , std::string &out
+      );
+
+  /**
+   * \brief puts back the message of a decoded record stored by its template
+   * \return false if the template is unknown or does not fit
+   */
+  bool applyTemplate( const std::map<uint32_t, MessageTemplate> &templates, Record &record );
+
+  /**
+   * \brief false only if no message of the template can contain a string
+   */
+  bool templateMayContain( const MessageTemplate &tmpl, const std::string &literal );
+
+  /**
+   * \brief learns templates from messages and encodes messages by them
+   *
+   * Owned by a single thread.
+   */
+  class TemplateMiner {
+    public:
+      /**
+       * \brief learns a template from the dictionary
+       *
+       * Templates must be learned in id order.
+       */
+      void learn( const MessageTemplate &tmpl );
+
+      /**
+       * \brief clusters a message and encodes it by its template
+       * \param [in] message message bytes
+       * \param [in] size number of message bytes
+       * \param [out] out templated message field
+       * \param [out] defined template defined for this message, which must
+       * be stored before the message, or NULL. Valid until the next call.
+       * \return true if out is shorter than the message and should replace
+       * it
+       */
+      bool encode( const uint8_t *message
+          , size_t size
+          , std::string &out
+          , const MessageTemplate *&defined
+          );
+
+    private:
+      //Templates are tracked per cluster; ids are handed out in order
+      std::vector<MessageTemplate> clusters_;
+      std::unordered_map<uint32_t, size_t> byCluster_;
+      std::unordered_map<std::string, std::vector<size_t> > leaves_;
+      uint32_t nextId_ = 1;
+      uint32_t nextCluster_ = 1;
+
+      std::vector<std::pair<const uint8_t *, size_t> > tokens_;
+      std::string key_;
+
+      void leafKey( size_t count, const uint8_t *first, size_t size, bool variable );
+  };
+}
@@ -0,0 +1,556 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <unistd.h>
+
+#ifdef LJ_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include <lumberjack_writer.hpp>
+
+namespace lumberjack {
+
+  bool writeFull( int fd, const struct iovec *iov, int iovcnt, uint64_t offset )
+  {
+    std::vector<struct iovec> pending( iov, iov + iovcnt );
+    size_t index = 0;
+    while( index < pending.size()) {
+      ssize_t count = ::pwritev( fd, &pending[index]
+          , static_cast<int>( pending.size() - index )
+          , offset
+          );
+      if( count < 0 && errno == EINTR ) {
+        continue;
+      }
+      if( count <= 0 ) {
+        return false;
+      }
+      offset += count;
+      size_t remaining = static_cast<size_t>( count );
+      while( index < pending.size() && remaining >= pending[index].iov_len ) {
+        remaining -= pending[index].iov_len;
+        index++;
+      }
+      if( index < pending.size()) {
+        pending[index].iov_base = static_cast<char *>( pending[index].iov_base ) + remaining;
+        pending[index].iov_len -= remaining;
+      }
+    }
+    return true;
+  }
+
+  namespace {
+
+    /**
+     * \brief blocking pwritev/fdatasync backend
+     */
+    class PwriteWriter : public FileWriter {
+      public:
+        bool write( int fd
+            , const struct iovec *iov
+            , int iovcnt
+            , uint64_t offset
+            )
+        {
+          return writeFull( fd, iov, iovcnt, offset );
+        };
+
+        bool sync( int fd ) { return ::fdatasync( fd ) == 0; };
+        bool drain() { return true; };
+        const char *name() const { return "pwrite"; };
+    };
+
+#ifdef LJ_HAVE_IO_URING
+
+    /**
+     * \brief io_uring backend using registered buffers and fixed files
+     *
+     * Each write is copied into one of depth registered buffers and
+     * submitted immediately. fdatasync is submitted with IOSQE_IO_DRAIN so
+     * it starts only after every earlier write on the ring has completed,
+     * which makes it cover all of them. Completions are reaped by whichever
+     * thread needs one; other threads wait on a condition variable.
+     *
+     * A write that completes with an error or short is written again with
+     * pwritev from its buffer. Only if that fails too is it reported, by
+     * drain() until the next sync() reports it once. If the ring itself
+     * stops accepting submissions, the writer carries on as the pwrite
+     * backend.
+     */
+    class UringWriter : public FileWriter {
+      public:
+        UringWriter() {};
+
+        ~UringWriter()
+        {
+          drain();
+          if( buffers_ != NULL ) {
+            munmap( buffers_, bufferSize_ * depth_ );
+          }
+          if( sqes_ != NULL ) {
+            munmap( sqes_, sqesSize_ );
+          }
+          if( cqPtr_ != NULL && cqPtr_ != sqPtr_ ) {
+            munmap( cqPtr_, cqSize_ );
+          }
+          if( sqPtr_ != NULL ) {
+            munmap( sqPtr_, sqSize_ );
+          }
+          if( ringFd_ >= 0 ) {
+            ::close( ringFd_ );
+          }
+        };
+
+        /**
+         * \brief sets up the ring, buffers and file table
+         * \return false if io_uring is not usable on this system
+         */
+        bool init( uint32_t depth )
+        {
+          depth_ = depth == 0 ? 1 : depth;
+
+          struct io_uring_params params;
+          memset( &params, 0, sizeof( params ));
+          ringFd_ = static_cast<int>( syscall( __NR_io_uring_setup, depth_ * 2, &params ));
+          if( ringFd_ < 0 ) {
+            return false;
+          }
+
+          sqSize_ = params.sq_off.array + params.sq_entries * sizeof( unsigned );
+          cqSize_ = params.cq_off.cqes + params.cq_entries * sizeof( struct io_uring_cqe );
+          if( params.features & IORING_FEAT_SINGLE_MMAP ) {
+            sqSize_ = cqSize_ = std::max( sqSize_, cqSize_ );
+          }
+
+          sqPtr_ = mmap( NULL, sqSize_, PROT_READ | PROT_WRITE
+              , MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQ_RING );
+          if( sqPtr_ == MAP_FAILED ) {
+            sqPtr_ = NULL;
+            return false;
+          }
+          if( params.features & IORING_FEAT_SINGLE_MMAP ) {
+            cqPtr_ = sqPtr_;
+          }
+          else {
+            cqPtr_ = mmap( NULL, cqSize_, PROT_READ | PROT_WRITE
+                , MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_CQ_RING );
+            if( cqPtr_ == MAP_FAILED ) {
+              cqPtr_ = NULL;
+              return false;
+            }
+          }
+
+          sqesSize_ = params.sq_entries * sizeof( struct io_uring_sqe );
+          void *sqes = mmap( NULL, sqesSize_, PROT_READ | PROT_WRITE
+              , MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQES );
+          if( sqes == MAP_FAILED ) {
+            return false;
+          }
+          sqes_ = static_cast<struct io_uring_sqe *>( sqes );
+
+          char *sq = static_cast<char *>( sqPtr_ );
+          sqHead_ = reinterpret_cast<unsigned *>( sq + params.sq_off.head );
+          sqTail_ = reinterpret_cast<unsigned *>( sq + params.sq_off.tail );
+          sqMask_ = *reinterpret_cast<unsigned *>( sq + params.sq_off.ring_mask );
+          sqEntries_ = params.sq_entries;
+          sqArray_ = reinterpret_cast<unsigned *>( sq + params.sq_off.array );
+
+          char *cq = static_cast<char *>( cqPtr_ );
+          cqHead_ = reinterpret_cast<unsigned *>( cq + params.cq_off.head );
+          cqTail_ = reinterpret_cast<unsigned *>( cq + params.cq_off.tail );
+          cqMask_ = *reinterpret_cast<unsigned *>( cq + params.cq_off.ring_mask );
+          cqes_ = reinterpret_cast<struct io_uring_cqe *>( cq + params.cq_off.cqes );
+
+          //Registered buffers, one per in-flight write
+          void *buffers = mmap( NULL, BUFFER_SIZE * depth_, PROT_READ | PROT_WRITE
+              , MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+          if( buffers == MAP_FAILED ) {
+            return false;
+          }
+          buffers_ = static_cast<char *>( buffers );
+          bufferSize_ = BUFFER_SIZE;
+
+          std::vector<struct iovec> iov( depth_ );
+          for( uint32_t i = 0; i < depth_; i++ ) {
+            iov[i].iov_base = buffers_ + i * bufferSize_;
+            iov[i].iov_len = bufferSize_;
+          }
+          if( syscall( __NR_io_uring_register, ringFd_, IORING_REGISTER_BUFFERS
+                , &iov[0], depth_ ) < 0 ) {
+            return false;
+          }
+
+          //Sparse fixed file table. Older kernels reject -1 entries, in
+          //which case writes use the plain descriptor.
+          for( int i = 0; i < FILE_SLOTS; i++ ) {
+            files_[i] = -1;
+          }
+          fixedFiles_ = syscall( __NR_io_uring_register, ringFd_, IORING_REGISTER_FILES
+              , files_, FILE_SLOTS ) == 0;
+
+          slots_.resize( depth_ );
+          for( uint32_t i = 0; i < depth_; i++ ) {
+            free_.push_back( depth_ - 1 - i );
+          }
+          return true;
+        };
+
+        bool write( int fd
+            , const struct iovec *iov
+            , int iovcnt
+            , uint64_t offset
+            )
+        {
+          size_t total = 0;
+          for( int i = 0; i < iovcnt; i++ ) {
+            total += iov[i].iov_len;
+          }
+
+          std::unique_lock<std::mutex> lock( mutex_ );
+          if( fallback_ ) {
+            lock.unlock();
+            return writeFull( fd, iov, iovcnt, offset );
+          }
+          waitFor( lock, [this] { return !free_.empty(); } );
+
+          uint32_t index = free_.back();
+          free_.pop_back();
+          Slot &slot = slots_[index];
+          slot.length = total;
+          slot.fd = fd;
+          slot.offset = offset;
+
+          char *dest = buffers_ + index * bufferSize_;
+          bool fixed = total <= bufferSize_;
+          if( !fixed ) {
+            slot.overflow.resize( total );
+            dest = &slot.overflow[0];
+          }
+          for( int i = 0; i < iovcnt; i++ ) {
+            memcpy( dest, iov[i].iov_base, iov[i].iov_len );
+            dest += iov[i].iov_len;
+          }
+
+          struct io_uring_sqe *sqe = nextSqe();
+          sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+          sqe->addr = reinterpret_cast<uint64_t>(
+              fixed ? buffers_ + index * bufferSize_ : &slot.overflow[0] );
+          sqe->len = static_cast<uint32_t>( total );
+          sqe->off = offset;
+          sqe->buf_index = fixed ? static_cast<uint16_t>( index ) : 0;
+          sqe->user_data = index;
+          setFile( sqe, fd );
+
+          inflight_++;
+          if( submit()) {
+            return true;
+          }
+
+          //The ring took nothing, so the write is done here instead
+          unsubmit();
+          slot.overflow.clear();
+          free_.push_back( index );
+          inflight_--;
+          lock.unlock();
+          return writeFull( fd, iov, iovcnt, offset );
+        };
+
+        bool sync( int fd )
+        {
+          std::unique_lock<std::mutex> lock( mutex_ );
+          int result = -1;
+          if( !fallback_ ) {
+            uint64_t id = ++syncId_;
+
+            struct io_uring_sqe *sqe = nextSqe();
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+            sqe->flags |= IOSQE_IO_DRAIN;
+            sqe->user_data = SYNC_FLAG | id;
+            setFile( sqe, fd );
+
+            if( submit()) {
+              waitFor( lock, [this, id] { return syncResults_.count( id ) > 0; } );
+              result = syncResults_[id];
+              syncResults_.erase( id );
+            }
+            else {
+              unsubmit();
+            }
+          }
+
+          //Completions ahead of the fsync's have been reaped by now, but a
+          //write redone with pwritev may have landed after the fsync ran.
+          //Without the ring, what it still has in flight lands first.
+          if( fallback_ ) {
+            waitFor( lock, [this] { return inflight_ == 0; } );
+          }
+          if( fallback_ || rewritten_ ) {
+            rewritten_ = false;
+            result = ::fdatasync( fd );
+          }
+
+          bool ok = result == 0 && !failed_;
+          failed_ = false;
+          return ok;
+        };
+
+        bool drain()
+        {
+          std::unique_lock<std::mutex> lock( mutex_ );
+          waitFor( lock, [this] { return inflight_ == 0; } );
+          return !failed_;
+        };
+
+        void release( int fd )
+        {
+          drain();
+
+          std::lock_guard<std::mutex> lock( mutex_ );
+          for( int i = 0; i < FILE_SLOTS; i++ ) {
+            if( files_[i] == fd ) {
+              updateFile( i, -1 );
+            }
+          }
+        };
+
+        const char *name() const { return "io_uring"; };
+
+      private:
+        static const size_t BUFFER_SIZE = 512 * 1024;
+        static const int FILE_SLOTS = 8;
+        static const uint64_t SYNC_FLAG = 1ull << 63;
+
+        struct Slot {
+          size_t length = 0;
+          int fd = -1;
+          uint64_t offset = 0;
+          std::vector<char> overflow;
+        };
+
+        std::mutex mutex_;
+        std::condition_variable cv_;
+        bool reaping_ = false;
+        bool failed_ = false;       //a write was lost since the last sync
+        bool rewritten_ = false;    //a write was redone since the last sync
+        bool fallback_ = false;     //the ring is unusable; writes use pwritev
+
+        int ringFd_ = -1;
+        void *sqPtr_ = NULL;
+        void *cqPtr_ = NULL;
+        size_t sqSize_ = 0;
+        size_t cqSize_ = 0;
+        size_t sqesSize_ = 0;
+        unsigned *sqHead_ = NULL;
+        unsigned *sqTail_ = NULL;
+        unsigned *sqArray_ = NULL;
+        unsigned sqMask_ = 0;
+        unsigned sqEntries_ = 0;
+        struct io_uring_sqe *sqes_ = NULL;
+        unsigned *cqHead_ = NULL;
+        unsigned *cqTail_ = NULL;
+        unsigned cqMask_ = 0;
+        struct io_uring_cqe *cqes_ = NULL;
+
+        char *buffers_ = NULL;
+        size_t bufferSize_ = 0;
+        uint32_t depth_ = 0;
+        std::vector<Slot> slots_;
+        std::vector<uint32_t> free_;
+        uint32_t inflight_ = 0;
+
+        int files_[FILE_SLOTS];
+        bool fixedFiles_ = false;
+
+        uint64_t syncId_ = 0;
+        std::map<uint64_t, int> syncResults_;
+
+        /**
+         * \brief returns a cleared SQE at the ring tail. Called with mutex_ held.
+         *
+         * Every SQE is submitted as soon as it is filled in, so the ring
+         * always has room for the next one.
+         */
+        struct io_uring_sqe *nextSqe()
+        {
+          unsigned tail = *sqTail_;
+          unsigned index = tail & sqMask_;
+          struct io_uring_sqe *sqe = &sqes_[index];
+          memset( sqe, 0, sizeof( *sqe ));
+          sqArray_[index] = index;
+          __atomic_store_n( sqTail_, tail + 1, __ATOMIC_RELEASE );
+          return sqe;
+        };
+
+        void setFile( struct io_uring_sqe *sqe, int fd )
+        {
+          int slot = fixedFiles_ ? fileSlot( fd ) : -1;
+          if( slot >= 0 ) {
+            sqe->fd = slot;
+            sqe->flags |= IOSQE_FIXED_FILE;
+          }
+          else {
+            sqe->fd = fd;
+          }
+        };
+
+        /**
+         * \brief finds or assigns the fixed file slot for a descriptor
+         */
+        int fileSlot( int fd )
+        {
+          int empty = -1;
+          for( int i = 0; i < FILE_SLOTS; i++ ) {
+            if( files_[i] == fd ) {
+              return i;
+            }
+            if( files_[i] < 0 && empty < 0 ) {
+              empty = i;
+            }
+          }
+          if( empty >= 0 && updateFile( empty, fd )) {
+            return empty;
+          }
+          return -1;
+        };
+
+        bool updateFile( int slot, int fd )
+        {
+          struct io_uring_files_update update;
+          memset( &update, 0, sizeof( update ));
+          update.offset = static_cast<uint32_t>( slot );
+          update.fds = reinterpret_cast<uint64_t>( &fd );
+          if( syscall( __NR_io_uring_register, ringFd_, IORING_REGISTER_FILES_UPDATE
+                , &update, 1 ) < 0 ) {
+            return false;
+          }
+          files_[slot] = fd;
+          return true;
+        };
+
+        bool submit()
+        {
+          while( true ) {
+            long result = syscall( __NR_io_uring_enter, ringFd_, 1, 0, 0, NULL, 0 );
+            if( result >= 0 ) {
+              return true;
+            }
+            if( errno != EINTR && errno != EAGAIN && errno != EBUSY ) {
+              return false;
+            }
+          }
+        };
+
+        /**
+         * \brief takes back the SQE the ring refused and stops using the
+         * ring. Called with mutex_ held.
+         *
+         * The kernel only consumes SQEs in io_uring_enter, so the one left
+         * at the tail by a failed submit can simply be dropped.
+         */
+        void unsubmit()
+        {
+          __atomic_store_n( sqTail_, *sqTail_ - 1, __ATOMIC_RELEASE );
+          fallback_ = true;
+        };
+
+        /**
+         * \brief consumes available completions. Called with mutex_ held.
+         */
+        void reap()
+        {
+          if( cqHead_ == NULL ) {
+            return;
+          }
+          unsigned head = *cqHead_;
+          unsigned tail = __atomic_load_n( cqTail_, __ATOMIC_ACQUIRE );
+          while( head != tail ) {
+            const struct io_uring_cqe &cqe = cqes_[head & cqMask_];
+            if( cqe.user_data & SYNC_FLAG ) {
+              syncResults_[cqe.user_data & ~SYNC_FLAG] = cqe.res;
+            }
+            else {
+              uint32_t index = static_cast<uint32_t>( cqe.user_data );
+              Slot &slot = slots_[index];
+              if( cqe.res < 0 || static_cast<size_t>( cqe.res ) != slot.length ) {
+                struct iovec iov;
+                iov.iov_base = slot.overflow.empty() ? buffers_ + index * bufferSize_ : &slot.overflow[0];
+                iov.iov_len = slot.length;
+                failed_ = !writeFull( slot.fd, &iov, 1, slot.offset ) || failed_;
+                rewritten_ = true;
+              }
+              slot.overflow.clear();
+              free_.push_back( index );
+              inflight_--;
+            }
+            head++;
+          }
+          __atomic_store_n( cqHead_, head, __ATOMIC_RELEASE );
+        };
+
+        /**
+         * \brief blocks until pred is true, reaping completions as needed
+         *
+         * Only one thread waits in io_uring_enter at a time; the others
+         * sleep on cv_ and are woken whenever completions are reaped.
+         */
+        template<typename Pred>
+        void waitFor( std::unique_lock<std::mutex> &lock, Pred pred )
+        {
+          reap();
+          while( !pred()) {
+            if( reaping_ ) {
+              cv_.wait( lock );
+              continue;
+            }
+            reaping_ = true;
+            lock.unlock();
+            syscall( __NR_io_uring_enter, ringFd_, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0 );
+            lock.lock();
+            reaping_ = false;
+            reap();
+            cv_.notify_all();
+          }
+        };
+    };
+
+#endif
+  }
+
+  std::unique_ptr<FileWriter> createFileWriter( IoBackend backend, uint32_t depth )
+  {
+#ifdef LJ_HAVE_IO_URING
+    if( backend == IoBackend::IO_URING ) {
+      std::unique_ptr<UringWriter> writer( new UringWriter());
+      if( writer->init( depth )) {
+        return std::unique_ptr<FileWriter>( writer.release());
+      }
+    }
+#endif
+    return std::unique_ptr<FileWriter>( new PwriteWriter());
+  }
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License
+ **/
+
+#pragma once
+
+// File writer backends used by the on-disk store.
+//
+// The pwrite backend issues one blocking pwritev per block. The io_uring
+// backend copies each block into a registered buffer and submits it against
+// a fixed file slot, so several blocks can be in flight while the consumer
+// thread encodes the next batch.
+
+#include <memory>
+#include <string>
+
+#include <sys/uio.h>
+
+#include <lumberjack.hpp>
+
+namespace lumberjack {
+
+  /**
+   * \brief interface for writing blocks to a file
+   */
+  class FileWriter {
+    public:
+      virtual ~FileWriter() {};
+
+      /**
+       * \brief writes data at an offset
+       * \param [in] fd file descriptor to write to
+       * \param [in] iov buffers to write, which may be reused once this returns
+       * \param [in] iovcnt number of buffers
+       * \param [in] offset file offset of the first byte
+       * \return false if the write could not be made. A write that fails
+       * after this returns is reported by drain() and sync().
+       */
+      virtual bool write( int fd
+          , const struct iovec *iov
+          , int iovcnt
+          , uint64_t offset
+          ) = 0;
+
+      /**
+       * \brief flushes every write issued so far to stable storage
+       * \param [in] fd file descriptor to flush
+       * \return false on failure, or if a write issued since the last sync
+       * was lost
+       */
+      virtual bool sync( int fd ) = 0;
+
+      /**
+       * \brief waits until every write issued so far has completed
+       * \return false if a write issued since the last sync was lost
+       */
+      virtual bool drain() = 0;
+
+      /**
+       * \brief tells the writer that a file is about to be closed
+       */
+      virtual void release( int ) { drain(); };
+
+      /**
+       * \brief name of the backend for diagnostics and benchmarks
+       */
+      virtual const char *name() const = 0;
+  };
+
+  /**
+   * \brief writes a set of buffers with pwritev, retrying short writes
+   * \return true on success, false on failure
+   */
+  bool writeFull( int fd, const struct iovec *iov, int iovcnt, uint64_t offset );
+
+  /**
+   * \brief creates the writer for the requested backend
+   * \param [in] backend requested backend
+   * \param [in] depth number of writes that may be in flight
+   * \return writer, falling back to pwrite if io_uring is unavailable
+   */
+  std::unique_ptr<FileWriter> createFileWriter( IoBackend backend, uint32_t depth );
+}
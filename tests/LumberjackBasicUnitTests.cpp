@@ -0,0 +1,2098 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Unit tests for the Lumberjack library (meson test).
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <future>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include <lumberjack.hpp>
+#include <lumberjack_arrow.hpp>
+#include <lumberjack_client.hpp>
+#include <lumberjack_config.hpp>
+#include <lumberjack_import.hpp>
+#include <lumberjack_index.hpp>
+#include <lumberjack_record.hpp>
+#include <lumberjack_rollup.hpp>
+#include <lumberjack_search.hpp>
+#include <lumberjack_shm.hpp>
+#include <lumberjack_stats.hpp>
+#include <lumberjack_store.hpp>
+#include <lumberjack_subscribe.hpp>
+#include <lumberjack_template.hpp>
+#include <lumberjack_writer.hpp>
+
+using namespace lumberjack;
+
+/////////////////////////////////////////////
+// Allocation counting
+//
+// Every heap allocation made through operator new on a thread that has
+// counting enabled is tallied, so a test can check that a code path stays
+// off the heap without seeing allocations from background threads.
+/////////////////////////////////////////////
+namespace {
+  thread_local bool counting = false;
+  thread_local size_t allocations = 0;
+
+  void *countedAlloc( size_t size )
+  {
+    if( counting ) {
+      allocations++;
+    }
+    void *ptr = malloc( size == 0 ? 1 : size );
+    if( ptr == NULL ) {
+      throw std::bad_alloc();
+    }
+    return ptr;
+  }
+}
+
+void *operator new( size_t size ) { return countedAlloc( size ); }
+void *operator new[]( size_t size ) { return countedAlloc( size ); }
+void operator delete( void *ptr ) noexcept { free( ptr ); }
+void operator delete[]( void *ptr ) noexcept { free( ptr ); }
+void operator delete( void *ptr, size_t ) noexcept { free( ptr ); }
+void operator delete[]( void *ptr, size_t ) noexcept { free( ptr ); }
+
+/////////////////////////////////////////////
+// Scratch directories
+/////////////////////////////////////////////
+namespace {
+  /**
+   * \brief directory made under /tmp for one test and removed, with
+   * everything in it, however the test ends
+   */
+  class TempDir {
+    public:
+      explicit TempDir( const std::string &name )
+        : path_( "/tmp/lj_" + name + "_XXXXXX" )
+      {
+        if( mkdtemp( &path_[0] ) == NULL ) {
+          path_.clear();
+        }
+      }
+
+      ~TempDir()
+      {
+        if( !path_.empty()) {
+          std::string cleanup = "rm -rf '" + path_ + "'";
+          if( system( cleanup.c_str()) != 0 ) {
+            ADD_FAILURE() << "unable to remove " << path_;
+          }
+        }
+      }
+
+      TempDir( const TempDir & ) = delete;
+      TempDir &operator=( const TempDir & ) = delete;
+
+      bool made() const { return !path_.empty(); }
+      const std::string &path() const { return path_; }
+
+    private:
+      std::string path_;
+  };
+}
+
+/////////////////////////////////////////////
+// Record encoding
+/////////////////////////////////////////////
+TEST( RecordTest, EncodeDecodeRoundTrip )
+{
+  Record record;
+  record.seq = 42;
+  record.timestamp = 1650000000123456789LL;
+  record.level = WARNING;
+  record.pid = 100;
+  record.tid = 200;
+  record.module = "record";
+  record.message = "round trip";
+  record.tags.push_back( "a" );
+  record.tags.push_back( "b" );
+
+  FieldValue field;
+  field.key = "ratio";
+  field.type = FieldType::DOUBLE;
+  field.real = 0.25;
+  record.fields.push_back( field );
+  field.key = "name";
+  field.type = FieldType::STRING;
+  field.text = "value";
+  record.fields.push_back( field );
+
+  std::string encoded;
+  encodeRecord( record, encoded );
+
+  uint32_t length = 0;
+  memcpy( &length, encoded.data(), sizeof( length ));
+  ASSERT_EQ( encoded.size() - sizeof( length ), length );
+
+  Record decoded;
+  ASSERT_TRUE( decodeRecord( reinterpret_cast<const uint8_t *>( encoded.data())
+        + sizeof( length ), length, decoded ));
+  EXPECT_EQ( record.seq, decoded.seq );
+  EXPECT_EQ( record.timestamp, decoded.timestamp );
+  EXPECT_EQ( record.level, decoded.level );
+  EXPECT_EQ( record.pid, decoded.pid );
+  EXPECT_EQ( record.tid, decoded.tid );
+  EXPECT_EQ( record.module, decoded.module );
+  EXPECT_EQ( record.message, decoded.message );
+  EXPECT_EQ( record.tags, decoded.tags );
+  ASSERT_EQ( 2u, decoded.fields.size());
+  EXPECT_EQ( FieldType::DOUBLE, decoded.fields[0].type );
+  EXPECT_EQ( 0.25, decoded.fields[0].real );
+  EXPECT_EQ( "name", decoded.fields[1].key );
+  EXPECT_EQ( "value", decoded.fields[1].text );
+
+  //The fixed fields can be read without decoding
+  const uint8_t *body = reinterpret_cast<const uint8_t *>( encoded.data()) + sizeof( length );
+  EXPECT_EQ( RECORD_VERSION, recordVersion( body ));
+  EXPECT_EQ( WARNING, recordLevel( body ));
+  EXPECT_EQ( record.seq, recordSeq( body ));
+  EXPECT_EQ( record.timestamp, recordTimestamp( body ));
+  EXPECT_EQ( record.pid, recordPid( body ));
+}
+
+/////////////////////////////////////////////
+// Hot path allocations
+/////////////////////////////////////////////
+TEST( AppendTest, SteadyStateAppendDoesNotAllocate )
+{
+  const int ENTRIES = 1000;
+
+  Lumberjack lj;
+  std::string message( 120, 'x' );
+  std::string module( "arena" );
+  std::vector<std::string> tags;
+  tags.push_back( "a tag longer than the small string buffer" );
+  tags.push_back( "short" );
+
+  //Warm up the thread's arena, the chunk pool and the queue. Waiting on a
+  //durable append drains everything queued before it.
+  for( int round = 0; round < 4; round++ ) {
+    for( int i = 0; i < ENTRIES; i++ ) {
+      lj.append( INFO, message, module, tags );
+    }
+    lj.appendDurable( INFO, message ).get();
+  }
+
+  allocations = 0;
+  counting = true;
+  for( int i = 0; i < ENTRIES; i++ ) {
+    lj.append( INFO, message, module, tags );
+  }
+  counting = false;
+
+  EXPECT_EQ( 0u, allocations );
+}
+
+/////////////////////////////////////////////
+// Log levels
+/////////////////////////////////////////////
+TEST( LevelTest, ModulesInheritFromTheirParent )
+{
+  Lumberjack lj;
+  std::vector<std::string> tags;
+  EXPECT_EQ( ALL, lj.getLogLevel());
+
+  EXPECT_TRUE( lj.setLogLevel( WARNING ));
+  EXPECT_TRUE( lj.setModuleLevel( "net", TRACE ));
+  EXPECT_TRUE( lj.setModuleLevel( "net.tcp", ERROR ));
+  EXPECT_EQ( TRACE, lj.getModuleLevel( "net.udp" ));
+  EXPECT_EQ( ERROR, lj.getModuleLevel( "net.tcp.accept" ));
+  EXPECT_EQ( WARNING, lj.getModuleLevel( "network" ));
+
+  EXPECT_TRUE( lj.append( DEBUG, "dropped", "disk", tags ).empty());
+  EXPECT_TRUE( lj.append( INFO, "dropped", "net.tcp", tags ).empty());
+  EXPECT_FALSE( lj.append( TRACE, "kept", "net.udp", tags ).empty());
+
+  //Sites cache their level until the table changes
+  const CallSite &site = LJ_SITE( INFO, "net.tcp", "site entry" );
+  EXPECT_TRUE( lj.append( site ).empty());
+  EXPECT_TRUE( lj.clearModuleLevel( "net.tcp" ));
+  EXPECT_FALSE( lj.append( site ).empty());
+}
+
+TEST( LevelTest, LoggerHandlesFollowTheirModule )
+{
+  Lumberjack lj;
+  Logger tcp = lj.getLogger( "net.tcp", { "conn" } );
+  Logger copy = tcp;
+  EXPECT_EQ( "net.tcp", copy.module());
+
+  EXPECT_FALSE( tcp.append( DEBUG, "kept" ).empty());
+  lj.setModuleLevel( "net", WARNING );
+  EXPECT_FALSE( copy.enabled( INFO ));
+  EXPECT_TRUE( copy.append( INFO, "dropped", { Field( "port", 80 ) } ).empty());
+  EXPECT_FALSE( copy.append( ERROR, "kept" ).empty());
+
+  Logger none;
+  EXPECT_FALSE( none.enabled( CRITICAL ));
+  EXPECT_TRUE( none.append( CRITICAL, "nowhere" ).empty());
+  EXPECT_EQ( &Lumberjack::shared(), &Lumberjack::shared());
+}
+
+/////////////////////////////////////////////
+// Durability
+/////////////////////////////////////////////
+TEST( DurabilityTest, WaitersCompleteInBlockOrderInEveryMode )
+{
+  const Durability MODES[] = { Durability::NONE, Durability::INTERVAL
+    , Durability::GROUP, Durability::SYNC_CRITICAL };
+
+  for( size_t m = 0; m < sizeof( MODES ) / sizeof( MODES[0] ); m++ ) {
+    TempDir dir( "durable" );
+    ASSERT_TRUE( dir.made());
+    StoreOptions options;
+    options.durability = MODES[m];
+    options.intervalUs = 20000;
+    options.groupEntries = 1000;
+    options.groupUs = 5000;
+    options.compactIntervalMs = 0;
+
+    FileStore store;
+    ASSERT_EQ( OK, store.open( dir.path(), options, "test" ));
+
+    //Every block but the last has a waiter; the last holds a CRITICAL
+    //entry, which SYNC_CRITICAL flushes without being asked
+    const int BLOCKS = 4;
+    std::mutex mutex;
+    std::vector<int> completed;
+    std::vector<std::future<bool> > results;
+    for( int i = 0; i < BLOCKS; i++ ) {
+      Record record;
+      record.seq = store.nextSeq();
+      record.timestamp = 1650000000000000000LL + i;
+      record.level = i == BLOCKS - 1 ? CRITICAL : INFO;
+      record.message = "durable " + std::to_string( i );
+      BlockBuilder block;
+      block.add( record );
+      block.seal();
+
+      std::vector<std::pair<uint64_t, DurableCallback> > waiters;
+      if( i < BLOCKS - 1 ) {
+        std::shared_ptr<std::promise<bool> > promise = std::make_shared<std::promise<bool> >();
+        results.push_back( promise->get_future());
+        waiters.push_back( std::make_pair( record.seq, [i, promise, &mutex, &completed]( bool durable ) {
+              std::lock_guard<std::mutex> lock( mutex );
+              completed.push_back( i );
+              promise->set_value( durable );
+            } ));
+      }
+      ASSERT_TRUE( store.write( block, waiters ));
+    }
+
+    for( size_t i = 0; i < results.size(); i++ ) {
+      ASSERT_EQ( std::future_status::ready, results[i].wait_for( std::chrono::seconds( 5 )));
+      EXPECT_TRUE( results[i].get());
+    }
+    {
+      std::lock_guard<std::mutex> lock( mutex );
+      ASSERT_EQ( BLOCKS - 1u, completed.size());
+      for( size_t i = 0; i < completed.size(); i++ ) {
+        EXPECT_EQ( static_cast<int>( i ), completed[i] );
+      }
+    }
+    store.close();
+
+    //Everything written is there once the store is reopened
+    FileStore reopened;
+    ASSERT_EQ( OK, reopened.open( dir.path(), options, "test" ));
+    Record record;
+    for( int i = 0; i < BLOCKS; i++ ) {
+      ASSERT_TRUE( reopened.read( i + 1, record ));
+      EXPECT_EQ( "durable " + std::to_string( i ), record.message );
+    }
+    reopened.close();
+  }
+}
+
+/////////////////////////////////////////////
+// Writer backends
+/////////////////////////////////////////////
+TEST( WriterTest, AFailedWriteIsReportedOnceAndWritingCarriesOn )
+{
+  TempDir dir( "writer" );
+  ASSERT_TRUE( dir.made());
+  std::string path = dir.path() + "/data";
+  int fd = open( path.c_str(), O_RDWR | O_CREAT, 0644 );
+  ASSERT_GE( fd, 0 );
+  int readOnly = open( path.c_str(), O_RDONLY );
+  ASSERT_GE( readOnly, 0 );
+
+  //Without io_uring at runtime both are the pwrite backend
+  const IoBackend BACKENDS[] = { IoBackend::PWRITE, IoBackend::IO_URING };
+  for( size_t b = 0; b < 2; b++ ) {
+    std::unique_ptr<FileWriter> writer = createFileWriter( BACKENDS[b], 4 );
+    std::string block( 4096, static_cast<char>( 'a' + b ));
+    struct iovec iov;
+    iov.iov_base = &block[0];
+    iov.iov_len = block.size();
+
+    //A write the file refuses fails when it is made or when it completes
+    if( writer->write( readOnly, &iov, 1, 0 )) {
+      EXPECT_FALSE( writer->drain()) << writer->name();
+      EXPECT_FALSE( writer->sync( fd )) << writer->name();
+    }
+
+    //and is not held against the writes after it
+    for( int i = 0; i < 16; i++ ) {
+      ASSERT_TRUE( writer->write( fd, &iov, 1, i * block.size())) << writer->name();
+    }
+    EXPECT_TRUE( writer->drain()) << writer->name();
+    EXPECT_TRUE( writer->sync( fd )) << writer->name();
+    writer->release( fd );
+
+    std::string data;
+    ASSERT_TRUE( readFile( path, data ));
+    ASSERT_EQ( 16 * block.size(), data.size());
+    EXPECT_EQ( std::string::npos, data.find_first_not_of( block[0] )) << writer->name();
+  }
+  close( readOnly );
+  close( fd );
+}
+
+TEST( WriterTest, AnEntryReadsBackAsSoonAsItsBlockIsWritten )
+{
+  TempDir dir( "readback" );
+  ASSERT_TRUE( dir.made());
+  StoreOptions options;
+  options.backend = IoBackend::IO_URING;
+  options.ioDepth = 16;
+  options.compactIntervalMs = 0;
+  FileStore store;
+  ASSERT_EQ( OK, store.open( dir.path(), options, "test" ));
+
+  //Large blocks keep io_uring busy past the write() that submitted them
+  std::vector<std::pair<uint64_t, DurableCallback> > waiters;
+  for( int i = 0; i < 64; i++ ) {
+    BlockBuilder block;
+    Record record;
+    record.timestamp = 1650000000000000000LL + i;
+    record.message = std::string( 64 * 1024, 'x' );
+    for( int j = 0; j < 4; j++ ) {
+      record.seq = store.nextSeq() + j;
+      block.add( record );
+    }
+    record.seq = store.nextSeq() + 4;
+    record.message = "last " + std::to_string( i );
+    block.add( record );
+    block.seal();
+    ASSERT_TRUE( store.write( block, waiters ));
+
+    Record read;
+    ASSERT_TRUE( store.read( record.seq, read )) << store.backend();
+    EXPECT_EQ( record.message, read.message );
+  }
+  store.close();
+}
+
+/////////////////////////////////////////////
+// Shared memory ring
+/////////////////////////////////////////////
+namespace {
+  std::string ringName( const char *name )
+  {
+    return std::string( "/lj_" ) + name + "_" + std::to_string( getpid());
+  }
+
+  //Polls until an entry can be read back
+  bool waitForEntry( Lumberjack &lj, const std::string &id, const std::string &text )
+  {
+    for( int i = 0; i < 500; i++ ) {
+      if( lj.getLogStringById( id ).find( text ) != std::string::npos ) {
+        return true;
+      }
+      std::this_thread::sleep_for( std::chrono::milliseconds( 10 ));
+    }
+    return false;
+  }
+}
+
+TEST( ShmTest, CellsOfAnExitedProducerAreReclaimed )
+{
+  SharedRingOptions options;
+  options.name = ringName( "reclaim" );
+  options.cells = 16;
+  options.cellSize = 64;
+  options.abandonMs = 60000;
+
+  //A ring its creator never finished setting up is set up again
+  int fd = shm_open( options.name.c_str(), O_RDWR | O_CREAT, 0600 );
+  ASSERT_GE( fd, 0 );
+  ASSERT_EQ( 0, ftruncate( fd, 4096 ));
+  ShmRing collector;
+  ASSERT_EQ( OK, collector.open( options.name, options ));
+  collector.becomeCollector( 1 );
+
+  //Claim the first cell for a producer that then exits without
+  //publishing it
+  pid_t child = fork();
+  ASSERT_GE( child, 0 );
+  if( child == 0 ) {
+    _exit( 0 );
+  }
+  ASSERT_EQ( child, waitpid( child, NULL, 0 ));
+  struct stat st;
+  ASSERT_EQ( 0, fstat( fd, &st ));
+  void *base = mmap( NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  ASSERT_NE( MAP_FAILED, base );
+  ShmRingHeader *header = static_cast<ShmRingHeader *>( base );
+  ShmCell *first = reinterpret_cast<ShmCell *>( static_cast<char *>( base )
+      + (( sizeof( ShmRingHeader ) + 63 ) & ~static_cast<size_t>( 63 )));
+  header->tail.fetch_add( 1 );
+  first->owner.store( static_cast<uint32_t>( child ));
+
+  ShmRing producer;
+  ASSERT_EQ( OK, producer.open( options.name, options ));
+  std::string message( 150, 'm' );
+  uint64_t seq = 0;
+  ASSERT_TRUE( producer.push( message.data(), message.size(), seq ));
+  EXPECT_EQ( 2u, seq );
+
+  //Well before abandonMs, the dead owner's cell is skipped and what
+  //follows it is delivered
+  std::vector<std::pair<uint64_t, std::string> > delivered;
+  ShmRing::Handler handler = [&delivered]( uint64_t at, const uint8_t *data, size_t size ) {
+      delivered.push_back( std::make_pair( at, std::string( reinterpret_cast<const char *>( data ), size )));
+    };
+  for( int i = 0; i < 100 && delivered.empty(); i++ ) {
+    collector.drain( handler, 10 );
+  }
+  ASSERT_EQ( 1u, delivered.size());
+  EXPECT_EQ( 2u, delivered[0].first );
+  EXPECT_EQ( message, delivered[0].second );
+  EXPECT_EQ( 1u, collector.abandoned());
+  EXPECT_EQ( 0u, collector.dropped());
+
+  munmap( base, st.st_size );
+  close( fd );
+  shm_unlink( options.name.c_str());
+}
+
+TEST( ShmTest, ALiveProducerKeepsACellItIsStillWritingPastAbandonMs )
+{
+  SharedRingOptions options;
+  options.name = ringName( "writing" );
+  options.cells = 16;
+  options.cellSize = 64;
+  options.abandonMs = 20;
+
+  ShmRing collector;
+  ASSERT_EQ( OK, collector.open( options.name, options ));
+  collector.becomeCollector( 1 );
+  ShmRing producer;
+  ASSERT_EQ( OK, producer.open( options.name, options ));
+  std::string message( 80, 'w' );
+  uint64_t seq = 0;
+  ASSERT_TRUE( producer.push( message.data(), message.size(), seq ));
+
+  //Put the continuation cell back in the hands of this, live, process as
+  //if it were still copying into it
+  int fd = shm_open( options.name.c_str(), O_RDWR, 0600 );
+  ASSERT_GE( fd, 0 );
+  struct stat st;
+  ASSERT_EQ( 0, fstat( fd, &st ));
+  void *base = mmap( NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  ASSERT_NE( MAP_FAILED, base );
+  ShmCell *second = reinterpret_cast<ShmCell *>( static_cast<char *>( base )
+      + (( sizeof( ShmRingHeader ) + 63 ) & ~static_cast<size_t>( 63 )) + options.cellSize );
+  const uint64_t WRITING = 1 | ( 1ull << 63 );
+  second->owner.store( static_cast<uint32_t>( getpid()));
+  second->seq.store( WRITING );
+
+  std::vector<std::string> delivered;
+  ShmRing::Handler handler = [&delivered]( uint64_t, const uint8_t *data, size_t size ) {
+      delivered.push_back( std::string( reinterpret_cast<const char *>( data ), size ));
+    };
+  for( int i = 0; i < 20; i++ ) {
+    collector.drain( handler, 10 );
+    std::this_thread::sleep_for( std::chrono::milliseconds( 10 ));
+  }
+  EXPECT_TRUE( delivered.empty());
+  EXPECT_EQ( WRITING, second->seq.load());
+  EXPECT_EQ( 0u, collector.abandoned());
+
+  //Once the producer publishes, its entry and those after it get through
+  second->seq.store( 2 );
+  ASSERT_TRUE( producer.push( "next", 4, seq ));
+  for( int i = 0; i < 100 && delivered.size() < 2; i++ ) {
+    collector.drain( handler, 10 );
+  }
+  ASSERT_EQ( 2u, delivered.size());
+  EXPECT_EQ( message, delivered[0] );
+  EXPECT_EQ( "next", delivered[1] );
+  EXPECT_EQ( 0u, collector.dropped());
+
+  munmap( base, st.st_size );
+  close( fd );
+  shm_unlink( options.name.c_str());
+}
+
+TEST( ShmTest, ANewCollectorTakesOverWhatIsLeftInTheRing )
+{
+  TempDir dir( "takeover" );
+  ASSERT_TRUE( dir.made());
+  SharedRingOptions ring;
+  ring.name = ringName( "takeover" );
+  ring.cells = 1024;
+
+  Lumberjack producer( ring );
+  std::string before;
+  {
+    Lumberjack first;
+    ASSERT_EQ( OK, first.openStore( dir.path()));
+    ASSERT_EQ( OK, first.collectSharedRing( ring ));
+    before = producer.append( INFO, "before the takeover" );
+    ASSERT_FALSE( before.empty());
+    ASSERT_TRUE( waitForEntry( first, before, "before the takeover" ));
+  }
+
+  //Nobody collects this one until the next collector starts
+  std::string between = producer.append( INFO, "between collectors" );
+  ASSERT_FALSE( between.empty());
+
+  Lumberjack second;
+  ASSERT_EQ( OK, second.openStore( dir.path()));
+  ASSERT_EQ( OK, second.collectSharedRing( ring ));
+  std::string after = producer.append( INFO, "after the takeover" );
+  EXPECT_TRUE( waitForEntry( second, between, "between collectors" ));
+  EXPECT_TRUE( waitForEntry( second, after, "after the takeover" ));
+  EXPECT_TRUE( waitForEntry( second, before, "before the takeover" ));
+  EXPECT_LT( std::stoull( before ), std::stoull( between ));
+  EXPECT_LT( std::stoull( between ), std::stoull( after ));
+
+  shm_unlink( ring.name.c_str());
+}
+
+/////////////////////////////////////////////
+// Daemon client
+/////////////////////////////////////////////
+TEST( DaemonTest, BatchesFitTheDatagramsTheDaemonReceives )
+{
+  TempDir dir( "daemon" );
+  ASSERT_TRUE( dir.made());
+
+  //Stands in for lumberjackd, receiving into the same size of buffer
+  struct sockaddr_un addr;
+  memset( &addr, 0, sizeof( addr ));
+  addr.sun_family = AF_UNIX;
+  std::string path = dir.path() + "/lumberjackd.sock";
+  strncpy( addr.sun_path, path.c_str(), sizeof( addr.sun_path ) - 1 );
+  int sock = socket( AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0 );
+  ASSERT_GE( sock, 0 );
+  ASSERT_EQ( 0, bind( sock, reinterpret_cast<struct sockaddr *>( &addr ), sizeof( addr )));
+  struct timeval timeout;
+  timeout.tv_sec = 0;
+  timeout.tv_usec = 200000;
+  ASSERT_EQ( 0, setsockopt( sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( timeout )));
+
+  std::atomic<bool> sent( false );
+  uint64_t entries = 0;
+  uint64_t truncated = 0;
+  std::thread daemon( [&] {
+      std::vector<char> buffer( MAX_DATAGRAM_BYTES );
+      while( true ) {
+        ssize_t size = recv( sock, &buffer[0], buffer.size(), MSG_TRUNC );
+        if( size < 0 ) {
+          if( sent ) {
+            break;
+          }
+          continue;
+        }
+        BatchHeader header;
+        memcpy( &header, &buffer[0], sizeof( header ));
+        if( static_cast<size_t>( size ) > buffer.size()) {
+          truncated++;
+        }
+        else if( header.magic == BATCH_MAGIC ) {
+          entries += header.count;
+        }
+      }
+    } );
+
+  Lumberjack lj;
+  ASSERT_EQ( OK, lj.connectDaemon( path ));
+  lj.setLatencyTarget( 200000, 50000 );
+
+  //A batch of small entries followed by large ones overflowed the
+  //datagram when it was only cut after an entry was added
+  for( int i = 0; i < 40; i++ ) {
+    lj.append( INFO, std::string( 1024, 's' ));
+  }
+  for( int i = 0; i < 3; i++ ) {
+    lj.append( INFO, std::string( 20 * 1024, 'l' ));
+  }
+  //No datagram can hold this one
+  lj.append( INFO, std::string( MAX_BATCH_BYTES, 'x' ));
+  lj.appendDurable( INFO, "flush" ).get();
+  sent = true;
+  daemon.join();
+  close( sock );
+
+  Stats stats = lj.getStats();
+  EXPECT_EQ( 0u, truncated );
+  EXPECT_EQ( 44u, entries );
+  EXPECT_EQ( 45u, stats.appended );
+  EXPECT_EQ( 1u, stats.dropped );
+}
+
+/////////////////////////////////////////////
+// Binary payloads
+/////////////////////////////////////////////
+namespace {
+  //Total size of the files in a directory with the given suffix
+  size_t bytesOf( const std::string &path, const std::string &suffix )
+  {
+    size_t bytes = 0;
+    DIR *dir = opendir( path.c_str());
+    for( struct dirent *ent = dir ? readdir( dir ) : NULL; ent != NULL; ent = readdir( dir )) {
+      std::string name( ent->d_name );
+      struct stat st;
+      if( name.size() > suffix.size()
+          && name.compare( name.size() - suffix.size(), suffix.size(), suffix ) == 0
+          && stat(( path + "/" + name ).c_str(), &st ) == 0 ) {
+        bytes += static_cast<size_t>( st.st_size );
+      }
+    }
+    if( dir != NULL ) {
+      closedir( dir );
+    }
+    return bytes;
+  }
+}
+
+TEST( BinaryTest, LargePayloadsAreSpilledAndReadBackWhole )
+{
+  TempDir dir( "binary" );
+  ASSERT_TRUE( dir.made());
+  StoreOptions options;
+  options.spillBytes = 1024;
+  options.compactIntervalMs = 0;
+
+  std::vector<uint8_t> small( 100 );
+  std::vector<uint8_t> large( 64 * 1024 );
+  for( size_t i = 0; i < large.size(); i++ ) {
+    large[i] = static_cast<uint8_t>( i * 31 + i / 256 );
+  }
+  for( size_t i = 0; i < small.size(); i++ ) {
+    small[i] = large[i * 7];
+  }
+  BinaryPayload shared = std::make_shared<const std::vector<uint8_t> >( large.rbegin(), large.rend());
+
+  std::string smallId;
+  std::string largeId;
+  std::string sharedId;
+  {
+    Lumberjack lj;
+    ASSERT_EQ( OK, lj.openStore( dir.path(), options ));
+    smallId = lj.appendBinary( INFO, small.data(), small.size(), "binary" );
+    largeId = lj.appendBinary( INFO, large.data(), large.size(), "binary" );
+    sharedId = lj.appendBinary( INFO, shared, "binary" );
+    lj.appendDurable( INFO, "flush" ).get();
+    EXPECT_NE( std::string::npos, lj.getLogStringById( largeId ).find( "\"encoding\":\"base64\"" ));
+  }
+
+  //Only the small payload stays in the segment
+  EXPECT_GE( bytesOf( dir.path(), ".ljblob" ), large.size() * 2 );
+  EXPECT_LT( bytesOf( dir.path(), ".ljseg" ), large.size());
+
+  FileStore store;
+  ASSERT_EQ( OK, store.open( dir.path(), options, "test" ));
+  Record record;
+  ASSERT_TRUE( store.read( std::stoull( smallId ), record ));
+  EXPECT_EQ( PayloadType::BINARY, record.type );
+  EXPECT_EQ( std::string( small.begin(), small.end()), record.message );
+  ASSERT_TRUE( store.read( std::stoull( largeId ), record ));
+  EXPECT_EQ( PayloadType::BINARY, record.type );
+  EXPECT_EQ( 0, record.flags & RECORD_SPILLED );
+  EXPECT_EQ( "binary", record.module );
+  EXPECT_EQ( std::string( large.begin(), large.end()), record.message );
+  ASSERT_TRUE( store.read( std::stoull( sharedId ), record ));
+  EXPECT_EQ( std::string( shared->begin(), shared->end()), record.message );
+  store.close();
+}
+
+/////////////////////////////////////////////
+// Typed fields
+/////////////////////////////////////////////
+TEST( FieldTest, TypedFieldsKeepTheirTypesThroughTheStore )
+{
+  TempDir dir( "fields" );
+  ASSERT_TRUE( dir.made());
+  StoreOptions options;
+  options.compactIntervalMs = 0;
+
+  const int64_t NS = 1650000000123456789LL;
+  std::chrono::system_clock::time_point when( std::chrono::duration_cast<std::chrono::system_clock::duration>(
+        std::chrono::nanoseconds( NS )));
+  std::string name( "camera 3" );
+  std::string id;
+  {
+    Lumberjack lj;
+    ASSERT_EQ( OK, lj.openStore( dir.path(), options ));
+    id = lj.appendFields( WARNING, "typed", { Field( "frame", -42 )
+        , Field( "big", 9007199254740993LL ), Field( "ratio", 0.125 ), Field( "ok", true )
+        , Field( "name", name ), Field( "at", when ) } );
+    ASSERT_FALSE( id.empty());
+    lj.appendDurable( INFO, "flush" ).get();
+
+    std::string json = lj.getLogStringById( id );
+    EXPECT_NE( std::string::npos, json.find( "\"frame\":-42" )) << json;
+    EXPECT_NE( std::string::npos, json.find( "\"ok\":true" )) << json;
+    EXPECT_NE( std::string::npos, json.find( "\"name\":\"camera 3\"" )) << json;
+  }
+
+  FileStore store;
+  ASSERT_EQ( OK, store.open( dir.path(), options, "test" ));
+  Record record;
+  ASSERT_TRUE( store.read( std::stoull( id ), record ));
+  EXPECT_EQ( "typed", record.message );
+  ASSERT_EQ( 6u, record.fields.size());
+  EXPECT_EQ( "frame", record.fields[0].key );
+  EXPECT_EQ( FieldType::INT64, record.fields[0].type );
+  EXPECT_EQ( -42, record.fields[0].integer );
+  EXPECT_EQ( FieldType::INT64, record.fields[1].type );
+  EXPECT_EQ( 9007199254740993LL, record.fields[1].integer );
+  EXPECT_EQ( FieldType::DOUBLE, record.fields[2].type );
+  EXPECT_EQ( 0.125, record.fields[2].real );
+  EXPECT_EQ( FieldType::BOOL, record.fields[3].type );
+  EXPECT_EQ( 1, record.fields[3].integer );
+  EXPECT_EQ( FieldType::STRING, record.fields[4].type );
+  EXPECT_EQ( name, record.fields[4].text );
+  EXPECT_EQ( FieldType::TIMESTAMP, record.fields[5].type );
+  EXPECT_EQ( NS / 1000 * 1000, record.fields[5].integer / 1000 * 1000 );
+  store.close();
+}
+
+/////////////////////////////////////////////
+// Call sites
+/////////////////////////////////////////////
+namespace {
+  /**
+   * \brief an encoded entry, or site definition, from a call site of a
+   * process, without its length prefix
+   */
+  std::string siteRecord( uint32_t pid
+      , uint32_t site
+      , const std::string &module
+      , const std::string &message
+      , bool definition
+      )
+  {
+    Record record;
+    record.timestamp = 1650000000000000000LL;
+    record.pid = pid;
+    record.site = site;
+    record.flags = RECORD_SITE;
+    if( definition ) {
+      record.flags |= RECORD_SITE_DEF;
+      record.module = module;
+      record.message = message;
+      FieldValue file;
+      file.key = "file";
+      file.type = FieldType::STRING;
+      file.text = "site.cpp";
+      FieldValue line;
+      line.key = "line";
+      line.integer = 12;
+      record.fields.push_back( file );
+      record.fields.push_back( line );
+    }
+    std::string encoded;
+    encodeRecord( record, encoded );
+    return encoded.substr( sizeof( uint32_t ));
+  }
+
+  /**
+   * \brief hands records to a store the way the writer thread does
+   */
+  bool storeRecords( FileStore &store, const std::vector<std::string> &records )
+  {
+    BlockBuilder block;
+    std::string scratch;
+    for( size_t i = 0; i < records.size(); i++ ) {
+      const uint8_t *body = reinterpret_cast<const uint8_t *>( records[i].data());
+      size_t size = records[i].size();
+      if( isSiteDefinition( body, size )) {
+        if( !store.defineSite( body, size )) {
+          return false;
+        }
+        continue;
+      }
+      if( store.prepareRecord( body, size, NULL, 0, scratch )) {
+        body = reinterpret_cast<const uint8_t *>( scratch.data());
+        size = scratch.size();
+      }
+      block.addEncoded( body, size, store.nextSeq() + block.count());
+    }
+    block.seal();
+    std::vector<std::pair<uint64_t, DurableCallback> > waiters;
+    return store.write( block, waiters );
+  }
+}
+
+TEST( SiteTest, CollidingIdsFromTwoProcessesResolveToTheirOwnSites )
+{
+  TempDir dir( "sites" );
+  ASSERT_TRUE( dir.made());
+  StoreOptions options;
+  options.compactIntervalMs = 0;
+
+  //Process 200 has "net" and "disk" under the ids process 100 gave to
+  //"camera" and that its own collision resolution moved "net" onto
+  const uint32_t ID = 77;
+  FileStore store;
+  ASSERT_EQ( OK, store.open( dir.path(), options, "test" ));
+  std::vector<std::string> records;
+  records.push_back( siteRecord( 100, ID, "camera", "frame dropped", true ));
+  records.push_back( siteRecord( 100, ID, "", "", false ));
+  records.push_back( siteRecord( 200, ID, "net", "link down", true ));
+  records.push_back( siteRecord( 200, ID + 1, "disk", "full", true ));
+  records.push_back( siteRecord( 200, ID, "", "", false ));
+  records.push_back( siteRecord( 200, ID + 1, "", "", false ));
+  records.push_back( siteRecord( 100, ID, "", "", false ));
+  ASSERT_TRUE( storeRecords( store, records ));
+
+  const char *EXPECTED[][2] = { { "camera", "frame dropped" }, { "net", "link down" }
+    , { "disk", "full" }, { "camera", "frame dropped" } };
+  Record record;
+  for( uint64_t i = 0; i < 4; i++ ) {
+    ASSERT_TRUE( store.read( i + 1, record ));
+    EXPECT_EQ( EXPECTED[i][0], record.module ) << i;
+    EXPECT_EQ( EXPECTED[i][1], record.message ) << i;
+    EXPECT_EQ( "site.cpp", record.file );
+  }
+
+  //Process 200 announces its sites again to the reopened store, which
+  //moves them to the ids they were stored under
+  store.close();
+  ASSERT_EQ( OK, store.open( dir.path(), options, "test" ));
+  records.clear();
+  records.push_back( siteRecord( 200, ID + 1, "disk", "full", true ));
+  records.push_back( siteRecord( 200, ID, "net", "link down", true ));
+  records.push_back( siteRecord( 200, ID + 1, "", "", false ));
+  records.push_back( siteRecord( 200, ID, "", "", false ));
+  records.push_back( siteRecord( 100, ID, "camera", "frame dropped", true ));
+  records.push_back( siteRecord( 100, ID, "", "", false ));
+  ASSERT_TRUE( storeRecords( store, records ));
+  ASSERT_TRUE( store.compact());
+  store.close();
+
+  const char *AGAIN[][2] = { { "disk", "full" }, { "net", "link down" }
+    , { "camera", "frame dropped" } };
+  ASSERT_EQ( OK, store.open( dir.path(), options, "test" ));
+  for( uint64_t i = 0; i < 4; i++ ) {
+    ASSERT_TRUE( store.read( i + 1, record ));
+    EXPECT_EQ( EXPECTED[i][0], record.module ) << i;
+    EXPECT_EQ( EXPECTED[i][1], record.message ) << i;
+  }
+  for( uint64_t i = 0; i < 3; i++ ) {
+    ASSERT_TRUE( store.read( i + 5, record ));
+    EXPECT_EQ( AGAIN[i][0], record.module ) << i;
+    EXPECT_EQ( AGAIN[i][1], record.message ) << i;
+  }
+  store.close();
+}
+
+/////////////////////////////////////////////
+// Hourglass connection
+/////////////////////////////////////////////
+TEST( ConnectTest, EntriesHeldWhileConnectingAreStoredInOrder )
+{
+  TempDir dir( "connect" );
+  ASSERT_TRUE( dir.made());
+
+  //Constructing never waits for the connection
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  std::unique_ptr<Lumberjack> lj( new Lumberjack());
+  EXPECT_LT( std::chrono::steady_clock::now() - start, std::chrono::seconds( 1 ));
+  Status status = lj->getAPIStatus();
+  EXPECT_TRUE( status == CONNECTING || status == OK || status == ERR ) << status;
+  ASSERT_EQ( OK, lj->openStore( dir.path()));
+
+  //Enough entries to end the hold early should the connection still be
+  //being made, so the durable entry gets through either way
+  const int ENTRIES = 5000;
+  std::vector<std::string> tags;
+  std::vector<std::string> ids;
+  for( int i = 0; i < ENTRIES; i++ ) {
+    ids.push_back( lj->append( INFO, "early " + std::to_string( i ), "connect", tags ));
+  }
+  std::future<bool> flushed = lj->appendDurable( INFO, "flush" );
+  ASSERT_EQ( std::future_status::ready, flushed.wait_for( std::chrono::seconds( 10 )));
+  EXPECT_TRUE( flushed.get());
+
+  //The connection settles one way or the other, and only a failure counts
+  for( int i = 0; i < 1000 && lj->getAPIStatus() == CONNECTING; i++ ) {
+    std::this_thread::sleep_for( std::chrono::milliseconds( 10 ));
+  }
+  status = lj->getAPIStatus();
+  ASSERT_TRUE( status == OK || status == ERR ) << status;
+  EXPECT_EQ( status == ERR ? 1u : 0u, lj->getStats().hourglassFailures );
+  lj.reset();
+
+  FileStore store;
+  StoreOptions options;
+  options.compactIntervalMs = 0;
+  ASSERT_EQ( OK, store.open( dir.path(), options, "test" ));
+  Record record;
+  for( int i = 0; i < ENTRIES; i += 499 ) {
+    ASSERT_TRUE( store.read( std::stoull( ids[i] ), record ));
+    EXPECT_EQ( "early " + std::to_string( i ), record.message );
+    if( i > 0 ) {
+      EXPECT_GT( std::stoull( ids[i] ), std::stoull( ids[i - 499] ));
+    }
+  }
+  store.close();
+}
+
+TEST( ConnectTest, IdsReturnedWhileConnectingAreNeverRenumbered )
+{
+  TempDir dir( "connect-ids" );
+  ASSERT_TRUE( dir.made());
+  {
+    Lumberjack lj;
+    ASSERT_EQ( OK, lj.openStore( dir.path()));
+    for( int i = 0; i < 100; i++ ) {
+      lj.append( INFO, "stored " + std::to_string( i ));
+    }
+    ASSERT_TRUE( lj.appendDurable( INFO, "flush" ).get());
+  }
+
+  //Appended before any store is opened, most likely while still
+  //connecting, so held under the numbers they were given
+  const int ENTRIES = 10;
+  std::unique_ptr<Lumberjack> lj( new Lumberjack());
+  std::vector<std::string> ids;
+  for( int i = 0; i < ENTRIES; i++ ) {
+    ids.push_back( lj->append( INFO, "early " + std::to_string( i )));
+    ASSERT_FALSE( ids.back().empty());
+  }
+  ASSERT_EQ( OK, lj->openStore( dir.path()));
+  std::string late = lj->append( INFO, "late" );
+  std::future<bool> flushed = lj->appendDurable( INFO, "flush" );
+  ASSERT_EQ( std::future_status::ready, flushed.wait_for( std::chrono::seconds( 10 )));
+  EXPECT_TRUE( flushed.get());
+  lj.reset();
+
+  //Opening the store lets held entries go first, so none is stored under
+  //a number other than the one returned for it
+  SearchQuery query;
+  query.text = "early ";
+  SearchCallback check = [&ids]( const SearchMatch &match ) {
+    size_t i = std::stoul( match.record.message.substr( 6 ));
+    EXPECT_EQ( ids[i], std::to_string( match.record.seq )) << match.record.message;
+    return true;
+  };
+  ASSERT_EQ( OK, searchStore( dir.path(), query, check ));
+
+  FileStore store;
+  StoreOptions options;
+  options.compactIntervalMs = 0;
+  ASSERT_EQ( OK, store.open( dir.path(), options, "test" ));
+  Record record;
+  ASSERT_TRUE( store.read( std::stoull( late ), record ));
+  EXPECT_EQ( "late", record.message );
+  EXPECT_GT( std::stoull( late ), 101u );
+  store.close();
+}
+
+/////////////////////////////////////////////
+// Config files
+/////////////////////////////////////////////
+namespace {
+  void writeFile( const std::string &path, const std::string &text )
+  {
+    std::ofstream file( path.c_str(), std::ios::trunc );
+    file << text;
+  }
+
+  //Waits for the watcher thread to apply a change
+  bool waitForLevel( Lumberjack &lj, const std::string &module, Severity level )
+  {
+    for( int i = 0; i < 200; i++ ) {
+      if( lj.getModuleLevel( module ) == level ) {
+        return true;
+      }
+      std::this_thread::sleep_for( std::chrono::milliseconds( 10 ));
+    }
+    return false;
+  }
+}
+
+TEST( ConfigTest, ReloadsWhenTheFileChanges )
+{
+  TempDir dir( "config" );
+  ASSERT_TRUE( dir.made());
+  std::string path = dir.path() + "/lumberjack.json";
+
+  writeFile( path, "{ \"level\": \"error\", \"modules\": { \"net\": \"debug\" } }" );
+  Lumberjack lj;
+  ASSERT_EQ( OK, lj.loadConfig( path ));
+  EXPECT_EQ( ERROR, lj.getLogLevel());
+  EXPECT_EQ( DEBUG, lj.getModuleLevel( "net.tcp" ));
+
+  writeFile( path, "{ \"level\": \"info\", \"sampling\": { \"debug\": 2 } }" );
+  ASSERT_TRUE( waitForLevel( lj, "net.tcp", INFO ));
+
+  //A broken edit keeps the last good config
+  writeFile( path, "{ \"level\": " );
+  std::this_thread::sleep_for( std::chrono::milliseconds( 100 ));
+  EXPECT_EQ( INFO, lj.getLogLevel());
+
+  Config config;
+  EXPECT_EQ( ERR, parseConfig( "{ \"level\": \"loud\" }", config ));
+  EXPECT_EQ( OK, parseConfig( "{ \"sampling\": { \"trace\": 100 } }", config ));
+  EXPECT_EQ( 100u, config.levels.sampleEvery[TRACE] );
+}
+
+/////////////////////////////////////////////
+// Stats
+/////////////////////////////////////////////
+TEST( StatsTest, CountsEntriesAndStoreWrites )
+{
+  TempDir dir( "stats" );
+  ASSERT_TRUE( dir.made());
+
+  Lumberjack lj;
+  ASSERT_EQ( OK, lj.openStore( dir.path()));
+  lj.setModuleLevel( "quiet", ERROR );
+
+  std::vector<std::string> tags;
+  for( int i = 0; i < 10; i++ ) {
+    lj.append( INFO, "kept", "loud", tags );
+    lj.append( INFO, "filtered", "quiet", tags );
+  }
+  lj.appendDurable( INFO, "flush" ).get();
+
+  Stats stats = lj.getStats();
+  EXPECT_EQ( 11u, stats.appended );
+  EXPECT_EQ( 10u, stats.filtered );
+  EXPECT_EQ( 0u, stats.dropped );
+  EXPECT_GT( stats.bytesEncoded, 0u );
+  EXPECT_GE( stats.queueHighWater, 1u );
+  EXPECT_GE( stats.storeWrite.count, 1u );
+  EXPECT_LE( stats.storeWrite.min, stats.storeWrite.p50 );
+  EXPECT_LE( stats.storeWrite.p50, stats.storeWrite.max );
+}
+
+TEST( StatsTest, AThreadKeepsOneShardPerLoggerPastItsSlots )
+{
+  //More loggers than a thread has slots for, counted for in turn
+  const size_t LOGGERS = 7;
+  const int ROUNDS = 50;
+  std::vector<std::unique_ptr<StatsShards> > loggers;
+  std::vector<StatsShard *> first;
+  for( size_t i = 0; i < LOGGERS; i++ ) {
+    loggers.push_back( std::unique_ptr<StatsShards>( new StatsShards()));
+  }
+  for( int round = 0; round < ROUNDS; round++ ) {
+    for( size_t i = 0; i < LOGGERS; i++ ) {
+      StatsShard &shard = loggers[i]->local();
+      StatsShard::add( shard.appended, 1 );
+      if( round == 0 ) {
+        first.push_back( &shard );
+      }
+      EXPECT_EQ( first[i], &shard );
+    }
+  }
+
+  //Another thread gets shards of its own
+  std::thread other( [&loggers]() {
+      for( size_t i = 0; i < loggers.size(); i++ ) {
+        StatsShard::add( loggers[i]->local().appended, 1000 );
+      }
+    });
+  other.join();
+  for( size_t i = 0; i < LOGGERS; i++ ) {
+    Stats stats;
+    loggers[i]->sum( stats );
+    EXPECT_EQ( ROUNDS + 1000u, stats.appended );
+    EXPECT_EQ( first[i], &loggers[i]->local());
+  }
+}
+
+TEST( StatsTest, LatencyTargetBatchesATrickleOfEntries )
+{
+  TempDir dir( "batch" );
+  ASSERT_TRUE( dir.made());
+
+  Lumberjack lj;
+  ASSERT_EQ( OK, lj.openStore( dir.path()));
+  lj.setLatencyTarget( 20000 );
+
+  const int ENTRIES = 2000;
+  std::vector<std::string> tags;
+  for( int i = 0; i < ENTRIES; i++ ) {
+    lj.append( INFO, "trickle", "batch", tags );
+    std::this_thread::sleep_for( std::chrono::microseconds( 100 ));
+  }
+  lj.appendDurable( INFO, "flush" ).get();
+
+  Stats stats = lj.getStats();
+  EXPECT_EQ( 20000u, stats.batching.targetP99Us );
+  EXPECT_GT( stats.batching.lingerUs, 0u );
+  EXPECT_LE( stats.batching.lingerUs, 10000u );
+  EXPECT_GT( stats.batching.entriesPerSec, 0.0 );
+  EXPECT_EQ( stats.storeWrite.count, stats.batching.delivery.count );
+  EXPECT_LT( stats.storeWrite.count, ENTRIES / 4u );
+}
+
+/////////////////////////////////////////////
+// Priority lanes
+/////////////////////////////////////////////
+TEST( LaneTest, ErrorsAreKeptThroughADebugFlood )
+{
+  TempDir dir( "lanes" );
+  ASSERT_TRUE( dir.made());
+  std::string path = dir.path() + "/lumberjack.json";
+  writeFile( path, std::string( "{ \"store\": { \"path\": \"" ) + dir.path()
+      + "/store\" }, \"buffers\": { \"lowLaneEntries\": 1000 } }" );
+
+  Lumberjack lj;
+  ASSERT_EQ( OK, lj.loadConfig( path, false ));
+
+  const int FLOOD = 200000;
+  std::thread flood( [&lj] {
+      std::vector<std::string> tags;
+      for( int i = 0; i < FLOOD; i++ ) {
+        lj.append( DEBUG, "flood", "noisy", tags );
+      }
+    } );
+  std::vector<std::string> errors;
+  for( int i = 0; i < 100; i++ ) {
+    errors.push_back( lj.append( ERROR, "incident" ));
+  }
+  flood.join();
+  lj.appendDurable( INFO, "flush" ).get();
+
+  for( size_t i = 0; i < errors.size(); i++ ) {
+    ASSERT_FALSE( errors[i].empty());
+    EXPECT_NE( std::string::npos, lj.getLogStringById( errors[i] ).find( "incident" ));
+  }
+  Stats stats = lj.getStats();
+  EXPECT_EQ( stats.dropped, stats.shed );
+  EXPECT_EQ( FLOOD + 101u, stats.appended );
+}
+
+TEST( LaneTest, LookupsOnlyReadSegmentsThatCanHoldTheEntry )
+{
+  TempDir dir( "late" );
+  ASSERT_TRUE( dir.made());
+  StoreOptions options;
+  options.segmentBytes = 16384;
+  options.compactIntervalMs = 0;
+  FileStore store;
+  ASSERT_EQ( OK, store.open( dir.path(), options, "test" ));
+
+  //Numbers 3 and 4 are skipped; 3 lands segments later, as a low lane
+  //entry would, and 4 never does
+  std::vector<std::pair<uint64_t, DurableCallback> > waiters;
+  auto write = [&]( uint64_t seq, const std::string &message ) {
+    BlockBuilder block;
+    Record record;
+    record.seq = seq;
+    record.timestamp = 1650000000000000000LL + static_cast<int64_t>( seq );
+    record.message = message;
+    block.add( record );
+    block.seal();
+    return store.write( block, waiters );
+  };
+  const std::string FILL( 4000, 'x' );
+  ASSERT_TRUE( write( 1, FILL ));
+  ASSERT_TRUE( write( 2, FILL ));
+  for( uint64_t seq = 5; seq < 40; seq++ ) {
+    ASSERT_TRUE( write( seq, FILL ));
+  }
+  ASSERT_TRUE( write( 3, "late" ));
+  for( uint64_t seq = 40; seq < 60; seq++ ) {
+    ASSERT_TRUE( write( seq, FILL ));
+  }
+  ASSERT_GT( store.segments().size(), 6u );
+
+  Record record;
+  ASSERT_TRUE( store.read( 3, record ));
+  EXPECT_EQ( "late", record.message );
+  EXPECT_FALSE( store.read( 4, record ));
+
+  //The miss read every segment once and noted where each starts, so
+  //later lookups pass over all but the one that took the late entry
+  std::vector<SegmentInfo> segments = store.segments();
+  size_t holding = 0;
+  for( size_t i = 0; i < segments.size(); i++ ) {
+    ASSERT_NE( 0u, segments[i].lowestSeq ) << segments[i].path;
+    holding += segments[i].lowestSeq <= 4;
+  }
+  EXPECT_EQ( 2u, holding );
+  EXPECT_FALSE( store.read( 4, record ));
+  ASSERT_TRUE( store.read( 3, record ));
+  EXPECT_EQ( "late", record.message );
+  ASSERT_TRUE( store.read( 50, record ));
+  store.close();
+
+  //Nothing is known after a reopen, so lookups read through again
+  ASSERT_EQ( OK, store.open( dir.path(), options, "test" ));
+  ASSERT_TRUE( store.read( 3, record ));
+  EXPECT_EQ( "late", record.message );
+  EXPECT_FALSE( store.read( 4, record ));
+  store.close();
+}
+
+/////////////////////////////////////////////
+// Retention and compaction
+/////////////////////////////////////////////
+namespace {
+  size_t countSegments( const std::string &path )
+  {
+    size_t count = 0;
+    DIR *dir = opendir( path.c_str());
+    for( struct dirent *ent = dir ? readdir( dir ) : NULL; ent != NULL; ent = readdir( dir )) {
+      std::string name( ent->d_name );
+      count += name.size() > 6 && name.compare( name.size() - 6, 6, ".ljseg" ) == 0;
+    }
+    if( dir != NULL ) {
+      closedir( dir );
+    }
+    return count;
+  }
+}
+
+TEST( CompactionTest, DropsExpiredLevelsAndMergesWhatIsLeft )
+{
+  TempDir dir( "compact" );
+  ASSERT_TRUE( dir.made());
+
+  StoreOptions options;
+  options.segmentBytes = 4096;
+  options.compactIntervalMs = 0;
+  options.levelRetainSeconds[DEBUG] = 1;
+
+  Lumberjack lj;
+  lj.setLogLevel( DEBUG );
+  ASSERT_EQ( OK, lj.openStore( dir.path(), options ));
+
+  std::vector<std::string> debugs;
+  std::vector<std::string> errors;
+  for( int i = 0; i < 40; i++ ) {
+    for( int j = 0; j < 5; j++ ) {
+      debugs.push_back( lj.append( DEBUG, "detail " + std::to_string( i ) + "." + std::to_string( j )));
+    }
+    errors.push_back( lj.append( ERROR, "failure " + std::to_string( i )));
+    lj.appendDurable( INFO, "flush" ).get();
+  }
+  size_t before = countSegments( dir.path());
+  ASSERT_GT( before, 4u );
+
+  std::this_thread::sleep_for( std::chrono::milliseconds( 1100 ));
+  EXPECT_EQ( OK, lj.compactStore());
+  EXPECT_EQ( OK, lj.compactStore());
+  //What is left of the sealed segments is merged into one beside the current
+  EXPECT_LE( countSegments( dir.path()), 2u );
+
+  //The current segment is left alone until it is sealed
+  for( size_t i = 0; i < debugs.size() / 2; i++ ) {
+    EXPECT_EQ( "", lj.getLogStringById( debugs[i] ));
+  }
+  for( size_t i = 0; i < errors.size(); i++ ) {
+    EXPECT_NE( std::string::npos, lj.getLogStringById( errors[i] ).find( "failure" ));
+  }
+
+  //Over the size limit the oldest segments go first, never the current one,
+  //which reopening leaves holding the last entry written
+  std::string latest = lj.append( ERROR, "failure latest" );
+  options.retainBytes = options.segmentBytes / 2;
+  ASSERT_EQ( OK, lj.openStore( dir.path(), options ));
+  EXPECT_EQ( OK, lj.compactStore());
+  EXPECT_EQ( "", lj.getLogStringById( errors.front()));
+  EXPECT_NE( std::string::npos, lj.getLogStringById( latest ).find( "failure" ));
+}
+
+TEST( CompactionTest, AMergeCutShortAfterItsMarkerIsFinishedOnOpen )
+{
+  TempDir dir( "merge" );
+  ASSERT_TRUE( dir.made());
+  StoreOptions options;
+  options.segmentBytes = 4096;
+  options.compactIntervalMs = 0;
+
+  std::vector<std::string> ids;
+  {
+    Lumberjack lj;
+    ASSERT_EQ( OK, lj.openStore( dir.path(), options ));
+    for( int i = 0; i < 40; i++ ) {
+      for( int j = 0; j < 5; j++ ) {
+        ids.push_back( lj.append( INFO, "entry " + std::to_string( ids.size())));
+      }
+      lj.appendDurable( INFO, "flush" ).get();
+    }
+  }
+
+  //Each copy is left as a crash would leave it once the marker is written:
+  //before the new file is renamed over the first segment, and after
+  TempDir before( "merge_before" );
+  TempDir after( "merge_after" );
+  ASSERT_TRUE( before.made() && after.made());
+  ASSERT_EQ( 0, system(( "cp -a '" + dir.path() + "/.' '" + before.path() + "'" ).c_str()));
+  ASSERT_EQ( 0, system(( "cp -a '" + dir.path() + "/.' '" + after.path() + "'" ).c_str()));
+
+  //Reopened with larger segments, the sealed ones are small enough to merge
+  options.segmentBytes = 1024 * 1024;
+  FileStore store;
+  ASSERT_EQ( OK, store.open( dir.path(), options, "test" ));
+  std::vector<SegmentInfo> run = store.segments();
+  ASSERT_TRUE( store.compact());
+  std::vector<SegmentInfo> merged = store.segments();
+  store.close();
+  ASSERT_GT( run.size(), merged.size());
+  ASSERT_EQ( run[0].path, merged[0].path );
+
+  std::string rest;
+  std::vector<std::string> gone;
+  for( size_t i = 1; i < run.size(); i++ ) {
+    if( run[i].firstSeq < merged[1].firstSeq ) {
+      putFixed<uint64_t>( rest, run[i].firstSeq );
+      gone.push_back( run[i].path.substr( dir.path().size()));
+    }
+  }
+  ASSERT_FALSE( gone.empty());
+  std::string first = run[0].path.substr( dir.path().size());
+  ASSERT_EQ( 0, system(( "cp '" + run[0].path + "' '" + before.path() + first + ".tmp'" ).c_str()));
+  ASSERT_EQ( 0, system(( "cp '" + run[0].path + "' '" + after.path() + first + "'" ).c_str()));
+
+  const TempDir *crashed[] = { &before, &after };
+  for( size_t c = 0; c < 2; c++ ) {
+    std::string marker = crashed[c]->path() + first + ".ljmerge";
+    std::ofstream( marker.c_str()) << rest;
+
+    ASSERT_EQ( OK, store.open( crashed[c]->path(), options, "test" ));
+    std::vector<SegmentInfo> segments = store.segments();
+    ASSERT_EQ( merged.size(), segments.size()) << c;
+    for( size_t i = 0; i < gone.size(); i++ ) {
+      EXPECT_NE( 0, access(( crashed[c]->path() + gone[i] ).c_str(), F_OK )) << gone[i];
+    }
+    EXPECT_NE( 0, access( marker.c_str(), F_OK ));
+    EXPECT_NE( 0, access(( crashed[c]->path() + first + ".tmp" ).c_str(), F_OK ));
+
+    Record record;
+    for( size_t i = 0; i < ids.size(); i++ ) {
+      ASSERT_TRUE( store.read( std::stoull( ids[i] ), record )) << c << " " << i;
+      EXPECT_EQ( "entry " + std::to_string( i ), record.message );
+    }
+    store.close();
+  }
+}
+
+/////////////////////////////////////////////
+// Search
+/////////////////////////////////////////////
+TEST( SearchTest, FindsMessagesAcrossSegmentsInTimeOrder )
+{
+  TempDir dir( "search" );
+  ASSERT_TRUE( dir.made());
+
+  StoreOptions options;
+  options.segmentBytes = 8192;
+  Lumberjack lj;
+  ASSERT_EQ( OK, lj.openStore( dir.path(), options ));
+  for( int i = 0; i < 500; i++ ) {
+    std::string message = "request " + std::to_string( i )
+      + ( i % 50 == 7 ? " timed out after 30 s" : " completed" );
+    lj.append( i % 50 == 7 ? WARNING : INFO, message );
+    if( i % 100 == 0 ) {
+      lj.append( LJ_SITE( ERROR, "net", "upstream timed out" ));
+    }
+  }
+  lj.appendDurable( INFO, "flush" ).get();
+
+  SearchQuery query;
+  query.text = "timed out";
+  query.threads = 4;
+  std::vector<Record> found;
+  SearchCallback keep = [&found]( const SearchMatch &match ) {
+    found.push_back( match.record );
+    return true;
+  };
+  ASSERT_EQ( OK, lj.search( query, keep ));
+  ASSERT_EQ( 15u, found.size());
+  for( size_t i = 1; i < found.size(); i++ ) {
+    EXPECT_LE( found[i - 1].timestamp, found[i].timestamp );
+  }
+  EXPECT_EQ( "upstream timed out", found[0].message );
+  EXPECT_EQ( "request 7 timed out after 30 s", found[1].message );
+
+  found.clear();
+  query.text = "^request [0-9]+7 timed";
+  query.regex = true;
+  query.level = WARNING;
+  query.limit = 3;
+  ASSERT_EQ( OK, lj.search( query, keep ));
+  ASSERT_EQ( 3u, found.size());
+  EXPECT_EQ( "request 57 timed out after 30 s", found[0].message );
+
+  query.text = "(unclosed";
+  EXPECT_EQ( ERR, lj.search( query, keep ));
+}
+
+TEST( SearchTest, BlockFiltersPruneBlocksWithoutTheKeys )
+{
+  TempDir dir( "filter" );
+  ASSERT_TRUE( dir.made());
+
+  StoreOptions options;
+  options.segmentBytes = 16384;
+  Lumberjack lj;
+  ASSERT_EQ( OK, lj.openStore( dir.path(), options ));
+  for( int i = 0; i < 400; i++ ) {
+    bool rare = i % 100 == 42;
+    lj.append( INFO, "request " + std::to_string( i ) + ( rare ? " timed out" : " completed" )
+        , rare ? "net.http" : "disk", std::vector<std::string>( 1, rare ? "slow" : "fast" ));
+    if( i % 10 == 9 ) {
+      lj.appendDurable( INFO, "flush" ).get();
+    }
+  }
+
+  SearchQuery query;
+  query.text = "timed out";
+  query.words = true;
+  SearchStats stats;
+  uint64_t found = 0;
+  SearchCallback count = [&found]( const SearchMatch &match ) {
+    EXPECT_EQ( "net.http", match.record.module );
+    found++;
+    return true;
+  };
+  ASSERT_EQ( OK, searchStore( dir.path(), query, count, &stats ));
+  EXPECT_EQ( 4u, found );
+  EXPECT_GT( stats.blocksPruned, 30u );
+
+  //Substrings of a word still match without words, and are found by
+  //module or tag alone
+  query.text = "timed ou";
+  query.words = false;
+  query.module = "net";
+  found = 0;
+  stats = SearchStats();
+  ASSERT_EQ( OK, searchStore( dir.path(), query, count, &stats ));
+  EXPECT_EQ( 4u, found );
+  EXPECT_GT( stats.blocksPruned, 30u );
+
+  query.text.clear();
+  query.module.clear();
+  query.tag = "slow";
+  found = 0;
+  ASSERT_EQ( OK, searchStore( dir.path(), query, count, &stats ));
+  EXPECT_EQ( 4u, found );
+
+  query.words = true;
+  query.tag.clear();
+  query.text = "timed o";
+  found = 0;
+  ASSERT_EQ( OK, searchStore( dir.path(), query, count, &stats ));
+  EXPECT_EQ( 0u, found );
+}
+
+/////////////////////////////////////////////
+// Rollups
+/////////////////////////////////////////////
+namespace {
+  //Sums rows over their buckets, which a test may straddle
+  std::map<std::string, uint64_t> totals( const std::vector<RollupRow> &rows )
+  {
+    std::map<std::string, uint64_t> sums;
+    for( size_t i = 0; i < rows.size(); i++ ) {
+      EXPECT_EQ( 0, rows[i].bucket % 60000000000LL );
+      std::string key = std::to_string( rows[i].level ) + " " + rows[i].module + " " + rows[i].tag;
+      sums[key] += rows[i].count;
+    }
+    return sums;
+  }
+}
+
+TEST( RollupTest, CountsPerLevelModuleAndTagSurviveCompaction )
+{
+  TempDir dir( "rollup" );
+  ASSERT_TRUE( dir.made());
+
+  StoreOptions options;
+  options.segmentBytes = 4096;
+  options.compactIntervalMs = 0;
+  Lumberjack lj;
+  ASSERT_EQ( OK, lj.openStore( dir.path(), options ));
+
+  Logger tcp = lj.getLogger( "net.tcp", { "peer" } );
+  Logger disk = lj.getLogger( "disk" );
+  for( int i = 0; i < 200; i++ ) {
+    tcp.append( i % 10 == 0 ? ERROR : INFO, "packet " + std::to_string( i ));
+    if( i % 4 == 0 ) {
+      disk.append( WARNING, "slow write " + std::to_string( i ));
+    }
+    if( i % 20 == 0 ) {
+      lj.append( LJ_SITE( ERROR, "net", "upstream timed out" ));
+    }
+  }
+  lj.appendDurable( INFO, "flush" ).get();
+
+  RollupQuery query;
+  query.module = "net";
+  std::vector<RollupRow> rows;
+  ASSERT_EQ( OK, lj.queryRollups( query, rows ));
+  std::map<std::string, uint64_t> expected = {
+    { "1 net ", 10 }, { "1 net.tcp ", 20 }, { "3 net.tcp ", 180 }
+  };
+  EXPECT_EQ( expected, totals( rows ));
+
+  RollupQuery errors;
+  errors.level = ERROR;
+  errors.byModule = false;
+  errors.bucketSeconds = 90;
+  ASSERT_EQ( OK, lj.queryRollups( errors, rows ));
+  expected = { { "1  ", 30 } };
+  EXPECT_EQ( expected, totals( rows ));
+  for( size_t i = 0; i < rows.size(); i++ ) {
+    EXPECT_EQ( 0, rows[i].bucket % 120000000000LL );
+  }
+
+  RollupQuery tags;
+  tags.byLevel = false;
+  tags.byTag = true;
+  ASSERT_EQ( OK, lj.queryRollups( tags, rows ));
+  expected = { { "6 net.tcp peer", 200 } };
+  EXPECT_EQ( expected, totals( rows ));
+
+  //Lost rollups are rebuilt, and merged segments keep their counts
+  DIR *listing = opendir( dir.path().c_str());
+  ASSERT_TRUE( listing != NULL );
+  for( struct dirent *ent = readdir( listing ); ent != NULL; ent = readdir( listing )) {
+    std::string name( ent->d_name );
+    if( name.size() > 7 && name.compare( name.size() - 7, 7, ".ljroll" ) == 0 ) {
+      unlink(( dir.path() + "/" + name ).c_str());
+    }
+  }
+  closedir( listing );
+  ASSERT_EQ( OK, lj.openStore( dir.path(), options ));
+  EXPECT_EQ( OK, lj.compactStore());
+  ASSERT_EQ( OK, lj.queryRollups( query, rows ));
+  expected = { { "1 net ", 10 }, { "1 net.tcp ", 20 }, { "3 net.tcp ", 180 } };
+  EXPECT_EQ( expected, totals( rows ));
+}
+
+/////////////////////////////////////////////
+// Message indexes
+/////////////////////////////////////////////
+TEST( IndexTest, AllAndAnyLookupsAgreeWithAndWithoutIndexes )
+{
+  TempDir dir( "index" );
+  ASSERT_TRUE( dir.made());
+
+  StoreOptions options;
+  options.segmentBytes = 4096;
+  options.compactIntervalMs = 0;
+  options.indexMessages = true;
+  Lumberjack lj;
+  ASSERT_EQ( OK, lj.openStore( dir.path(), options ));
+
+  std::vector<std::string> timedOut;
+  std::vector<std::string> retried;
+  std::vector<std::string> both;
+  for( int i = 0; i < 300; i++ ) {
+    std::string message = "request " + std::to_string( i )
+      + ( i % 3 == 0 ? " timed out" : " completed" ) + ( i % 5 == 0 ? ", retrying" : "" );
+    std::string id = lj.append( INFO, message );
+    if( i % 3 == 0 ) {
+      timedOut.push_back( id );
+    }
+    if( i % 5 == 0 ) {
+      retried.push_back( id );
+    }
+    if( i % 15 == 0 ) {
+      both.push_back( id );
+    }
+    if( i % 100 == 50 ) {
+      timedOut.push_back( lj.append( LJ_SITE( ERROR, "net", "upstream timed out" )));
+    }
+    if( i % 20 == 19 ) {
+      lj.appendDurable( INFO, "flush" ).get();
+    }
+  }
+  lj.appendDurable( INFO, "flush" ).get();
+
+  TermQuery all;
+  all.clauses = { { "timed" }, { "out" } };
+  TermQuery any;
+  any.clauses = { { "retrying", "nothing" } };
+  TermQuery mixed;
+  mixed.clauses = { { "retrying" }, { "timed", "nothing" }, { "request" } };
+
+  for( int pass = 0; pass < 2; pass++ ) {
+    std::vector<std::string> ids;
+    ASSERT_EQ( OK, lj.lookupTerms( all, ids ));
+    EXPECT_EQ( timedOut, ids );
+    ASSERT_EQ( OK, lj.lookupTerms( any, ids ));
+    EXPECT_EQ( retried, ids );
+    ASSERT_EQ( OK, lj.lookupTerms( mixed, ids ));
+    EXPECT_EQ( both, ids );
+
+    //Only sealed segments get an index, once the compactor has run
+    std::vector<uint64_t> seqs;
+    TermStats stats;
+    ASSERT_EQ( OK, lookupTerms( dir.path(), all, seqs, &stats ));
+    EXPECT_GT( stats.segments, 1u );
+    if( pass == 0 ) {
+      EXPECT_EQ( 0u, stats.indexed );
+      EXPECT_EQ( OK, lj.compactStore());
+    }
+    else {
+      EXPECT_EQ( stats.segments - 1, stats.indexed );
+    }
+  }
+
+  TermQuery empty;
+  std::vector<std::string> ids;
+  EXPECT_EQ( ERR, lj.lookupTerms( empty, ids ));
+  empty.clauses.resize( 1 );
+  EXPECT_EQ( ERR, lj.lookupTerms( empty, ids ));
+}
+
+/////////////////////////////////////////////
+// Message templates
+/////////////////////////////////////////////
+TEST( TemplateTest, MessagesReadBackExactlyAndGroupByTemplate )
+{
+  TempDir dir( "template" );
+  ASSERT_TRUE( dir.made());
+
+  StoreOptions options;
+  options.segmentBytes = 8192;
+  options.compactIntervalMs = 0;
+  options.indexMessages = true;
+  options.mineTemplates = true;
+  Lumberjack lj;
+  ASSERT_EQ( OK, lj.openStore( dir.path(), options ));
+
+  const char *users[] = { "alice", "bob", "carol", "dave" };
+  std::vector<std::pair<std::string, std::string> > written;
+  std::vector<std::string> alice;
+  for( int i = 0; i < 300; i++ ) {
+    std::string message;
+    if( i % 3 == 2 ) {
+      message = std::string( "user " ) + users[i % 4] + " logged in";
+    }
+    else {
+      message = "request " + std::to_string( i ) + " completed in  " + std::to_string( i % 40 ) + " ms ";
+    }
+    std::string id = lj.append( INFO, message );
+    written.push_back( std::make_pair( id, message ));
+    if( i % 3 == 2 && i % 4 == 0 ) {
+      alice.push_back( id );
+    }
+  }
+  written.push_back( std::make_pair( lj.append( INFO, "starting up" ), std::string( "starting up" )));
+  lj.appendDurable( INFO, "flush" ).get();
+
+  for( size_t i = 0; i < written.size(); i++ ) {
+    json entry = json::parse( lj.getLogStringById( written[i].first ));
+    EXPECT_EQ( written[i].second, entry["message"].get<std::string>());
+  }
+
+  //Matches can span a template's text and a variable
+  SearchQuery query;
+  query.text = "alice logged";
+  std::vector<std::string> found;
+  SearchCallback keep = [&found]( const SearchMatch &match ) {
+    found.push_back( std::to_string( match.record.seq ));
+    return true;
+  };
+  ASSERT_EQ( OK, lj.search( query, keep ));
+  EXPECT_EQ( alice, found );
+
+  EXPECT_EQ( OK, lj.compactStore());
+  std::vector<std::string> ids;
+  TermQuery terms;
+  terms.clauses = { { "alice" }, { "logged" } };
+  ASSERT_EQ( OK, lj.lookupTerms( terms, ids ));
+  EXPECT_EQ( alice, ids );
+
+  TemplateQuery groups;
+  std::vector<TemplateRow> rows;
+  ASSERT_EQ( OK, lj.queryTemplates( groups, rows ));
+  ASSERT_GE( rows.size(), 2u );
+  EXPECT_EQ( "request <*> completed in  <*> ms ", rows[0].text );
+  EXPECT_EQ( 200u, rows[0].count );
+  EXPECT_EQ( "user <*> logged in", rows[1].text );
+  EXPECT_EQ( 100u, rows[1].count );
+  size_t clusters = rows.size();
+
+  //Templates are learned again from the store when it is reopened
+  ASSERT_EQ( OK, lj.openStore( dir.path(), options ));
+  std::string later = lj.append( INFO, "request 1000 completed in  7 ms " );
+  lj.appendDurable( INFO, "flush" ).get();
+  EXPECT_EQ( "request 1000 completed in  7 ms "
+      , json::parse( lj.getLogStringById( later ))["message"].get<std::string>());
+  ASSERT_EQ( OK, lj.queryTemplates( groups, rows ));
+  EXPECT_EQ( 201u, rows[0].count );
+  EXPECT_EQ( clusters, rows.size());
+}
+
+/////////////////////////////////////////////
+// Arrow export
+/////////////////////////////////////////////
+TEST( ArrowTest, ExportsAWellFramedStreamWithAndWithoutText )
+{
+  TempDir dir( "arrow" );
+  ASSERT_TRUE( dir.made());
+
+  StoreOptions options;
+  options.segmentBytes = 8192;
+  options.compactIntervalMs = 0;
+  options.mineTemplates = true;
+  Lumberjack lj;
+  ASSERT_EQ( OK, lj.openStore( dir.path(), options ));
+  for( int i = 0; i < 200; i++ ) {
+    lj.append( i % 10 == 0 ? WARNING : INFO, "job " + std::to_string( i ) + " finished" );
+  }
+  lj.appendDurable( INFO, "flush" ).get();
+
+  auto exported = [&dir]( const SearchQuery &query, ExportStats &stats ) {
+    std::string file = dir.path() + "/export.arrow";
+    int fd = ::open( file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    EXPECT_LE( 0, fd );
+    EXPECT_EQ( OK, exportArrow( dir.path(), query, fd, &stats ));
+    ::close( fd );
+    std::ifstream in( file, std::ios::binary );
+    return std::string(( std::istreambuf_iterator<char>( in )), std::istreambuf_iterator<char>());
+  };
+
+  //Every message starts with the continuation marker and the stream ends
+  //with an empty one
+  const std::string marker( "\xff\xff\xff\xff", 4 );
+  const std::string eos = marker + std::string( 4, '\0' );
+  SearchQuery all;
+  ExportStats stats;
+  std::string stream = exported( all, stats );
+  EXPECT_EQ( 201u, stats.rows );
+  EXPECT_EQ( stream.size(), stats.bytes );
+  ASSERT_GT( stream.size(), eos.size());
+  EXPECT_EQ( 0u, stream.find( marker ));
+  EXPECT_EQ( eos, stream.substr( stream.size() - eos.size()));
+  EXPECT_NE( std::string::npos, stream.find( "job 199 finished" ));
+  EXPECT_NE( std::string::npos, stream.find( "warning" ));
+
+  SearchQuery text;
+  text.text = "job 1";
+  stream = exported( text, stats );
+  EXPECT_EQ( 111u, stats.rows );
+  EXPECT_NE( std::string::npos, stream.find( "job 150 finished" ));
+  EXPECT_EQ( std::string::npos, stream.find( "job 20 finished" ));
+  EXPECT_EQ( eos, stream.substr( stream.size() - eos.size()));
+
+  EXPECT_EQ( OK, lj.exportArrow( all, dir.path() + "/all.arrow" ));
+  EXPECT_EQ( ERR, lj.exportArrow( all, dir.path() + "/missing/all.arrow" ));
+}
+
+/////////////////////////////////////////////
+// JSON-lines import
+/////////////////////////////////////////////
+TEST( ImportTest, StoresJsonLinesInOrderAndIndexesThemAfterwards )
+{
+  TempDir dir( "import" );
+  ASSERT_TRUE( dir.made());
+  std::string logs = dir.path() + "/logs.jsonl";
+  {
+    std::ofstream out( logs.c_str());
+    out << "{\"id\":\"9\",\"timestamp\":1666000000.25,\"pid\":12,\"tid\":7,\"deviceId\":\"cam-3\""
+      << ",\"type\":\"log\",\"level\":2,\"message\":\"disk \\\"sda\\\" at 91%\\tcaf\\u00e9 \\ud83d\\ude00\""
+      << ",\"module\":\"storage\",\"tags\":[\"disk\",\"alert\"]}\n";
+    out << "\n";
+    out << "{\"message\":\"unterminated}\n";
+    out << " { \"level\" : \"debug\" , \"timestamp\" : 1666000001 , \"pid\" : \"123\""
+      << " , \"message\" : \"AAEC/w==\" , \"encoding\" : \"base64\" , \"extra\" : [ 1, { \"a\" : null } ] }\r\n";
+    out << "{\"level\":\"info\",\"message\":\"no timestamp\"}\n";
+    out << "{\"timestamp\":1.5e9,\"message\":\"with fields\",\"fields\":{\"n\":-3,\"x\":1.5"
+      << ",\"ok\":true,\"s\":\"v\",\"skipped\":{\"a\":1}}}";
+  }
+
+  StoreOptions options;
+  options.segmentBytes = 16384;
+  options.compactIntervalMs = 0;
+  options.indexMessages = true;
+  ImportStats stats;
+  {
+    Lumberjack lj;
+    ASSERT_EQ( OK, lj.openStore( dir.path(), options ));
+    std::string before = lj.append( INFO, "before" );
+    lj.appendDurable( INFO, "flush" ).get();
+
+    ASSERT_EQ( OK, lj.importJson( { logs }, &stats ));
+    EXPECT_EQ( 5u, stats.lines );
+    EXPECT_EQ( 3u, stats.entries );
+    EXPECT_EQ( 2u, stats.rejected );
+    EXPECT_EQ( std::stoull( before ) + 2, stats.firstSeq );
+
+    json first = json::parse( lj.getLogStringById( std::to_string( stats.firstSeq )));
+    EXPECT_EQ( "disk \"sda\" at 91%\tcaf\xc3\xa9 \xf0\x9f\x98\x80", first["message"].get<std::string>());
+    EXPECT_NEAR( 1666000000.25, first["timestamp"].get<double>(), 1e-6 );
+    EXPECT_EQ( 12u, first["pid"].get<uint32_t>());
+    EXPECT_EQ( 7u, first["tid"].get<uint32_t>());
+    EXPECT_EQ( WARNING, first["level"].get<int>());
+    EXPECT_EQ( "storage", first["module"].get<std::string>());
+    EXPECT_EQ( std::vector<std::string>( { "disk", "alert" } ), first["tags"].get<std::vector<std::string> >());
+    EXPECT_EQ( "cam-3", first["fields"]["deviceId"].get<std::string>());
+
+    json binary = json::parse( lj.getLogStringById( std::to_string( stats.firstSeq + 1 )));
+    EXPECT_EQ( "base64", binary["encoding"].get<std::string>());
+    EXPECT_EQ( "AAEC/w==", binary["message"].get<std::string>());
+    EXPECT_EQ( DEBUG, binary["level"].get<int>());
+    EXPECT_EQ( 1666000001.0, binary["timestamp"].get<double>());
+    EXPECT_EQ( 123u, binary["pid"].get<uint32_t>());
+
+    json fields = json::parse( lj.getLogStringById( std::to_string( stats.firstSeq + 2 )))["fields"];
+    EXPECT_EQ( -3, fields["n"].get<int64_t>());
+    EXPECT_EQ( 1.5, fields["x"].get<double>());
+    EXPECT_TRUE( fields["ok"].get<bool>());
+    EXPECT_EQ( "v", fields["s"].get<std::string>());
+    EXPECT_EQ( 4u, fields.size());
+
+    //Appends carry on after the imported entries
+    EXPECT_EQ( std::to_string( stats.firstSeq + 3 ), lj.append( INFO, "after" ));
+    lj.appendDurable( INFO, "flush" ).get();
+  }
+
+  //Many chunks parsed at once still land in file order, across segments
+  //that are indexed once the load is done
+  {
+    std::ofstream out( logs.c_str(), std::ios::trunc );
+    for( int i = 0; i < 2000; i++ ) {
+      out << "{\"timestamp\":" << 1666000000 + i << ",\"level\":3,\"message\":\"job " << i
+        << ( i % 100 == 0 ? " failed" : " done" ) << "\"}\n";
+    }
+  }
+  FileStore store;
+  ASSERT_EQ( OK, store.open( dir.path(), options, "test" ));
+  ImportOptions bulk;
+  bulk.threads = 4;
+  bulk.chunkBytes = 1000;
+  ASSERT_EQ( OK, importJsonLines( store, { logs }, bulk, &stats ));
+  EXPECT_EQ( 2000u, stats.entries );
+  for( uint64_t i = 0; i < 2000; i += 7 ) {
+    Record record;
+    ASSERT_TRUE( store.read( stats.firstSeq + i, record ));
+    EXPECT_EQ( "job " + std::to_string( i ) + ( i % 100 == 0 ? " failed" : " done" ), record.message );
+  }
+  store.close();
+
+  TermQuery failed;
+  failed.clauses = { { "failed" } };
+  std::vector<uint64_t> seqs;
+  TermStats terms;
+  ASSERT_EQ( OK, lookupTerms( dir.path(), failed, seqs, &terms ));
+  EXPECT_EQ( 20u, seqs.size());
+  EXPECT_GE( terms.segments, 2u );
+  EXPECT_EQ( terms.segments - 1, terms.indexed );
+
+  RollupQuery counts;
+  counts.byLevel = false;
+  counts.byModule = false;
+  counts.from = 1665990000LL * 1000000000LL;
+  counts.to = 1666003000LL * 1000000000LL;
+  std::vector<RollupRow> rows;
+  ASSERT_EQ( OK, queryRollups( dir.path(), counts, rows ));
+  uint64_t counted = 0;
+  for( size_t i = 0; i < rows.size(); i++ ) {
+    counted += rows[i].count;
+  }
+  //The jobs and the first two entries of the earlier import
+  EXPECT_EQ( 2002u, counted );
+
+  std::vector<std::string> missing = { dir.path() + "/missing.jsonl" };
+  ASSERT_EQ( OK, store.open( dir.path(), options, "test" ));
+  EXPECT_EQ( ERR, importJsonLines( store, missing, bulk ));
+}
+
+TEST( ImportTest, AppendsCarryOnDuringAnImportNumberedAfterIt )
+{
+  TempDir dir( "import-live" );
+  ASSERT_TRUE( dir.made());
+  std::string logs = dir.path() + "/logs.jsonl";
+  {
+    std::ofstream out( logs.c_str());
+    for( int i = 0; i < 400000; i++ ) {
+      out << "{\"timestamp\":" << 1666000000 + i << ",\"level\":4,\"module\":\"bulk\""
+        << ",\"message\":\"imported " << i << "\",\"tags\":[\"old\"]}\n";
+    }
+  }
+
+  Lumberjack lj;
+  ASSERT_EQ( OK, lj.openStore( dir.path()));
+  ImportStats stats;
+  std::atomic<bool> imported{ false };
+  std::thread import( [&] {
+      EXPECT_EQ( OK, lj.importJson( { logs }, &stats ));
+      imported = true;
+    } );
+
+  //Appends that return while the import runs have not waited for it
+  std::vector<std::string> ids;
+  size_t during = 0;
+  for( int i = 0; !imported; i++ ) {
+    ids.push_back( lj.append( INFO, "live " + std::to_string( i )));
+    during += !imported && !ids.back().empty()
+      && std::stoull( ids.back()) > 400000;
+    std::this_thread::sleep_for( std::chrono::microseconds( 100 ));
+  }
+  import.join();
+  ASSERT_TRUE( lj.appendDurable( INFO, "flush" ).get());
+  EXPECT_EQ( 400000u, stats.entries );
+  EXPECT_GT( during, 10u );
+
+  //Each keeps the number it was given, clear of the imported range
+  uint64_t last = stats.firstSeq + stats.entries - 1;
+  for( size_t i = 0; i < ids.size(); i += std::max<size_t>( 1, ids.size() / 50 )) {
+    json entry = json::parse( lj.getLogStringById( ids[i] ));
+    EXPECT_EQ( "live " + std::to_string( i ), entry["message"].get<std::string>());
+    uint64_t seq = std::stoull( ids[i] );
+    EXPECT_TRUE( seq < stats.firstSeq || seq > last ) << seq;
+  }
+  json entry = json::parse( lj.getLogStringById( std::to_string( last )));
+  EXPECT_EQ( "imported 399999", entry["message"].get<std::string>());
+}
+
+/////////////////////////////////////////////
+// Live subscriptions
+/////////////////////////////////////////////
+TEST( SubscribeTest, EachSubscriberSeesItsOwnFilter )
+{
+  Lumberjack lj;
+  SubscriptionFilter netFilter;
+  netFilter.module = "net";
+  std::unique_ptr<Subscription> net = lj.subscribe( netFilter );
+  SubscriptionFilter errorFilter;
+  errorFilter.level = ERROR;
+  std::unique_ptr<Subscription> errors = lj.subscribe( errorFilter );
+
+  std::vector<std::string> tags;
+  lj.append( INFO, "connected", "net.tcp", tags );
+  lj.append( INFO, "elsewhere", "network", tags );
+  lj.append( ERROR, "disk full", "disk", tags );
+  lj.appendDurable( INFO, "flush" ).get();
+
+  std::vector<std::string> seen;
+  net->poll( [&seen]( const Record &record ) { seen.push_back( record.message ); } );
+  ASSERT_EQ( 1u, seen.size());
+  EXPECT_EQ( "connected", seen[0] );
+
+  seen.clear();
+  errors->poll( [&seen]( const Record &record ) { seen.push_back( record.message ); } );
+  ASSERT_EQ( 1u, seen.size());
+  EXPECT_EQ( "disk full", seen[0] );
+}
+
+TEST( SubscribeTest, ErrorsBringTheirFlightRecorderAlong )
+{
+  Lumberjack lj;
+  lj.setLogLevel( INFO );
+  lj.setFlightRecorder( 4096, DEBUG );
+  std::unique_ptr<Subscription> all = lj.subscribe( SubscriptionFilter());
+
+  Logger log = lj.getLogger( "flight" );
+  EXPECT_TRUE( log.enabled( DEBUG ));
+  EXPECT_FALSE( log.enabled( TRACE ));
+  for( int i = 0; i < 3; i++ ) {
+    EXPECT_TRUE( log.append( DEBUG, "context " + std::to_string( i )).empty());
+  }
+  log.append( TRACE, "too detailed" );
+  std::thread other( [&log] { log.append( DEBUG, "other thread" ); } );
+  other.join();
+  log.append( ERROR, "failed" );
+  lj.appendDurable( INFO, "flush" ).get();
+
+  std::vector<Record> seen;
+  all->poll( [&seen]( const Record &record ) { seen.push_back( record ); } );
+  ASSERT_EQ( 5u, seen.size());
+  for( int i = 0; i < 3; i++ ) {
+    EXPECT_EQ( "context " + std::to_string( i ), seen[i].message );
+    EXPECT_TRUE( seen[i].flags & RECORD_REPLAYED );
+  }
+  EXPECT_EQ( "failed", seen[3].message );
+  EXPECT_FALSE( seen[3].flags & RECORD_REPLAYED );
+
+  //The other thread's ring is only written on request
+  EXPECT_EQ( 1u, lj.dumpFlightRecorder());
+  lj.appendDurable( INFO, "flush" ).get();
+  seen.clear();
+  all->poll( [&seen]( const Record &record ) { seen.push_back( record ); } );
+  ASSERT_EQ( 2u, seen.size());
+  EXPECT_EQ( "other thread", seen[0].message );
+}
+
+TEST( SubscribeTest, SlowSubscriberIsToldWhatItMissed )
+{
+  BroadcastRing ring( 4096 );
+  uint64_t lagged = 0;
+  SubscriptionFilter filter;
+  filter.lagged = [&lagged]( uint64_t missed ) { lagged += missed; };
+  Subscription slow( ring, filter );
+
+  Record record;
+  record.module = "ring";
+  record.message = std::string( 100, 'x' );
+  std::string encoded;
+  encodeRecord( record, encoded );
+  const uint8_t *body = reinterpret_cast<const uint8_t *>( encoded.data()) + sizeof( uint32_t );
+  size_t size = encoded.size() - sizeof( uint32_t );
+
+  //Read one so the subscriber has a position, then let it fall far behind
+  ring.publish( body, size, 1 );
+  EXPECT_EQ( 1u, slow.poll( []( const Record & ) {} ));
+  for( uint64_t seq = 2; seq <= 200; seq++ ) {
+    ring.publish( body, size, seq );
+  }
+
+  uint64_t last = 0;
+  size_t read = slow.poll( [&last]( const Record &record ) { last = record.seq; } );
+  EXPECT_GT( read, 0u );
+  EXPECT_EQ( 200u, last );
+  EXPECT_EQ( 199u, lagged + read );
+  EXPECT_EQ( lagged, slow.missed());
+}
+
+int main( int argc, char **argv )
+{
+  ::testing::InitGoogleTest( &argc, argv );
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,187 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// ljexport: writes entries of a store as an Arrow IPC stream.
+//
+// Writes every entry the query selects, or the whole store without one, in
+// the columns described in lumberjack_arrow.hpp, e.g. for
+// pyarrow.ipc.open_stream( "logs.arrows" ).read_pandas(). The store may be
+// in use by a logger or lumberjackd meanwhile.
+//
+// Usage: ljexport [-d store] [-o file] [-e] [-w] [-m module] [-t tag]
+//                 [-l level] [-a from] [-b to] [-n limit] [-s] [text]
+//
+//   -o  file to write, stdout if not given
+//   -e  text is an ECMAScript regular expression
+//   -w  text must match whole words
+//   -m  only entries of this module or one below it
+//   -t  only entries with this tag
+//   -l  only entries at this level or more severe, e.g. "warning"
+//   -a  only entries at or after this time, in seconds since the epoch
+//   -b  only entries at or before this time, in seconds since the epoch
+//   -n  at most this many entries
+//   -s  print what was written to stderr
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <lumberjack.hpp>
+#include <lumberjack_arrow.hpp>
+
+using namespace lumberjack;
+
+namespace {
+
+  const char *LEVEL_NAMES[] = {
+    "critical", "error", "warning", "info", "debug", "trace", "all"
+  };
+
+  void usage( const char *name )
+  {
+    std::cerr << "usage: " << name
+      << " [-d store] [-o file] [-e] [-w] [-m module] [-t tag] [-l level] [-a from] [-b to]"
+      << " [-n limit] [-s] [text]"
+      << std::endl;
+  }
+
+  bool parseLevel( const char *value, Severity &level )
+  {
+    for( int i = CRITICAL; i <= ALL; i++ ) {
+      if( strcasecmp( value, LEVEL_NAMES[i] ) == 0 ) {
+        level = static_cast<Severity>( i );
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool parseTime( const char *value, int64_t &timestamp )
+  {
+    char *end = NULL;
+    double seconds = strtod( value, &end );
+    if( end == value || *end != '\0' ) {
+      return false;
+    }
+    timestamp = static_cast<int64_t>( seconds * 1e9 );
+    return true;
+  }
+}
+
+int main( int argc, char *argv[] )
+{
+  std::string storePath = "lumberjack_store";
+  std::string outPath;
+  SearchQuery query;
+  bool showStats = false;
+
+  int opt;
+  while(( opt = getopt( argc, argv, "d:o:ewm:t:l:a:b:n:sh" )) != -1 ) {
+    switch( opt ) {
+      case 'd':
+        storePath = optarg;
+        break;
+      case 'o':
+        outPath = optarg;
+        break;
+      case 'e':
+        query.regex = true;
+        break;
+      case 'w':
+        query.words = true;
+        break;
+      case 'm':
+        query.module = optarg;
+        break;
+      case 't':
+        query.tag = optarg;
+        break;
+      case 'l':
+        if( !parseLevel( optarg, query.level )) {
+          usage( argv[0] );
+          return 1;
+        }
+        break;
+      case 'a':
+        if( !parseTime( optarg, query.from )) {
+          usage( argv[0] );
+          return 1;
+        }
+        break;
+      case 'b':
+        if( !parseTime( optarg, query.to )) {
+          usage( argv[0] );
+          return 1;
+        }
+        break;
+      case 'n':
+        query.limit = strtoull( optarg, NULL, 10 );
+        break;
+      case 's':
+        showStats = true;
+        break;
+      default:
+        usage( argv[0] );
+        return 1;
+    }
+  }
+  if( optind + 1 < argc ) {
+    usage( argv[0] );
+    return 1;
+  }
+  if( optind < argc ) {
+    query.text = argv[optind];
+  }
+
+  int fd = STDOUT_FILENO;
+  if( !outPath.empty()) {
+    fd = ::open( outPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    if( fd < 0 ) {
+      std::cerr << "ljexport: unable to create " << outPath << std::endl;
+      return 1;
+    }
+  }
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  ExportStats stats;
+  Status status = exportArrow( storePath, query, fd, &stats );
+  if( fd != STDOUT_FILENO && ::close( fd ) != 0 ) {
+    status = ERR;
+  }
+  if( status != OK ) {
+    std::cerr << "ljexport: unable to export " << storePath
+      << ( query.regex ? " (or the pattern is invalid)" : "" ) << std::endl;
+    return 1;
+  }
+
+  if( showStats ) {
+    double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+    fprintf( stderr, "%llu rows in %llu batches, %.1f MB in %.3f s (%.0f rows/s)\n"
+        , static_cast<unsigned long long>( stats.rows )
+        , static_cast<unsigned long long>( stats.batches )
+        , stats.bytes / 1e6, seconds
+        , seconds > 0 ? stats.rows / seconds : 0.0
+        );
+  }
+  return 0;
+}
@@ -0,0 +1,132 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// ljimport: stores the entries of JSON-lines log files.
+//
+// Reads files of one JSON object per line, as described in
+// lumberjack_import.hpp, into a store, in the order given. The store must
+// not be open in a logger or lumberjackd meanwhile.
+//
+// Usage: ljimport [-d store] [-i device] [-j threads] [-w] [-T] [-u] [-s]
+//                 file...
+//
+//   -i  device the store belongs to; entries from others keep theirs as a
+//       deviceId field
+//   -j  parsing threads, one per core if not given
+//   -w  index message words, as with StoreOptions::indexMessages
+//   -T  store messages by template, as with StoreOptions::mineTemplates
+//   -u  write with io_uring
+//   -s  print what was imported to stderr
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <getopt.h>
+
+#include <lumberjack.hpp>
+#include <lumberjack_import.hpp>
+#include <lumberjack_store.hpp>
+
+using namespace lumberjack;
+
+namespace {
+
+  void usage( const char *name )
+  {
+    std::cerr << "usage: " << name
+      << " [-d store] [-i device] [-j threads] [-w] [-T] [-u] [-s] file..."
+      << std::endl;
+  }
+}
+
+int main( int argc, char *argv[] )
+{
+  std::string storePath = "lumberjack_store";
+  StoreOptions storeOptions;
+  ImportOptions options;
+  options.deviceId = "ljimport";
+  bool showStats = false;
+
+  //The load compacts once it is done, so the store needs no compactor
+  storeOptions.compactIntervalMs = 0;
+
+  int opt;
+  while(( opt = getopt( argc, argv, "d:i:j:wTush" )) != -1 ) {
+    switch( opt ) {
+      case 'd':
+        storePath = optarg;
+        break;
+      case 'i':
+        options.deviceId = optarg;
+        break;
+      case 'j':
+        options.threads = static_cast<unsigned>( strtoul( optarg, NULL, 10 ));
+        break;
+      case 'w':
+        storeOptions.indexMessages = true;
+        break;
+      case 'T':
+        storeOptions.mineTemplates = true;
+        break;
+      case 'u':
+        storeOptions.backend = IoBackend::IO_URING;
+        break;
+      case 's':
+        showStats = true;
+        break;
+      default:
+        usage( argv[0] );
+        return 1;
+    }
+  }
+  if( optind >= argc ) {
+    usage( argv[0] );
+    return 1;
+  }
+  std::vector<std::string> files( argv + optind, argv + argc );
+
+  FileStore store;
+  if( store.open( storePath, storeOptions, options.deviceId ) != OK ) {
+    std::cerr << "ljimport: unable to open store " << storePath << std::endl;
+    return 1;
+  }
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  ImportStats stats;
+  Status status = importJsonLines( store, files, options, &stats );
+  store.close();
+  if( status != OK ) {
+    std::cerr << "ljimport: unable to import into " << storePath
+      << " (a file could not be read or the store written)" << std::endl;
+    return 1;
+  }
+
+  if( showStats ) {
+    double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+    fprintf( stderr, "%llu entries from %llu lines, %llu rejected, %.1f MB in %.3f s (%.0f entries/s)\n"
+        , static_cast<unsigned long long>( stats.entries )
+        , static_cast<unsigned long long>( stats.lines )
+        , static_cast<unsigned long long>( stats.rejected )
+        , stats.bytes / 1e6, seconds
+        , seconds > 0 ? stats.entries / seconds : 0.0
+        );
+  }
+  return 0;
+}
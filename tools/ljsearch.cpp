@@ -0,0 +1,177 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// ljsearch: searches a store directory for entries by message text.
+//
+// Prints every match as one JSON object per line, oldest first, in the
+// shape getLogStringById returns. The store may be in use by a logger or
+// lumberjackd meanwhile. See lumberjack_search.hpp for how the scan works.
+//
+// Usage: ljsearch [-d store] [-e] [-w] [-m module] [-t tag] [-l level]
+//                 [-a from] [-b to] [-n limit] [-j threads] [-s] text
+//
+//   -e  text is an ECMAScript regular expression
+//   -w  text must match whole words, which lets block filters skip more
+//   -m  only entries of this module or one below it
+//   -t  only entries with this tag
+//   -l  only entries at this level or more severe, e.g. "warning"
+//   -a  only entries at or after this time, in seconds since the epoch
+//   -b  only entries at or before this time, in seconds since the epoch
+//   -s  print what the scan did to stderr
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include <getopt.h>
+#include <strings.h>
+
+#include <lumberjack.hpp>
+#include <lumberjack_search.hpp>
+
+using namespace lumberjack;
+
+namespace {
+
+  const char *LEVEL_NAMES[] = {
+    "critical", "error", "warning", "info", "debug", "trace", "all"
+  };
+
+  void usage( const char *name )
+  {
+    std::cerr << "usage: " << name
+      << " [-d store] [-e] [-w] [-m module] [-t tag] [-l level] [-a from] [-b to]"
+      << " [-n limit] [-j threads] [-s] text"
+      << std::endl;
+  }
+
+  bool parseLevel( const char *value, Severity &level )
+  {
+    for( int i = CRITICAL; i <= ALL; i++ ) {
+      if( strcasecmp( value, LEVEL_NAMES[i] ) == 0 ) {
+        level = static_cast<Severity>( i );
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool parseTime( const char *value, int64_t &timestamp )
+  {
+    char *end = NULL;
+    double seconds = strtod( value, &end );
+    if( end == value || *end != '\0' ) {
+      return false;
+    }
+    timestamp = static_cast<int64_t>( seconds * 1e9 );
+    return true;
+  }
+}
+
+int main( int argc, char *argv[] )
+{
+  std::string storePath = "lumberjack_store";
+  SearchQuery query;
+  bool showStats = false;
+
+  int opt;
+  while(( opt = getopt( argc, argv, "d:ewm:t:l:a:b:n:j:sh" )) != -1 ) {
+    switch( opt ) {
+      case 'd':
+        storePath = optarg;
+        break;
+      case 'e':
+        query.regex = true;
+        break;
+      case 'w':
+        query.words = true;
+        break;
+      case 'm':
+        query.module = optarg;
+        break;
+      case 't':
+        query.tag = optarg;
+        break;
+      case 'l':
+        if( !parseLevel( optarg, query.level )) {
+          usage( argv[0] );
+          return 1;
+        }
+        break;
+      case 'a':
+        if( !parseTime( optarg, query.from )) {
+          usage( argv[0] );
+          return 1;
+        }
+        break;
+      case 'b':
+        if( !parseTime( optarg, query.to )) {
+          usage( argv[0] );
+          return 1;
+        }
+        break;
+      case 'n':
+        query.limit = strtoull( optarg, NULL, 10 );
+        break;
+      case 'j':
+        query.threads = static_cast<unsigned>( strtoul( optarg, NULL, 10 ));
+        break;
+      case 's':
+        showStats = true;
+        break;
+      default:
+        usage( argv[0] );
+        return 1;
+    }
+  }
+  if( optind + 1 != argc ) {
+    usage( argv[0] );
+    return 1;
+  }
+  query.text = argv[optind];
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  SearchStats stats;
+  Status status = searchStore( storePath, query, []( const SearchMatch &match ) {
+      std::cout << recordToJson( match.record, match.deviceId ).dump() << '\n';
+      return true;
+    }, &stats );
+  std::cout.flush();
+  if( status != OK ) {
+    std::cerr << "ljsearch: unable to search " << storePath
+      << ( query.regex ? " (or the pattern is invalid)" : "" ) << std::endl;
+    return 1;
+  }
+
+  if( showStats ) {
+    double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+    fprintf( stderr, "%llu matches, %llu segments, %llu blocks scanned, %llu skipped, "
+        "%llu pruned, %llu decoded, %.1f MB in %.3f s (%.2f GB/s)\n"
+        , static_cast<unsigned long long>( stats.matches )
+        , static_cast<unsigned long long>( stats.segments )
+        , static_cast<unsigned long long>( stats.blocks )
+        , static_cast<unsigned long long>( stats.blocksSkipped )
+        , static_cast<unsigned long long>( stats.blocksPruned )
+        , static_cast<unsigned long long>( stats.decoded )
+        , stats.bytesScanned / 1e6, seconds
+        , seconds > 0 ? stats.bytesScanned / seconds / 1e9 : 0.0
+        );
+  }
+  return 0;
+}
@@ -0,0 +1,395 @@
+/*
+ * Copyright 2022 FellerTech LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// lumberjackd: local collector daemon.
+//
+// Listens on a Unix datagram socket for batches sent by Lumberjack clients
+// (see lumberjack_client.hpp) and writes every entry into a single store.
+// Datagrams are pulled with recvmmsg so one wakeup ingests many batches, and
+// all entries received in one wakeup are written as one block.
+//
+// Any client that can write to the socket can add entries and define call
+// sites, so it is created with mode 0660 for the daemon's group only. -g
+// hands it to another group and -m sets another mode, e.g. -m 0666 to let
+// every local user log.
+//
+// Usage: lumberjackd [-s socket] [-d store] [-D none|interval|group|critical] [-u]
+//                    [-g group] [-m mode]
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <getopt.h>
+#include <grp.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <lumberjack.hpp>
+#include <lumberjack_client.hpp>
+#include <lumberjack_store.hpp>
+
+using namespace lumberjack;
+
+namespace {
+
+  //Datagrams pulled per recvmmsg call
+  const unsigned int MESSAGES = 64;
+
+  //Blocks are written once they reach this size
+  const size_t MAX_BLOCK_BYTES = 256 * 1024;
+
+  //Socket permissions unless -m says otherwise
+  const mode_t SOCKET_MODE = 0660;
+
+  struct Counters {
+    uint64_t batches = 0;
+    uint64_t entries = 0;
+    uint64_t rejected = 0;
+  };
+
+  void usage( const char *name )
+  {
+    std::cerr << "usage: " << name
+      << " [-s socket] [-d store] [-D none|interval|group|critical] [-u]"
+      << " [-g group] [-m mode]" << std::endl;
+  }
+
+  bool parseMode( const std::string &value, mode_t &mode )
+  {
+    char *end = NULL;
+    unsigned long parsed = strtoul( value.c_str(), &end, 8 );
+    if( value.empty() || *end != '\0' || parsed > 0777 ) {
+      return false;
+    }
+    mode = static_cast<mode_t>( parsed );
+    return true;
+  }
+
+  bool parseGroup( const std::string &value, gid_t &gid )
+  {
+    struct group *entry = getgrnam( value.c_str());
+    if( entry != NULL ) {
+      gid = entry->gr_gid;
+      return true;
+    }
+    char *end = NULL;
+    unsigned long parsed = strtoul( value.c_str(), &end, 10 );
+    if( value.empty() || *end != '\0' ) {
+      return false;
+    }
+    gid = static_cast<gid_t>( parsed );
+    return true;
+  }
+
+  bool parseDurability( const std::string &value, Durability &durability )
+  {
+    if( value == "none" ) {
+      durability = Durability::NONE;
+    }
+    else if( value == "interval" ) {
+      durability = Durability::INTERVAL;
+    }
+    else if( value == "group" ) {
+      durability = Durability::GROUP;
+    }
+    else if( value == "critical" ) {
+      durability = Durability::SYNC_CRITICAL;
+    }
+    else {
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * \brief binds the daemon socket with the given group and mode
+   * \param [in] gid group to hand the socket to, -1 to keep the daemon's
+   */
+  int bindSocket( const std::string &path, gid_t gid, mode_t mode )
+  {
+    struct sockaddr_un addr;
+    memset( &addr, 0, sizeof( addr ));
+    addr.sun_family = AF_UNIX;
+    if( path.size() >= sizeof( addr.sun_path )) {
+      return -1;
+    }
+    strncpy( addr.sun_path, path.c_str(), sizeof( addr.sun_path ) - 1 );
+
+    int fd = socket( AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if( fd < 0 ) {
+      return -1;
+    }
+
+    //Larger receive buffer absorbs bursts from many clients
+    int size = 8 * 1024 * 1024;
+    setsockopt( fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof( size ));
+
+    //Created private, so no client gets in before the mode is applied
+    unlink( path.c_str());
+    mode_t mask = umask( 0177 );
+    int bound = bind( fd, reinterpret_cast<struct sockaddr *>( &addr ), sizeof( addr ));
+    umask( mask );
+    if( bound != 0
+        || ( gid != static_cast<gid_t>( -1 ) && chown( path.c_str(), static_cast<uid_t>( -1 ), gid ) != 0 )
+        || chmod( path.c_str(), mode ) != 0 ) {
+      int error = errno;
+      if( bound == 0 ) {
+        unlink( path.c_str());
+      }
+      close( fd );
+      errno = error;
+      return -1;
+    }
+    return fd;
+  }
+
+  void flush( FileStore &store, BlockBuilder &block )
+  {
+    if( block.empty()) {
+      return;
+    }
+    std::vector<std::pair<uint64_t, DurableCallback> > waiters;
+    block.seal();
+    if( !store.write( block, waiters )) {
+      std::cerr << "lumberjackd: store write failed" << std::endl;
+    }
+    block.clear();
+  }
+
+  /**
+   * \brief appends the records of one batch datagram to the block
+   */
+  void ingest( const uint8_t *data
+      , size_t size
+      , uint64_t &seq
+      , FileStore &store
+      , BlockBuilder &block
+      , std::string &scratch
+      , Counters &counters
+      )
+  {
+    BatchHeader header;
+    if( size < sizeof( header )) {
+      counters.rejected++;
+      return;
+    }
+    memcpy( &header, data, sizeof( header ));
+    if( header.magic != BATCH_MAGIC
+        || header.version != BATCH_VERSION
+        || header.bytes != size - sizeof( header )) {
+      counters.rejected++;
+      return;
+    }
+    counters.batches++;
+
+    const uint8_t *ptr = data + sizeof( header );
+    const uint8_t *end = data + size;
+    for( uint32_t i = 0; i < header.count; i++ ) {
+      uint32_t length = 0;
+      if( !getFixed( ptr, end, length ) || length > static_cast<size_t>( end - ptr )) {
+        counters.rejected++;
+        return;
+      }
+
+      //Call site definitions go to the store's dictionary
+      if( isSiteDefinition( ptr, length )) {
+        if( !store.defineSite( ptr, length )) {
+          counters.rejected++;
+        }
+        ptr += length;
+        continue;
+      }
+
+      //Large binary payloads go to the store's blob file
+      const uint8_t *body = ptr;
+      size_t size = length;
+      if( store.prepareRecord( ptr, length, NULL, 0, scratch )) {
+        body = reinterpret_cast<const uint8_t *>( scratch.data());
+        size = scratch.size();
+      }
+
+      if( block.addEncoded( body, size, seq )) {
+        seq++;
+        counters.entries++;
+      }
+      else {
+        counters.rejected++;
+      }
+      ptr += length;
+
+      if( block.bytes() >= MAX_BLOCK_BYTES ) {
+        flush( store, block );
+      }
+    }
+  }
+}
+
+int main( int argc, char *argv[] )
+{
+  std::string socketPath = defaultDaemonSocket();
+  std::string storePath = "lumberjack_store";
+  StoreOptions options;
+  gid_t socketGroup = static_cast<gid_t>( -1 );
+  mode_t socketMode = SOCKET_MODE;
+
+  int opt;
+  while(( opt = getopt( argc, argv, "s:d:D:ug:m:h" )) != -1 ) {
+    switch( opt ) {
+      case 's':
+        socketPath = optarg;
+        break;
+      case 'd':
+        storePath = optarg;
+        break;
+      case 'D':
+        if( !parseDurability( optarg, options.durability )) {
+          usage( argv[0] );
+          return 1;
+        }
+        break;
+      case 'u':
+        options.backend = IoBackend::IO_URING;
+        break;
+      case 'g':
+        if( !parseGroup( optarg, socketGroup )) {
+          usage( argv[0] );
+          return 1;
+        }
+        break;
+      case 'm':
+        if( !parseMode( optarg, socketMode )) {
+          usage( argv[0] );
+          return 1;
+        }
+        break;
+      default:
+        usage( argv[0] );
+        return 1;
+    }
+  }
+
+  //Shut down cleanly on SIGINT/SIGTERM so the store is flushed.
+  //Blocked before the store starts its syncer thread so that thread
+  //inherits the mask.
+  sigset_t signals;
+  sigemptyset( &signals );
+  sigaddset( &signals, SIGINT );
+  sigaddset( &signals, SIGTERM );
+  sigprocmask( SIG_BLOCK, &signals, NULL );
+  int sigfd = signalfd( -1, &signals, SFD_NONBLOCK | SFD_CLOEXEC );
+
+  FileStore store;
+  if( store.open( storePath, options, "lumberjackd" ) != OK ) {
+    std::cerr << "lumberjackd: unable to open store " << storePath << std::endl;
+    return 1;
+  }
+
+  int sock = bindSocket( socketPath, socketGroup, socketMode );
+  if( sock < 0 ) {
+    std::cerr << "lumberjackd: unable to bind " << socketPath
+      << ": " << strerror( errno ) << std::endl;
+    return 1;
+  }
+
+  int epfd = epoll_create1( EPOLL_CLOEXEC );
+  struct epoll_event event;
+  memset( &event, 0, sizeof( event ));
+  event.events = EPOLLIN;
+  event.data.fd = sock;
+  epoll_ctl( epfd, EPOLL_CTL_ADD, sock, &event );
+  event.data.fd = sigfd;
+  epoll_ctl( epfd, EPOLL_CTL_ADD, sigfd, &event );
+
+  //Receive buffers for one recvmmsg round
+  const size_t DATAGRAM = MAX_DATAGRAM_BYTES;
+  std::vector<char> buffers( MESSAGES * DATAGRAM );
+  std::vector<struct mmsghdr> messages( MESSAGES );
+  std::vector<struct iovec> iov( MESSAGES );
+
+  std::cout << "lumberjackd: listening on " << socketPath
+    << ", store " << storePath << " (" << store.backend() << ")" << std::endl;
+
+  Counters counters;
+  BlockBuilder block;
+  std::string scratch;
+  uint64_t seq = store.nextSeq();
+  bool running = true;
+
+  while( running ) {
+    struct epoll_event events[2];
+    int ready = epoll_wait( epfd, events, 2, -1 );
+    if( ready < 0 && errno != EINTR ) {
+      break;
+    }
+
+    for( int e = 0; e < ready; e++ ) {
+      if( events[e].data.fd == sigfd ) {
+        running = false;
+        continue;
+      }
+
+      //Drain the socket completely before writing
+      while( true ) {
+        for( unsigned int i = 0; i < MESSAGES; i++ ) {
+          iov[i].iov_base = &buffers[i * DATAGRAM];
+          iov[i].iov_len = DATAGRAM;
+          memset( &messages[i], 0, sizeof( messages[i] ));
+          messages[i].msg_hdr.msg_iov = &iov[i];
+          messages[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int count = recvmmsg( sock, &messages[0], MESSAGES, MSG_DONTWAIT, NULL );
+        if( count <= 0 ) {
+          break;
+        }
+        for( int i = 0; i < count; i++ ) {
+          if( messages[i].msg_hdr.msg_flags & MSG_TRUNC ) {
+            counters.rejected++;
+            continue;
+          }
+          ingest( reinterpret_cast<const uint8_t *>( iov[i].iov_base )
+              , messages[i].msg_len, seq, store, block, scratch, counters );
+        }
+        if( count < static_cast<int>( MESSAGES )) {
+          break;
+        }
+      }
+      flush( store, block );
+    }
+  }
+
+  flush( store, block );
+  store.close();
+  close( epfd );
+  close( sigfd );
+  close( sock );
+  unlink( socketPath.c_str());
+
+  std::cout << "lumberjackd: " << counters.entries << " entries in "
+    << counters.batches << " batches, " << counters.rejected << " rejected"
+    << std::endl;
+  return 0;
+}